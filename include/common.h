@@ -226,6 +226,7 @@ do { \
 long long util_get_bytes(const char *str);
 void util_print_bytes(long long bytes, int bracket);
 int util_srand(void);
+unsigned long long util_get_msecs(void);
 
 /*
  * The following helpers are here to avoid compiler complaints about unchecked
@@ -10,4 +10,31 @@
 /* Return a 32-bit CRC of the contents of the buffer */
 extern uint32_t mtd_crc32(uint32_t val, const void *ss, int len);
 
+/**
+ * struct mtd_crc32_impl - a CRC32 kernel.
+ * @name: kernel name ("bytewise", "slice8", "slice16", "pclmul", "armv8")
+ * @crc32: the kernel, same semantics as 'mtd_crc32()'
+ * @supported: returns non-zero if the running CPU can execute @crc32
+ *
+ * All kernels produce bit-exact results. 'mtd_crc32()' dispatches to the
+ * fastest supported one, which is picked once at program start.
+ */
+struct mtd_crc32_impl {
+	const char *name;
+	uint32_t (*crc32)(uint32_t val, const void *ss, int len);
+	int (*supported)(void);
+};
+
+/* Return the array of all compiled-in kernels, count is stored in @cnt */
+extern const struct mtd_crc32_impl *mtd_crc32_get_impls(int *cnt);
+
+/* Return the kernel currently used by 'mtd_crc32()' */
+extern const struct mtd_crc32_impl *mtd_crc32_get_impl(void);
+
+/*
+ * Make 'mtd_crc32()' use the kernel called @name. Returns %0 on success and
+ * %-1 if there is no such kernel or the CPU does not support it.
+ */
+extern int mtd_crc32_set_impl(const char *name);
+
 #endif /* __CRC32_H__ */
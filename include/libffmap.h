@@ -0,0 +1,188 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See
+ * the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ * Erased-region maps of flash images.
+ *
+ * Flash images are mostly 0xFF bytes - empty LEBs, padding up to the end of
+ * the eraseblock, empty NAND pages. Such regions can be left out of the image
+ * file: the image is written as a sparse file, only the regions containing
+ * real data are written, and a small text file, the "ff-map", lists them.
+ * Everything which is not listed in the ff-map consists of 0xFF bytes,
+ * whatever the image file contains there. The holes read back as zeroes, so
+ * such an image is only valid together with its ff-map.
+ *
+ * The ff-map file starts with the line "FFMAP <version> <image size>",
+ * followed by one "<offset> <length>" line per data extent, in ascending
+ * offset order. All numbers are decimal.
+ */
+
+#ifndef __LIBFFMAP_H__
+#define __LIBFFMAP_H__
+
+#include <sys/types.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define FFMAP_VERSION 1
+
+/**
+ * struct ffmap_extent - a region of an image which contains data.
+ * @offs: offset of the region
+ * @len: length of the region
+ */
+struct ffmap_extent {
+	off_t offs;
+	off_t len;
+};
+
+/**
+ * struct ffmap - an erased-region map.
+ * @ext: data extents, sorted by offset, neither overlapping nor adjacent
+ * @cnt: count of extents
+ * @max: how many extents fit in @ext
+ * @size: image size
+ * @unit: granularity at which 'ffmap_pwrite()' looks for 0xFF regions
+ */
+struct ffmap {
+	struct ffmap_extent *ext;
+	int cnt;
+	int max;
+	off_t size;
+	int unit;
+};
+
+/**
+ * ffmap_new - create an empty erased-region map.
+ * @unit: granularity of 0xFF regions left out by 'ffmap_pwrite()', usually
+ *        the minimum I/O unit size of the flash
+ *
+ * Returns the map in case of success and %NULL in case of failure.
+ */
+struct ffmap *ffmap_new(int unit);
+
+/**
+ * ffmap_free - free an erased-region map.
+ * @map: the map to free, may be %NULL
+ */
+void ffmap_free(struct ffmap *map);
+
+/**
+ * ffmap_add - mark a region of the image as containing data.
+ * @map: erased-region map
+ * @offs: offset of the region
+ * @len: length of the region
+ *
+ * Returns %0 in case of success and %-1 in case of failure.
+ */
+int ffmap_add(struct ffmap *map, off_t offs, off_t len);
+
+/**
+ * ffmap_merge - add the data regions of one map to another.
+ * @map: erased-region map to add to
+ * @from: the map to add
+ *
+ * Returns %0 in case of success and %-1 in case of failure.
+ */
+int ffmap_merge(struct ffmap *map, const struct ffmap *from);
+
+/**
+ * ffmap_pwrite - write a part of the image, leaving out 0xFF regions.
+ * @map: erased-region map
+ * @fd: image file descriptor
+ * @buf: the data to write
+ * @len: how many bytes to write
+ * @offs: image offset to write at
+ *
+ * @buf is looked at in pieces of @map->unit bytes. Pieces consisting of 0xFF
+ * bytes are not written, unless they overwrite data written earlier, the rest
+ * is written with 'pwrite()' and added to @map. Returns %0 in case of success
+ * and %-1 in case of failure.
+ */
+int ffmap_pwrite(struct ffmap *map, int fd, const void *buf, size_t len,
+		 off_t offs);
+
+/**
+ * ffmap_write - write a part of the image at the current file position.
+ * @map: erased-region map
+ * @fd: image file descriptor
+ * @buf: the data to write
+ * @len: how many bytes to write
+ *
+ * The same as 'ffmap_pwrite()', but writes at the current file position and
+ * moves it forward by @len bytes, like 'write()' does.
+ */
+int ffmap_write(struct ffmap *map, int fd, const void *buf, size_t len);
+
+/**
+ * ffmap_save - finish the image and write the erased-region map.
+ * @map: erased-region map
+ * @fd: image file descriptor
+ * @path: ff-map file to create
+ *
+ * Extends the image file to the image size, in case it ends with a 0xFF
+ * region, and writes @map to @path. Returns %0 in case of success and %-1 in
+ * case of failure.
+ */
+int ffmap_save(const struct ffmap *map, int fd, const char *path);
+
+/**
+ * ffmap_load - read an erased-region map.
+ * @path: ff-map file
+ *
+ * Returns the map in case of success and %NULL in case of failure.
+ */
+struct ffmap *ffmap_load(const char *path);
+
+/**
+ * ffmap_is_erased - check whether a region of the image contains no data.
+ * @map: erased-region map
+ * @offs: offset of the region
+ * @len: length of the region
+ *
+ * Returns %1 if the region consists of 0xFF bytes only and %0 if not.
+ */
+int ffmap_is_erased(const struct ffmap *map, off_t offs, off_t len);
+
+/**
+ * ffmap_fill - fill in the erased parts of a piece of the image.
+ * @map: erased-region map
+ * @buf: the piece of the image as read from the image file
+ * @len: length of the piece
+ * @offs: image offset of the piece
+ *
+ * The image file may contain anything in the regions @map does not list,
+ * usually zeroes as they are holes. This function sets them to 0xFF in @buf.
+ */
+void ffmap_fill(const struct ffmap *map, void *buf, size_t len, off_t offs);
+
+/**
+ * ffmap_check_holes - check that an image given without an ff-map has no holes.
+ * @fd: image file descriptor
+ * @name: image file name for the error message
+ *
+ * Tools which take an ff-map use this to refuse a sparse image given without
+ * its ff-map. Returns %0 if @fd is not a regular file or has no holes, and
+ * %-1 if it has holes or in case of failure. The file position is not changed.
+ */
+int ffmap_check_holes(int fd, const char *name);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* !__LIBFFMAP_H__ */
@@ -149,6 +149,8 @@ struct mtd_pairing_scheme {
  * @writable: zero if the device is read-only
  * @bb_allowed: non-zero if the MTD device may have bad eraseblocks
  * @pairing: wunit pairing scheme, if any
+ * @bbt: cached bad eraseblock table, two bits per eraseblock (%NULL if it has
+ *       not been set up with 'mtd_get_bbt()')
  */
 struct mtd_dev_info
 {
@@ -168,6 +170,7 @@ struct mtd_dev_info
 	unsigned int writable:1;
 	unsigned int bb_allowed:1;
 	const struct mtd_pairing_scheme *pairing;
+	uint8_t *bbt;
 };
 
 /**
@@ -341,6 +344,35 @@ int mtd_is_bad(const struct mtd_dev_info *mtd, int fd, int eb);
  */
 int mtd_mark_bad(const struct mtd_dev_info *mtd, int fd, int eb);
 
+/**
+ * mtd_get_bbt - set up the bad eraseblock table.
+ * @mtd: MTD device description object
+ *
+ * This function sets up a cache of the bad status of eraseblocks in
+ * @mtd->bbt. It does not query the device: 'mtd_is_bad()' asks about an
+ * eraseblock the first time it is checked and answers from the table
+ * afterwards, and 'mtd_mark_bad()' keeps it up to date. So every eraseblock
+ * is queried at most once, and only if it is checked at all. Does nothing if
+ * the table has already been set up. Returns %0 in case of success and %-1 in
+ * case of failure.
+ */
+int mtd_get_bbt(struct mtd_dev_info *mtd);
+
+/**
+ * mtd_bbt_refresh - forget the cached bad eraseblock status.
+ * @mtd: MTD device description object
+ *
+ * This function makes 'mtd_is_bad()' query the device again about every
+ * eraseblock. Useful if eraseblocks may have been marked bad by somebody else.
+ */
+void mtd_bbt_refresh(struct mtd_dev_info *mtd);
+
+/**
+ * mtd_bbt_free - free the cached bad eraseblock table.
+ * @mtd: MTD device description object
+ */
+void mtd_bbt_free(struct mtd_dev_info *mtd);
+
 /**
  * mtd_read - read data from an MTD device.
  * @mtd: MTD device description object
@@ -357,6 +389,82 @@ int mtd_mark_bad(const struct mtd_dev_info *mtd, int fd, int eb);
 int mtd_read(const struct mtd_dev_info *mtd, int fd, int eb, int offs,
 	     void *buf, int len);
 
+/**
+ * mtd_pread - read data from an MTD device without moving the file offset.
+ * @mtd: MTD device description object
+ * @fd: MTD device node file descriptor
+ * @eb: eraseblock to read from
+ * @offs: offset withing the eraseblock to read from
+ * @buf: buffer to read data to
+ * @len: how many bytes to read
+ *
+ * This function is similar to 'mtd_read()', but uses positional reads and
+ * does not change the file offset of @fd, so several threads may read the
+ * same MTD device node file descriptor concurrently. Returns %0 in case of
+ * success and %-1 in case of failure.
+ */
+int mtd_pread(const struct mtd_dev_info *mtd, int fd, int eb, int offs,
+	      void *buf, int len);
+
+/**
+ * mtd_pwrite - write data to an MTD device without moving the file offset.
+ * @mtd: MTD device description object
+ * @fd: MTD device node file descriptor
+ * @eb: eraseblock to write to
+ * @offs: offset withing the eraseblock to write to
+ * @buf: data buffer to write
+ * @len: how many bytes to write
+ *
+ * This function writes @len bytes of data to eraseblock @eb and offset @offs
+ * using positional writes, and does not change the file offset of @fd. Both
+ * @offs and @len have to be aligned to the sub-page size. Returns %0 in case
+ * of success and %-1 in case of failure.
+ */
+int mtd_pwrite(const struct mtd_dev_info *mtd, int fd, int eb, int offs,
+	       const void *buf, int len);
+
+/**
+ * struct mtd_extent - a piece of an eraseblock for vectored I/O.
+ * @eb: eraseblock number
+ * @offs: offset within the eraseblock
+ * @buf: data buffer
+ * @len: length of the data in bytes
+ */
+struct mtd_extent {
+	int eb;
+	int offs;
+	void *buf;
+	int len;
+};
+
+/**
+ * mtd_readv - read several extents from an MTD device.
+ * @mtd: MTD device description object
+ * @fd: MTD device node file descriptor
+ * @ext: array of extents to read
+ * @cnt: count of elements in @ext
+ *
+ * This function reads all the extents in @ext. Extents which follow each other
+ * on the flash are read with a single 'preadv()' call. The file offset of @fd
+ * is not changed. Returns %0 in case of success and %-1 in case of failure.
+ */
+int mtd_readv(const struct mtd_dev_info *mtd, int fd,
+	      const struct mtd_extent *ext, int cnt);
+
+/**
+ * mtd_writev - write several extents to an MTD device.
+ * @mtd: MTD device description object
+ * @fd: MTD device node file descriptor
+ * @ext: array of extents to write
+ * @cnt: count of elements in @ext
+ *
+ * This function is the 'pwritev()' counterpart of 'mtd_readv()'. Offsets and
+ * lengths of all the extents have to be aligned to the sub-page size. Returns
+ * %0 in case of success and %-1 in case of failure.
+ */
+int mtd_writev(const struct mtd_dev_info *mtd, int fd,
+	       const struct mtd_extent *ext, int cnt);
+
 /**
  * mtd_write - write data to an MTD device.
  * @desc: MTD library descriptor
@@ -501,6 +609,198 @@ int mtd_pairing_groups(const struct mtd_dev_info *mtd);
  */
 const struct mtd_pairing_scheme *mtd_get_pairing_scheme(const char *name);
 
+/**
+ * struct mtd_pairing_extent - a run of consecutive group 0 wunits.
+ * @pair: pair id of the first wunit
+ * @wunit: first wunit
+ * @cnt: count of wunits, which belong to pairs @pair, @pair + 1, etc.
+ */
+struct mtd_pairing_extent {
+	int pair;
+	int wunit;
+	int cnt;
+};
+
+/**
+ * struct mtd_pairing_table - precomputed pairing scheme conversions.
+ * @pairing: the pairing scheme, %NULL if the pages are not paired
+ * @eb_size: eraseblock size the table was built for
+ * @min_io_size: write unit size the table was built for
+ * @ngroups: number of groups
+ * @npairs: number of pairs in an eraseblock
+ * @nwunits: number of wunits in an eraseblock
+ * @info: pairing information of each wunit, indexed by wunit
+ * @wunits: wunit of each pairing information, indexed by
+ *          'group * npairs + pair'
+ * @slc: the group 0 wunits of all pairs, in pair order, merged into runs of
+ *       consecutive wunits. This is where the data of an eraseblock used in
+ *       SLC mode go.
+ * @slc_cnt: count of elements in @slc
+ * @next: next table in the cache
+ *
+ * The tables are built once per pairing scheme and geometry by
+ * 'mtd_get_pairing_table()', which spares looking up every page through the
+ * pairing scheme callbacks when a whole eraseblock is laid out.
+ */
+struct mtd_pairing_table {
+	const struct mtd_pairing_scheme *pairing;
+	int eb_size;
+	int min_io_size;
+	int ngroups;
+	int npairs;
+	int nwunits;
+	struct mtd_pairing_info *info;
+	int *wunits;
+	struct mtd_pairing_extent *slc;
+	int slc_cnt;
+	struct mtd_pairing_table *next;
+};
+
+/**
+ * mtd_get_pairing_table - get the pairing tables of an MTD device
+ * @mtd: MTD device description object
+ *
+ * Returns the pairing tables for the pairing scheme, eraseblock size and
+ * minimum I/O unit size of @mtd, or %NULL with errno set in case of failure.
+ * The tables are built the first time they are asked for and then shared by
+ * all devices of the same geometry until the program exits. This function
+ * may be called from several threads at once.
+ */
+const struct mtd_pairing_table *mtd_get_pairing_table(const struct mtd_dev_info *mtd);
+
+/**
+ * mtd_pairing_table_wunit - get the wunit of pairing information
+ * @tbl: pairing tables
+ * @info: pairing information
+ *
+ * The same as 'mtd_pairing_info_to_wunit()', but looks the wunit up in @tbl.
+ * Returns the wunit, or %-EINVAL if @info is out of range.
+ */
+int mtd_pairing_table_wunit(const struct mtd_pairing_table *tbl,
+			    const struct mtd_pairing_info *info);
+
+/**
+ * mtd_pairing_table_info - get the pairing information of a wunit
+ * @tbl: pairing tables
+ * @wunit: write unit we are interested in
+ * @info: returned pairing information
+ *
+ * The same as 'mtd_wunit_to_pairing_info()', but looks the information up in
+ * @tbl. Returns %0 on success and %-EINVAL if @wunit is out of range.
+ */
+int mtd_pairing_table_info(const struct mtd_pairing_table *tbl, int wunit,
+			   struct mtd_pairing_info *info);
+
+/* Asynchronous I/O engine descriptor */
+typedef void * mtd_aio_t;
+
+/* Default queue depth of the asynchronous I/O engine */
+#define MTD_AIO_DEFAULT_DEPTH 32
+
+/**
+ * mtd_aio_done_t - asynchronous request failure callback.
+ * @priv: the private pointer the request was queued with
+ * @eb: eraseblock of the request
+ * @offs: offset within the eraseblock of the request
+ * @err: error code (an errno value)
+ */
+typedef void (*mtd_aio_done_t)(void *priv, int eb, int offs, int err);
+
+/**
+ * mtd_aio_open - open the asynchronous I/O engine.
+ * @desc: MTD library descriptor
+ * @mtd: MTD device description object
+ * @fd: MTD device node or image file descriptor
+ * @depth: queue depth, %0 for the default
+ * @done: function to call for each failed request, may be %NULL
+ *
+ * This function creates an engine which queues reads, writes and erasures of
+ * the MTD device and submits them in batches of up to @depth requests through
+ * io_uring. If io_uring is not available, the requests are executed
+ * synchronously when they are queued, so callers do not need to care.
+ *
+ * @fd may also refer to a regular file containing a flash image, in which case
+ * eraseblocks are "erased" by filling them with 0xFF bytes.
+ *
+ * Returns the engine descriptor in case of success and %NULL in case of
+ * failure.
+ */
+mtd_aio_t mtd_aio_open(libmtd_t desc, const struct mtd_dev_info *mtd, int fd,
+		       int depth, mtd_aio_done_t done);
+
+/**
+ * mtd_aio_close - close the asynchronous I/O engine.
+ * @aio: engine descriptor
+ *
+ * Waits for all queued requests and frees all resources of @aio.
+ */
+void mtd_aio_close(mtd_aio_t aio);
+
+/**
+ * mtd_aio_is_async - check whether requests are really asynchronous.
+ * @aio: engine descriptor
+ *
+ * Returns %1 if @aio uses io_uring and %0 if it has fallen back to
+ * synchronous I/O.
+ */
+int mtd_aio_is_async(mtd_aio_t aio);
+
+/**
+ * mtd_aio_read - queue a read request.
+ * @aio: engine descriptor
+ * @eb: eraseblock to read from
+ * @offs: offset within the eraseblock to read from
+ * @buf: buffer to read data to
+ * @len: how many bytes to read
+ * @priv: private pointer passed to the failure callback
+ *
+ * The contents of @buf are undefined until 'mtd_aio_wait()' returns. Requests
+ * are not ordered against each other, except as described at
+ * 'mtd_aio_write()' and 'mtd_aio_erase()'. Returns %0 if the request was
+ * queued and %-1 if it is invalid.
+ */
+int mtd_aio_read(mtd_aio_t aio, int eb, int offs, void *buf, int len,
+		 void *priv);
+
+/**
+ * mtd_aio_write - queue a write request.
+ * @aio: engine descriptor
+ * @eb: eraseblock to write to
+ * @offs: offset within the eraseblock to write to
+ * @buf: data to write
+ * @len: how many bytes to write
+ * @priv: private pointer passed to the failure callback
+ *
+ * @buf must not be changed until 'mtd_aio_wait()' returns. Writes to the same
+ * eraseblock are carried out in the order they were queued in, as NAND flash
+ * requires. Returns %0 if the request was queued and %-1 if it is invalid.
+ */
+int mtd_aio_write(mtd_aio_t aio, int eb, int offs, const void *buf, int len,
+		  void *priv);
+
+/**
+ * mtd_aio_erase - queue an erase request.
+ * @aio: engine descriptor
+ * @eb: eraseblock to erase
+ * @priv: private pointer passed to the failure callback
+ *
+ * MTD devices cannot be erased through io_uring, so this function waits for
+ * all the requests queued so far to complete and then erases @eb
+ * synchronously. Returns %0 if the request was carried out (whether it
+ * succeeded or not) and %-1 if it is invalid.
+ */
+int mtd_aio_erase(mtd_aio_t aio, int eb, void *priv);
+
+/**
+ * mtd_aio_wait - wait for all queued requests.
+ * @aio: engine descriptor
+ *
+ * This function submits all queued requests and waits until they complete.
+ * Returns %0 if all requests since the previous call succeeded and %-1 if
+ * any failed, in which case @errno is the error code of the first failure.
+ */
+int mtd_aio_wait(mtd_aio_t aio);
+
 #ifdef __cplusplus
 }
 #endif
@@ -59,6 +59,51 @@ enum
 	EC_MAX       = UBI_MAX_ERASECOUNTER,
 };
 
+/*
+ * If an eraseblock does not contain a VID header (i.e., it is free), this
+ * value is used instead of the volume ID.
+ */
+#define NO_VID 0xFFFFFFFF
+
+/*
+ * If an eraseblock contains a corrupted VID header, this value is used instead
+ * of the volume ID.
+ */
+#define CORRUPT_VID 0xFFFFFFFE
+
+/**
+ * struct ubi_scan_leb - VID header information of a physical eraseblock.
+ * @vol_id: volume ID, %NO_VID or %CORRUPT_VID
+ * @lnum: logical eraseblock number
+ * @sqnum: sequence number
+ * @data_size: how many bytes of data this logical eraseblock contains
+ * @copy_flag: if this logical eraseblock was copied for wear-leveling reasons
+ * @lpos: LEB position in the PEB (%UBI_VID_LPOS_CONSOLIDATED if the real VID
+ *        headers are at the end of the PEB)
+ */
+struct ubi_scan_leb
+{
+	uint32_t vol_id;
+	uint32_t lnum;
+	unsigned long long sqnum;
+	uint32_t data_size;
+	uint8_t copy_flag;
+	uint8_t lpos;
+};
+
+/**
+ * struct ubi_scan_vol - LEB to PEB mapping of a volume.
+ * @vol_id: volume ID
+ * @leb_cnt: count of elements in @pebs (the highest found LEB number plus one)
+ * @pebs: physical eraseblock each LEB is mapped to, %-1 if it is unmapped
+ */
+struct ubi_scan_vol
+{
+	uint32_t vol_id;
+	int leb_cnt;
+	int *pebs;
+};
+
 /**
  * struct ubi_scan_info - UBI scanning information.
  * @ec: erase counters or eraseblock status for all eraseblocks
@@ -72,6 +117,15 @@ enum
  * @vid_hdr_offs: volume ID header offset from the found EC headers (%-1 means
  *                undefined)
  * @data_offs: data offset from the found EC headers (%-1 means undefined)
+ * @image_seq: image sequence number from the first correct EC header
+ *             (undefined if @ok_cnt is zero)
+ * @lebs: VID header information for all eraseblocks (only if the LEB map was
+ *        requested, %NULL otherwise)
+ * @vols: LEB to PEB mapping of the found volumes, sorted by volume ID
+ * @vol_cnt: count of elements in @vols
+ * @used_cnt: count of eraseblocks with correct VID header
+ * @vid_corrupted_cnt: count of eraseblocks with correct EC header but
+ *                     corrupted VID header
  */
 struct ubi_scan_info
 {
@@ -85,20 +139,110 @@ struct ubi_scan_info
 	int good_cnt;
 	int vid_hdr_offs;
 	int data_offs;
+	uint32_t image_seq;
+	struct ubi_scan_leb *lebs;
+	struct ubi_scan_vol *vols;
+	int vol_cnt;
+	int used_cnt;
+	int vid_corrupted_cnt;
 };
 
 struct mtd_dev_info;
 
+/**
+ * struct ubi_scan_opts - UBI scanning options.
+ * @verbose: verbose mode: %0 - be silent, %1 - output progress information,
+ *           2 - debugging output mode
+ * @threads: how many threads read EC headers in parallel (%0 and %1 mean
+ *           scanning from the calling thread only)
+ * @leb_map: also read the VID headers and build the LEB to PEB mapping
+ */
+struct ubi_scan_opts
+{
+	int verbose;
+	int threads;
+	int leb_map;
+};
+
 /**
  * ubi_scan - scan an MTD device.
  * @mtd: information about the MTD device to scan
  * @fd: MTD device node file descriptor
  * @info: the result of the scanning is returned here
- * @verbose: verbose mode: %0 - be silent, %1 - output progress information,
- *           2 - debugging output mode
+ * @opts: scanning options, %NULL means silent single-threaded scanning
+ *
+ * The EC headers are read with positional reads, so the file offset of @fd is
+ * not used. The result does not depend on the number of threads.
+ *
+ * If @opts->leb_map is set, the VID headers are read in the same pass (with the
+ * same read as the EC header when the VID header is within the first two
+ * min. I/O units) and the LEB to PEB mapping is built. If several PEBs
+ * contain the same LEB, the one with the highest sequence number is picked;
+ * the data CRC of copied LEBs is not checked. Consolidated MLC PEBs are
+ * reported in @lebs but not mapped.
  */
 int ubi_scan(struct mtd_dev_info *mtd, int fd, struct ubi_scan_info **info,
-	     int verbose);
+	     const struct ubi_scan_opts *opts);
+
+/**
+ * ubi_scan_get_vol - find the LEB to PEB mapping of a volume.
+ * @si: scanning information
+ * @vol_id: ID of the volume to find
+ *
+ * Returns %NULL if @vol_id has no mapped LEBs or the LEB map was not built.
+ */
+const struct ubi_scan_vol *ubi_scan_get_vol(const struct ubi_scan_info *si,
+					    uint32_t vol_id);
+
+/*
+ * Directory where the scanning results are cached, may be overridden with the
+ * %UBI_SCAN_CACHE_DIR environment variable.
+ */
+#ifndef UBI_SCAN_CACHE_DIR
+#define UBI_SCAN_CACHE_DIR "/var/cache/mtd-utils"
+#endif
+
+/**
+ * ubi_scan_cache_load - get scanning information from the cache.
+ * @mtd: information about the MTD device
+ * @fd: MTD device node file descriptor
+ * @info: the cached scanning information is returned here
+ * @opts: scanning options (only @opts->verbose is used), may be %NULL
+ *
+ * The cache is only used if it was saved for an MTD device of the same
+ * geometry and if the EC headers of a few sampled eraseblocks still match it:
+ * same erase counter, image sequence number and header offsets, or the same
+ * bad, empty, corrupted or alien state. The LEB map is never cached.
+ *
+ * Returns %0 if the cache was loaded, %1 if there is no usable cache and %-1
+ * in case of failure. @info is set to %NULL unless %0 is returned.
+ */
+int ubi_scan_cache_load(const struct mtd_dev_info *mtd, int fd,
+			struct ubi_scan_info **info,
+			const struct ubi_scan_opts *opts);
+
+/**
+ * ubi_scan_cache_save - save scanning information to the cache.
+ * @mtd: information about the MTD device
+ * @si: scanning information describing what is on flash now
+ * @image_seq: UBI image sequence number of the EC headers on flash
+ *
+ * Only @si->ec, @si->vid_hdr_offs and @si->data_offs are saved, the counters
+ * are re-calculated when the cache is loaded. Returns %0 in case of success
+ * and %-1 in case of failure.
+ */
+int ubi_scan_cache_save(const struct mtd_dev_info *mtd,
+			const struct ubi_scan_info *si, uint32_t image_seq);
+
+/**
+ * ubi_scan_cache_invalidate - drop the cached scanning information.
+ * @mtd: information about the MTD device
+ *
+ * Must be called before changing the contents of the MTD device. Returns %0 in
+ * case of success (including when there was nothing cached) and %-1 in case of
+ * failure.
+ */
+int ubi_scan_cache_invalidate(const struct mtd_dev_info *mtd);
 
 /**
  * ubi_scan_free - free scanning information.
@@ -28,6 +28,7 @@
 #include <stdint.h>
 #include <mtd/ubi-media.h>
 #include <libmtd.h>
+#include <libffmap.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -49,6 +50,10 @@ struct ubigen_info;
  * @image_seq: UBI image sequence number
  * @mtd: MTD info
  * @pairing: MTD pairing scheme
+ * @pairing_tbl: pairing tables of @mtd, %NULL if the pages are not paired or
+ *               the tables could not be built
+ * @ffmap: if not %NULL, PEBs are written with 'ffmap_write()', so the 0xFF
+ *         regions are left out of the output file
  */
 struct ubigen_info
 {
@@ -64,6 +69,8 @@ struct ubigen_info
 	int max_volumes;
 	uint32_t image_seq;
 	struct mtd_dev_info mtd;
+	const struct mtd_pairing_table *pairing_tbl;
+	struct ffmap *ffmap;
 };
 
 /**
@@ -156,6 +163,23 @@ void ubigen_init_vid_hdr(const struct ubigen_info *ui,
 			 struct ubi_vid_hdr *hdr, int lnum, int lpos,
 			 const void *data, int data_size);
 
+/**
+ * ubigen_layout_vid_and_data - lay out the headers and data of a PEB.
+ * @ui: libubigen information
+ * @vi: volume information
+ * @lnum: logical eraseblock number of the first LEB in the PEB
+ * @inbuf: the contents of the LEBs
+ * @outbuf: the PEB, its EC header has to be initialized already
+ * @len: amount of data in @inbuf
+ *
+ * Puts the VID headers and the data to @outbuf the way the mode of the volume
+ * wants them, the rest of the PEB is filled with 0xFF bytes.
+ */
+void ubigen_layout_vid_and_data(const struct ubigen_info *ui,
+				const struct ubigen_vol_info *vi,
+				int lnum, const void *inbuf, void *outbuf,
+				int len);
+
 /**
  * ubigen_add_volume - add a volume to the volume table.
  * @ui: libubigen information
@@ -169,6 +193,18 @@ int ubigen_add_volume(const struct ubigen_info *ui,
 		      const struct ubigen_vol_info *vi,
 		      struct ubi_vtbl_record *vtbl);
 
+/**
+ * ubigen_volume_pebs - count the PEBs of a volume.
+ * @ui: libubigen information
+ * @vi: volume information
+ * @bytes: volume size in bytes
+ *
+ * Returns how many physical eraseblocks 'ubigen_write_volume()' writes for
+ * @bytes bytes of volume contents.
+ */
+int ubigen_volume_pebs(const struct ubigen_info *ui,
+		       const struct ubigen_vol_info *vi, long long bytes);
+
 /**
  * ubigen_write_volume - write UBI volume.
  * @ui: libubigen information
@@ -179,13 +215,46 @@ int ubigen_add_volume(const struct ubigen_info *ui,
  * @out: output file descriptor
  *
  * This function reads the contents of the volume from the input file @in and
- * writes the UBI volume to the output file @out. Returns zero on success and
- * %-1 on failure.
+ * writes the UBI volume to the output file @out at its current position.
+ * Returns zero on success and %-1 on failure.
  */
 int ubigen_write_volume(const struct ubigen_info *ui,
 			const struct ubigen_vol_info *vi, long long ec,
 			long long bytes, int in, int out);
 
+/**
+ * ubigen_write_volume_at - write UBI volume at a given offset.
+ * @ui: libubigen information
+ * @vi: volume information
+ * @ec: erase counter value to put to EC headers
+ * @bytes: volume size in bytes
+ * @in: input file descriptor (has to be properly seeked)
+ * @out: output file descriptor
+ * @offs: offset in @out to write the volume at
+ *
+ * The same as 'ubigen_write_volume()', but writes with 'pwrite()' and leaves
+ * the file position of @out alone, so several volumes may be written to @out
+ * at once. @ui->ffmap must not be shared by the writers then.
+ */
+int ubigen_write_volume_at(const struct ubigen_info *ui,
+			   const struct ubigen_vol_info *vi, long long ec,
+			   long long bytes, int in, int out, off_t offs);
+
+/**
+ * ubigen_layout_vtbl_peb - lay out a PEB of the layout volume.
+ * @ui: libubigen information
+ * @lnum: logical eraseblock number, %0 or %1
+ * @ec: erase counter value to put to the EC header
+ * @vtbl: volume table
+ * @buf: the PEB, @ui->peb_size bytes
+ *
+ * Lays out a PEB of the layout volume to write it wherever the caller wants,
+ * e.g., after the volumes when the output cannot seek.
+ */
+void ubigen_layout_vtbl_peb(const struct ubigen_info *ui, int lnum,
+			    long long ec, const struct ubi_vtbl_record *vtbl,
+			    void *buf);
+
 /**
  * ubigen_write_layout_vol - write UBI layout volume
  * @ui: libubigen information
@@ -203,6 +272,138 @@ int ubigen_write_layout_vol(const struct ubigen_info *ui, int peb1, int peb2,
 			    long long ec1, long long ec2,
 			    struct ubi_vtbl_record *vtbl, int fd);
 
+/* What a PEB holds, as far as a fastmap is concerned */
+enum {
+	UBIGEN_FM_ERASE,
+	UBIGEN_FM_FREE,
+	UBIGEN_FM_USED,
+	UBIGEN_FM_BAD,
+	UBIGEN_FM_BLOCK,
+};
+
+/* A fastmap being generated */
+struct ubigen_fastmap;
+
+/**
+ * ubigen_fm_blocks - count of PEBs a fastmap takes.
+ * @ui: libubigen information
+ * @peb_count: count of PEBs of the UBI device, bad ones included
+ *
+ * The kernel only accepts a fastmap of the size it would write itself, which
+ * depends on the count of PEBs of the device. Returns the count of PEBs, or
+ * %-1 if the fastmap does not fit in %UBI_FM_MAX_BLOCKS PEBs or the flash has
+ * paired pages.
+ */
+int ubigen_fm_blocks(const struct ubigen_info *ui, int peb_count);
+
+/**
+ * ubigen_fm_new - start generating a fastmap.
+ * @ui: libubigen information
+ * @peb_count: count of PEBs of the UBI device, bad ones included
+ * @ec: erase counter of the PEBs which are not described otherwise
+ *
+ * All PEBs are %UBIGEN_FM_ERASE at first, i.e., the kernel erases them and
+ * writes their EC headers when it attaches the device. The PEBs of the image
+ * are then described with 'ubigen_fm_add_vtbl()', 'ubigen_fm_add_vol()',
+ * 'ubigen_fm_add_peb()' and 'ubigen_fm_set_peb()'. Fastmap cannot describe
+ * several LEBs sharing a PEB, so MLC flash with a pairing scheme is not
+ * supported. Returns the fastmap, or %NULL in case of failure.
+ */
+struct ubigen_fastmap *ubigen_fm_new(const struct ubigen_info *ui,
+				     int peb_count, long long ec);
+
+/**
+ * ubigen_fm_free - free a fastmap.
+ * @fm: the fastmap
+ */
+void ubigen_fm_free(struct ubigen_fastmap *fm);
+
+/**
+ * ubigen_fm_set_peb - set what a PEB holds.
+ * @fm: the fastmap
+ * @pnum: the PEB
+ * @state: %UBIGEN_FM_ERASE, %UBIGEN_FM_FREE or %UBIGEN_FM_BAD
+ * @ec: erase counter of the PEB
+ */
+void ubigen_fm_set_peb(struct ubigen_fastmap *fm, int pnum, int state,
+		       long long ec);
+
+/**
+ * ubigen_fm_add_vtbl - add the layout volume to a fastmap.
+ * @fm: the fastmap
+ * @vtbl: the volume table
+ * @peb1: PEB of the first volume table copy
+ * @peb2: PEB of the second volume table copy
+ * @ec1: erase counter of @peb1
+ * @ec2: erase counter of @peb2
+ *
+ * The volumes of @vtbl are what the fastmap describes. Returns zero in case of
+ * success and %-1 in case of failure.
+ */
+int ubigen_fm_add_vtbl(struct ubigen_fastmap *fm,
+		       const struct ubi_vtbl_record *vtbl, int peb1, int peb2,
+		       long long ec1, long long ec2);
+
+/**
+ * ubigen_fm_add_vol - add the PEBs of a volume to a fastmap.
+ * @fm: the fastmap
+ * @vi: volume information
+ * @bytes: size of the volume contents in bytes
+ * @pnum: first PEB of the volume
+ * @ec: erase counter of the PEBs
+ *
+ * Adds the PEBs written by 'ubigen_write_volume()' for @bytes bytes of volume
+ * contents at PEB @pnum. Returns zero in case of success and %-1 in case of
+ * failure.
+ */
+int ubigen_fm_add_vol(struct ubigen_fastmap *fm,
+		      const struct ubigen_vol_info *vi, long long bytes,
+		      int pnum, long long ec);
+
+/**
+ * ubigen_fm_add_peb - add a PEB of an image to a fastmap.
+ * @fm: the fastmap
+ * @pnum: the PEB
+ * @ec: erase counter of the PEB
+ * @buf: contents of the PEB
+ *
+ * The PEB is free if it has no valid VID header, and holds the LEB its VID
+ * header says otherwise. The volume table is taken from the first LEB of the
+ * layout volume. Returns zero in case of success and %-1 if the PEB holds a
+ * LEB the fastmap cannot describe.
+ */
+int ubigen_fm_add_peb(struct ubigen_fastmap *fm, int pnum, long long ec,
+		      const void *buf);
+
+/**
+ * ubigen_fm_build - lay out the PEBs of a fastmap.
+ * @fm: the fastmap
+ * @pnums: PEBs to put the fastmap to, the first one is the anchor PEB and
+ *         has to be one of the first %UBI_FM_MAX_START PEBs
+ * @ecs: erase counters of @pnums
+ *
+ * Returns a buffer with the contents of the 'ubigen_fm_blocks()' PEBs to
+ * write to @pnums, which has to be freed with 'free()', or %NULL in case of
+ * failure.
+ */
+void *ubigen_fm_build(struct ubigen_fastmap *fm, const int *pnums,
+		      const long long *ecs);
+
+/**
+ * ubigen_write_fastmap - write a fastmap to an image file.
+ * @ui: libubigen information
+ * @fm: the fastmap
+ * @pnums: PEBs to put the fastmap to
+ * @ecs: erase counters of @pnums
+ * @fd: output file descriptor
+ *
+ * The same as 'ubigen_fm_build()', but writes the PEBs to @fd at the offsets
+ * of @pnums. Returns zero in case of success and %-1 in case of failure.
+ */
+int ubigen_write_fastmap(const struct ubigen_info *ui,
+			 struct ubigen_fastmap *fm, const int *pnums,
+			 const long long *ecs, int fd);
+
 #ifdef __cplusplus
 }
 #endif
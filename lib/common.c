@@ -27,6 +27,7 @@
 
 #include <sys/time.h>
 #include <sys/types.h>
+#include <time.h>
 #include <stdio.h>
 #include <string.h>
 #include <ctype.h>
@@ -156,3 +157,17 @@ int util_srand(void)
 	srand(seed);
 	return 0;
 }
+
+/**
+ * util_get_msecs - get monotonic time in milliseconds.
+ *
+ * This helper is meant for measuring how long an operation takes, the
+ * returned value has no meaning by itself.
+ */
+unsigned long long util_get_msecs(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
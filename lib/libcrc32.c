@@ -38,6 +38,24 @@
  */
 
 #include <stdint.h>
+#include <string.h>
+#include <mtd_swab.h>
+#include <crc32.h>
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define CRC32_HAVE_PCLMUL
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+#if defined(__GNUC__) && defined(__aarch64__) && defined(__linux__)
+#define CRC32_HAVE_ARMV8
+#include <sys/auxv.h>
+#include <arm_acle.h>
+#ifndef HWCAP_CRC32
+#define HWCAP_CRC32 (1 << 7)
+#endif
+#endif
 
 static const uint32_t crc32_table[256] = {
 	0x00000000L, 0x77073096L, 0xee0e612cL, 0x990951baL, 0x076dc419L,
@@ -94,7 +112,22 @@ static const uint32_t crc32_table[256] = {
 	0x2d02ef8dL
 };
 
-uint32_t mtd_crc32(uint32_t val, const void *ss, int len)
+/*
+ * Slicing-by-N tables: crc32_slice[0] is @crc32_table and crc32_slice[k][i]
+ * is the CRC of byte @i followed by @k zero bytes. They are generated from
+ * @crc32_table when the library is loaded.
+ */
+static uint32_t crc32_slice[16][256];
+
+static inline uint32_t load_le32(const unsigned char *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return le32_to_cpu(v);
+}
+
+static uint32_t crc32_bytewise(uint32_t val, const void *ss, int len)
 {
 	const unsigned char *s = ss;
 
@@ -102,3 +135,282 @@ uint32_t mtd_crc32(uint32_t val, const void *ss, int len)
 		val = crc32_table[(val ^ *s++) & 0xff] ^ (val >> 8);
 	return val;
 }
+
+static uint32_t crc32_slice8(uint32_t val, const void *ss, int len)
+{
+	const unsigned char *s = ss;
+
+	while (len >= 8) {
+		uint32_t one = load_le32(s) ^ val;
+		uint32_t two = load_le32(s + 4);
+
+		val = crc32_slice[7][one & 0xff] ^
+		      crc32_slice[6][(one >> 8) & 0xff] ^
+		      crc32_slice[5][(one >> 16) & 0xff] ^
+		      crc32_slice[4][one >> 24] ^
+		      crc32_slice[3][two & 0xff] ^
+		      crc32_slice[2][(two >> 8) & 0xff] ^
+		      crc32_slice[1][(two >> 16) & 0xff] ^
+		      crc32_slice[0][two >> 24];
+		s += 8;
+		len -= 8;
+	}
+
+	return crc32_bytewise(val, s, len);
+}
+
+static uint32_t crc32_slice16(uint32_t val, const void *ss, int len)
+{
+	const unsigned char *s = ss;
+
+	while (len >= 16) {
+		uint32_t one = load_le32(s) ^ val;
+		uint32_t two = load_le32(s + 4);
+		uint32_t three = load_le32(s + 8);
+		uint32_t four = load_le32(s + 12);
+
+		val = crc32_slice[15][one & 0xff] ^
+		      crc32_slice[14][(one >> 8) & 0xff] ^
+		      crc32_slice[13][(one >> 16) & 0xff] ^
+		      crc32_slice[12][one >> 24] ^
+		      crc32_slice[11][two & 0xff] ^
+		      crc32_slice[10][(two >> 8) & 0xff] ^
+		      crc32_slice[9][(two >> 16) & 0xff] ^
+		      crc32_slice[8][two >> 24] ^
+		      crc32_slice[7][three & 0xff] ^
+		      crc32_slice[6][(three >> 8) & 0xff] ^
+		      crc32_slice[5][(three >> 16) & 0xff] ^
+		      crc32_slice[4][three >> 24] ^
+		      crc32_slice[3][four & 0xff] ^
+		      crc32_slice[2][(four >> 8) & 0xff] ^
+		      crc32_slice[1][(four >> 16) & 0xff] ^
+		      crc32_slice[0][four >> 24];
+		s += 16;
+		len -= 16;
+	}
+
+	return crc32_slice8(val, s, len);
+}
+
+#ifdef CRC32_HAVE_PCLMUL
+/*
+ * Carry-less multiplication folding, see Intel's "Fast CRC Computation for
+ * Generic Polynomials Using PCLMULQDQ Instruction". The constants are the
+ * bit-reflected x^(4*128+32), x^(4*128-32), x^(128+32), x^(128-32), x^64
+ * mod P(x), and the Barrett reduction constants for P(x) = 0x104C11DB7.
+ */
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t crc32_pclmul(uint32_t val, const void *ss, int len)
+{
+	static const uint64_t k1k2[] __attribute__((aligned(16))) =
+		{ 0x0154442bd4ULL, 0x01c6e41596ULL };
+	static const uint64_t k3k4[] __attribute__((aligned(16))) =
+		{ 0x01751997d0ULL, 0x00ccaa009eULL };
+	static const uint64_t k5k0[] __attribute__((aligned(16))) =
+		{ 0x0163cd6124ULL, 0x0000000000ULL };
+	static const uint64_t poly[] __attribute__((aligned(16))) =
+		{ 0x01db710641ULL, 0x01f7011641ULL };
+	const unsigned char *s = ss;
+	__m128i x0, x1, x2, x3, x4, x5, x6, x7, x8, y5, y6, y7, y8;
+
+	if (len < 64)
+		return crc32_slice16(val, ss, len);
+
+	x1 = _mm_loadu_si128((const __m128i *)(s + 0x00));
+	x2 = _mm_loadu_si128((const __m128i *)(s + 0x10));
+	x3 = _mm_loadu_si128((const __m128i *)(s + 0x20));
+	x4 = _mm_loadu_si128((const __m128i *)(s + 0x30));
+	x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(val));
+	x0 = _mm_load_si128((const __m128i *)k1k2);
+	s += 64;
+	len -= 64;
+
+	/* Fold 4 x 128 bits in parallel */
+	while (len >= 64) {
+		x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+		x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+		x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+		x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+		x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+		x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+		x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+		y5 = _mm_loadu_si128((const __m128i *)(s + 0x00));
+		y6 = _mm_loadu_si128((const __m128i *)(s + 0x10));
+		y7 = _mm_loadu_si128((const __m128i *)(s + 0x20));
+		y8 = _mm_loadu_si128((const __m128i *)(s + 0x30));
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), y5);
+		x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), y6);
+		x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), y7);
+		x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), y8);
+		s += 64;
+		len -= 64;
+	}
+
+	/* Fold into 128 bits */
+	x0 = _mm_load_si128((const __m128i *)k3k4);
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+	/* Single folds of the remaining 128-bit blocks */
+	while (len >= 16) {
+		x2 = _mm_loadu_si128((const __m128i *)s);
+		x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+		s += 16;
+		len -= 16;
+	}
+
+	/* Fold 128 bits to 64 bits */
+	x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+	x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+	x1 = _mm_srli_si128(x1, 8);
+	x1 = _mm_xor_si128(x1, x2);
+	x0 = _mm_loadl_epi64((const __m128i *)k5k0);
+	x2 = _mm_srli_si128(x1, 4);
+	x1 = _mm_and_si128(x1, x3);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	/* Barrett reduction to 32 bits */
+	x0 = _mm_load_si128((const __m128i *)poly);
+	x2 = _mm_and_si128(x1, x3);
+	x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+	x2 = _mm_and_si128(x2, x3);
+	x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+	val = _mm_extract_epi32(x1, 1);
+
+	return crc32_slice16(val, s, len);
+}
+
+static int crc32_pclmul_supported(void)
+{
+	unsigned int eax, ebx, ecx, edx;
+
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+		return 0;
+	return (ecx & bit_PCLMUL) && (ecx & bit_SSE4_1);
+}
+#endif /* CRC32_HAVE_PCLMUL */
+
+#ifdef CRC32_HAVE_ARMV8
+/*
+ * The ARMv8 CRC32 instructions (not CRC32C) implement exactly this
+ * polynomial in the reflected bit order and do not invert the register,
+ * so they can be fed the running value directly.
+ */
+__attribute__((target("arch=armv8-a+crc")))
+static uint32_t crc32_armv8(uint32_t val, const void *ss, int len)
+{
+	const unsigned char *s = ss;
+	uint64_t v;
+
+	while (len > 0 && ((uintptr_t)s & 7)) {
+		val = __crc32b(val, *s++);
+		len -= 1;
+	}
+	while (len >= 8) {
+		memcpy(&v, s, sizeof(v));
+		val = __crc32d(val, le64_to_cpu(v));
+		s += 8;
+		len -= 8;
+	}
+	while (len > 0) {
+		val = __crc32b(val, *s++);
+		len -= 1;
+	}
+	return val;
+}
+
+static int crc32_armv8_supported(void)
+{
+	return !!(getauxval(AT_HWCAP) & HWCAP_CRC32);
+}
+#endif /* CRC32_HAVE_ARMV8 */
+
+static int crc32_always_supported(void)
+{
+	return 1;
+}
+
+/* All CRC32 kernels, in the order of preference (best last) */
+static const struct mtd_crc32_impl crc32_impls[] = {
+	{ "bytewise", crc32_bytewise, crc32_always_supported },
+	{ "slice8",   crc32_slice8,   crc32_always_supported },
+	{ "slice16",  crc32_slice16,  crc32_always_supported },
+#ifdef CRC32_HAVE_PCLMUL
+	{ "pclmul",   crc32_pclmul,   crc32_pclmul_supported },
+#endif
+#ifdef CRC32_HAVE_ARMV8
+	{ "armv8",    crc32_armv8,    crc32_armv8_supported },
+#endif
+};
+
+#define CRC32_IMPL_CNT ((int)(sizeof(crc32_impls) / sizeof(crc32_impls[0])))
+
+static const struct mtd_crc32_impl *crc32_impl = &crc32_impls[0];
+
+/*
+ * Build the slicing tables and pick the fastest kernel the CPU supports.
+ * This runs once when the program is loaded, before any thread can call
+ * mtd_crc32().
+ */
+__attribute__((constructor))
+static void crc32_init(void)
+{
+	int i, k;
+
+	for (i = 0; i < 256; i++) {
+		crc32_slice[0][i] = crc32_table[i];
+		for (k = 1; k < 16; k++) {
+			uint32_t prev = crc32_slice[k - 1][i];
+
+			crc32_slice[k][i] = crc32_table[prev & 0xff] ^ (prev >> 8);
+		}
+	}
+
+	for (i = 0; i < CRC32_IMPL_CNT; i++)
+		if (crc32_impls[i].supported())
+			crc32_impl = &crc32_impls[i];
+}
+
+const struct mtd_crc32_impl *mtd_crc32_get_impls(int *cnt)
+{
+	*cnt = CRC32_IMPL_CNT;
+	return crc32_impls;
+}
+
+const struct mtd_crc32_impl *mtd_crc32_get_impl(void)
+{
+	return crc32_impl;
+}
+
+int mtd_crc32_set_impl(const char *name)
+{
+	int i;
+
+	for (i = 0; i < CRC32_IMPL_CNT; i++) {
+		if (strcmp(crc32_impls[i].name, name))
+			continue;
+		if (!crc32_impls[i].supported())
+			return -1;
+		crc32_impl = &crc32_impls[i];
+		return 0;
+	}
+
+	return -1;
+}
+
+uint32_t mtd_crc32(uint32_t val, const void *ss, int len)
+{
+	return crc32_impl->crc32(val, ss, len);
+}
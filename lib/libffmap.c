@@ -0,0 +1,345 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See
+ * the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ * Erased-region maps of flash images.
+ */
+
+#define PROGRAM_NAME "libffmap"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <libffmap.h>
+#include "common.h"
+
+struct ffmap *ffmap_new(int unit)
+{
+	struct ffmap *map;
+
+	map = calloc(1, sizeof(struct ffmap));
+	if (!map) {
+		sys_errmsg("cannot allocate %zd bytes of memory",
+			   sizeof(struct ffmap));
+		return NULL;
+	}
+	map->unit = unit;
+	return map;
+}
+
+void ffmap_free(struct ffmap *map)
+{
+	if (!map)
+		return;
+	free(map->ext);
+	free(map);
+}
+
+/*
+ * Returns the index of the first extent which ends after @offs, @map->cnt if
+ * there is none.
+ */
+static int first_ext(const struct ffmap *map, off_t offs)
+{
+	int lo = 0, hi = map->cnt;
+
+	while (lo < hi) {
+		int mid = lo + (hi - lo) / 2;
+		const struct ffmap_extent *e = &map->ext[mid];
+
+		if (e->offs + e->len <= offs)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+int ffmap_add(struct ffmap *map, off_t offs, off_t len)
+{
+	off_t end = offs + len;
+	int i, j;
+
+	if (len <= 0)
+		return 0;
+
+	/* The extents merged with the new one are @i to @j - 1 */
+	i = first_ext(map, offs - 1);
+	for (j = i; j < map->cnt && map->ext[j].offs <= end; j++) {
+		if (map->ext[j].offs < offs)
+			offs = map->ext[j].offs;
+		if (map->ext[j].offs + map->ext[j].len > end)
+			end = map->ext[j].offs + map->ext[j].len;
+	}
+
+	if (i == j) {
+		if (map->cnt == map->max) {
+			int max = map->max ? map->max * 2 : 64;
+			struct ffmap_extent *ext;
+
+			ext = realloc(map->ext, max * sizeof(*ext));
+			if (!ext)
+				return sys_errmsg("cannot allocate %zd bytes of memory",
+						  max * sizeof(*ext));
+			map->ext = ext;
+			map->max = max;
+		}
+		memmove(&map->ext[i + 1], &map->ext[i],
+			(map->cnt - i) * sizeof(*map->ext));
+		map->cnt += 1;
+	} else if (j > i + 1) {
+		memmove(&map->ext[i + 1], &map->ext[j],
+			(map->cnt - j) * sizeof(*map->ext));
+		map->cnt -= j - i - 1;
+	}
+
+	map->ext[i].offs = offs;
+	map->ext[i].len = end - offs;
+	if (end > map->size)
+		map->size = end;
+	return 0;
+}
+
+int ffmap_merge(struct ffmap *map, const struct ffmap *from)
+{
+	int i;
+
+	for (i = 0; i < from->cnt; i++)
+		if (ffmap_add(map, from->ext[i].offs, from->ext[i].len))
+			return -1;
+	if (from->size > map->size)
+		map->size = from->size;
+	return 0;
+}
+
+int ffmap_is_erased(const struct ffmap *map, off_t offs, off_t len)
+{
+	int i = first_ext(map, offs);
+
+	return i == map->cnt || map->ext[i].offs >= offs + len;
+}
+
+void ffmap_fill(const struct ffmap *map, void *buf, size_t len, off_t offs)
+{
+	off_t pos = offs, end = offs + len;
+	int i;
+
+	for (i = first_ext(map, offs); i < map->cnt; i++) {
+		const struct ffmap_extent *e = &map->ext[i];
+
+		if (e->offs >= end)
+			break;
+		if (e->offs > pos)
+			memset(buf + (pos - offs), 0xFF, e->offs - pos);
+		pos = e->offs + e->len;
+	}
+	if (pos < end)
+		memset(buf + (pos - offs), 0xFF, end - pos);
+}
+
+int ffmap_check_holes(int fd, const char *name)
+{
+	struct stat st;
+	off_t pos, hole;
+
+	if (fstat(fd, &st))
+		return sys_errmsg("cannot stat \"%s\"", name);
+	if (!S_ISREG(st.st_mode) || st.st_size == 0)
+		return 0;
+
+	pos = lseek(fd, 0, SEEK_CUR);
+	if (pos == -1)
+		return sys_errmsg("cannot get the file position of \"%s\"", name);
+	/* File systems which cannot tell holes fail or report none */
+	hole = lseek(fd, 0, SEEK_HOLE);
+	if (lseek(fd, pos, SEEK_SET) == -1)
+		return sys_errmsg("cannot seek to offset %lld of \"%s\"",
+				  (long long)pos, name);
+
+	if (hole != -1 && hole < st.st_size)
+		return errmsg("\"%s\" is a sparse image, which is only valid together with its ff-map",
+			      name);
+	return 0;
+}
+
+static int all_ff(const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		if (p[i] != 0xFF)
+			return 0;
+	return 1;
+}
+
+static int pwrite_all(int fd, const void *buf, size_t len, off_t offs)
+{
+	while (len) {
+		ssize_t ret = pwrite(fd, buf, len, offs);
+
+		if (ret <= 0) {
+			if (ret < 0 && errno == EINTR)
+				continue;
+			return sys_errmsg("cannot write %zu bytes at offset %lld",
+					  len, (long long)offs);
+		}
+		buf += ret;
+		len -= ret;
+		offs += ret;
+	}
+	return 0;
+}
+
+int ffmap_pwrite(struct ffmap *map, int fd, const void *buf, size_t len,
+		 off_t offs)
+{
+	size_t unit = map->unit > 0 ? map->unit : len, pos = 0, start = 0;
+	int err;
+
+	while (pos < len) {
+		size_t n = len - pos < unit ? len - pos : unit;
+
+		if (all_ff(buf + pos, n) &&
+		    ffmap_is_erased(map, offs + pos, n)) {
+			/* Write out the data collected so far */
+			if (pos > start) {
+				err = pwrite_all(fd, buf + start, pos - start,
+						 offs + start);
+				if (err)
+					return err;
+				err = ffmap_add(map, offs + start, pos - start);
+				if (err)
+					return err;
+			}
+			start = pos + n;
+		}
+		pos += n;
+	}
+
+	if (pos > start) {
+		err = pwrite_all(fd, buf + start, pos - start, offs + start);
+		if (err)
+			return err;
+		err = ffmap_add(map, offs + start, pos - start);
+		if (err)
+			return err;
+	}
+
+	if (offs + (off_t)len > map->size)
+		map->size = offs + len;
+	return 0;
+}
+
+int ffmap_write(struct ffmap *map, int fd, const void *buf, size_t len)
+{
+	off_t offs;
+
+	offs = lseek(fd, 0, SEEK_CUR);
+	if (offs == -1)
+		return sys_errmsg("cannot get the file position");
+	if (ffmap_pwrite(map, fd, buf, len, offs))
+		return -1;
+	if (lseek(fd, offs + len, SEEK_SET) == -1)
+		return sys_errmsg("cannot seek to offset %lld",
+				  (long long)(offs + len));
+	return 0;
+}
+
+int ffmap_save(const struct ffmap *map, int fd, const char *path)
+{
+	FILE *f;
+	int i;
+
+	if (ftruncate(fd, map->size))
+		return sys_errmsg("cannot extend the image to %lld bytes",
+				  (long long)map->size);
+
+	f = fopen(path, "w");
+	if (!f)
+		return sys_errmsg("cannot create \"%s\"", path);
+
+	fprintf(f, "FFMAP %d %lld\n", FFMAP_VERSION, (long long)map->size);
+	for (i = 0; i < map->cnt; i++)
+		fprintf(f, "%lld %lld\n", (long long)map->ext[i].offs,
+			(long long)map->ext[i].len);
+
+	if (ferror(f)) {
+		fclose(f);
+		return errmsg("cannot write \"%s\"", path);
+	}
+	if (fclose(f))
+		return sys_errmsg("cannot write \"%s\"", path);
+	return 0;
+}
+
+struct ffmap *ffmap_load(const char *path)
+{
+	struct ffmap *map;
+	long long size, offs, len;
+	int ver, ret;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (!f) {
+		sys_errmsg("cannot open \"%s\"", path);
+		return NULL;
+	}
+
+	map = ffmap_new(0);
+	if (!map)
+		goto out_close;
+
+	if (fscanf(f, "FFMAP %d %lld", &ver, &size) != 2) {
+		errmsg("\"%s\" is not an ff-map file", path);
+		goto out_free;
+	}
+	if (ver != FFMAP_VERSION) {
+		errmsg("unsupported ff-map version %d in \"%s\"", ver, path);
+		goto out_free;
+	}
+	if (size < 0) {
+		errmsg("bad image size %lld in \"%s\"", size, path);
+		goto out_free;
+	}
+
+	while ((ret = fscanf(f, "%lld %lld", &offs, &len)) == 2) {
+		if (offs < 0 || len <= 0 || offs + len > size) {
+			errmsg("bad extent %lld %lld in \"%s\"", offs, len, path);
+			goto out_free;
+		}
+		if (ffmap_add(map, offs, len))
+			goto out_free;
+	}
+	if (ret != EOF || ferror(f)) {
+		errmsg("cannot parse \"%s\"", path);
+		goto out_free;
+	}
+
+	map->size = size;
+	fclose(f);
+	return map;
+
+out_free:
+	ffmap_free(map);
+out_close:
+	fclose(f);
+	return NULL;
+}
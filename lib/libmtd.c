@@ -31,6 +31,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/ioctl.h>
+#include <sys/uio.h>
 #include <inttypes.h>
 
 #include <mtd/mtd-user.h>
@@ -1028,6 +1029,32 @@ out:
 	return err;
 }
 
+/*
+ * The cached bad eraseblock table consists of two bitmaps, the first one tells
+ * whether the status of an eraseblock is known, and the second one whether it
+ * is bad. 'mtd_is_bad()' may be called from several threads, so the bits are
+ * set atomically, and the status is set before it is marked known.
+ */
+static int bbt_lookup(const struct mtd_dev_info *mtd, int eb)
+{
+	const uint8_t *bad = mtd->bbt + (mtd->eb_cnt + 7) / 8;
+	uint8_t bit = 1 << (eb % 8);
+
+	if (!(__atomic_load_n(&mtd->bbt[eb / 8], __ATOMIC_ACQUIRE) & bit))
+		return -1;
+	return !!(__atomic_load_n(&bad[eb / 8], __ATOMIC_RELAXED) & bit);
+}
+
+static void bbt_store(const struct mtd_dev_info *mtd, int eb, int is_bad)
+{
+	uint8_t *bad = mtd->bbt + (mtd->eb_cnt + 7) / 8;
+	uint8_t bit = 1 << (eb % 8);
+
+	if (is_bad)
+		__atomic_fetch_or(&bad[eb / 8], bit, __ATOMIC_RELAXED);
+	__atomic_fetch_or(&mtd->bbt[eb / 8], bit, __ATOMIC_RELEASE);
+}
+
 int mtd_is_bad(const struct mtd_dev_info *mtd, int fd, int eb)
 {
 	int ret;
@@ -1040,10 +1067,19 @@ int mtd_is_bad(const struct mtd_dev_info *mtd, int fd, int eb)
 	if (!mtd->bb_allowed)
 		return 0;
 
+	if (mtd->bbt) {
+		ret = bbt_lookup(mtd, eb);
+		if (ret != -1)
+			return ret;
+	}
+
 	seek = (loff_t)eb * mtd->eb_size;
 	ret = ioctl(fd, MEMGETBADBLOCK, &seek);
 	if (ret == -1)
 		return mtd_ioctl_error(mtd, eb, "MEMGETBADBLOCK");
+
+	if (mtd->bbt)
+		bbt_store(mtd, eb, ret);
 	return ret;
 }
 
@@ -1065,43 +1101,226 @@ int mtd_mark_bad(const struct mtd_dev_info *mtd, int fd, int eb)
 	ret = ioctl(fd, MEMSETBADBLOCK, &seek);
 	if (ret == -1)
 		return mtd_ioctl_error(mtd, eb, "MEMSETBADBLOCK");
+
+	if (mtd->bbt)
+		bbt_store(mtd, eb, 1);
 	return 0;
 }
 
-int mtd_read(const struct mtd_dev_info *mtd, int fd, int eb, int offs,
-	     void *buf, int len)
+int mtd_get_bbt(struct mtd_dev_info *mtd)
 {
-	int ret, rd = 0;
-	off_t seek;
+	if (mtd->bbt)
+		return 0;
+
+	mtd->bbt = calloc(2 * ((mtd->eb_cnt + 7) / 8), 1);
+	if (!mtd->bbt)
+		return sys_errmsg("cannot allocate bad eraseblock table for mtd%d",
+				  mtd->mtd_num);
+	return 0;
+}
+
+void mtd_bbt_refresh(struct mtd_dev_info *mtd)
+{
+	if (mtd->bbt)
+		memset(mtd->bbt, 0, 2 * ((mtd->eb_cnt + 7) / 8));
+}
+
+void mtd_bbt_free(struct mtd_dev_info *mtd)
+{
+	free(mtd->bbt);
+	mtd->bbt = NULL;
+}
+
+int mtd_valid_range(const struct mtd_dev_info *mtd, int eb, int offs, int len)
+{
+	int ret;
 
 	ret = mtd_valid_erase_block(mtd, eb);
 	if (ret)
 		return ret;
 
-	if (offs < 0 || offs + len > mtd->eb_size) {
+	if (offs < 0 || len < 0 || offs + len > mtd->eb_size) {
 		errmsg("bad offset %d or length %d, mtd%d eraseblock size is %d",
 		       offs, len, mtd->mtd_num, mtd->eb_size);
 		errno = EINVAL;
 		return -1;
 	}
 
-	/* Seek to the beginning of the eraseblock */
-	seek = (off_t)eb * mtd->eb_size + offs;
-	if (lseek(fd, seek, SEEK_SET) != seek)
-		return sys_errmsg("cannot seek mtd%d to offset %"PRIdoff_t,
-				  mtd->mtd_num, seek);
+	return 0;
+}
+
+int mtd_valid_write_range(const struct mtd_dev_info *mtd, int eb, int offs,
+			  int len)
+{
+	int ret;
+
+	ret = mtd_valid_range(mtd, eb, offs, len);
+	if (ret)
+		return ret;
+
+	if (offs % mtd->subpage_size) {
+		errmsg("write offset %d is not aligned to mtd%d min. I/O size %d",
+		       offs, mtd->mtd_num, mtd->subpage_size);
+		errno = EINVAL;
+		return -1;
+	}
+	if (len % mtd->subpage_size) {
+		errmsg("write length %d is not aligned to mtd%d min. I/O size %d",
+		       len, mtd->mtd_num, mtd->subpage_size);
+		errno = EINVAL;
+		return -1;
+	}
+
+	return 0;
+}
 
+static int do_pwrite(const struct mtd_dev_info *mtd, int fd, int eb, int offs,
+		     const void *buf, int len)
+{
+	int ret, wr = 0;
+	off_t seek = (off_t)eb * mtd->eb_size + offs;
+
+	while (wr < len) {
+		ret = pwrite(fd, buf + wr, len - wr, seek + wr);
+		if (ret <= 0) {
+			if (ret == 0)
+				errno = EIO;
+			return sys_errmsg("cannot write %d bytes to mtd%d "
+					  "(eraseblock %d, offset %d)",
+					  len - wr, mtd->mtd_num, eb, offs + wr);
+		}
+		wr += ret;
+	}
+
+	return 0;
+}
+
+int mtd_pread(const struct mtd_dev_info *mtd, int fd, int eb, int offs,
+	      void *buf, int len)
+{
+	int ret, rd = 0;
+	off_t seek;
+
+	ret = mtd_valid_range(mtd, eb, offs, len);
+	if (ret)
+		return ret;
+
+	seek = (off_t)eb * mtd->eb_size + offs;
 	while (rd < len) {
-		ret = read(fd, buf + rd, len - rd);
-		if (ret < 0)
+		ret = pread(fd, buf + rd, len - rd, seek + rd);
+		if (ret <= 0) {
+			if (ret == 0)
+				errno = EIO;
 			return sys_errmsg("cannot read %d bytes from mtd%d (eraseblock %d, offset %d)",
 					  len - rd, mtd->mtd_num, eb, offs + rd);
+		}
 		rd += ret;
 	}
 
 	return 0;
 }
 
+int mtd_read(const struct mtd_dev_info *mtd, int fd, int eb, int offs,
+	     void *buf, int len)
+{
+	return mtd_pread(mtd, fd, eb, offs, buf, len);
+}
+
+int mtd_pwrite(const struct mtd_dev_info *mtd, int fd, int eb, int offs,
+	       const void *buf, int len)
+{
+	int ret;
+
+	ret = mtd_valid_write_range(mtd, eb, offs, len);
+	if (ret)
+		return ret;
+
+	return do_pwrite(mtd, fd, eb, offs, buf, len);
+}
+
+/*
+ * Transfer the extents in @ext, merging the ones which are adjacent on flash
+ * into one 'preadv()' or 'pwritev()' call of up to %MTD_IOV_MAX vectors.
+ */
+static int mtd_rw_vec(const struct mtd_dev_info *mtd, int fd,
+		      const struct mtd_extent *ext, int cnt, int write)
+{
+	struct iovec iov[MTD_IOV_MAX], *v;
+	int i, n, vcnt;
+	ssize_t ret;
+	off_t seek, end;
+
+	for (i = 0; i < cnt; i++) {
+		if (write)
+			ret = mtd_valid_write_range(mtd, ext[i].eb, ext[i].offs,
+						    ext[i].len);
+		else
+			ret = mtd_valid_range(mtd, ext[i].eb, ext[i].offs,
+					      ext[i].len);
+		if (ret)
+			return -1;
+	}
+
+	for (i = 0; i < cnt; i += n) {
+		seek = end = (off_t)ext[i].eb * mtd->eb_size + ext[i].offs;
+		for (n = 0; i + n < cnt && n < MTD_IOV_MAX; n++) {
+			const struct mtd_extent *e = &ext[i + n];
+
+			if ((off_t)e->eb * mtd->eb_size + e->offs != end)
+				break;
+			iov[n].iov_base = e->buf;
+			iov[n].iov_len = e->len;
+			end += e->len;
+		}
+
+		v = iov;
+		vcnt = n;
+		while (seek < end) {
+			if (write)
+				ret = pwritev(fd, v, vcnt, seek);
+			else
+				ret = preadv(fd, v, vcnt, seek);
+			if (ret <= 0) {
+				if (ret == 0)
+					errno = EIO;
+				return sys_errmsg("cannot %s %lld bytes %s mtd%d (eraseblock %lld, offset %lld)",
+						  write ? "write" : "read",
+						  (long long)(end - seek),
+						  write ? "to" : "from",
+						  mtd->mtd_num,
+						  (long long)(seek / mtd->eb_size),
+						  (long long)(seek % mtd->eb_size));
+			}
+
+			/* Skip what has been transferred on a short transfer */
+			seek += ret;
+			while (vcnt && (size_t)ret >= v->iov_len) {
+				ret -= v->iov_len;
+				v += 1;
+				vcnt -= 1;
+			}
+			if (vcnt) {
+				v->iov_base += ret;
+				v->iov_len -= ret;
+			}
+		}
+	}
+
+	return 0;
+}
+
+int mtd_readv(const struct mtd_dev_info *mtd, int fd,
+	      const struct mtd_extent *ext, int cnt)
+{
+	return mtd_rw_vec(mtd, fd, ext, cnt, 0);
+}
+
+int mtd_writev(const struct mtd_dev_info *mtd, int fd,
+	       const struct mtd_extent *ext, int cnt)
+{
+	return mtd_rw_vec(mtd, fd, ext, cnt, 1);
+}
+
 static int legacy_auto_oob_layout(const struct mtd_dev_info *mtd, int fd,
 				  int ooblen, void *oob) {
 	struct nand_oobinfo old_oobinfo;
@@ -1147,29 +1366,10 @@ int mtd_write(libmtd_t desc, const struct mtd_dev_info *mtd, int fd, int eb,
 	struct mtd_write_req ops;
 	memset(&ops, 0, sizeof(ops));
 
-	ret = mtd_valid_erase_block(mtd, eb);
+	ret = mtd_valid_write_range(mtd, eb, offs, len);
 	if (ret)
 		return ret;
 
-	if (offs < 0 || offs + len > mtd->eb_size) {
-		errmsg("bad offset %d or length %d, mtd%d eraseblock size is %d",
-		       offs, len, mtd->mtd_num, mtd->eb_size);
-		errno = EINVAL;
-		return -1;
-	}
-	if (offs % mtd->subpage_size) {
-		errmsg("write offset %d is not aligned to mtd%d min. I/O size %d",
-		       offs, mtd->mtd_num, mtd->subpage_size);
-		errno = EINVAL;
-		return -1;
-	}
-	if (len % mtd->subpage_size) {
-		errmsg("write length %d is not aligned to mtd%d min. I/O size %d",
-		       len, mtd->mtd_num, mtd->subpage_size);
-		errno = EINVAL;
-		return -1;
-	}
-
 	/* Calculate seek address */
 	seek = (off_t)eb * mtd->eb_size + offs;
 
@@ -1194,17 +1394,8 @@ int mtd_write(libmtd_t desc, const struct mtd_dev_info *mtd, int fd, int eb,
 		if (mtd_write_oob(desc, mtd, fd, seek, ooblen, oob) < 0)
 			return sys_errmsg("cannot write to OOB");
 	}
-	if (data) {
-		/* Seek to the beginning of the eraseblock */
-		if (lseek(fd, seek, SEEK_SET) != seek)
-			return sys_errmsg("cannot seek mtd%d to offset %"PRIdoff_t,
-					mtd->mtd_num, seek);
-		ret = write(fd, data, len);
-		if (ret != len)
-			return sys_errmsg("cannot write %d bytes to mtd%d "
-					  "(eraseblock %d, offset %d)",
-					  len, mtd->mtd_num, eb, offs);
-	}
+	if (data)
+		return do_pwrite(mtd, fd, eb, offs, data, len);
 
 	return 0;
 }
@@ -1465,3 +1656,130 @@ const struct mtd_pairing_scheme *mtd_get_pairing_scheme(const char *name)
 
 	return NULL;
 }
+
+/* Pairing tables built so far, see 'mtd_get_pairing_table()' */
+static struct mtd_pairing_table *pairing_tables;
+
+static void free_pairing_table(struct mtd_pairing_table *tbl)
+{
+	free(tbl->info);
+	free(tbl->wunits);
+	free(tbl->slc);
+	free(tbl);
+}
+
+static struct mtd_pairing_table *build_pairing_table(const struct mtd_dev_info *mtd)
+{
+	struct mtd_pairing_table *tbl;
+	struct mtd_pairing_extent *ext = NULL;
+	struct mtd_pairing_info info;
+	int wunit, i;
+
+	tbl = calloc(1, sizeof(struct mtd_pairing_table));
+	if (!tbl)
+		return NULL;
+
+	tbl->pairing = mtd->pairing;
+	tbl->eb_size = mtd->eb_size;
+	tbl->min_io_size = mtd->min_io_size;
+	tbl->ngroups = mtd_pairing_groups(mtd);
+	tbl->nwunits = mtd_wunit_per_eb(mtd);
+	tbl->npairs = tbl->nwunits / tbl->ngroups;
+
+	tbl->info = malloc(tbl->nwunits * sizeof(struct mtd_pairing_info));
+	tbl->wunits = malloc(tbl->nwunits * sizeof(int));
+	tbl->slc = malloc(tbl->npairs * sizeof(struct mtd_pairing_extent));
+	if (!tbl->info || !tbl->wunits || !tbl->slc)
+		goto out_free;
+
+	for (wunit = 0; wunit < tbl->nwunits; wunit++) {
+		if (mtd->pairing && mtd->pairing->get_info) {
+			if (mtd->pairing->get_info(mtd, wunit, &tbl->info[wunit]))
+				goto out_inval;
+		} else {
+			tbl->info[wunit].group = 0;
+			tbl->info[wunit].pair = wunit;
+		}
+	}
+
+	for (i = 0; i < tbl->ngroups * tbl->npairs; i++) {
+		info.group = i / tbl->npairs;
+		info.pair = i % tbl->npairs;
+		wunit = mtd_pairing_info_to_wunit(mtd, &info);
+		if (wunit < 0 || wunit >= tbl->nwunits)
+			goto out_inval;
+		tbl->wunits[i] = wunit;
+
+		if (info.group)
+			continue;
+		if (ext && ext->wunit + ext->cnt == wunit) {
+			ext->cnt += 1;
+			continue;
+		}
+		ext = &tbl->slc[tbl->slc_cnt++];
+		ext->pair = info.pair;
+		ext->wunit = wunit;
+		ext->cnt = 1;
+	}
+
+	return tbl;
+
+out_inval:
+	errno = EINVAL;
+out_free:
+	free_pairing_table(tbl);
+	return NULL;
+}
+
+const struct mtd_pairing_table *mtd_get_pairing_table(const struct mtd_dev_info *mtd)
+{
+	struct mtd_pairing_table *tbl, *head;
+
+	if (mtd->eb_size <= 0 || mtd->min_io_size <= 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	head = __atomic_load_n(&pairing_tables, __ATOMIC_ACQUIRE);
+	for (tbl = head; tbl; tbl = tbl->next)
+		if (tbl->pairing == mtd->pairing &&
+		    tbl->eb_size == mtd->eb_size &&
+		    tbl->min_io_size == mtd->min_io_size)
+			return tbl;
+
+	tbl = build_pairing_table(mtd);
+	if (!tbl)
+		return NULL;
+
+	/*
+	 * Another thread may add a table meanwhile. The cache then holds two
+	 * equal tables, which is harmless.
+	 */
+	tbl->next = head;
+	while (!__atomic_compare_exchange_n(&pairing_tables, &tbl->next, tbl,
+					    0, __ATOMIC_RELEASE,
+					    __ATOMIC_ACQUIRE))
+		;
+
+	return tbl;
+}
+
+int mtd_pairing_table_wunit(const struct mtd_pairing_table *tbl,
+			    const struct mtd_pairing_info *info)
+{
+	if (!info || info->pair < 0 || info->pair >= tbl->npairs ||
+	    info->group < 0 || info->group >= tbl->ngroups)
+		return -EINVAL;
+
+	return tbl->wunits[info->group * tbl->npairs + info->pair];
+}
+
+int mtd_pairing_table_info(const struct mtd_pairing_table *tbl, int wunit,
+			   struct mtd_pairing_info *info)
+{
+	if (wunit < 0 || wunit >= tbl->nwunits)
+		return -EINVAL;
+
+	*info = tbl->info[wunit];
+	return 0;
+}
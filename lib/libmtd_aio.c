@@ -0,0 +1,592 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See
+ * the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ * Asynchronous I/O engine of the MTD library. Reads and writes are batched
+ * and submitted through io_uring, using the raw system calls so that liburing
+ * is not needed. If io_uring is not available, everything is done
+ * synchronously.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#ifdef HAVE_IO_URING
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+#define USE_IO_URING
+#endif
+#endif
+
+#include <mtd/mtd-user.h>
+#include <libmtd.h>
+
+#include "libmtd_int.h"
+#include "common.h"
+
+/* Maximum queue depth of the asynchronous I/O engine */
+#define MTD_AIO_MAX_DEPTH 4096
+
+#define AIO_READ  0
+#define AIO_WRITE 1
+
+/**
+ * struct aio_req - an asynchronous request.
+ * @op: %AIO_READ or %AIO_WRITE
+ * @in_use: non-zero if the request is queued or in flight
+ * @eb: eraseblock
+ * @offs: offset within the eraseblock
+ * @len: length in bytes
+ * @done: how many bytes have been transferred so far
+ * @buf: data buffer
+ * @priv: private pointer of the caller
+ * @iov: I/O vector of the io_uring operation
+ * @next: next free request
+ */
+struct aio_req {
+	int op;
+	int in_use;
+	int eb;
+	int offs;
+	int len;
+	int done;
+	void *buf;
+	void *priv;
+	struct iovec iov;
+	struct aio_req *next;
+};
+
+/**
+ * struct mtd_aio - asynchronous I/O engine.
+ * @desc: MTD library descriptor
+ * @mtd: MTD device description object
+ * @fd: MTD device node or image file descriptor
+ * @depth: queue depth
+ * @is_file: non-zero if @fd is a regular file
+ * @done: failure callback
+ * @err: error code of the first failure since the last 'mtd_aio_wait()'
+ * @ff_buf: eraseblock of 0xFF bytes used to "erase" image files
+ * @ring_fd: io_uring file descriptor, %-1 if requests are synchronous
+ * @reqs: array of @depth requests
+ * @free: list of free requests
+ * @queued: count of requests in the submission queue
+ * @inflight: count of submitted requests which have not completed yet
+ * @last_sqe: most recent submission queue entry, if not submitted yet
+ * @last_req: request of @last_sqe
+ * @chain: count of unsubmitted writes linked into a chain ending at @last_sqe
+ *
+ * The rest of the fields describe the mapped io_uring rings.
+ */
+struct mtd_aio {
+	libmtd_t desc;
+	const struct mtd_dev_info *mtd;
+	int fd;
+	int depth;
+	int is_file;
+	mtd_aio_done_t done;
+	int err;
+	void *ff_buf;
+	int ring_fd;
+#ifdef USE_IO_URING
+	struct aio_req *reqs;
+	struct aio_req *free;
+	int queued;
+	int inflight;
+	struct io_uring_sqe *last_sqe;
+	struct aio_req *last_req;
+	int chain;
+	void *sq_ring;
+	size_t sq_ring_len;
+	void *cq_ring;
+	size_t cq_ring_len;
+	struct io_uring_sqe *sqes;
+	size_t sqes_len;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_cqe *cqes;
+#endif
+};
+
+static void aio_fail(struct mtd_aio *aio, int eb, int offs, void *priv,
+		     int err)
+{
+	if (!aio->err)
+		aio->err = err;
+	if (aio->done)
+		aio->done(priv, eb, offs, err);
+}
+
+/* Erase eraseblock @eb synchronously, returns zero or an errno value */
+static int aio_erase_sync(struct mtd_aio *aio, int eb)
+{
+	const struct mtd_dev_info *mtd = aio->mtd;
+	off_t seek = (off_t)eb * mtd->eb_size;
+	ssize_t ret;
+	int wr = 0;
+
+	if (!aio->is_file)
+		return mtd_erase(aio->desc, mtd, aio->fd, eb) ? errno : 0;
+
+	while (wr < mtd->eb_size) {
+		ret = pwrite(aio->fd, aio->ff_buf + wr, mtd->eb_size - wr,
+			     seek + wr);
+		if (ret <= 0) {
+			if (ret == 0)
+				errno = EIO;
+			sys_errmsg("cannot erase eraseblock %d of the image file",
+				   eb);
+			return errno;
+		}
+		wr += ret;
+	}
+
+	return 0;
+}
+
+#ifdef USE_IO_URING
+
+static void aio_ring_free(struct mtd_aio *aio)
+{
+	if (aio->sqes && aio->sqes != MAP_FAILED)
+		munmap(aio->sqes, aio->sqes_len);
+	if (aio->cq_ring && aio->cq_ring != MAP_FAILED)
+		munmap(aio->cq_ring, aio->cq_ring_len);
+	if (aio->sq_ring && aio->sq_ring != MAP_FAILED)
+		munmap(aio->sq_ring, aio->sq_ring_len);
+	close(aio->ring_fd);
+	aio->ring_fd = -1;
+	free(aio->reqs);
+}
+
+/* Set up the io_uring instance, returns %-1 if it is not available */
+static int aio_ring_init(struct mtd_aio *aio)
+{
+	struct io_uring_params p;
+	int i;
+
+	memset(&p, 0, sizeof(p));
+	aio->ring_fd = syscall(__NR_io_uring_setup, aio->depth, &p);
+	if (aio->ring_fd < 0) {
+		aio->ring_fd = -1;
+		return -1;
+	}
+
+	aio->sq_ring_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	aio->sq_ring = mmap(NULL, aio->sq_ring_len, PROT_READ | PROT_WRITE,
+			    MAP_SHARED | MAP_POPULATE, aio->ring_fd,
+			    IORING_OFF_SQ_RING);
+	aio->cq_ring_len = p.cq_off.cqes +
+			   p.cq_entries * sizeof(struct io_uring_cqe);
+	aio->cq_ring = mmap(NULL, aio->cq_ring_len, PROT_READ | PROT_WRITE,
+			    MAP_SHARED | MAP_POPULATE, aio->ring_fd,
+			    IORING_OFF_CQ_RING);
+	aio->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	aio->sqes = mmap(NULL, aio->sqes_len, PROT_READ | PROT_WRITE,
+			 MAP_SHARED | MAP_POPULATE, aio->ring_fd,
+			 IORING_OFF_SQES);
+	aio->reqs = calloc(aio->depth, sizeof(struct aio_req));
+	if (aio->sq_ring == MAP_FAILED || aio->cq_ring == MAP_FAILED ||
+	    aio->sqes == MAP_FAILED || !aio->reqs) {
+		aio_ring_free(aio);
+		return -1;
+	}
+
+	aio->sq_tail = aio->sq_ring + p.sq_off.tail;
+	aio->sq_mask = aio->sq_ring + p.sq_off.ring_mask;
+	aio->sq_array = aio->sq_ring + p.sq_off.array;
+	aio->cq_head = aio->cq_ring + p.cq_off.head;
+	aio->cq_tail = aio->cq_ring + p.cq_off.tail;
+	aio->cq_mask = aio->cq_ring + p.cq_off.ring_mask;
+	aio->cqes = aio->cq_ring + p.cq_off.cqes;
+
+	for (i = aio->depth - 1; i >= 0; i--) {
+		aio->reqs[i].next = aio->free;
+		aio->free = &aio->reqs[i];
+	}
+
+	return 0;
+}
+
+/*
+ * Put @req to the submission queue. If @link is non-zero, @req is linked to
+ * the previous unsubmitted write, which is to the same eraseblock.
+ */
+static void aio_prep(struct mtd_aio *aio, struct aio_req *req, int link)
+{
+	unsigned tail = *aio->sq_tail;
+	unsigned idx = tail & *aio->sq_mask;
+	struct io_uring_sqe *sqe = &aio->sqes[idx];
+
+	req->iov.iov_base = req->buf + req->done;
+	req->iov.iov_len = req->len - req->done;
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = req->op == AIO_READ ? IORING_OP_READV : IORING_OP_WRITEV;
+	sqe->fd = aio->fd;
+	sqe->addr = (unsigned long)&req->iov;
+	sqe->len = 1;
+	sqe->off = (off_t)req->eb * aio->mtd->eb_size + req->offs + req->done;
+	sqe->user_data = req - aio->reqs;
+
+	if (link) {
+		aio->last_sqe->flags |= IOSQE_IO_LINK;
+		aio->chain += 1;
+	} else {
+		aio->chain = req->op == AIO_WRITE;
+	}
+
+	aio->sq_array[idx] = idx;
+	__atomic_store_n(aio->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	aio->queued += 1;
+	aio->last_sqe = sqe;
+	aio->last_req = req;
+}
+
+static void aio_complete(struct mtd_aio *aio, struct aio_req *req, int res)
+{
+	const struct mtd_dev_info *mtd = aio->mtd;
+	int err;
+
+	if (res > 0 && req->done + res < req->len && req->op == AIO_READ) {
+		/* Short read, read the rest */
+		req->done += res;
+		aio_prep(aio, req, 0);
+		return;
+	}
+
+	if (res >= 0 && req->done + res == req->len) {
+		err = 0;
+	} else {
+		err = res < 0 ? -res : EIO;
+		/* Writes linked to a failed one are cancelled, do not shout */
+		if (err != ECANCELED) {
+			errno = err;
+			sys_errmsg("cannot %s %d bytes %s mtd%d (eraseblock %d, offset %d)",
+				   req->op == AIO_READ ? "read" : "write",
+				   req->len - req->done,
+				   req->op == AIO_READ ? "from" : "to",
+				   mtd->mtd_num, req->eb, req->offs + req->done);
+		}
+	}
+
+	req->in_use = 0;
+	req->next = aio->free;
+	aio->free = req;
+	if (err)
+		aio_fail(aio, req->eb, req->offs, req->priv, err);
+}
+
+/* Process all the available completions, returns their count */
+static int aio_reap(struct mtd_aio *aio)
+{
+	unsigned head = *aio->cq_head;
+	unsigned tail = __atomic_load_n(aio->cq_tail, __ATOMIC_ACQUIRE);
+	int cnt = 0;
+
+	while (head != tail) {
+		struct io_uring_cqe *cqe = &aio->cqes[head & *aio->cq_mask];
+		struct aio_req *req = &aio->reqs[cqe->user_data];
+		int res = cqe->res;
+
+		head += 1;
+		__atomic_store_n(aio->cq_head, head, __ATOMIC_RELEASE);
+		aio->inflight -= 1;
+		cnt += 1;
+		aio_complete(aio, req, res);
+	}
+
+	return cnt;
+}
+
+/*
+ * Submit the queued requests, and also wait for up to @wait requests to
+ * complete, if there are so many.
+ */
+static int aio_enter(struct mtd_aio *aio, int wait)
+{
+	int ret;
+
+	do {
+		unsigned int min_complete = min(wait, aio->queued + aio->inflight);
+
+		ret = syscall(__NR_io_uring_enter, aio->ring_fd, aio->queued,
+			      min_complete,
+			      min_complete ? IORING_ENTER_GETEVENTS : 0,
+			      NULL, 0);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			if ((errno == EAGAIN || errno == EBUSY) && aio_reap(aio))
+				continue;
+			return sys_errmsg("io_uring_enter failed");
+		}
+
+		aio->queued -= ret;
+		aio->inflight += ret;
+		aio->last_sqe = NULL;
+		aio->chain = 0;
+	} while (aio->queued);
+
+	aio_reap(aio);
+	return 0;
+}
+
+/* Wait until all the queued requests complete */
+static int aio_drain(struct mtd_aio *aio)
+{
+	while (aio->queued || aio->inflight)
+		if (aio_enter(aio, aio->queued + aio->inflight))
+			return -1;
+	return 0;
+}
+
+/*
+ * Check whether eraseblock @eb has writes which a new write to @eb cannot be
+ * linked to, and thus has to wait for. If @link is non-zero, the new write
+ * goes to the end of the unsubmitted chain of writes to @eb, so only the
+ * writes outside of that chain count.
+ */
+static int aio_write_busy(struct mtd_aio *aio, int eb, int link)
+{
+	int i, cnt = 0;
+
+	for (i = 0; i < aio->depth; i++) {
+		struct aio_req *req = &aio->reqs[i];
+
+		if (req->in_use && req->op == AIO_WRITE && req->eb == eb)
+			cnt += 1;
+	}
+
+	return cnt > (link ? aio->chain : 0);
+}
+
+static int aio_queue(struct mtd_aio *aio, int op, int eb, int offs,
+		     void *buf, int len, void *priv)
+{
+	struct aio_req *req;
+	int link = 0;
+
+	if (op == AIO_WRITE) {
+		/*
+		 * NAND pages have to be written in order. A write right after
+		 * another unsubmitted write to the same eraseblock is linked to
+		 * it, and so extends the chain of writes to the eraseblock.
+		 * Otherwise previous writes to the eraseblock have to complete
+		 * first.
+		 */
+		link = aio->last_sqe && aio->last_req->op == AIO_WRITE &&
+		       aio->last_req->eb == eb;
+		/* Waiting for a free request would submit the chain */
+		if (!aio->free)
+			link = 0;
+		if (aio_write_busy(aio, eb, link)) {
+			if (aio_drain(aio))
+				return -1;
+			link = 0;
+		}
+	}
+
+	while (!aio->free)
+		if (aio_enter(aio, 1))
+			return -1;
+
+	req = aio->free;
+	aio->free = req->next;
+	req->op = op;
+	req->in_use = 1;
+	req->eb = eb;
+	req->offs = offs;
+	req->len = len;
+	req->done = 0;
+	req->buf = buf;
+	req->priv = priv;
+	aio_prep(aio, req, link);
+
+	if (aio->queued >= aio->depth)
+		return aio_enter(aio, 0);
+	return 0;
+}
+
+#else
+
+static int aio_ring_init(struct mtd_aio *aio)
+{
+	aio->ring_fd = -1;
+	return -1;
+}
+
+static void aio_ring_free(struct mtd_aio *aio)
+{
+}
+
+static int aio_drain(struct mtd_aio *aio)
+{
+	return 0;
+}
+
+static int aio_queue(struct mtd_aio *aio, int op, int eb, int offs,
+		     void *buf, int len, void *priv)
+{
+	errno = ENOSYS;
+	return -1;
+}
+
+#endif /* USE_IO_URING */
+
+mtd_aio_t mtd_aio_open(libmtd_t desc, const struct mtd_dev_info *mtd, int fd,
+		       int depth, mtd_aio_done_t done)
+{
+	struct mtd_aio *aio;
+	struct stat st;
+
+	if (depth <= 0)
+		depth = MTD_AIO_DEFAULT_DEPTH;
+	if (depth > MTD_AIO_MAX_DEPTH)
+		depth = MTD_AIO_MAX_DEPTH;
+
+	if (fstat(fd, &st)) {
+		sys_errmsg("cannot stat file descriptor %d", fd);
+		return NULL;
+	}
+
+	aio = calloc(1, sizeof(struct mtd_aio));
+	if (!aio) {
+		sys_errmsg("cannot allocate %zd bytes of memory",
+			   sizeof(struct mtd_aio));
+		return NULL;
+	}
+
+	aio->desc = desc;
+	aio->mtd = mtd;
+	aio->fd = fd;
+	aio->depth = depth;
+	aio->done = done;
+	aio->is_file = S_ISREG(st.st_mode);
+	if (aio->is_file) {
+		aio->ff_buf = malloc(mtd->eb_size);
+		if (!aio->ff_buf) {
+			sys_errmsg("cannot allocate %d bytes of memory",
+				   mtd->eb_size);
+			free(aio);
+			return NULL;
+		}
+		memset(aio->ff_buf, 0xFF, mtd->eb_size);
+	}
+
+	/* Fall back to synchronous I/O if io_uring cannot be used */
+	aio_ring_init(aio);
+
+	return aio;
+}
+
+void mtd_aio_close(mtd_aio_t aio_desc)
+{
+	struct mtd_aio *aio = aio_desc;
+
+	if (!aio)
+		return;
+
+	if (aio->ring_fd != -1) {
+		aio_drain(aio);
+		aio_ring_free(aio);
+	}
+	free(aio->ff_buf);
+	free(aio);
+}
+
+int mtd_aio_is_async(mtd_aio_t aio_desc)
+{
+	struct mtd_aio *aio = aio_desc;
+
+	return aio->ring_fd != -1;
+}
+
+int mtd_aio_read(mtd_aio_t aio_desc, int eb, int offs, void *buf, int len,
+		 void *priv)
+{
+	struct mtd_aio *aio = aio_desc;
+
+	if (mtd_valid_range(aio->mtd, eb, offs, len))
+		return -1;
+
+	if (aio->ring_fd != -1)
+		return aio_queue(aio, AIO_READ, eb, offs, buf, len, priv);
+
+	if (mtd_pread(aio->mtd, aio->fd, eb, offs, buf, len))
+		aio_fail(aio, eb, offs, priv, errno);
+	return 0;
+}
+
+int mtd_aio_write(mtd_aio_t aio_desc, int eb, int offs, const void *buf,
+		  int len, void *priv)
+{
+	struct mtd_aio *aio = aio_desc;
+
+	if (mtd_valid_write_range(aio->mtd, eb, offs, len))
+		return -1;
+
+	if (aio->ring_fd != -1)
+		return aio_queue(aio, AIO_WRITE, eb, offs, (void *)buf, len,
+				 priv);
+
+	if (mtd_pwrite(aio->mtd, aio->fd, eb, offs, buf, len))
+		aio_fail(aio, eb, offs, priv, errno);
+	return 0;
+}
+
+int mtd_aio_erase(mtd_aio_t aio_desc, int eb, void *priv)
+{
+	struct mtd_aio *aio = aio_desc;
+	int err;
+
+	if (mtd_valid_range(aio->mtd, eb, 0, aio->mtd->eb_size))
+		return -1;
+
+	if (aio->ring_fd != -1 && aio_drain(aio))
+		return -1;
+
+	err = aio_erase_sync(aio, eb);
+	if (err)
+		aio_fail(aio, eb, 0, priv, err);
+	return 0;
+}
+
+int mtd_aio_wait(mtd_aio_t aio_desc)
+{
+	struct mtd_aio *aio = aio_desc;
+	int err;
+
+	if (aio->ring_fd != -1 && aio_drain(aio))
+		return -1;
+
+	err = aio->err;
+	aio->err = 0;
+	if (err) {
+		errno = err;
+		return -1;
+	}
+	return 0;
+}
@@ -52,6 +52,9 @@ extern "C" {
 #define OFFS64_IOCTLS_NOT_SUPPORTED 1
 #define OFFS64_IOCTLS_SUPPORTED     2
 
+/* Maximum count of I/O vectors passed to one 'preadv()'/'pwritev()' call */
+#define MTD_IOV_MAX 64
+
 /**
  * libmtd - MTD library description data structure.
  * @sysfs_mtd: MTD directory in sysfs
@@ -106,6 +109,10 @@ int legacy_mtd_get_info(struct mtd_info *info);
 int legacy_get_dev_info(const char *node, struct mtd_dev_info *mtd);
 int legacy_get_dev_info1(int dev_num, struct mtd_dev_info *mtd);
 
+int mtd_valid_range(const struct mtd_dev_info *mtd, int eb, int offs, int len);
+int mtd_valid_write_range(const struct mtd_dev_info *mtd, int eb, int offs,
+			  int len);
+
 #ifdef __cplusplus
 }
 #endif
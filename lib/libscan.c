@@ -28,6 +28,9 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <stdio.h>
+#include <limits.h>
+#include <pthread.h>
 
 #include <mtd_swab.h>
 #include <mtd/ubi-media.h>
@@ -37,6 +40,80 @@
 #include <crc32.h>
 #include "common.h"
 
+/* How many eraseblocks a scanning thread claims at a time */
+#define SCAN_CHUNK 64
+
+/* Scanning cache file magic ("UBSC") and format version */
+#define SCAN_CACHE_MAGIC   0x55425343
+#define SCAN_CACHE_VERSION 1
+
+/* How many eraseblocks are checked before trusting the cache */
+#define SCAN_CACHE_SAMPLES 32
+
+/*
+ * Per-eraseblock scanning states, the raw result of reading one EC header.
+ * Classification into &struct ubi_scan_info happens afterwards, in eraseblock
+ * order, so that the result does not depend on the order the threads finished
+ * in.
+ */
+enum {
+	SCAN_BAD,
+	SCAN_EMPTY,
+	SCAN_ALIEN,
+	SCAN_BAD_CRC,
+	SCAN_OK,
+};
+
+/**
+ * struct scan_eb - raw scanning result of one eraseblock.
+ * @ec: erase counter from the EC header
+ * @crc: calculated EC header CRC
+ * @hdr_crc: EC header CRC found on flash
+ * @vid_hdr_offs: VID header offset from the EC header
+ * @data_offs: data offset from the EC header
+ * @image_seq: image sequence number from the EC header
+ * @state: one of the %SCAN_* states
+ * @leb: VID header information, only filled in the LEB map mode
+ */
+struct scan_eb {
+	unsigned long long ec;
+	uint32_t crc;
+	uint32_t hdr_crc;
+	int vid_hdr_offs;
+	int data_offs;
+	uint32_t image_seq;
+	int state;
+	struct ubi_scan_leb leb;
+};
+
+/**
+ * struct scan_ctx - state shared by the scanning threads.
+ * @mtd: the MTD device to scan
+ * @fd: MTD device node file descriptor
+ * @ebs: raw per-eraseblock results
+ * @lock: protects @next_eb, @done and @err
+ * @next_eb: first eraseblock not yet claimed by a thread
+ * @done: count of eraseblocks scanned so far
+ * @err: non-zero if a thread failed, scanning stops then
+ * @pr: print progress information
+ * @owner: the thread which called 'ubi_scan()', only it prints progress
+ * @leb_map: read the VID headers as well
+ * @win: how many bytes are read from the beginning of each eraseblock
+ */
+struct scan_ctx {
+	const struct mtd_dev_info *mtd;
+	int fd;
+	struct scan_eb *ebs;
+	pthread_mutex_t lock;
+	int next_eb;
+	int done;
+	int err;
+	int pr;
+	pthread_t owner;
+	int leb_map;
+	int win;
+};
+
 static int all_ff(const void *buf, int len)
 {
 	int i;
@@ -48,13 +125,311 @@ static int all_ff(const void *buf, int len)
 	return 1;
 }
 
+/*
+ * Check the VID header of an eraseblock with a correct EC header. @buf
+ * contains the first @ctx->win bytes of the eraseblock, the VID header is read
+ * separately only if it is not there.
+ */
+static int scan_vid_hdr(const struct scan_ctx *ctx, int eb, struct scan_eb *seb,
+			void *buf)
+{
+	const struct mtd_dev_info *mtd = ctx->mtd;
+	struct ubi_scan_leb *leb = &seb->leb;
+	struct ubi_vid_hdr *vidh;
+	uint32_t crc;
+
+	leb->vol_id = CORRUPT_VID;
+	if (seb->vid_hdr_offs < UBI_EC_HDR_SIZE ||
+	    seb->vid_hdr_offs > mtd->eb_size - UBI_VID_HDR_SIZE)
+		return 0;
+
+	if (seb->vid_hdr_offs + UBI_VID_HDR_SIZE <= ctx->win) {
+		vidh = buf + seb->vid_hdr_offs;
+	} else {
+		vidh = buf;
+		if (mtd_pread(mtd, ctx->fd, eb, seb->vid_hdr_offs, vidh,
+			      UBI_VID_HDR_SIZE))
+			return -1;
+	}
+
+	if (be32_to_cpu(vidh->magic) != UBI_VID_HDR_MAGIC) {
+		if (all_ff(vidh, UBI_VID_HDR_SIZE))
+			leb->vol_id = NO_VID;
+		return 0;
+	}
+
+	crc = mtd_crc32(UBI_CRC32_INIT, vidh, UBI_VID_HDR_SIZE_CRC);
+	if (be32_to_cpu(vidh->hdr_crc) != crc)
+		return 0;
+
+	/* Do not let garbage LEB numbers blow up the LEB map */
+	if (be32_to_cpu(vidh->lnum) >= (uint32_t)mtd->eb_cnt)
+		return 0;
+
+	leb->vol_id = be32_to_cpu(vidh->vol_id);
+	leb->lnum = be32_to_cpu(vidh->lnum);
+	leb->sqnum = be64_to_cpu(vidh->sqnum);
+	leb->data_size = be32_to_cpu(vidh->data_size);
+	leb->copy_flag = vidh->copy_flag;
+	leb->lpos = vidh->lpos;
+	return 0;
+}
+
+static int scan_eb(const struct scan_ctx *ctx, int eb, struct scan_eb *seb,
+		   void *buf)
+{
+	int ret;
+	const struct mtd_dev_info *mtd = ctx->mtd;
+	struct ubi_ec_hdr *ech = buf;
+
+	seb->leb.vol_id = NO_VID;
+
+	ret = mtd_is_bad(mtd, ctx->fd, eb);
+	if (ret == -1)
+		return -1;
+	if (ret) {
+		seb->state = SCAN_BAD;
+		return 0;
+	}
+
+	ret = mtd_pread(mtd, ctx->fd, eb, 0, buf, ctx->win);
+	if (ret < 0)
+		return -1;
+
+	if (be32_to_cpu(ech->magic) != UBI_EC_HDR_MAGIC) {
+		if (all_ff(ech, sizeof(struct ubi_ec_hdr)))
+			seb->state = SCAN_EMPTY;
+		else
+			seb->state = SCAN_ALIEN;
+		return 0;
+	}
+
+	seb->crc = mtd_crc32(UBI_CRC32_INIT, ech, UBI_EC_HDR_SIZE_CRC);
+	seb->hdr_crc = be32_to_cpu(ech->hdr_crc);
+	if (seb->hdr_crc != seb->crc) {
+		seb->state = SCAN_BAD_CRC;
+		return 0;
+	}
+
+	seb->ec = be64_to_cpu(ech->ec);
+	seb->vid_hdr_offs = be32_to_cpu(ech->vid_hdr_offset);
+	seb->data_offs = be32_to_cpu(ech->data_offset);
+	seb->image_seq = be32_to_cpu(ech->image_seq);
+	seb->state = SCAN_OK;
+
+	if (ctx->leb_map)
+		return scan_vid_hdr(ctx, eb, seb, buf);
+	return 0;
+}
+
+/*
+ * The scanning thread: claims chunks of eraseblocks until the whole device is
+ * scanned or some thread fails. The calling thread runs it too and is the one
+ * which prints the progress.
+ */
+static void *scan_worker(void *arg)
+{
+	struct scan_ctx *ctx = arg;
+	const struct mtd_dev_info *mtd = ctx->mtd;
+	void *buf;
+
+	buf = malloc(ctx->win);
+	if (!buf) {
+		sys_errmsg("cannot allocate %d bytes of memory", ctx->win);
+		pthread_mutex_lock(&ctx->lock);
+		ctx->err = 1;
+		pthread_mutex_unlock(&ctx->lock);
+		return NULL;
+	}
+
+	while (1) {
+		int eb, first, last, err = 0;
+
+		pthread_mutex_lock(&ctx->lock);
+		first = ctx->next_eb;
+		if (ctx->err || first >= mtd->eb_cnt) {
+			pthread_mutex_unlock(&ctx->lock);
+			break;
+		}
+		last = first + SCAN_CHUNK;
+		if (last > mtd->eb_cnt)
+			last = mtd->eb_cnt;
+		ctx->next_eb = last;
+		pthread_mutex_unlock(&ctx->lock);
+
+		for (eb = first; eb < last && !err; eb++)
+			err = scan_eb(ctx, eb, &ctx->ebs[eb], buf);
+
+		pthread_mutex_lock(&ctx->lock);
+		if (err)
+			ctx->err = 1;
+		ctx->done += last - first;
+		eb = ctx->done;
+		pthread_mutex_unlock(&ctx->lock);
+
+		if (ctx->pr && pthread_equal(pthread_self(), ctx->owner)) {
+			printf("\r" PROGRAM_NAME ": scanning eraseblock %d -- %2lld %% complete  ",
+			       eb - 1, (long long)eb * 100 / mtd->eb_cnt);
+			fflush(stdout);
+		}
+	}
+
+	free(buf);
+	return NULL;
+}
+
+/*
+ * Run the scanning threads. The calling thread is one of them, so @threads
+ * equal to %1 scans without creating any threads.
+ */
+static int scan_ebs(struct scan_ctx *ctx, int threads)
+{
+	pthread_t *tids;
+	int i, started = 0, err;
+
+	if (threads > ctx->mtd->eb_cnt / SCAN_CHUNK)
+		threads = ctx->mtd->eb_cnt / SCAN_CHUNK;
+	if (threads < 1)
+		threads = 1;
+
+	tids = malloc(threads * sizeof(pthread_t));
+	if (!tids)
+		return sys_errmsg("cannot allocate %zd bytes of memory",
+				  threads * sizeof(pthread_t));
+
+	pthread_mutex_init(&ctx->lock, NULL);
+	for (i = 1; i < threads; i++) {
+		err = pthread_create(&tids[i], NULL, scan_worker, ctx);
+		if (err) {
+			errno = err;
+			sys_errmsg("cannot create scanning thread, use %d", i);
+			break;
+		}
+		started += 1;
+	}
+
+	scan_worker(ctx);
+
+	for (i = 1; i <= started; i++)
+		pthread_join(tids[i], NULL);
+	pthread_mutex_destroy(&ctx->lock);
+	free(tids);
+
+	return ctx->err ? -1 : 0;
+}
+
+static int cmp_vol(const void *a, const void *b)
+{
+	const struct ubi_scan_vol *va = a, *vb = b;
+
+	if (va->vol_id == vb->vol_id)
+		return 0;
+	return va->vol_id < vb->vol_id ? -1 : 1;
+}
+
+static struct ubi_scan_vol *find_vol(struct ubi_scan_vol *vols, int vol_cnt,
+				     uint32_t vol_id)
+{
+	struct ubi_scan_vol key = { .vol_id = vol_id };
+
+	return bsearch(&key, vols, vol_cnt, sizeof(struct ubi_scan_vol),
+		       cmp_vol);
+}
+
+/*
+ * Build the per-volume LEB to PEB mapping from @si->lebs. There are at most
+ * %UBI_MAX_VOLUMES user volumes plus a few internal ones, so the volumes are
+ * first collected unsorted and sorted before the PEBs are assigned.
+ */
+static int build_vols(const struct mtd_dev_info *mtd, struct ubi_scan_info *si)
+{
+	int eb, i, vol_cnt = 0, max = 0;
+	struct ubi_scan_vol *vols = NULL, *vol;
+
+	for (eb = 0; eb < mtd->eb_cnt; eb++) {
+		const struct ubi_scan_leb *leb = &si->lebs[eb];
+
+		if (leb->vol_id == NO_VID || leb->vol_id == CORRUPT_VID ||
+		    leb->lpos == UBI_VID_LPOS_CONSOLIDATED)
+			continue;
+
+		for (i = 0; i < vol_cnt; i++)
+			if (vols[i].vol_id == leb->vol_id)
+				break;
+		if (i == vol_cnt) {
+			if (vol_cnt == max) {
+				max = max ? max * 2 : 16;
+				vol = realloc(vols, max * sizeof(struct ubi_scan_vol));
+				if (!vol) {
+					sys_errmsg("cannot allocate %zd bytes of memory",
+						   max * sizeof(struct ubi_scan_vol));
+					goto out_free;
+				}
+				vols = vol;
+			}
+			vols[i].vol_id = leb->vol_id;
+			vols[i].leb_cnt = 0;
+			vols[i].pebs = NULL;
+			vol_cnt += 1;
+		}
+		if ((int)leb->lnum >= vols[i].leb_cnt)
+			vols[i].leb_cnt = leb->lnum + 1;
+	}
+
+	if (vol_cnt == 0)
+		return 0;
+
+	qsort(vols, vol_cnt, sizeof(struct ubi_scan_vol), cmp_vol);
+	for (i = 0; i < vol_cnt; i++) {
+		vols[i].pebs = malloc(vols[i].leb_cnt * sizeof(int));
+		if (!vols[i].pebs) {
+			sys_errmsg("cannot allocate %zd bytes of memory",
+				   vols[i].leb_cnt * sizeof(int));
+			goto out_free;
+		}
+		memset(vols[i].pebs, 0xFF, vols[i].leb_cnt * sizeof(int));
+	}
+
+	for (eb = 0; eb < mtd->eb_cnt; eb++) {
+		const struct ubi_scan_leb *leb = &si->lebs[eb];
+		int *peb;
+
+		if (leb->vol_id == NO_VID || leb->vol_id == CORRUPT_VID ||
+		    leb->lpos == UBI_VID_LPOS_CONSOLIDATED)
+			continue;
+
+		vol = find_vol(vols, vol_cnt, leb->vol_id);
+		peb = &vol->pebs[leb->lnum];
+		if (*peb == -1 || si->lebs[*peb].sqnum < leb->sqnum)
+			*peb = eb;
+	}
+
+	si->vols = vols;
+	si->vol_cnt = vol_cnt;
+	return 0;
+
+out_free:
+	for (i = 0; i < vol_cnt; i++)
+		free(vols[i].pebs);
+	free(vols);
+	return -1;
+}
+
 int ubi_scan(struct mtd_dev_info *mtd, int fd, struct ubi_scan_info **info,
-	     int verbose)
+	     const struct ubi_scan_opts *opts)
 {
-	int eb, v = (verbose == 2), pr = (verbose == 1);
+	int eb, v = 0, pr = 0, threads = 1;
 	struct ubi_scan_info *si;
+	struct scan_ctx ctx;
 	unsigned long long sum = 0;
 
+	if (opts) {
+		v = (opts->verbose == 2);
+		pr = (opts->verbose == 1);
+		if (opts->threads > 1)
+			threads = opts->threads;
+	}
+
 	si = calloc(1, sizeof(struct ubi_scan_info));
 	if (!si)
 		return sys_errmsg("cannot allocate %zd bytes of memory",
@@ -67,78 +442,98 @@ int ubi_scan(struct mtd_dev_info *mtd, int fd, struct ubi_scan_info **info,
 		goto out_si;
 	}
 
+	memset(&ctx, 0, sizeof(struct scan_ctx));
+	ctx.mtd = mtd;
+	ctx.fd = fd;
+	ctx.pr = pr;
+	ctx.owner = pthread_self();
+	ctx.win = sizeof(struct ubi_ec_hdr);
+	if (opts && opts->leb_map) {
+		ctx.leb_map = 1;
+		ctx.win = 2 * mtd->min_io_size;
+		if (ctx.win < UBI_EC_HDR_SIZE + UBI_VID_HDR_SIZE)
+			ctx.win = UBI_EC_HDR_SIZE + UBI_VID_HDR_SIZE;
+		if (ctx.win > mtd->eb_size)
+			ctx.win = mtd->eb_size;
+
+		si->lebs = malloc(mtd->eb_cnt * sizeof(struct ubi_scan_leb));
+		if (!si->lebs) {
+			sys_errmsg("cannot allocate %zd bytes of memory",
+				   mtd->eb_cnt * sizeof(struct ubi_scan_leb));
+			goto out_ec;
+		}
+		for (eb = 0; eb < mtd->eb_cnt; eb++)
+			si->lebs[eb].vol_id = NO_VID;
+	}
+	ctx.ebs = calloc(mtd->eb_cnt, sizeof(struct scan_eb));
+	if (!ctx.ebs) {
+		sys_errmsg("cannot allocate %zd bytes of memory",
+			   mtd->eb_cnt * sizeof(struct scan_eb));
+		goto out_ec;
+	}
+
 	si->vid_hdr_offs = si->data_offs = -1;
 
-	verbose(v, "start scanning eraseblocks 0-%d", mtd->eb_cnt);
+	verbose(v, "start scanning eraseblocks 0-%d with %d thread(s)",
+		mtd->eb_cnt, threads);
+	if (scan_ebs(&ctx, threads)) {
+		if (pr)
+			printf("\n");
+		goto out_ebs;
+	}
+
+	/*
+	 * Classify the eraseblocks in order, the VID header and data offset
+	 * consistency checks rely on it.
+	 */
 	for (eb = 0; eb < mtd->eb_cnt; eb++) {
-		int ret;
-		uint32_t crc;
-		struct ubi_ec_hdr ech;
-		unsigned long long ec;
+		struct scan_eb *seb = &ctx.ebs[eb];
 
 		if (v) {
 			normsg_cont("scanning eraseblock %d", eb);
 			fflush(stdout);
 		}
-		if (pr) {
-			printf("\r" PROGRAM_NAME ": scanning eraseblock %d -- %2lld %% complete  ",
-			       eb, (long long)(eb + 1) * 100 / mtd->eb_cnt);
-			fflush(stdout);
-		}
 
-		ret = mtd_is_bad(mtd, fd, eb);
-		if (ret == -1)
-			goto out_ec;
-		if (ret) {
+		switch (seb->state) {
+		case SCAN_BAD:
 			si->bad_cnt += 1;
 			si->ec[eb] = EB_BAD;
 			if (v)
 				printf(": bad\n");
 			continue;
-		}
-
-		ret = mtd_read(mtd, fd, eb, 0, &ech, sizeof(struct ubi_ec_hdr));
-		if (ret < 0)
-			goto out_ec;
-
-		if (be32_to_cpu(ech.magic) != UBI_EC_HDR_MAGIC) {
-			if (all_ff(&ech, sizeof(struct ubi_ec_hdr))) {
-				si->empty_cnt += 1;
-				si->ec[eb] = EB_EMPTY;
-				if (v)
-					printf(": empty\n");
-			} else {
-				si->alien_cnt += 1;
-				si->ec[eb] = EB_ALIEN;
-				if (v)
-					printf(": alien\n");
-			}
+		case SCAN_EMPTY:
+			si->empty_cnt += 1;
+			si->ec[eb] = EB_EMPTY;
+			if (v)
+				printf(": empty\n");
 			continue;
-		}
-
-		crc = mtd_crc32(UBI_CRC32_INIT, &ech, UBI_EC_HDR_SIZE_CRC);
-		if (be32_to_cpu(ech.hdr_crc) != crc) {
+		case SCAN_ALIEN:
+			si->alien_cnt += 1;
+			si->ec[eb] = EB_ALIEN;
+			if (v)
+				printf(": alien\n");
+			continue;
+		case SCAN_BAD_CRC:
 			si->corrupted_cnt += 1;
 			si->ec[eb] = EB_CORRUPTED;
 			if (v)
 				printf(": bad CRC %#08x, should be %#08x\n",
-				       crc, be32_to_cpu(ech.hdr_crc));
+				       seb->crc, seb->hdr_crc);
 			continue;
 		}
 
-		ec = be64_to_cpu(ech.ec);
-		if (ec > EC_MAX) {
+		if (seb->ec > EC_MAX) {
 			if (pr)
 				printf("\n");
 			errmsg("erase counter in EB %d is %llu, while this "
 			       "program expects them to be less than %u",
-			       eb, ec, EC_MAX);
-			goto out_ec;
+			       eb, seb->ec, EC_MAX);
+			goto out_ebs;
 		}
 
 		if (si->vid_hdr_offs == -1) {
-			si->vid_hdr_offs = be32_to_cpu(ech.vid_hdr_offset);
-			si->data_offs = be32_to_cpu(ech.data_offset);
+			si->vid_hdr_offs = seb->vid_hdr_offs;
+			si->data_offs = seb->data_offs;
 			if (si->data_offs % mtd->min_io_size) {
 				if (pr)
 					printf("\n");
@@ -154,29 +549,27 @@ int ubi_scan(struct mtd_dev_info *mtd, int fd, struct ubi_scan_info **info,
 
 			}
 		} else {
-			if ((int)be32_to_cpu(ech.vid_hdr_offset) != si->vid_hdr_offs) {
+			if (seb->vid_hdr_offs != si->vid_hdr_offs) {
 				if (pr)
 					printf("\n");
 				if (v)
 					printf(": corrupted because of the below\n");
 				warnmsg("inconsistent VID header offset: was "
 					"%d, but is %d in eraseblock %d",
-					si->vid_hdr_offs,
-					be32_to_cpu(ech.vid_hdr_offset), eb);
+					si->vid_hdr_offs, seb->vid_hdr_offs, eb);
 				warnmsg("treat eraseblock %d as corrupted", eb);
 				si->corrupted_cnt += 1;
 				si->ec[eb] = EB_CORRUPTED;
 				continue;
 			}
-			if ((int)be32_to_cpu(ech.data_offset) != si->data_offs) {
+			if (seb->data_offs != si->data_offs) {
 				if (pr)
 					printf("\n");
 				if (v)
 					printf(": corrupted because of the below\n");
 				warnmsg("inconsistent data offset: was %d, but"
 					" is %d in eraseblock %d",
-					si->data_offs,
-					be32_to_cpu(ech.data_offset), eb);
+					si->data_offs, seb->data_offs, eb);
 				warnmsg("treat eraseblock %d as corrupted", eb);
 				si->corrupted_cnt += 1;
 				si->ec[eb] = EB_CORRUPTED;
@@ -184,11 +577,34 @@ int ubi_scan(struct mtd_dev_info *mtd, int fd, struct ubi_scan_info **info,
 			}
 		}
 
+		if (si->ok_cnt == 0)
+			si->image_seq = seb->image_seq;
 		si->ok_cnt += 1;
-		si->ec[eb] = ec;
+		si->ec[eb] = seb->ec;
 		if (v)
-			printf(": OK, erase counter %u\n", si->ec[eb]);
+			printf(": OK, erase counter %u", si->ec[eb]);
+
+		if (ctx.leb_map) {
+			si->lebs[eb] = seb->leb;
+			if (seb->leb.vol_id == CORRUPT_VID) {
+				si->vid_corrupted_cnt += 1;
+				if (v)
+					printf(", corrupted VID header");
+			} else if (seb->leb.vol_id != NO_VID) {
+				si->used_cnt += 1;
+				if (v)
+					printf(", volume %u LEB %u sqnum %llu",
+					       seb->leb.vol_id, seb->leb.lnum,
+					       seb->leb.sqnum);
+			}
+		}
+		if (v)
+			printf("\n");
 	}
+	free(ctx.ebs);
+
+	if (ctx.leb_map && build_vols(mtd, si))
+		goto out_ec;
 
 	if (si->ok_cnt != 0) {
 		/* Calculate mean erase counter */
@@ -204,13 +620,19 @@ int ubi_scan(struct mtd_dev_info *mtd, int fd, struct ubi_scan_info **info,
 	verbose(v, "finished, mean EC %lld, %d OK, %d corrupted, %d empty, %d "
 		"alien, bad %d", si->mean_ec, si->ok_cnt, si->corrupted_cnt,
 		si->empty_cnt, si->alien_cnt, si->bad_cnt);
+	if (ctx.leb_map)
+		verbose(v, "%d used, %d with corrupted VID header, %d volumes",
+			si->used_cnt, si->vid_corrupted_cnt, si->vol_cnt);
 
 	*info = si;
 	if (pr)
 		printf("\n");
 	return 0;
 
+out_ebs:
+	free(ctx.ebs);
 out_ec:
+	free(si->lebs);
 	free(si->ec);
 out_si:
 	free(si);
@@ -218,8 +640,392 @@ out_si:
 	return -1;
 }
 
+/**
+ * struct scan_cache_hdr - scanning cache file header.
+ * @magic: %SCAN_CACHE_MAGIC
+ * @version: %SCAN_CACHE_VERSION
+ * @size: MTD device size
+ * @type: MTD device type
+ * @eb_cnt: count of eraseblocks
+ * @eb_size: eraseblock size
+ * @min_io_size: minimum input/output unit size
+ * @subpage_size: sub-page size
+ * @name: MTD device name
+ * @image_seq: UBI image sequence number
+ * @vid_hdr_offs: VID header offset
+ * @data_offs: data offset
+ * @ec_crc: CRC of the erase counters array which follows the header
+ * @hdr_crc: CRC of this header
+ *
+ * The cache is private to the host which created it, so everything is stored
+ * in native byte order.
+ */
+struct scan_cache_hdr {
+	uint32_t magic;
+	uint32_t version;
+	int64_t size;
+	int32_t type;
+	int32_t eb_cnt;
+	int32_t eb_size;
+	int32_t min_io_size;
+	int32_t subpage_size;
+	char name[MTD_NAME_MAX + 1];
+	uint32_t image_seq;
+	int32_t vid_hdr_offs;
+	int32_t data_offs;
+	uint32_t ec_crc;
+	uint32_t hdr_crc;
+};
+
+#define SCAN_CACHE_HDR_SIZE_CRC (sizeof(struct scan_cache_hdr) - sizeof(uint32_t))
+
+static void cache_path(const struct mtd_dev_info *mtd, char *path, char *dir)
+{
+	const char *d = getenv("UBI_SCAN_CACHE_DIR");
+
+	if (!d || !*d)
+		d = UBI_SCAN_CACHE_DIR;
+	if (dir)
+		snprintf(dir, PATH_MAX, "%s", d);
+	snprintf(path, PATH_MAX, "%s/mtd%d.scan", d, mtd->mtd_num);
+}
+
+static void cache_init_hdr(const struct mtd_dev_info *mtd,
+			   struct scan_cache_hdr *hdr)
+{
+	memset(hdr, 0, sizeof(struct scan_cache_hdr));
+	hdr->magic = SCAN_CACHE_MAGIC;
+	hdr->version = SCAN_CACHE_VERSION;
+	hdr->size = mtd->size;
+	hdr->type = mtd->type;
+	hdr->eb_cnt = mtd->eb_cnt;
+	hdr->eb_size = mtd->eb_size;
+	hdr->min_io_size = mtd->min_io_size;
+	hdr->subpage_size = mtd->subpage_size;
+	memcpy(hdr->name, mtd->name, sizeof(hdr->name));
+}
+
+static int read_full(int fd, void *buf, size_t len)
+{
+	while (len > 0) {
+		ssize_t ret = read(fd, buf, len);
+
+		if (ret == 0)
+			return 1;
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+static int write_full(int fd, const void *buf, size_t len)
+{
+	while (len > 0) {
+		ssize_t ret = write(fd, buf, len);
+
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+/*
+ * Re-calculate the counters of @si from the erase counters, the same way
+ * 'ubi_scan()' does.
+ */
+static void count_ebs(const struct mtd_dev_info *mtd, struct ubi_scan_info *si)
+{
+	int eb;
+	unsigned long long sum = 0;
+
+	for (eb = 0; eb < mtd->eb_cnt; eb++) {
+		switch (si->ec[eb]) {
+		case EB_BAD:
+			si->bad_cnt += 1;
+			break;
+		case EB_EMPTY:
+			si->empty_cnt += 1;
+			break;
+		case EB_ALIEN:
+			si->alien_cnt += 1;
+			break;
+		case EB_CORRUPTED:
+			si->corrupted_cnt += 1;
+			break;
+		default:
+			si->ok_cnt += 1;
+			sum += si->ec[eb];
+		}
+	}
+
+	if (si->ok_cnt != 0)
+		si->mean_ec = sum / si->ok_cnt;
+	si->good_cnt = mtd->eb_cnt - si->bad_cnt;
+}
+
+/*
+ * Check that eraseblock @eb still looks the way the cache says. Returns %0 if
+ * it does, %1 if it does not and %-1 in case of failure.
+ */
+static int cache_check_eb(const struct scan_ctx *ctx,
+			  const struct ubi_scan_info *si, uint32_t image_seq,
+			  int eb, void *buf)
+{
+	struct scan_eb seb;
+	uint32_t ec;
+
+	memset(&seb, 0, sizeof(struct scan_eb));
+	if (scan_eb(ctx, eb, &seb, buf))
+		return -1;
+
+	switch (seb.state) {
+	case SCAN_BAD:
+		ec = EB_BAD;
+		break;
+	case SCAN_EMPTY:
+		ec = EB_EMPTY;
+		break;
+	case SCAN_ALIEN:
+		ec = EB_ALIEN;
+		break;
+	case SCAN_BAD_CRC:
+		ec = EB_CORRUPTED;
+		break;
+	default:
+		if (seb.image_seq != image_seq ||
+		    seb.vid_hdr_offs != si->vid_hdr_offs ||
+		    seb.data_offs != si->data_offs)
+			return 1;
+		ec = seb.ec;
+	}
+
+	return ec != si->ec[eb];
+}
+
+int ubi_scan_cache_load(const struct mtd_dev_info *mtd, int fd,
+			struct ubi_scan_info **info,
+			const struct ubi_scan_opts *opts)
+{
+	int cfd, ret, i, samples, stride, v = 0;
+	char path[PATH_MAX];
+	struct scan_cache_hdr hdr, cur;
+	struct ubi_scan_info *si;
+	struct scan_ctx ctx;
+	struct ubi_ec_hdr ech;
+
+	*info = NULL;
+	if (opts)
+		v = (opts->verbose == 2);
+
+	cache_path(mtd, path, NULL);
+	cfd = open(path, O_RDONLY);
+	if (cfd == -1) {
+		if (errno == ENOENT) {
+			verbose(v, "no scanning cache \"%s\"", path);
+			return 1;
+		}
+		return sys_errmsg("cannot open \"%s\"", path);
+	}
+
+	ret = read_full(cfd, &hdr, sizeof(struct scan_cache_hdr));
+	if (ret < 0) {
+		sys_errmsg("cannot read \"%s\"", path);
+		goto out_close;
+	}
+
+	cache_init_hdr(mtd, &cur);
+	if (ret || hdr.magic != SCAN_CACHE_MAGIC ||
+	    hdr.version != SCAN_CACHE_VERSION ||
+	    hdr.hdr_crc != mtd_crc32(UBI_CRC32_INIT, &hdr, SCAN_CACHE_HDR_SIZE_CRC)) {
+		verbose(v, "scanning cache \"%s\" is corrupted", path);
+		close(cfd);
+		return 1;
+	}
+
+	if (hdr.size != cur.size || hdr.type != cur.type ||
+	    hdr.eb_cnt != cur.eb_cnt || hdr.eb_size != cur.eb_size ||
+	    hdr.min_io_size != cur.min_io_size ||
+	    hdr.subpage_size != cur.subpage_size ||
+	    memcmp(hdr.name, cur.name, sizeof(hdr.name))) {
+		verbose(v, "scanning cache \"%s\" is for another MTD device",
+			path);
+		close(cfd);
+		return 1;
+	}
+
+	si = calloc(1, sizeof(struct ubi_scan_info));
+	if (!si) {
+		sys_errmsg("cannot allocate %zd bytes of memory",
+			   sizeof(struct ubi_scan_info));
+		goto out_close;
+	}
+
+	si->ec = malloc(mtd->eb_cnt * sizeof(uint32_t));
+	if (!si->ec) {
+		sys_errmsg("cannot allocate %zd bytes of memory",
+			   mtd->eb_cnt * sizeof(uint32_t));
+		goto out_si;
+	}
+
+	ret = read_full(cfd, si->ec, mtd->eb_cnt * sizeof(uint32_t));
+	if (ret < 0) {
+		sys_errmsg("cannot read \"%s\"", path);
+		goto out_ec;
+	}
+	close(cfd);
+	cfd = -1;
+
+	if (ret || hdr.ec_crc != mtd_crc32(UBI_CRC32_INIT, si->ec,
+					   mtd->eb_cnt * sizeof(uint32_t))) {
+		verbose(v, "scanning cache \"%s\" is corrupted", path);
+		ret = 1;
+		goto out_ec;
+	}
+
+	si->vid_hdr_offs = hdr.vid_hdr_offs;
+	si->data_offs = hdr.data_offs;
+	si->image_seq = hdr.image_seq;
+	count_ebs(mtd, si);
+
+	/*
+	 * Spot-check the first and the last eraseblocks and a few in between,
+	 * picking a random one out of each stride, so that repeated runs look
+	 * at different eraseblocks.
+	 */
+	memset(&ctx, 0, sizeof(struct scan_ctx));
+	ctx.mtd = mtd;
+	ctx.fd = fd;
+	ctx.win = sizeof(struct ubi_ec_hdr);
+
+	samples = SCAN_CACHE_SAMPLES;
+	if (samples > mtd->eb_cnt)
+		samples = mtd->eb_cnt;
+	stride = mtd->eb_cnt / samples;
+	for (i = 0; i < samples; i++) {
+		int eb;
+
+		if (i == 0)
+			eb = 0;
+		else if (i == samples - 1)
+			eb = mtd->eb_cnt - 1;
+		else
+			eb = i * stride + rand() % stride;
+
+		ret = cache_check_eb(&ctx, si, hdr.image_seq, eb, &ech);
+		if (ret < 0)
+			goto out_ec;
+		if (ret) {
+			verbose(v, "eraseblock %d changed since scanning cache \"%s\" was saved",
+				eb, path);
+			goto out_ec;
+		}
+	}
+
+	verbose(v, "using scanning cache \"%s\", image sequence number %u",
+		path, hdr.image_seq);
+	*info = si;
+	return 0;
+
+out_ec:
+	free(si->ec);
+out_si:
+	free(si);
+out_close:
+	if (cfd != -1)
+		close(cfd);
+	return ret == 1 ? 1 : -1;
+}
+
+int ubi_scan_cache_save(const struct mtd_dev_info *mtd,
+			const struct ubi_scan_info *si, uint32_t image_seq)
+{
+	int cfd;
+	char path[PATH_MAX], tmp[PATH_MAX + 4], dir[PATH_MAX];
+	struct scan_cache_hdr hdr;
+	size_t ec_len = mtd->eb_cnt * sizeof(uint32_t);
+
+	cache_path(mtd, path, dir);
+	if (mkdir(dir, 0755) && errno != EEXIST)
+		return sys_errmsg("cannot create directory \"%s\"", dir);
+
+	cache_init_hdr(mtd, &hdr);
+	hdr.image_seq = image_seq;
+	hdr.vid_hdr_offs = si->vid_hdr_offs;
+	hdr.data_offs = si->data_offs;
+	hdr.ec_crc = mtd_crc32(UBI_CRC32_INIT, si->ec, ec_len);
+	hdr.hdr_crc = mtd_crc32(UBI_CRC32_INIT, &hdr, SCAN_CACHE_HDR_SIZE_CRC);
+
+	/* Write a temporary file and rename it, so the cache is never torn */
+	sprintf(tmp, "%s.tmp", path);
+	cfd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (cfd == -1)
+		return sys_errmsg("cannot create \"%s\"", tmp);
+
+	if (write_full(cfd, &hdr, sizeof(struct scan_cache_hdr)) ||
+	    write_full(cfd, si->ec, ec_len)) {
+		sys_errmsg("cannot write \"%s\"", tmp);
+		goto out_unlink;
+	}
+
+	if (fsync(cfd)) {
+		sys_errmsg("cannot sync \"%s\"", tmp);
+		goto out_unlink;
+	}
+	close(cfd);
+	cfd = -1;
+
+	if (rename(tmp, path)) {
+		sys_errmsg("cannot rename \"%s\" to \"%s\"", tmp, path);
+		goto out_unlink;
+	}
+
+	return 0;
+
+out_unlink:
+	if (cfd != -1)
+		close(cfd);
+	unlink(tmp);
+	return -1;
+}
+
+int ubi_scan_cache_invalidate(const struct mtd_dev_info *mtd)
+{
+	char path[PATH_MAX];
+
+	cache_path(mtd, path, NULL);
+	if (unlink(path) && errno != ENOENT)
+		return sys_errmsg("cannot remove \"%s\"", path);
+	return 0;
+}
+
+const struct ubi_scan_vol *ubi_scan_get_vol(const struct ubi_scan_info *si,
+					    uint32_t vol_id)
+{
+	if (!si->vols)
+		return NULL;
+	return find_vol(si->vols, si->vol_cnt, vol_id);
+}
+
 void ubi_scan_free(struct ubi_scan_info *si)
 {
+	int i;
+
+	for (i = 0; i < si->vol_cnt; i++)
+		free(si->vols[i].pebs);
+	free(si->vols);
+	free(si->lebs);
 	free(si->ec);
 	free(si);
 }
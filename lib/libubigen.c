@@ -30,6 +30,7 @@
 #include <stdint.h>
 #include <unistd.h>
 #include <string.h>
+#include <sys/uio.h>
 
 #include <mtd/ubi-media.h>
 #include <mtd_swab.h>
@@ -38,6 +39,12 @@
 #include <crc32.h>
 #include "common.h"
 
+/*
+ * Size of the pieces the volume data is read and written in by
+ * 'ubigen_write_direct()', which bounds its memory use whatever the PEB size.
+ */
+#define UBIGEN_CHUNK (256 * 1024)
+
 void ubigen_info_init(struct ubigen_info *ui, int peb_size, int min_io_size,
 		      int subpage_size, int vid_hdr_offs, int ubi_ver,
 		      uint32_t image_seq,
@@ -58,6 +65,7 @@ void ubigen_info_init(struct ubigen_info *ui, int peb_size, int min_io_size,
 	ui->leb_size = peb_size - ui->data_offs;
 	ui->ubi_ver = ubi_ver;
 	ui->image_seq = image_seq;
+	ui->ffmap = NULL;
 
 	ui->max_volumes = ui->leb_size / UBI_VTBL_RECORD_SIZE;
 	if (ui->max_volumes > UBI_MAX_VOLUMES)
@@ -67,6 +75,7 @@ void ubigen_info_init(struct ubigen_info *ui, int peb_size, int min_io_size,
 	ui->mtd.eb_size = ui->peb_size;
 	ui->mtd.min_io_size = ui->min_io_size;
 	ui->mtd.pairing = pairing;
+	ui->pairing_tbl = pairing ? mtd_get_pairing_table(&ui->mtd) : NULL;
 
 	if (pairing) {
 		ui->slc_leb_size = (peb_size / pairing->ngroups) -
@@ -78,6 +87,38 @@ void ubigen_info_init(struct ubigen_info *ui, int peb_size, int min_io_size,
 	}
 }
 
+/*
+ * Write a PEB to the output file at the current position. Returns %0 on
+ * success and %-1 on failure.
+ */
+static int ubigen_write_peb(const struct ubigen_info *ui, int fd,
+			    const void *buf)
+{
+	if (ui->ffmap)
+		return ffmap_write(ui->ffmap, fd, buf, ui->peb_size);
+
+	if (write(fd, buf, ui->peb_size) != ui->peb_size)
+		return sys_errmsg("cannot write %d bytes to the output file",
+				  ui->peb_size);
+	return 0;
+}
+
+/*
+ * Write a PEB to the output file at offset @offs, the file position is not
+ * used. Returns %0 on success and %-1 on failure.
+ */
+static int ubigen_pwrite_peb(const struct ubigen_info *ui, int fd,
+			     const void *buf, off_t offs)
+{
+	if (ui->ffmap)
+		return ffmap_pwrite(ui->ffmap, fd, buf, ui->peb_size, offs);
+
+	if (pwrite(fd, buf, ui->peb_size, offs) != ui->peb_size)
+		return sys_errmsg("cannot write %d bytes to the output file at offset %lld",
+				  ui->peb_size, (long long)offs);
+	return 0;
+}
+
 struct ubi_vtbl_record *ubigen_create_empty_vtbl(const struct ubigen_info *ui)
 {
 	struct ubi_vtbl_record *vtbl;
@@ -176,10 +217,14 @@ void ubigen_init_ec_hdr(const struct ubigen_info *ui,
 	hdr->hdr_crc = cpu_to_be32(crc);
 }
 
-void ubigen_init_vid_hdr(const struct ubigen_info *ui,
-			 const struct ubigen_vol_info *vi,
-			 struct ubi_vid_hdr *hdr, int lnum,
-			 int lpos, const void *data, int data_size)
+/*
+ * Initialize a VID header. The same as 'ubigen_init_vid_hdr()', but takes the
+ * CRC of the data of a static volume LEB instead of the data.
+ */
+static void ubigen_init_vid_hdr_crc(const struct ubigen_info *ui,
+				    const struct ubigen_vol_info *vi,
+				    struct ubi_vid_hdr *hdr, int lnum,
+				    int lpos, int data_size, uint32_t data_crc)
 {
 	uint32_t crc;
 
@@ -199,14 +244,25 @@ void ubigen_init_vid_hdr(const struct ubigen_info *ui,
 	if (vi->type == UBI_VID_STATIC) {
 		hdr->data_size = cpu_to_be32(data_size);
 		hdr->used_ebs = cpu_to_be32(vi->used_ebs);
-		crc = mtd_crc32(UBI_CRC32_INIT, data, data_size);
-		hdr->data_crc = cpu_to_be32(crc);
+		hdr->data_crc = cpu_to_be32(data_crc);
 	}
 
 	crc = mtd_crc32(UBI_CRC32_INIT, hdr, UBI_VID_HDR_SIZE_CRC);
 	hdr->hdr_crc = cpu_to_be32(crc);
 }
 
+void ubigen_init_vid_hdr(const struct ubigen_info *ui,
+			 const struct ubigen_vol_info *vi,
+			 struct ubi_vid_hdr *hdr, int lnum,
+			 int lpos, const void *data, int data_size)
+{
+	uint32_t crc = 0;
+
+	if (vi->type == UBI_VID_STATIC)
+		crc = mtd_crc32(UBI_CRC32_INIT, data, data_size);
+	ubigen_init_vid_hdr_crc(ui, vi, hdr, lnum, lpos, data_size, crc);
+}
+
 static void ubigen_init_dummy_vid_hdr(const struct ubigen_info *ui,
 				      const struct ubigen_vol_info *vi,
 				      struct ubi_vid_hdr *hdr)
@@ -245,7 +301,31 @@ void ubigen_layout_vid_and_data(const struct ubigen_info *ui,
 
 	memset(outbuf + ui->data_offs, 0xFF, ui->peb_size - ui->data_offs);
 
-	if (vi->mode == UBI_VID_MODE_SLC && ui->max_lebs_per_peb > 1) {
+	if (vi->mode == UBI_VID_MODE_SLC && ui->pairing_tbl) {
+		const struct mtd_pairing_table *tbl = ui->pairing_tbl;
+		const struct mtd_pairing_extent *ext = tbl->slc;
+		int first = (ui->data_offs + ui->min_io_size - 1) /
+			    ui->min_io_size;
+
+		/* Copy each run of consecutive group 0 wunits at once */
+		for (; ext < tbl->slc + tbl->slc_cnt && len; ext++) {
+			int skip = first - ext->pair, wsize;
+
+			if (skip >= ext->cnt)
+				continue;
+			if (skip < 0)
+				skip = 0;
+
+			wsize = (ext->cnt - skip) * ui->min_io_size;
+			if (wsize > len)
+				wsize = len;
+
+			offset = (ext->wunit + skip) * ui->min_io_size;
+			memcpy(outbuf + offset, inbuf, wsize);
+			inbuf += wsize;
+			len -= wsize;
+		}
+	} else if (vi->mode == UBI_VID_MODE_SLC && ui->max_lebs_per_peb > 1) {
 		struct mtd_pairing_info info;
 		int npairs, nwunits;
 
@@ -291,9 +371,180 @@ void ubigen_layout_vid_and_data(const struct ubigen_info *ui,
 				    inbuf, len);
 }
 
+int ubigen_volume_pebs(const struct ubigen_info *ui,
+		       const struct ubigen_vol_info *vi, long long bytes)
+{
+	long long len = vi->usable_leb_size;
+
+	if (vi->mode == UBI_VID_MODE_MLC_SAFE)
+		len *= ui->max_lebs_per_peb;
+
+	return (bytes + len - 1) / len;
+}
+
 int ubigen_write_volume(const struct ubigen_info *ui,
 			const struct ubigen_vol_info *vi, long long ec,
 			long long bytes, int in, int out)
+{
+	off_t offs;
+
+	offs = lseek(out, 0, SEEK_CUR);
+	if (offs == -1)
+		return sys_errmsg("cannot get the output file position");
+	if (ubigen_write_volume_at(ui, vi, ec, bytes, in, out, offs))
+		return -1;
+
+	offs += (off_t)ubigen_volume_pebs(ui, vi, bytes) * ui->peb_size;
+	if (lseek(out, offs, SEEK_SET) != offs)
+		return sys_errmsg("cannot seek output file");
+	return 0;
+}
+
+/*
+ * Read exactly @len bytes from @fd. Returns %0 on success and %-1 on failure.
+ */
+static int ubigen_read(int fd, void *buf, int len)
+{
+	int rd;
+
+	do {
+		rd = read(fd, buf, len);
+		if (rd <= 0)
+			return sys_errmsg("cannot read %d bytes from the input file",
+					  len);
+		buf += rd;
+		len -= rd;
+	} while (len);
+	return 0;
+}
+
+/*
+ * Write the buffers of @iov to @fd at @offs, @iov is changed. Returns %0 on
+ * success and %-1 on failure.
+ */
+static int ubigen_pwritev(int fd, struct iovec *iov, int cnt, off_t offs)
+{
+	ssize_t ret;
+
+	while (cnt) {
+		ret = pwritev(fd, iov, cnt, offs);
+		if (ret <= 0)
+			return sys_errmsg("cannot write to the output file at offset %lld",
+					  (long long)offs);
+		offs += ret;
+		while (cnt && (size_t)ret >= iov->iov_len) {
+			ret -= iov->iov_len;
+			iov += 1;
+			cnt -= 1;
+		}
+		if (cnt) {
+			iov->iov_base += ret;
+			iov->iov_len -= ret;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Write a volume whose LEBs are stored in the PEBs as they are, without
+ * assembling the PEBs in memory. The data are read in pieces of at most
+ * %UBIGEN_CHUNK bytes and written straight from the read buffer, the 0xFF
+ * tail of each PEB comes from a buffer of 0xFF bytes, and only the headers
+ * are generated. A PEB whose LEB fits in one piece is written with a single
+ * 'pwritev()' of the headers, the data and the tail. Otherwise the header of a
+ * static volume LEB is written last, once the CRC of its data is known.
+ */
+static int ubigen_write_direct(const struct ubigen_info *ui,
+			       const struct ubigen_vol_info *vi, long long ec,
+			       long long bytes, int in, int out, off_t offs)
+{
+	int len = vi->usable_leb_size, lnum = 0, chunk, max_iov;
+	char *hdr, *buf, *ff;
+	struct iovec *iov;
+	int err = -1;
+
+	chunk = len < UBIGEN_CHUNK ? len : UBIGEN_CHUNK;
+	max_iov = 2 + (ui->peb_size + chunk - 1) / chunk;
+	hdr = malloc(ui->data_offs);
+	buf = malloc(chunk);
+	ff = malloc(chunk);
+	iov = malloc(max_iov * sizeof(struct iovec));
+	if (!hdr || !buf || !ff || !iov) {
+		sys_errmsg("cannot allocate memory");
+		goto out_free;
+	}
+
+	memset(ff, 0xFF, chunk);
+	memset(hdr, 0xFF, ui->vid_hdr_offs);
+	memset(hdr + ui->vid_hdr_offs, 0x00, ui->data_offs - ui->vid_hdr_offs);
+	ubigen_init_ec_hdr(ui, (struct ubi_ec_hdr *)hdr, ec);
+
+	while (bytes) {
+		struct ubi_vid_hdr *vid_hdr = (void *)(hdr + ui->vid_hdr_offs);
+		uint32_t crc = UBI_CRC32_INIT;
+		int pos = 0, n, tail, cnt = 0;
+
+		if (bytes < len)
+			len = bytes;
+		bytes -= len;
+
+		/* All but the last piece of the LEB */
+		while (len - pos > chunk) {
+			if (ubigen_read(in, buf, chunk))
+				goto out_free;
+			if (vi->type == UBI_VID_STATIC)
+				crc = mtd_crc32(crc, buf, chunk);
+			iov[0].iov_base = buf;
+			iov[0].iov_len = chunk;
+			if (ubigen_pwritev(out, iov, 1,
+					   offs + ui->data_offs + pos))
+				goto out_free;
+			pos += chunk;
+		}
+
+		n = len - pos;
+		if (ubigen_read(in, buf, n))
+			goto out_free;
+		if (vi->type == UBI_VID_STATIC)
+			crc = mtd_crc32(crc, buf, n);
+		ubigen_init_vid_hdr_crc(ui, vi, vid_hdr, lnum, 0, len, crc);
+
+		if (pos == 0) {
+			iov[cnt].iov_base = hdr;
+			iov[cnt++].iov_len = ui->data_offs;
+		} else {
+			iov[0].iov_base = hdr;
+			iov[0].iov_len = ui->data_offs;
+			if (ubigen_pwritev(out, iov, 1, offs))
+				goto out_free;
+		}
+		iov[cnt].iov_base = buf;
+		iov[cnt++].iov_len = n;
+		for (tail = ui->peb_size - ui->data_offs - len; tail;
+		     tail -= iov[cnt++].iov_len) {
+			iov[cnt].iov_base = ff;
+			iov[cnt].iov_len = tail < chunk ? tail : chunk;
+		}
+		if (ubigen_pwritev(out, iov, cnt,
+				   pos ? offs + ui->data_offs + pos : offs))
+			goto out_free;
+
+		offs += ui->peb_size;
+		lnum += ui->max_lebs_per_peb;
+	}
+	err = 0;
+
+out_free:
+	free(iov);
+	free(ff);
+	free(buf);
+	free(hdr);
+	return err;
+}
+
+int ubigen_write_volume_at(const struct ubigen_info *ui,
+			   const struct ubigen_vol_info *vi, long long ec,
+			   long long bytes, int in, int out, off_t offs)
 {
 	int len = vi->usable_leb_size, rd, lnum = 0;
 	char *inbuf, *outbuf;
@@ -312,6 +563,15 @@ int ubigen_write_volume(const struct ubigen_info *ui,
 		return -1;
 	}
 
+	/*
+	 * Volumes stored in the PEBs as they are, which is all of them but the
+	 * SLC and MLC safe ones on MLC flash, are written without assembling
+	 * the PEBs, unless the 0xFF regions have to be looked for.
+	 */
+	if (!ui->ffmap && vi->mode != UBI_VID_MODE_MLC_SAFE &&
+	    (vi->mode != UBI_VID_MODE_SLC || ui->max_lebs_per_peb == 1))
+		return ubigen_write_direct(ui, vi, ec, bytes, in, out, offs);
+
 	inbuf = malloc(ui->peb_size);
 	if (!inbuf)
 		return sys_errmsg("cannot allocate %d bytes of memory",
@@ -348,11 +608,10 @@ int ubigen_write_volume(const struct ubigen_info *ui,
 
 		ubigen_layout_vid_and_data(ui, vi, lnum, inbuf, outbuf, len);
 
-		if (write(out, outbuf, ui->peb_size) != ui->peb_size) {
-			sys_errmsg("cannot write %d bytes to the output file", ui->peb_size);
+		if (ubigen_pwrite_peb(ui, out, outbuf, offs))
 			goto out_free1;
-		}
 
+		offs += ui->peb_size;
 		lnum += ui->max_lebs_per_peb;
 	}
 
@@ -367,16 +626,14 @@ out_free:
 	return -1;
 }
 
-int ubigen_write_layout_vol(const struct ubigen_info *ui, int peb1, int peb2,
-			    long long ec1, long long ec2,
-			    struct ubi_vtbl_record *vtbl, int fd)
+void ubigen_layout_vtbl_peb(const struct ubigen_info *ui, int lnum,
+			    long long ec, const struct ubi_vtbl_record *vtbl,
+			    void *buf)
 {
-	int ret;
+	struct ubi_vid_hdr *vid_hdr = buf + ui->vid_hdr_offs;
 	struct ubigen_vol_info vi;
-	char *outbuf;
-	struct ubi_vid_hdr *vid_hdr;
-	off_t seek;
 
+	memset(&vi, 0, sizeof(struct ubigen_vol_info));
 	vi.bytes = ui->leb_size * UBI_LAYOUT_VOLUME_EBS;
 	vi.id = UBI_LAYOUT_VOLUME_ID;
 	vi.alignment = UBI_LAYOUT_VOLUME_ALIGN;
@@ -388,43 +645,45 @@ int ubigen_write_layout_vol(const struct ubigen_info *ui, int peb1, int peb2,
 	vi.name_len = strlen(UBI_LAYOUT_VOLUME_NAME);
 	vi.compat = UBI_LAYOUT_VOLUME_COMPAT;
 
+	memset(buf, 0xFF, ui->data_offs);
+	memcpy(buf + ui->data_offs, vtbl, ui->vtbl_size);
+	memset(buf + ui->data_offs + ui->vtbl_size, 0xFF,
+	       ui->peb_size - ui->data_offs - ui->vtbl_size);
+
+	ubigen_init_ec_hdr(ui, (struct ubi_ec_hdr *)buf, ec);
+	ubigen_init_vid_hdr(ui, &vi, vid_hdr, lnum, 0, NULL, 0);
+}
+
+int ubigen_write_layout_vol(const struct ubigen_info *ui, int peb1, int peb2,
+			    long long ec1, long long ec2,
+			    struct ubi_vtbl_record *vtbl, int fd)
+{
+	char *outbuf;
+	off_t seek;
+
 	outbuf = malloc(ui->peb_size);
 	if (!outbuf)
 		return sys_errmsg("failed to allocate %d bytes",
 				  ui->peb_size);
 
-	memset(outbuf, 0xFF, ui->data_offs);
-	vid_hdr = (struct ubi_vid_hdr *)(&outbuf[ui->vid_hdr_offs]);
-	memcpy(outbuf + ui->data_offs, vtbl, ui->vtbl_size);
-	memset(outbuf + ui->data_offs + ui->vtbl_size, 0xFF,
-	       ui->peb_size - ui->data_offs - ui->vtbl_size);
-
 	seek = (off_t) peb1 * ui->peb_size;
 	if (lseek(fd, seek, SEEK_SET) != seek) {
 		sys_errmsg("cannot seek output file");
 		goto out_free;
 	}
 
-	ubigen_init_ec_hdr(ui, (struct ubi_ec_hdr *)outbuf, ec1);
-	ubigen_init_vid_hdr(ui, &vi, vid_hdr, 0, 0, NULL, 0);
-	ret = write(fd, outbuf, ui->peb_size);
-	if (ret != ui->peb_size) {
-		sys_errmsg("cannot write %d bytes", ui->peb_size);
+	ubigen_layout_vtbl_peb(ui, 0, ec1, vtbl, outbuf);
+	if (ubigen_write_peb(ui, fd, outbuf))
 		goto out_free;
-	}
 
 	seek = (off_t) peb2 * ui->peb_size;
 	if (lseek(fd, seek, SEEK_SET) != seek) {
 		sys_errmsg("cannot seek output file");
 		goto out_free;
 	}
-	ubigen_init_ec_hdr(ui, (struct ubi_ec_hdr *)outbuf, ec2);
-	ubigen_init_vid_hdr(ui, &vi, vid_hdr, 1, 0, NULL, 0);
-	ret = write(fd, outbuf, ui->peb_size);
-	if (ret != ui->peb_size) {
-		sys_errmsg("cannot write %d bytes", ui->peb_size);
+	ubigen_layout_vtbl_peb(ui, 1, ec2, vtbl, outbuf);
+	if (ubigen_write_peb(ui, fd, outbuf))
 		goto out_free;
-	}
 
 	free(outbuf);
 	return 0;
@@ -433,3 +692,515 @@ out_free:
 	free(outbuf);
 	return -1;
 }
+
+/**
+ * struct ubigen_fm_vol - a volume described by a fastmap.
+ * @vol_type: volume type (%UBI_VID_DYNAMIC or %UBI_VID_STATIC), %0 if the
+ *            volume is not in the volume table
+ * @data_pad: how many bytes are unused at the end of each PEB
+ * @reserved_pebs: how many PEBs are reserved for the volume
+ * @used_ebs: how many LEBs a static volume takes
+ * @last_eb_bytes: how many bytes the last LEB of a static volume holds
+ * @eba: PEB of each LEB, %-1 if the LEB is not mapped, %NULL if no LEB is
+ * @eba_size: count of elements in @eba
+ */
+struct ubigen_fm_vol {
+	int vol_type;
+	int data_pad;
+	int reserved_pebs;
+	int used_ebs;
+	int last_eb_bytes;
+	int *eba;
+	int eba_size;
+};
+
+/**
+ * struct ubigen_fastmap - a fastmap being generated.
+ * @ui: libubigen information
+ * @peb_count: count of PEBs of the UBI device, bad ones included
+ * @state: what each PEB holds (%UBIGEN_FM_ERASE, etc)
+ * @ec: erase counter of each PEB
+ * @sqnum: highest sequence number of the VID headers
+ * @vols: the volumes, indexed like the volume table, and the layout volume
+ *        after them
+ */
+struct ubigen_fastmap {
+	const struct ubigen_info *ui;
+	int peb_count;
+	char *state;
+	long long *ec;
+	unsigned long long sqnum;
+	struct ubigen_fm_vol vols[UBI_MAX_VOLUMES + UBI_INT_VOL_COUNT];
+};
+
+/* Size of the fastmap data, the same way the kernel computes it */
+static size_t ubigen_fm_size(const struct ubigen_info *ui, int peb_count)
+{
+	size_t size;
+
+	size = sizeof(struct ubi_fm_sb) + sizeof(struct ubi_fm_hdr) +
+	       2 * sizeof(struct ubi_fm_scan_pool) +
+	       peb_count * sizeof(struct ubi_fm_ec) +
+	       sizeof(struct ubi_fm_eba) + peb_count * sizeof(__be32) +
+	       UBI_MAX_VOLUMES * sizeof(struct ubi_fm_volhdr);
+
+	return (size + ui->leb_size - 1) / ui->leb_size * ui->leb_size;
+}
+
+int ubigen_fm_blocks(const struct ubigen_info *ui, int peb_count)
+{
+	int blocks = ubigen_fm_size(ui, peb_count) / ui->leb_size;
+
+	if (ui->max_lebs_per_peb > 1) {
+		errmsg("fastmap is not supported on flash with paired pages");
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (blocks > UBI_FM_MAX_BLOCKS) {
+		errmsg("a fastmap of %d PEBs needs %d PEBs, max. is %d",
+		       peb_count, blocks, UBI_FM_MAX_BLOCKS);
+		errno = EINVAL;
+		return -1;
+	}
+
+	return blocks;
+}
+
+struct ubigen_fastmap *ubigen_fm_new(const struct ubigen_info *ui,
+				     int peb_count, long long ec)
+{
+	struct ubigen_fastmap *fm;
+	int i;
+
+	if (ubigen_fm_blocks(ui, peb_count) < 0)
+		return NULL;
+
+	fm = calloc(1, sizeof(struct ubigen_fastmap));
+	if (!fm) {
+		sys_errmsg("cannot allocate memory");
+		return NULL;
+	}
+
+	fm->ui = ui;
+	fm->peb_count = peb_count;
+	fm->state = malloc(peb_count);
+	fm->ec = malloc(peb_count * sizeof(long long));
+	if (!fm->state || !fm->ec) {
+		sys_errmsg("cannot allocate memory");
+		ubigen_fm_free(fm);
+		return NULL;
+	}
+
+	for (i = 0; i < peb_count; i++) {
+		fm->state[i] = UBIGEN_FM_ERASE;
+		fm->ec[i] = ec;
+	}
+
+	return fm;
+}
+
+void ubigen_fm_free(struct ubigen_fastmap *fm)
+{
+	int i;
+
+	if (!fm)
+		return;
+
+	for (i = 0; i < UBI_MAX_VOLUMES + UBI_INT_VOL_COUNT; i++)
+		free(fm->vols[i].eba);
+	free(fm->ec);
+	free(fm->state);
+	free(fm);
+}
+
+void ubigen_fm_set_peb(struct ubigen_fastmap *fm, int pnum, int state,
+		       long long ec)
+{
+	if (pnum < 0 || pnum >= fm->peb_count)
+		return;
+
+	fm->state[pnum] = state;
+	fm->ec[pnum] = ec;
+}
+
+/* Take the volumes the fastmap describes from the volume table */
+static void ubigen_fm_set_vtbl(struct ubigen_fastmap *fm,
+			       const struct ubi_vtbl_record *vtbl)
+{
+	int i;
+
+	for (i = 0; i < fm->ui->max_volumes; i++) {
+		struct ubigen_fm_vol *vol = &fm->vols[i];
+
+		if (!vtbl[i].reserved_pebs)
+			continue;
+
+		vol->vol_type = vtbl[i].vol_type;
+		vol->data_pad = be32_to_cpu(vtbl[i].data_pad);
+		vol->reserved_pebs = be32_to_cpu(vtbl[i].reserved_pebs);
+	}
+
+	fm->vols[UBI_MAX_VOLUMES].vol_type = UBI_LAYOUT_VOLUME_TYPE;
+	fm->vols[UBI_MAX_VOLUMES].reserved_pebs = UBI_LAYOUT_VOLUME_EBS;
+}
+
+/*
+ * Record that PEB @pnum holds the LEB described by VID header @hdr. Returns
+ * %0 on success and %-1 on failure.
+ */
+static int ubigen_fm_add_leb(struct ubigen_fastmap *fm, int pnum,
+			     long long ec, const struct ubi_vid_hdr *hdr)
+{
+	int vol_id = be32_to_cpu(hdr->vol_id);
+	int lnum = be32_to_cpu(hdr->lnum);
+	struct ubigen_fm_vol *vol;
+
+	if (pnum < 0 || pnum >= fm->peb_count)
+		return errmsg("PEB %d is beyond the %d PEBs of the device",
+			      pnum, fm->peb_count);
+
+	if (vol_id == UBI_LAYOUT_VOLUME_ID)
+		vol = &fm->vols[UBI_MAX_VOLUMES];
+	else if (vol_id >= 0 && vol_id < UBI_MAX_VOLUMES)
+		vol = &fm->vols[vol_id];
+	else
+		return errmsg("PEB %d belongs to volume %d, which a fastmap cannot describe",
+			      pnum, vol_id);
+
+	if (hdr->lpos == UBI_VID_LPOS_CONSOLIDATED)
+		return errmsg("PEB %d holds several LEBs, which a fastmap cannot describe",
+			      pnum);
+
+	if (lnum < 0 || lnum >= fm->peb_count)
+		return errmsg("PEB %d holds LEB %d of volume %d, which cannot be mapped",
+			      pnum, lnum, vol_id);
+
+	if (!vol->eba) {
+		int i;
+
+		vol->eba = malloc(fm->peb_count * sizeof(int));
+		if (!vol->eba)
+			return sys_errmsg("cannot allocate memory");
+		for (i = 0; i < fm->peb_count; i++)
+			vol->eba[i] = -1;
+	}
+
+	if (vol->eba[lnum] != -1)
+		return errmsg("LEB %d of volume %d is in PEBs %d and %d",
+			      lnum, vol_id, vol->eba[lnum], pnum);
+
+	vol->eba[lnum] = pnum;
+	if (lnum >= vol->eba_size)
+		vol->eba_size = lnum + 1;
+
+	if (hdr->vol_type == UBI_VID_STATIC) {
+		vol->used_ebs = be32_to_cpu(hdr->used_ebs);
+		if (lnum == vol->used_ebs - 1)
+			vol->last_eb_bytes = be32_to_cpu(hdr->data_size);
+	}
+
+	if (be64_to_cpu(hdr->sqnum) > fm->sqnum)
+		fm->sqnum = be64_to_cpu(hdr->sqnum);
+
+	fm->state[pnum] = UBIGEN_FM_USED;
+	fm->ec[pnum] = ec;
+	return 0;
+}
+
+int ubigen_fm_add_vtbl(struct ubigen_fastmap *fm,
+		       const struct ubi_vtbl_record *vtbl, int peb1, int peb2,
+		       long long ec1, long long ec2)
+{
+	struct ubi_vid_hdr hdr;
+
+	ubigen_fm_set_vtbl(fm, vtbl);
+
+	memset(&hdr, 0, sizeof(struct ubi_vid_hdr));
+	hdr.vol_type = UBI_LAYOUT_VOLUME_TYPE;
+	hdr.vol_id = cpu_to_be32(UBI_LAYOUT_VOLUME_ID);
+	if (ubigen_fm_add_leb(fm, peb1, ec1, &hdr))
+		return -1;
+	hdr.lnum = cpu_to_be32(1);
+	return ubigen_fm_add_leb(fm, peb2, ec2, &hdr);
+}
+
+int ubigen_fm_add_vol(struct ubigen_fastmap *fm,
+		      const struct ubigen_vol_info *vi, long long bytes,
+		      int pnum, long long ec)
+{
+	int lnum, len = vi->usable_leb_size;
+	struct ubi_vid_hdr hdr;
+
+	for (lnum = 0; bytes; lnum++) {
+		if (bytes < len)
+			len = bytes;
+		bytes -= len;
+
+		ubigen_init_vid_hdr_crc(fm->ui, vi, &hdr, lnum, 0, len, 0);
+		if (ubigen_fm_add_leb(fm, pnum + lnum, ec, &hdr))
+			return -1;
+	}
+
+	return 0;
+}
+
+int ubigen_fm_add_peb(struct ubigen_fastmap *fm, int pnum, long long ec,
+		      const void *buf)
+{
+	const struct ubigen_info *ui = fm->ui;
+	const struct ubi_vid_hdr *hdr = buf + ui->vid_hdr_offs;
+	uint32_t crc;
+	int err;
+
+	crc = mtd_crc32(UBI_CRC32_INIT, hdr, UBI_VID_HDR_SIZE_CRC);
+	if (be32_to_cpu(hdr->magic) != UBI_VID_HDR_MAGIC ||
+	    be32_to_cpu(hdr->hdr_crc) != crc) {
+		ubigen_fm_set_peb(fm, pnum, UBIGEN_FM_FREE, ec);
+		return 0;
+	}
+
+	err = ubigen_fm_add_leb(fm, pnum, ec, hdr);
+	if (err)
+		return err;
+
+	if (be32_to_cpu(hdr->vol_id) == UBI_LAYOUT_VOLUME_ID &&
+	    be32_to_cpu(hdr->lnum) == 0)
+		ubigen_fm_set_vtbl(fm, buf + ui->data_offs);
+
+	return 0;
+}
+
+/* Initialize the VID header of fastmap PEB number @i */
+static void ubigen_fm_vid_hdr(const struct ubigen_info *ui,
+			      struct ubi_vid_hdr *hdr, int i,
+			      unsigned long long sqnum)
+{
+	uint32_t crc;
+
+	memset(hdr, 0, sizeof(struct ubi_vid_hdr));
+	hdr->magic = cpu_to_be32(UBI_VID_HDR_MAGIC);
+	hdr->version = ui->ubi_ver;
+	hdr->vol_type = UBI_VID_DYNAMIC;
+	hdr->compat = UBI_COMPAT_DELETE;
+	hdr->vol_id = cpu_to_be32(i ? UBI_FM_DATA_VOLUME_ID :
+				      UBI_FM_SB_VOLUME_ID);
+	hdr->lnum = cpu_to_be32(i);
+	hdr->sqnum = cpu_to_be64(sqnum);
+	crc = mtd_crc32(UBI_CRC32_INIT, hdr, UBI_VID_HDR_SIZE_CRC);
+	hdr->hdr_crc = cpu_to_be32(crc);
+}
+
+void *ubigen_fm_build(struct ubigen_fastmap *fm, const int *pnums,
+		      const long long *ecs)
+{
+	const struct ubigen_info *ui = fm->ui;
+	size_t fm_size = ubigen_fm_size(ui, fm->peb_count), pos;
+	int blocks = fm_size / ui->leb_size, pool_size, i, j, state;
+	int counts[UBIGEN_FM_BLOCK] = { 0 }, vol_count = 0;
+	struct ubi_fm_scan_pool *pool;
+	struct ubi_fm_sb *fmsb;
+	struct ubi_fm_hdr *fmh;
+	char *raw, *pebs;
+	uint32_t crc;
+
+	if (pnums[0] >= UBI_FM_MAX_START) {
+		errmsg("fastmap anchor PEB %d is not one of the first %d PEBs",
+		       pnums[0], UBI_FM_MAX_START);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	for (i = 0; i < blocks; i++) {
+		if (pnums[i] < 0 || pnums[i] >= fm->peb_count ||
+		    fm->state[pnums[i]] == UBIGEN_FM_USED ||
+		    fm->state[pnums[i]] == UBIGEN_FM_BAD) {
+			errmsg("PEB %d cannot hold the fastmap", pnums[i]);
+			errno = EINVAL;
+			return NULL;
+		}
+	}
+
+	/* A volume may only have LEBs the volume table reserved PEBs for */
+	for (i = 0; i < UBI_MAX_VOLUMES + UBI_INT_VOL_COUNT; i++) {
+		const struct ubigen_fm_vol *vol = &fm->vols[i];
+
+		if (vol->eba_size > vol->reserved_pebs) {
+			errmsg("volume %d has LEB %d, but only %d reserved PEBs",
+			       i, vol->eba_size - 1, vol->reserved_pebs);
+			errno = EINVAL;
+			return NULL;
+		}
+		if (vol->vol_type)
+			vol_count += 1;
+	}
+
+	raw = calloc(1, fm_size);
+	if (!raw) {
+		sys_errmsg("cannot allocate %zd bytes of memory", fm_size);
+		return NULL;
+	}
+
+	for (i = 0; i < blocks; i++)
+		fm->state[pnums[i]] = UBIGEN_FM_BLOCK;
+
+	fmsb = (struct ubi_fm_sb *)raw;
+	pos = sizeof(struct ubi_fm_sb);
+	fmh = (struct ubi_fm_hdr *)(raw + pos);
+	pos += sizeof(struct ubi_fm_hdr);
+
+	/*
+	 * No PEB is in the pools, the kernel fills them once attached. Their
+	 * maximum sizes are the ones the kernel would use.
+	 */
+	pool_size = fm->peb_count / 100 * 5;
+	if (pool_size > UBI_FM_MAX_POOL_SIZE)
+		pool_size = UBI_FM_MAX_POOL_SIZE;
+	if (pool_size < UBI_FM_MIN_POOL_SIZE)
+		pool_size = UBI_FM_MIN_POOL_SIZE;
+	for (i = 0; i < 2; i++) {
+		pool = (struct ubi_fm_scan_pool *)(raw + pos);
+		pool->magic = cpu_to_be32(UBI_FM_POOL_MAGIC);
+		pool->max_size = cpu_to_be16(i ? pool_size / 2 : pool_size);
+		pos += sizeof(struct ubi_fm_scan_pool);
+	}
+
+	/* The free, used and erase lists of erase counters, in this order */
+	for (state = UBIGEN_FM_FREE; ; ) {
+		for (i = 0; i < fm->peb_count; i++) {
+			struct ubi_fm_ec *fec;
+
+			if (fm->state[i] != state)
+				continue;
+
+			fec = (struct ubi_fm_ec *)(raw + pos);
+			fec->pnum = cpu_to_be32(i);
+			fec->ec = cpu_to_be32(fm->ec[i]);
+			pos += sizeof(struct ubi_fm_ec);
+			counts[state] += 1;
+		}
+
+		if (state == UBIGEN_FM_FREE)
+			state = UBIGEN_FM_USED;
+		else if (state == UBIGEN_FM_USED)
+			state = UBIGEN_FM_ERASE;
+		else
+			break;
+	}
+	for (i = 0; i < fm->peb_count; i++)
+		if (fm->state[i] == UBIGEN_FM_BAD)
+			counts[UBIGEN_FM_BAD] += 1;
+
+	for (i = 0; i < UBI_MAX_VOLUMES + UBI_INT_VOL_COUNT; i++) {
+		const struct ubigen_fm_vol *vol = &fm->vols[i];
+		int usable_leb_size = ui->leb_size - vol->data_pad;
+		struct ubi_fm_volhdr *fvh;
+		struct ubi_fm_eba *feba;
+
+		if (!vol->vol_type)
+			continue;
+
+		if (pos + sizeof(struct ubi_fm_volhdr) +
+		    sizeof(struct ubi_fm_eba) +
+		    vol->reserved_pebs * sizeof(__be32) > fm_size) {
+			errmsg("the volumes do not fit in the fastmap");
+			errno = EINVAL;
+			goto out_free;
+		}
+
+		fvh = (struct ubi_fm_volhdr *)(raw + pos);
+		fvh->magic = cpu_to_be32(UBI_FM_VHDR_MAGIC);
+		fvh->vol_id = cpu_to_be32(i == UBI_MAX_VOLUMES ?
+					  UBI_LAYOUT_VOLUME_ID : i);
+		/* Unlike the VID headers, fastmap uses the kernel volume types */
+		fvh->vol_type = vol->vol_type == UBI_VID_STATIC ?
+				UBI_STATIC_VOLUME : UBI_DYNAMIC_VOLUME;
+		fvh->data_pad = cpu_to_be32(vol->data_pad);
+		if (vol->vol_type == UBI_VID_STATIC) {
+			fvh->used_ebs = cpu_to_be32(vol->used_ebs);
+			fvh->last_eb_bytes = cpu_to_be32(vol->last_eb_bytes);
+		} else {
+			fvh->used_ebs = cpu_to_be32(vol->reserved_pebs);
+			fvh->last_eb_bytes = cpu_to_be32(usable_leb_size);
+		}
+		pos += sizeof(struct ubi_fm_volhdr);
+
+		feba = (struct ubi_fm_eba *)(raw + pos);
+		feba->magic = cpu_to_be32(UBI_FM_EBA_MAGIC);
+		feba->reserved_pebs = cpu_to_be32(vol->reserved_pebs);
+		for (j = 0; j < vol->reserved_pebs; j++)
+			feba->pnum[j] = cpu_to_be32(j < vol->eba_size ?
+						    vol->eba[j] : -1);
+		pos += sizeof(struct ubi_fm_eba) +
+		       vol->reserved_pebs * sizeof(__be32);
+	}
+
+	fmh->magic = cpu_to_be32(UBI_FM_HDR_MAGIC);
+	fmh->free_peb_count = cpu_to_be32(counts[UBIGEN_FM_FREE]);
+	fmh->used_peb_count = cpu_to_be32(counts[UBIGEN_FM_USED]);
+	fmh->bad_peb_count = cpu_to_be32(counts[UBIGEN_FM_BAD]);
+	fmh->erase_peb_count = cpu_to_be32(counts[UBIGEN_FM_ERASE]);
+	fmh->vol_count = cpu_to_be32(vol_count);
+
+	fmsb->magic = cpu_to_be32(UBI_FM_SB_MAGIC);
+	fmsb->version = UBI_FM_FMT_VERSION;
+	fmsb->used_blocks = cpu_to_be32(blocks);
+	for (i = 0; i < blocks; i++) {
+		fmsb->block_loc[i] = cpu_to_be32(pnums[i]);
+		fmsb->block_ec[i] = cpu_to_be32(ecs[i]);
+	}
+	fmsb->sqnum = cpu_to_be64(fm->sqnum + 1);
+	/* Like UBI does, the CRC covers the super block with @data_crc zero */
+	fmsb->data_crc = 0;
+	crc = mtd_crc32(UBI_CRC32_INIT, raw, fm_size);
+	fmsb->data_crc = cpu_to_be32(crc);
+
+	pebs = malloc((size_t)blocks * ui->peb_size);
+	if (!pebs) {
+		sys_errmsg("cannot allocate memory");
+		goto out_free;
+	}
+
+	for (i = 0; i < blocks; i++) {
+		char *peb = pebs + (size_t)i * ui->peb_size;
+
+		memset(peb, 0xFF, ui->vid_hdr_offs);
+		memset(peb + ui->vid_hdr_offs, 0x00,
+		       ui->data_offs - ui->vid_hdr_offs);
+		ubigen_init_ec_hdr(ui, (struct ubi_ec_hdr *)peb, ecs[i]);
+		ubigen_fm_vid_hdr(ui, (void *)(peb + ui->vid_hdr_offs), i,
+				  fm->sqnum + 2 + i);
+		memcpy(peb + ui->data_offs, raw + (size_t)i * ui->leb_size,
+		       ui->leb_size);
+	}
+
+	free(raw);
+	return pebs;
+
+out_free:
+	free(raw);
+	return NULL;
+}
+
+int ubigen_write_fastmap(const struct ubigen_info *ui,
+			 struct ubigen_fastmap *fm, const int *pnums,
+			 const long long *ecs, int fd)
+{
+	int blocks = ubigen_fm_size(ui, fm->peb_count) / ui->leb_size, i;
+	char *pebs;
+
+	pebs = ubigen_fm_build(fm, pnums, ecs);
+	if (!pebs)
+		return -1;
+
+	for (i = 0; i < blocks; i++) {
+		if (ubigen_pwrite_peb(ui, fd, pebs + (size_t)i * ui->peb_size,
+				      (off_t)pnums[i] * ui->peb_size)) {
+			free(pebs);
+			return -1;
+		}
+	}
+
+	free(pebs);
+	return 0;
+}
@@ -36,6 +36,8 @@
 #include <common.h>
 #include <crc32.h>
 #include <libmtd.h>
+#include <mtd/ubi-media.h>
+#include <libscan.h>
 
 #include <mtd/mtd-user.h>
 #include <mtd/jffs2-user.h>
@@ -95,6 +97,9 @@ int main(int argc, char *argv[])
 	int fd, clmpos = 0, clmlen = 8;
 	unsigned long long start;
 	unsigned int eb, eb_start, eb_cnt;
+	unsigned int erased_to = 0, single_to = 0, erase_reqs = 0, erased = 0;
+	unsigned long long start_ms;
+	char *skip;
 	bool isNAND;
 	int error = 0;
 	off_t offset = 0;
@@ -233,6 +238,16 @@ int main(int argc, char *argv[])
 	if (eb_cnt == 0)
 		eb_cnt = (mtd.size / mtd.eb_size) - eb_start;
 
+	/* Cached UBI scanning results do not survive erasure */
+	if (ubi_scan_cache_invalidate(&mtd))
+		warnmsg("cannot invalidate the UBI scanning cache of %s",
+			mtd_device);
+
+	/*
+	 * Find the bad blocks (and unlock the rest) up front, so that runs of
+	 * good blocks can be erased with one request each
+	 */
+	skip = xcalloc(eb_cnt, 1);
 	for (eb = eb_start; eb < eb_start + eb_cnt; eb++) {
 		offset = (off_t)eb * mtd.eb_size;
 
@@ -240,6 +255,7 @@ int main(int argc, char *argv[])
 			int ret = mtd_is_bad(&mtd, fd, eb);
 			if (ret > 0) {
 				verbose(!quiet, "Skipping bad block at %08"PRIxoff_t, offset);
+				skip[eb - eb_start] = 1;
 				continue;
 			} else if (ret < 0) {
 				if (errno == EOPNOTSUPP) {
@@ -251,19 +267,46 @@ int main(int argc, char *argv[])
 			}
 		}
 
-		show_progress(&mtd, offset, eb, eb_start, eb_cnt);
-
 		if (unlock) {
 			if (mtd_unlock(&mtd, fd, eb) != 0) {
 				sys_errmsg("%s: MTD unlock failure", mtd_device);
+				skip[eb - eb_start] = 1;
 				continue;
 			}
 		}
+	}
+
+	start_ms = util_get_msecs();
+	for (eb = eb_start; eb < eb_start + eb_cnt; eb++) {
+		offset = (off_t)eb * mtd.eb_size;
 
-		if (mtd_erase(mtd_desc, &mtd, fd, eb) != 0) {
-			sys_errmsg("%s: MTD Erase failure", mtd_device);
+		if (skip[eb - eb_start])
 			continue;
+
+		show_progress(&mtd, offset, eb, eb_start, eb_cnt);
+
+		if (eb >= erased_to && eb >= single_to) {
+			unsigned int cnt = 1;
+
+			while (eb + cnt < eb_start + eb_cnt && !skip[eb + cnt - eb_start])
+				cnt += 1;
+			if (cnt > 1) {
+				erase_reqs += 1;
+				if (mtd_erase_multi(mtd_desc, &mtd, fd, eb, cnt) == 0)
+					erased_to = eb + cnt;
+				else
+					single_to = eb + cnt;
+			}
+		}
+
+		if (eb >= erased_to) {
+			erase_reqs += 1;
+			if (mtd_erase(mtd_desc, &mtd, fd, eb) != 0) {
+				sys_errmsg("%s: MTD Erase failure", mtd_device);
+				continue;
+			}
 		}
+		erased += 1;
 
 		/* format for JFFS2 ? */
 		if (!jffs2)
@@ -285,6 +328,9 @@ int main(int argc, char *argv[])
 	}
 	show_progress(&mtd, offset, eb, eb_start, eb_cnt);
 	bareverbose(!quiet, "\n");
+	verbose(!quiet, "Erased %u blocks with %u erase requests in %llu ms",
+		erased, erase_reqs, util_get_msecs() - start_ms);
+	free(skip);
 
 	return 0;
 }
@@ -32,6 +32,7 @@
 #include <mtd/mtd-user.h>
 #include "common.h"
 #include <libmtd.h>
+#include <libffmap.h>
 
 static void display_help(int status)
 {
@@ -42,6 +43,12 @@ static void display_help(int status)
 "-h         --help               Display this help and exit\n"
 "           --version            Output version information and exit\n"
 "           --bb=METHOD          Choose bad block handling method (see below).\n"
+"           --aio[=DEPTH]        Read whole eraseblocks with asynchronous I/O,\n"
+"                                queue depth DEPTH (default 32); ECC statistics\n"
+"                                are then reported per eraseblock\n"
+"           --ff-map=FILE        Leave the regions of 0xFF bytes out of the\n"
+"                                dump file as holes, list the regions containing\n"
+"                                data in FILE (requires --file)\n"
 "-a         --forcebinary        Force printing of binary data to tty\n"
 "-c         --canonicalprint     Print canonical Hex+ASCII dump\n"
 "-f file    --file=file          Dump to file\n"
@@ -86,6 +93,8 @@ static const char		*dumpfile;		// dump file name
 static bool			quiet = false;		// suppress diagnostic output
 static bool			canonical = false;	// print nice + ascii
 static bool			forcebinary = false;	// force printing binary to tty
+static int			aio_depth;		// async I/O queue depth, 0 if off
+static const char		*ffmap_file;		// ff-map file name
 
 static enum {
 	padbad,   // dump flash data, substituting 0xFF for any bad blocks
@@ -105,6 +114,8 @@ static void process_options(int argc, char * const argv[])
 			{"version", no_argument, 0, 'V'},
 			{"bb", required_argument, 0, 0},
 			{"omitoob", no_argument, 0, 0},
+			{"aio", optional_argument, 0, 0},
+			{"ff-map", required_argument, 0, 0},
 			{"help", no_argument, 0, 'h'},
 			{"forcebinary", no_argument, 0, 'a'},
 			{"canonicalprint", no_argument, 0, 'c'},
@@ -146,6 +157,16 @@ static void process_options(int argc, char * const argv[])
 							errmsg_die("--oob and --oomitoob are mutually exclusive");
 						}
 						break;
+					case 3: /* --aio */
+						aio_depth = MTD_AIO_DEFAULT_DEPTH;
+						if (optarg)
+							aio_depth = simple_strtoul(optarg, &error);
+						if (aio_depth <= 0)
+							error++;
+						break;
+					case 4: /* --ff-map */
+						ffmap_file = optarg;
+						break;
 				}
 				break;
 			case 'V':
@@ -211,6 +232,9 @@ static void process_options(int argc, char * const argv[])
 		exit(EXIT_FAILURE);
 	}
 
+	if (ffmap_file && (pretty_print || !dumpfile))
+		errmsg_die("--ff-map requires a binary dump to a file");
+
 	if ((argc - optind) != 1 || error)
 		display_help(EXIT_FAILURE);
 
@@ -318,6 +342,17 @@ static int ofd_write(int ofd, const void *buf, size_t nbyte)
 	return 0;
 }
 
+/*
+ * Write binary dump data, leaving out the 0xFF regions if an ff-map is made.
+ */
+static int dump_write(int ofd, struct ffmap *ffmap, const void *buf,
+		      size_t nbyte)
+{
+	if (ffmap)
+		return ffmap_write(ffmap, ofd, buf, nbyte);
+	return ofd_write(ofd, buf, nbyte);
+}
+
 /*
  * Main program
  */
@@ -331,8 +366,11 @@ int main(int argc, char * const argv[])
 	int firstblock = 1;
 	struct mtd_ecc_stats stat1, stat2;
 	bool eccstats = false;
-	unsigned char *readbuf = NULL, *oobbuf = NULL;
+	unsigned char *readbuf = NULL, *oobbuf = NULL, *blockbuf = NULL;
 	libmtd_t mtd_desc;
+	mtd_aio_t aio = NULL;
+	struct ffmap *ffmap = NULL;
+	long long rablock = -1;
 	int err;
 
 	process_options(argc, argv);
@@ -352,10 +390,26 @@ int main(int argc, char * const argv[])
 	if (mtd_get_dev_info(mtd_desc, mtddev, &mtd) < 0)
 		return errmsg("mtd_get_dev_info failed");
 
+	if (bb_method != dumpbad && mtd_get_bbt(&mtd) < 0)
+		return errmsg("libmtd: mtd_get_bbt");
+
 	/* Allocate buffers */
 	oobbuf = xmalloc(sizeof(oobbuf) * mtd.oob_size);
 	readbuf = xmalloc(sizeof(readbuf) * mtd.min_io_size);
 
+	if (ffmap_file) {
+		ffmap = ffmap_new(mtd.min_io_size);
+		if (!ffmap)
+			goto closeall;
+	}
+
+	if (aio_depth) {
+		aio = mtd_aio_open(mtd_desc, &mtd, fd, aio_depth, NULL);
+		if (!aio)
+			goto closeall;
+		blockbuf = xmalloc(mtd.eb_size);
+	}
+
 	if (noecc)  {
 		if (ioctl(fd, MTDFILEMODE, MTD_FILE_MODE_RAW) != 0) {
 				perror("MTDFILEMODE");
@@ -438,6 +492,23 @@ int main(int argc, char * const argv[])
 				continue;
 			}
 			memset(readbuf, 0xff, bs);
+		} else if (aio) {
+			/* Read the rest of the eraseblock at once */
+			long long blk = ofs & (~mtd.eb_size + 1), o;
+
+			if (rablock != blk) {
+				for (o = ofs; o < min(blk + mtd.eb_size, end_addr); o += bs) {
+					if (mtd_aio_read(aio, o / mtd.eb_size, o % mtd.eb_size,
+							 blockbuf + (o - blk), bs, NULL))
+						goto closeall;
+				}
+				if (mtd_aio_wait(aio)) {
+					errmsg("mtd_aio_read");
+					goto closeall;
+				}
+				rablock = blk;
+			}
+			memcpy(readbuf, blockbuf + (ofs - blk), bs);
 		} else {
 			/* Read page data and exit on failure */
 			if (mtd_read(&mtd, fd, ofs / mtd.eb_size, ofs % mtd.eb_size, readbuf, bs)) {
@@ -476,9 +547,9 @@ int main(int argc, char * const argv[])
 			/* Write requested length if oob is omitted */
 			size_t size_left = end_addr - ofs;
 			if (omitoob && (size_left < bs))
-				err = ofd_write(ofd, readbuf, size_left);
+				err = dump_write(ofd, ffmap, readbuf, size_left);
 			else
-				err = ofd_write(ofd, readbuf, bs);
+				err = dump_write(ofd, ffmap, readbuf, bs);
 
 			if (err)
 				goto closeall;
@@ -507,25 +578,36 @@ int main(int argc, char * const argv[])
 					goto closeall;
 			}
 		} else {
-			err = ofd_write(ofd, oobbuf, mtd.oob_size);
+			err = dump_write(ofd, ffmap, oobbuf, mtd.oob_size);
 			if (err)
 				goto closeall;
 		}
 	}
 
+	if (ffmap && ffmap_save(ffmap, ofd, ffmap_file))
+		goto closeall;
+
 	/* Close the output file and MTD device, free memory */
+	mtd_aio_close(aio);
 	close(fd);
 	close(ofd);
 	free(oobbuf);
 	free(readbuf);
+	free(blockbuf);
+	ffmap_free(ffmap);
+	mtd_bbt_free(&mtd);
 
 	/* Exit happy */
 	return EXIT_SUCCESS;
 
 closeall:
+	mtd_aio_close(aio);
 	close(fd);
 	close(ofd);
 	free(oobbuf);
 	free(readbuf);
+	free(blockbuf);
+	ffmap_free(ffmap);
+	mtd_bbt_free(&mtd);
 	exit(EXIT_FAILURE);
 }
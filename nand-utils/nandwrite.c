@@ -41,6 +41,7 @@
 #include "mtd/mtd-user.h"
 #include "common.h"
 #include <libmtd.h>
+#include <libffmap.h>
 
 static void display_help(int status)
 {
@@ -59,6 +60,12 @@ static void display_help(int status)
 "  -b, --blockalign=1|2|4  Set multiple of eraseblocks to align to\n"
 "      --input-skip=length Skip |length| bytes of the input file\n"
 "      --input-size=length Only read |length| bytes of the input file\n"
+"      --aio[=depth]       Write pages with asynchronous I/O, queue depth\n"
+"                          |depth| (default 32); not supported with -o/-O\n"
+"      --ff-map=file       The input is a sparse image described by the\n"
+"                          ff-map |file|, regions it does not list are 0xFF;\n"
+"                          pages which are all 0xFF are not written; a\n"
+"                          sparse input is refused without its ff-map\n"
 "  -q, --quiet             Don't display progress messages\n"
 "  -h, --help              Display this help and exit\n"
 "  -V, --version           Output version information and exit\n"
@@ -95,6 +102,8 @@ static bool		autoplace = false;
 static bool		noskipbad = false;
 static bool		pad = false;
 static int		blockalign = 1; /* default to using actual block size */
+static int		aio_depth;	/* async I/O queue depth, 0 if disabled */
+static const char	*ffmap_file;	/* ff-map of the input, if any */
 
 static void process_options(int argc, char * const argv[])
 {
@@ -108,6 +117,8 @@ static void process_options(int argc, char * const argv[])
 			{"version", no_argument, 0, 'V'},
 			{"input-skip", required_argument, 0, 0},
 			{"input-size", required_argument, 0, 0},
+			{"aio", optional_argument, 0, 0},
+			{"ff-map", required_argument, 0, 0},
 			{"help", no_argument, 0, 'h'},
 			{"blockalign", required_argument, 0, 'b'},
 			{"markbad", no_argument, 0, 'm'},
@@ -136,6 +147,16 @@ static void process_options(int argc, char * const argv[])
 			case 2: /* --input-size */
 				inputsize = simple_strtoll(optarg, &error);
 				break;
+			case 3: /* --aio */
+				aio_depth = MTD_AIO_DEFAULT_DEPTH;
+				if (optarg)
+					aio_depth = simple_strtoul(optarg, &error);
+				if (aio_depth <= 0)
+					error++;
+				break;
+			case 4: /* --ff-map */
+				ffmap_file = optarg;
+				break;
 			}
 			break;
 		case 'V':
@@ -195,6 +216,9 @@ static void process_options(int argc, char * const argv[])
 	if (!onlyoob && (pad && writeoob))
 		errmsg_die("Can't pad when oob data is present");
 
+	if (aio_depth && writeoob)
+		errmsg_die("Asynchronous I/O cannot write oob data");
+
 	argc -= optind;
 	argv += optind;
 
@@ -217,6 +241,17 @@ static void process_options(int argc, char * const argv[])
 	img = ((argc == 2) ? argv[1] : standard_input);
 }
 
+static bool buffer_erased(const void *buffer, size_t size)
+{
+	const uint8_t *p = buffer;
+	size_t i;
+
+	for (i = 0; i < size; i++)
+		if (p[i] != 0xff)
+			return false;
+	return true;
+}
+
 static void erase_buffer(void *buffer, size_t size)
 {
 	const uint8_t kEraseByte = 0xff;
@@ -225,6 +260,17 @@ static void erase_buffer(void *buffer, size_t size)
 		memset(buffer, kEraseByte, size);
 }
 
+/* The first eraseblock a queued write failed on */
+static int aio_failed_eb = -1;
+
+static void aio_write_failed(__attribute__((unused)) void *priv, int eb,
+			     __attribute__((unused)) int offs,
+			     __attribute__((unused)) int err)
+{
+	if (aio_failed_eb == -1)
+		aio_failed_eb = eb;
+}
+
 /*
  * Main program
  */
@@ -249,6 +295,10 @@ int main(int argc, char * const argv[])
 	/* points to the OOB for the current page in filebuf */
 	unsigned char *oobbuf = NULL;
 	libmtd_t mtd_desc;
+	mtd_aio_t aio = NULL;
+	struct ffmap *ffmap = NULL;
+	/* offset in the input image of the next byte read */
+	long long ipos;
 	int ebsize_aligned;
 	uint8_t write_mode;
 
@@ -266,6 +316,9 @@ int main(int argc, char * const argv[])
 	if (mtd_get_dev_info(mtd_desc, mtd_device, &mtd) < 0)
 		errmsg_die("mtd_get_dev_info failed");
 
+	if (!noskipbad && mtd_get_bbt(&mtd) < 0)
+		sys_errmsg_die("%s: MTD get bad block failed", mtd_device);
+
 	/*
 	 * Pretend erasesize is specified number of blocks - to match jffs2
 	 *   (virtual) block size
@@ -309,6 +362,15 @@ int main(int argc, char * const argv[])
 		goto closeall;
 	}
 
+	ipos = inputskip;
+	if (ffmap_file) {
+		ffmap = ffmap_load(ffmap_file);
+		if (!ffmap)
+			goto closeall;
+	} else if (ffmap_check_holes(ifd, img)) {
+		goto closeall;
+	}
+
 	pagelen = mtd.min_io_size + ((writeoob) ? mtd.oob_size : 0);
 
 	if (ifd == STDIN_FILENO) {
@@ -360,6 +422,18 @@ int main(int argc, char * const argv[])
 	filebuf = xmalloc(filebuf_max);
 	erase_buffer(filebuf, filebuf_max);
 
+	/*
+	 * Writes are queued until the end of each eraseblock, when they are
+	 * waited for, so that the eraseblock may still be replayed elsewhere
+	 * if one of them fails.
+	 */
+	if (aio_depth) {
+		aio = mtd_aio_open(mtd_desc, &mtd, fd, aio_depth,
+				   aio_write_failed);
+		if (!aio)
+			goto closeall;
+	}
+
 	/*
 	 * Get data from input and write to the device while there is
 	 * still input to read and we are still within the device
@@ -445,6 +519,11 @@ int main(int argc, char * const argv[])
 				tinycnt += cnt;
 			}
 
+			if (ffmap)
+				ffmap_fill(ffmap, writebuf + alreadyread,
+					   tinycnt - alreadyread, ipos);
+			ipos += tinycnt - alreadyread;
+
 			/* No padding needed - we are done */
 			if (tinycnt == 0) {
 				/*
@@ -499,6 +578,11 @@ int main(int argc, char * const argv[])
 					tinycnt += cnt;
 				}
 
+				if (ffmap)
+					ffmap_fill(ffmap, oobbuf + alreadyread,
+						   tinycnt - alreadyread, ipos);
+				ipos += tinycnt - alreadyread;
+
 				if (tinycnt < readlen) {
 					fprintf(stderr, "Unexpected EOF. Expecting at least "
 							"%zu more bytes for OOB\n", readlen - tinycnt);
@@ -516,15 +600,41 @@ int main(int argc, char * const argv[])
 		}
 
 		/* Write out data */
-		ret = mtd_write(mtd_desc, &mtd, fd, mtdoffset / mtd.eb_size,
-				mtdoffset % mtd.eb_size,
-				onlyoob ? NULL : writebuf,
-				onlyoob ? 0 : mtd.min_io_size,
-				writeoob ? oobbuf : NULL,
-				writeoob ? mtd.oob_size : 0,
-				write_mode);
+		if (ffmap && !writeoob &&
+		    buffer_erased(writebuf, mtd.min_io_size)) {
+			/* Nothing to program in an erased page */
+			ret = 0;
+		} else if (aio) {
+			ret = mtd_aio_write(aio, mtdoffset / mtd.eb_size,
+					    mtdoffset % mtd.eb_size, writebuf,
+					    mtd.min_io_size, NULL);
+			if (ret)
+				goto closeall;
+		} else {
+			ret = mtd_write(mtd_desc, &mtd, fd, mtdoffset / mtd.eb_size,
+					mtdoffset % mtd.eb_size,
+					onlyoob ? NULL : writebuf,
+					onlyoob ? 0 : mtd.min_io_size,
+					writeoob ? oobbuf : NULL,
+					writeoob ? mtd.oob_size : 0,
+					write_mode);
+		}
+
+		/* Wait at the end of the eraseblock or of the input */
+		if (!ret && aio &&
+		    ((mtdoffset + mtd.min_io_size) % ebsize_aligned == 0 ||
+		     mtdoffset + mtd.min_io_size >= mtd.size ||
+		     (imglen <= 0 && writebuf + pagelen >= filebuf + filebuf_len)))
+			ret = mtd_aio_wait(aio);
+
 		if (ret) {
 			long long i;
+
+			/* The failed page is somewhere in the queued ones */
+			if (aio && aio_failed_eb != -1) {
+				mtdoffset = (long long)aio_failed_eb * mtd.eb_size;
+				aio_failed_eb = -1;
+			}
 			if (errno != EIO) {
 				sys_errmsg("%s: MTD write failure", mtd_device);
 				goto closeall;
@@ -560,10 +670,19 @@ int main(int argc, char * const argv[])
 		writebuf += pagelen;
 	}
 
+	/* Input ended in the middle of an eraseblock */
+	if (aio && mtd_aio_wait(aio)) {
+		sys_errmsg("%s: MTD write failure", mtd_device);
+		goto closeall;
+	}
+
 	failed = false;
 
 closeall:
+	mtd_aio_close(aio);
+	ffmap_free(ffmap);
 	close(ifd);
+	mtd_bbt_free(&mtd);
 	libmtd_close(mtd_desc);
 	free(filebuf);
 	close(fd);
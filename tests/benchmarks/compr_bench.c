@@ -0,0 +1,322 @@
+/*
+ * Copyright (C) 2026 mtd-utils contributors
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * Measure the mkfs.ubifs favor LZO compression with and without the
+ * incompressible data probe: compression speed versus the size of the
+ * resulting data nodes, over a mixed corpus of 4KiB blocks.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <getopt.h>
+#include <time.h>
+#include <zlib.h>
+
+#include "mkfs.ubifs.h"
+
+struct ubifs_info info_;
+static struct ubifs_info *c = &info_;
+int verbose;
+int debug_level;
+
+/**
+ * struct corpus - a part of the corpus.
+ * @name: name to report it under
+ * @buf: the data
+ * @len: length of the data
+ */
+struct corpus {
+	const char *name;
+	unsigned char *buf;
+	size_t len;
+};
+
+static struct corpus corpora[16];
+static int corpus_cnt;
+static long long class_bytes = 4 * 1024 * 1024;
+
+static const struct option options[] = {
+	{ "help", no_argument, NULL, 'h' },
+	{ "bytes", required_argument, NULL, 'b' },
+	{ "favor-percent", required_argument, NULL, 'X' },
+	{ NULL, 0, NULL, 0 },
+};
+
+static void __attribute__((noreturn)) usage(int status)
+{
+	fputs(
+	"Usage: compr_bench [OPTIONS] [FILE...]\n\n"
+	"Compresses the FILEs, or a built-in mixed corpus if none are given,\n"
+	"in 4KiB blocks the way mkfs.ubifs -x favor_lzo does.\n\n"
+	"  -h, --help                Display this help output\n"
+	"  -b, --bytes <size>        Size of each built-in corpus part\n"
+	"                            (default: 4MiB)\n"
+	"  -X, --favor-percent <n>   The mkfs.ubifs favor LZO percentage\n"
+	"                            (default: 20)\n",
+	status == EXIT_SUCCESS ? stdout : stderr);
+	exit(status);
+}
+
+static void add_corpus(const char *name, unsigned char *buf, size_t len)
+{
+	if (corpus_cnt == ARRAY_SIZE(corpora)) {
+		free(buf);
+		return;
+	}
+	corpora[corpus_cnt].name = name;
+	corpora[corpus_cnt].buf = buf;
+	corpora[corpus_cnt].len = len;
+	corpus_cnt += 1;
+}
+
+static unsigned char *read_file(const char *path, size_t *len)
+{
+	unsigned char *buf = NULL;
+	size_t n = 0, max = 0;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (!f) {
+		sys_err_msg("cannot open '%s'", path);
+		return NULL;
+	}
+	do {
+		if (n == max) {
+			max = max ? max * 2 : 1024 * 1024;
+			buf = xrealloc(buf, max);
+		}
+		n += fread(buf + n, 1, max - n, f);
+	} while (!feof(f) && !ferror(f));
+	fclose(f);
+	*len = n;
+	return buf;
+}
+
+/* Text made of common words */
+static unsigned char *make_text(size_t len)
+{
+	static const char * const words[] = {
+		"the", "of", "and", "to", "in", "is", "was", "that", "for",
+		"flash", "erase", "block", "volume", "page", "write", "read",
+		"image", "node", "index", "journal", "compress", "data", "with",
+		"UBI", "UBIFS", "MTD", "device", "bad", "error", "\n",
+	};
+	unsigned char *buf = xmalloc(len);
+	size_t n = 0;
+
+	while (n < len) {
+		const char *w = words[rand() % ARRAY_SIZE(words)];
+		size_t l = strlen(w);
+
+		if (l > len - n - 1)
+			l = len - n - 1;
+		memcpy(buf + n, w, l);
+		n += l;
+		if (n < len)
+			buf[n++] = ' ';
+	}
+	return buf;
+}
+
+/* Tables of small structures, like databases and binaries have */
+static unsigned char *make_records(size_t len)
+{
+	unsigned char *buf = xzalloc(len);
+	size_t n;
+
+	for (n = 0; n + 16 <= len; n += 16) {
+		uint32_t rec[4];
+
+		rec[0] = n / 16;
+		rec[1] = rand() % 1000;
+		rec[2] = 0x8000 + (rand() % 16) * 4;
+		rec[3] = rand() % 3;
+		memcpy(buf + n, rec, sizeof(rec));
+	}
+	return buf;
+}
+
+static unsigned char *make_random(size_t len)
+{
+	unsigned char *buf = xmalloc(len);
+	size_t n;
+
+	for (n = 0; n < len; n++)
+		buf[n] = rand();
+	return buf;
+}
+
+/* Text compressed with zlib, like already compressed media and archives */
+static unsigned char *make_deflated(size_t len)
+{
+	size_t n = 0, chunk = 64 * 1024;
+	uLongf max = compressBound(chunk);
+	unsigned char *buf = xmalloc(len), *out = xmalloc(max);
+
+	while (n < len) {
+		unsigned char *text = make_text(chunk);
+		uLongf l = max;
+
+		if (compress2(out, &l, text, chunk, 9) != Z_OK)
+			memcpy(out, text, l = chunk);
+		free(text);
+		if (l > len - n)
+			l = len - n;
+		memcpy(buf + n, out, l);
+		n += l;
+	}
+	free(out);
+	return buf;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * struct result - the result of compressing a part of the corpus.
+ * @secs: time spent compressing
+ * @size: total size of the data nodes
+ * @cnt: count of blocks stored with each compression type
+ */
+struct result {
+	double secs;
+	unsigned long long size;
+	unsigned long cnt[3];
+};
+
+static void run(const struct corpus *cp, struct result *res)
+{
+	static unsigned char out[UBIFS_BLOCK_SIZE * WORST_COMPR_FACTOR];
+	size_t pos;
+	double t;
+
+	memset(res, 0, sizeof(*res));
+	t = now();
+	for (pos = 0; pos < cp->len; pos += UBIFS_BLOCK_SIZE) {
+		size_t len = cp->len - pos, out_len = sizeof(out);
+		int type;
+
+		if (len > UBIFS_BLOCK_SIZE)
+			len = UBIFS_BLOCK_SIZE;
+		type = compress_data(cp->buf + pos, len, out, &out_len,
+				     MKFS_UBIFS_COMPR_LZO);
+		res->cnt[type] += 1;
+		res->size += ALIGN(UBIFS_DATA_NODE_SZ + out_len, 8);
+	}
+	res->secs = now() - t;
+}
+
+static void report(const char *name, size_t len, const struct result *res)
+{
+	printf("  %-10s %9.1f %12llu %7lu %7lu %7lu\n", name,
+	       len / res->secs / (1024 * 1024), res->size,
+	       res->cnt[MKFS_UBIFS_COMPR_NONE], res->cnt[MKFS_UBIFS_COMPR_LZO],
+	       res->cnt[MKFS_UBIFS_COMPR_ZLIB]);
+}
+
+int main(int argc, char **argv)
+{
+	struct result res[2][ARRAY_SIZE(corpora)], total[2];
+	size_t total_len = 0;
+	int i, probe, opt;
+
+	c->favor_lzo = 1;
+	c->favor_percent = 20;
+
+	while ((opt = getopt_long(argc, argv, "hb:X:", options, NULL)) != -1) {
+		switch (opt) {
+		case 'h':
+			usage(EXIT_SUCCESS);
+		case 'b':
+			class_bytes = util_get_bytes(optarg);
+			if (class_bytes <= 0)
+				usage(EXIT_FAILURE);
+			break;
+		case 'X':
+			c->favor_percent = atoi(optarg);
+			if (c->favor_percent <= 0 || c->favor_percent >= 100)
+				usage(EXIT_FAILURE);
+			break;
+		default:
+			usage(EXIT_FAILURE);
+		}
+	}
+
+	if (optind < argc) {
+		for (i = optind; i < argc; i++) {
+			unsigned char *buf;
+			size_t len;
+
+			buf = read_file(argv[i], &len);
+			if (!buf)
+				return EXIT_FAILURE;
+			add_corpus(argv[i], buf, len);
+		}
+	} else {
+		unsigned char *buf;
+		size_t len;
+
+		add_corpus("text", make_text(class_bytes), class_bytes);
+		add_corpus("records", make_records(class_bytes), class_bytes);
+		add_corpus("random", make_random(class_bytes), class_bytes);
+		add_corpus("deflated", make_deflated(class_bytes),
+			   class_bytes);
+		/* Our own executable stands for binaries */
+		buf = read_file("/proc/self/exe", &len);
+		if (buf)
+			add_corpus("binary", buf, len);
+	}
+
+	if (init_compression())
+		return err_msg("cannot initialize compression");
+
+	memset(total, 0, sizeof(total));
+	for (probe = 0; probe < 2; probe++) {
+		c->favor_probe = probe;
+		for (i = 0; i < corpus_cnt; i++) {
+			int j;
+
+			run(&corpora[i], &res[probe][i]);
+			total[probe].secs += res[probe][i].secs;
+			total[probe].size += res[probe][i].size;
+			for (j = 0; j < 3; j++)
+				total[probe].cnt[j] += res[probe][i].cnt[j];
+		}
+	}
+
+	for (i = 0; i < corpus_cnt; i++)
+		total_len += corpora[i].len;
+
+	for (probe = 0; probe < 2; probe++) {
+		printf("%s:\n", probe ? "with the probe" : "without the probe");
+		printf("  %-10s %9s %12s %7s %7s %7s\n", "corpus", "MiB/s",
+		       "node bytes", "none", "lzo", "zlib");
+		for (i = 0; i < corpus_cnt; i++)
+			report(corpora[i].name, corpora[i].len, &res[probe][i]);
+		report("total", total_len, &total[probe]);
+		printf("\n");
+	}
+
+	printf("speed-up %.2fx, data node size %+.2f%%\n",
+	       total[0].secs / total[1].secs,
+	       ((double)total[1].size - total[0].size) * 100 / total[0].size);
+
+	destroy_compression();
+	for (i = 0; i < corpus_cnt; i++)
+		free(corpora[i].buf);
+	return 0;
+}
@@ -0,0 +1,163 @@
+/*
+ * Copyright (C) 2026 mtd-utils contributors
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * Compare the throughput of the CRC32 kernels behind mtd_crc32() across
+ * buffer sizes and check that they all produce the same result.
+ */
+
+#define PROGRAM_NAME "crc32_bench"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <getopt.h>
+#include <time.h>
+
+#include <mtd/ubi-media.h>
+#include <crc32.h>
+#include "common.h"
+
+/* Buffer sizes to measure: UBI headers up to a whole 1MiB PEB */
+static const int sizes[] = {
+	64, 512, 4096, 65536, 131072, 262144, 1048576,
+};
+
+static long long total_bytes = 256 * 1024 * 1024;
+
+static const struct option options[] = {
+	{ "help", no_argument, NULL, 'h' },
+	{ "bytes", required_argument, NULL, 'b' },
+	{ NULL, 0, NULL, 0 },
+};
+
+static void __attribute__((noreturn)) usage(int status)
+{
+	fputs(
+	"Usage: "PROGRAM_NAME" [OPTIONS]\n\n"
+	"  -h, --help          Display this help output\n"
+	"  -b, --bytes <size>  Bytes to checksum per kernel and buffer size\n"
+	"                      (default: 256MiB)\n",
+	status == EXIT_SUCCESS ? stdout : stderr);
+	exit(status);
+}
+
+/*
+ * Check every kernel against the byte-wise reference for all lengths and
+ * alignments up to 1KiB, which covers every head/tail path of the kernels.
+ */
+static int verify(const struct mtd_crc32_impl *impls, int cnt,
+		  const unsigned char *buf)
+{
+	int j, offs, len;
+
+	for (j = 1; j < cnt; j++) {
+		if (!impls[j].supported())
+			continue;
+		for (offs = 0; offs < 16; offs++)
+			for (len = 0; len <= 1024; len++) {
+				uint32_t ref, crc;
+
+				ref = impls[0].crc32(UBI_CRC32_INIT, buf + offs, len);
+				crc = impls[j].crc32(UBI_CRC32_INIT, buf + offs, len);
+				if (crc != ref)
+					return errmsg("kernel \"%s\" returned %#08x instead of %#08x (offset %d, length %d)",
+						      impls[j].name, crc, ref, offs, len);
+			}
+	}
+
+	return 0;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv)
+{
+	const struct mtd_crc32_impl *impls;
+	unsigned char *buf;
+	int i, j, cnt, c, maxsz = sizes[ARRAY_SIZE(sizes) - 1];
+	uint32_t ref;
+
+	while ((c = getopt_long(argc, argv, "hb:", options, NULL)) != -1) {
+		switch (c) {
+		case 'h':
+			usage(EXIT_SUCCESS);
+		case 'b':
+			total_bytes = util_get_bytes(optarg);
+			if (total_bytes <= 0)
+				usage(EXIT_FAILURE);
+			break;
+		default:
+			usage(EXIT_FAILURE);
+		}
+	}
+
+	/* Odd offset so that the kernels also see unaligned data */
+	buf = xmalloc(maxsz + 1);
+	for (i = 0; i <= maxsz; i++)
+		buf[i] = rand();
+
+	impls = mtd_crc32_get_impls(&cnt);
+	if (verify(impls, cnt, buf))
+		return EXIT_FAILURE;
+
+	printf("mtd_crc32() uses \"%s\"\n\n", mtd_crc32_get_impl()->name);
+
+	printf("%-10s", "size");
+	for (j = 0; j < cnt; j++)
+		if (impls[j].supported())
+			printf("%12s", impls[j].name);
+	printf("   (MiB/s)\n");
+
+	for (i = 0; i < (int)ARRAY_SIZE(sizes); i++) {
+		int sz = sizes[i];
+		long long iter = total_bytes / sz;
+
+		if (iter < 1)
+			iter = 1;
+
+		ref = impls[0].crc32(UBI_CRC32_INIT, buf + 1, sz);
+		printf("%-10d", sz);
+		for (j = 0; j < cnt; j++) {
+			uint32_t crc = 0;
+			double t;
+			long long k;
+
+			if (!impls[j].supported())
+				continue;
+
+			if (impls[j].crc32(UBI_CRC32_INIT, buf + 1, sz) != ref) {
+				errmsg("kernel \"%s\" mismatch at size %d",
+				       impls[j].name, sz);
+				return EXIT_FAILURE;
+			}
+
+			t = now();
+			for (k = 0; k < iter; k++)
+				crc ^= impls[j].crc32(crc, buf + 1, sz);
+			t = now() - t;
+
+			/* Keep the loop from being optimized away */
+			if (crc == 0x12345678)
+				printf("!");
+			printf("%12.0f", (double)iter * sz / t / (1024 * 1024));
+		}
+		printf("\n");
+	}
+
+	free(buf);
+	return 0;
+}
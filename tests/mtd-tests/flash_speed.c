@@ -282,12 +282,16 @@ static long calc_speed(void)
 	return ((long)goodebcnt * (mtd.eb_size / 1024L) * 1000L) / ms;
 }
 
-static void scan_for_bad_eraseblocks(unsigned int eb, int ebcnt, int ebskip)
+static int scan_for_bad_eraseblocks(unsigned int eb, int ebcnt, int ebskip)
 {
 	int i, bad = 0;
 
 	puts("scanning for bad eraseblocks");
 
+	/* Cache the bad status of the eraseblocks checked below */
+	if (mtd_get_bbt(&mtd))
+		return errmsg("cannot get the bad eraseblock table");
+
 	for (i = 0; i < ebcnt; ++i) {
 		bbt[i] = mtd_is_bad(&mtd, fd, eb + i*(ebskip+1)) ? 1 : 0;
 		if (bbt[i])
@@ -295,6 +299,7 @@ static void scan_for_bad_eraseblocks(unsigned int eb, int ebcnt, int ebskip)
 	}
 
 	printf("scanned %d eraseblocks, %d are bad\n", ebcnt, bad);
+	return 0;
 }
 
 static int erase_good_eraseblocks(unsigned int eb, int ebcnt, int ebskip)
@@ -371,7 +376,8 @@ int main(int argc, char **argv)
 	for (i = 0; i < mtd.eb_size; ++i)
 		iobuf[i] = rand();
 
-	scan_for_bad_eraseblocks(peb, count, skip);
+	if (scan_for_bad_eraseblocks(peb, count, skip))
+		goto out;
 
 	for (i = 0; i < count; ++i) {
 		if (!bbt[i])
@@ -469,6 +475,7 @@ int main(int argc, char **argv)
 out:
 	close(fd);
 outfree:
+	mtd_bbt_free(&mtd);
 	free(iobuf);
 	free(bbt);
 	return status;
@@ -0,0 +1,113 @@
+#include <stdarg.h>
+#include <setjmp.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <cmocka.h>
+
+#include "libmtd.h"
+
+#define PAGE_SIZE	2048
+#define PAGE_CNT	64
+#define EB_SIZE		(PAGE_CNT * PAGE_SIZE)
+#define EB_CNT		4
+
+/* Count of 'io_uring_enter()' calls */
+static int enter_cnt;
+
+long __real_syscall(long number, ...);
+
+long __wrap_syscall(long number, ...)
+{
+	long a[6];
+	va_list ap;
+	int i;
+
+	va_start(ap, number);
+	for (i = 0; i < 6; i++)
+		a[i] = va_arg(ap, long);
+	va_end(ap);
+
+#ifdef __NR_io_uring_enter
+	if (number == __NR_io_uring_enter)
+		enter_cnt += 1;
+#endif
+	return __real_syscall(number, a[0], a[1], a[2], a[3], a[4], a[5]);
+}
+
+static void init_mtd(struct mtd_dev_info *mtd)
+{
+	memset(mtd, 0, sizeof(struct mtd_dev_info));
+	mtd->eb_cnt = EB_CNT;
+	mtd->eb_size = EB_SIZE;
+	mtd->size = (long long)EB_CNT * EB_SIZE;
+	mtd->min_io_size = PAGE_SIZE;
+	mtd->subpage_size = PAGE_SIZE;
+}
+
+static int open_image(void)
+{
+	char tmpl[] = "/tmp/libmtd_aio_XXXXXX";
+	int fd;
+
+	fd = mkstemp(tmpl);
+	assert_true(fd >= 0);
+	unlink(tmpl);
+	assert_int_equal(ftruncate(fd, (off_t)EB_CNT * EB_SIZE), 0);
+	return fd;
+}
+
+static void test_mtd_aio_write_chain(void **state)
+{
+	static char buf[EB_SIZE], rbuf[EB_SIZE];
+	struct mtd_dev_info mtd;
+	mtd_aio_t aio;
+	int fd, i;
+
+	init_mtd(&mtd);
+	fd = open_image();
+	for (i = 0; i < EB_SIZE; i++)
+		buf[i] = i / PAGE_SIZE + i;
+
+	aio = mtd_aio_open(NULL, &mtd, fd, 32, NULL);
+	assert_non_null(aio);
+	if (!mtd_aio_is_async(aio)) {
+		mtd_aio_close(aio);
+		close(fd);
+		skip();
+	}
+
+	/* Write one eraseblock page by page */
+	enter_cnt = 0;
+	for (i = 0; i < PAGE_CNT; i++)
+		assert_int_equal(mtd_aio_write(aio, 1, i * PAGE_SIZE,
+					       buf + i * PAGE_SIZE, PAGE_SIZE,
+					       NULL), 0);
+	assert_int_equal(mtd_aio_wait(aio), 0);
+
+	/*
+	 * Each full queue goes in one chain of linked writes, so there is one
+	 * call to submit it and one to wait for it.
+	 */
+	assert_true(enter_cnt <= 2 * PAGE_CNT / 32);
+
+	assert_int_equal(pread(fd, rbuf, EB_SIZE, EB_SIZE), EB_SIZE);
+	assert_memory_equal(buf, rbuf, EB_SIZE);
+
+	mtd_aio_close(aio);
+	close(fd);
+	(void) state;
+}
+
+int main(void)
+{
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test(test_mtd_aio_write_chain),
+	};
+
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}
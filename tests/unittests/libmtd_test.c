@@ -2,6 +2,7 @@
 #include <setjmp.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <errno.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <sys/types.h>
@@ -94,6 +95,50 @@ static void test_mtd_is_bad(void **state)
 	(void) state;
 }
 
+static void test_mtd_get_bbt(void **state)
+{
+	struct mtd_dev_info mtd;
+	loff_t seek[10];
+	int eb;
+	memset(&mtd, 0, sizeof(mtd));
+	mtd.bb_allowed = 1;
+	mtd.eb_cnt = 10;
+	mtd.eb_size = 128;
+	/* Setting up the table does not query the device */
+	int r = mtd_get_bbt(&mtd);
+	assert_int_equal(r, 0);
+	assert_non_null(mtd.bbt);
+
+	/* The first check of an eraseblock asks the device */
+	for (eb = 0; eb < mtd.eb_cnt; eb++) {
+		seek[eb] = (loff_t)eb * mtd.eb_size;
+		expect_ioctl(MEMGETBADBLOCK, eb == 3 || eb == 9,
+			     &seek[eb], sizeof(seek[eb]));
+		assert_int_equal(mtd_is_bad(&mtd, 4, eb), eb == 3 || eb == 9);
+	}
+
+	/* Cached: neither of these should issue an ioctl */
+	r = mtd_get_bbt(&mtd);
+	assert_int_equal(r, 0);
+	for (eb = 0; eb < mtd.eb_cnt; eb++)
+		assert_int_equal(mtd_is_bad(&mtd, 4, eb), eb == 3 || eb == 9);
+
+	expect_ioctl(MEMSETBADBLOCK, 0, &seek[5], sizeof(seek[5]));
+	r = mtd_mark_bad(&mtd, 4, 5);
+	assert_int_equal(r, 0);
+	assert_int_equal(mtd_is_bad(&mtd, 4, 5), 1);
+
+	/* After a refresh the device is asked again */
+	mtd_bbt_refresh(&mtd);
+	expect_ioctl(MEMGETBADBLOCK, 0, &seek[3], sizeof(seek[3]));
+	assert_int_equal(mtd_is_bad(&mtd, 4, 3), 0);
+	assert_int_equal(mtd_is_bad(&mtd, 4, 3), 0);
+
+	mtd_bbt_free(&mtd);
+	assert_null(mtd.bbt);
+	(void) state;
+}
+
 static void test_mtd_lock(void **state)
 {
 	int eb = 0xBA;
@@ -252,11 +297,46 @@ static void test_mtd_read(void **state)
 	mtd.eb_cnt = 1024;
 	mtd.eb_size = 128;
 	seek = (off_t)eb * mtd.eb_size + offs;
-	expect_lseek(seek, SEEK_SET, seek);
-	expect_read(len, len);
+	expect_pread(len, seek, len);
 	int r = mtd_read(&mtd, mock_fd, eb, offs, &buf, len);
 	assert_int_equal(r, 0);
 
+	/* Short reads are continued */
+	expect_pread(len, seek, 10);
+	expect_pread(len - 10, seek + 10, len - 10);
+	r = mtd_pread(&mtd, mock_fd, eb, offs, &buf, len);
+	assert_int_equal(r, 0);
+
+	(void) state;
+}
+
+static void test_mtd_readv(void **state)
+{
+	int mock_fd = 4;
+	char buf[4][16];
+	struct mtd_dev_info mtd;
+	memset(&mtd, 0, sizeof(mtd));
+	mtd.bb_allowed = 1;
+	mtd.eb_cnt = 1024;
+	mtd.eb_size = 128;
+	/* The first three extents are adjacent, the last one is not */
+	struct mtd_extent ext[4] = {
+		{ .eb = 1, .offs = 96, .buf = buf[0], .len = 16 },
+		{ .eb = 1, .offs = 112, .buf = buf[1], .len = 16 },
+		{ .eb = 2, .offs = 0, .buf = buf[2], .len = 16 },
+		{ .eb = 5, .offs = 32, .buf = buf[3], .len = 16 },
+	};
+	expect_preadv(3, 1 * 128 + 96, 20);
+	expect_preadv(2, 1 * 128 + 96 + 20, 28);
+	expect_preadv(1, 5 * 128 + 32, 16);
+	int r = mtd_readv(&mtd, mock_fd, ext, 4);
+	assert_int_equal(r, 0);
+
+	/* Nothing is read if any of the extents is invalid */
+	ext[3].len = 128;
+	r = mtd_readv(&mtd, mock_fd, ext, 4);
+	assert_int_equal(r, -1);
+
 	(void) state;
 }
 
@@ -277,11 +357,14 @@ static void test_mtd_write_nooob(void **state)
 	mtd.eb_size = 128;
 	mtd.subpage_size = 64;
 	seek = (off_t)eb * mtd.eb_size + offs;
-	expect_lseek(seek, SEEK_SET, seek);
-	expect_write(buf, len, len);
+	expect_pwrite(buf, len, seek, len);
 	int r = mtd_write(lib, &mtd, mock_fd, eb, offs, buf, len, NULL, 0, 0);
 	assert_int_equal(r, 0);
 
+	expect_pwrite(buf, len, seek, len);
+	r = mtd_pwrite(&mtd, mock_fd, eb, offs, buf, len);
+	assert_int_equal(r, 0);
+
 	libmtd_close(lib);
 	(void)state;
 }
@@ -465,12 +548,69 @@ static void test_mtd_get_dev_info1(void **state)
 	(void)state;
 }
 
+static void test_mtd_pairing_table(void **state)
+{
+	const struct mtd_pairing_table *tbl;
+	struct mtd_pairing_info info, ref;
+	struct mtd_dev_info mtd;
+	int wunit, i, n = 0;
+
+	memset(&mtd, 0, sizeof(mtd));
+	mtd.eb_size = 256 * 1024;
+	mtd.min_io_size = 4096;
+	mtd.pairing = mtd_get_pairing_scheme("mlc-dist3");
+	assert_non_null(mtd.pairing);
+
+	tbl = mtd_get_pairing_table(&mtd);
+	assert_non_null(tbl);
+	assert_ptr_equal(mtd_get_pairing_table(&mtd), tbl);
+	assert_int_equal(tbl->ngroups, 2);
+	assert_int_equal(tbl->npairs, 32);
+	assert_int_equal(tbl->nwunits, 64);
+
+	for (wunit = 0; wunit < tbl->nwunits; wunit++) {
+		assert_int_equal(mtd_pairing_table_info(tbl, wunit, &info), 0);
+		mtd.pairing->get_info(&mtd, wunit, &ref);
+		assert_int_equal(info.pair, ref.pair);
+		assert_int_equal(info.group, ref.group);
+		assert_int_equal(mtd_pairing_table_wunit(tbl, &info), wunit);
+	}
+	assert_int_equal(mtd_pairing_table_info(tbl, wunit, &info), -EINVAL);
+	info.pair = tbl->npairs;
+	info.group = 0;
+	assert_int_equal(mtd_pairing_table_wunit(tbl, &info), -EINVAL);
+
+	/* The SLC runs are the group 0 wunits in pair order */
+	for (i = 0; i < tbl->slc_cnt; i++) {
+		const struct mtd_pairing_extent *ext = &tbl->slc[i];
+
+		assert_int_equal(ext->pair, n);
+		for (wunit = ext->wunit; wunit < ext->wunit + ext->cnt; wunit++) {
+			info.pair = n++;
+			info.group = 0;
+			assert_int_equal(mtd_pairing_info_to_wunit(&mtd, &info),
+					 wunit);
+		}
+	}
+	assert_int_equal(n, tbl->npairs);
+
+	/* Without a pairing scheme every wunit is a pair of its own */
+	mtd.pairing = NULL;
+	tbl = mtd_get_pairing_table(&mtd);
+	assert_non_null(tbl);
+	assert_int_equal(tbl->npairs, 64);
+	assert_int_equal(tbl->slc_cnt, 1);
+	assert_int_equal(tbl->slc[0].cnt, 64);
+	(void) state;
+}
+
 int main(void)
 {
 	const struct CMUnitTest tests[] = {
 		cmocka_unit_test(test_libmtd_open),
 		cmocka_unit_test(test_mtd_is_bad),
 		cmocka_unit_test(test_mtd_mark_bad),
+		cmocka_unit_test(test_mtd_get_bbt),
 		cmocka_unit_test(test_mtd_lock),
 		cmocka_unit_test(test_mtd_unlock),
 		cmocka_unit_test(test_mtd_is_locked),
@@ -478,6 +618,7 @@ int main(void)
 		cmocka_unit_test(test_mtd_erase_multi),
 		cmocka_unit_test(test_mtd_erase),
 		cmocka_unit_test(test_mtd_read),
+		cmocka_unit_test(test_mtd_readv),
 		cmocka_unit_test(test_mtd_write_nooob),
 		cmocka_unit_test(test_mtd_write_withoob),
 		cmocka_unit_test(test_mtd_read_oob),
@@ -485,6 +626,7 @@ int main(void)
 		cmocka_unit_test(test_mtd_dev_present),
 		cmocka_unit_test(test_mtd_get_info),
 		cmocka_unit_test(test_mtd_get_dev_info1),
+		cmocka_unit_test(test_mtd_pairing_table),
 	};
 
 	return cmocka_run_group_tests(tests, NULL, NULL);
@@ -0,0 +1,230 @@
+#include <stdarg.h>
+#include <setjmp.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <cmocka.h>
+
+#include "mtd/ubi-media.h"
+#include "mtd_swab.h"
+#include "libmtd.h"
+#include "libscan.h"
+#include "crc32.h"
+
+#define PEB_SIZE	(16 * 1024)
+#define MIN_IO_SIZE	512
+#define PEB_COUNT	16
+#define VID_HDR_OFFS	MIN_IO_SIZE
+#define DATA_OFFS	(2 * MIN_IO_SIZE)
+
+/* What each PEB of the test image holds */
+enum {
+	T_EMPTY,	/* all 0xFF bytes */
+	T_ALIEN,	/* not UBI */
+	T_BAD_EC,	/* EC header with a bad CRC */
+	T_FREE,		/* EC header only */
+	T_LEB,		/* EC and VID header */
+	T_BAD_VID,	/* EC header and a VID header with a bad CRC */
+};
+
+static const struct {
+	int type;
+	uint32_t vol_id;
+	uint32_t lnum;
+	unsigned long long sqnum;
+} test_pebs[PEB_COUNT] = {
+	{ T_LEB,     0,                    0, 10 },
+	{ T_LEB,     0,                    1, 11 },
+	/* A newer copy of LEB 1 */
+	{ T_LEB,     0,                    1, 20 },
+	{ T_BAD_VID, 0,                    2, 12 },
+	{ T_LEB,     7,                    3,  5 },
+	/* LEB 4 with the older copy after the newer one */
+	{ T_LEB,     0,                    4, 30 },
+	{ T_LEB,     0,                    4, 25 },
+	{ T_FREE,    0,                    0,  0 },
+	{ T_EMPTY,   0,                    0,  0 },
+	{ T_ALIEN,   0,                    0,  0 },
+	{ T_BAD_EC,  0,                    0,  0 },
+	{ T_LEB,     UBI_LAYOUT_VOLUME_ID, 0,  1 },
+	{ T_EMPTY,   0,                    0,  0 },
+	{ T_EMPTY,   0,                    0,  0 },
+	{ T_EMPTY,   0,                    0,  0 },
+	{ T_EMPTY,   0,                    0,  0 },
+};
+
+static void init_peb(char *buf, int i)
+{
+	struct ubi_ec_hdr *ec_hdr = (struct ubi_ec_hdr *)buf;
+	struct ubi_vid_hdr *vid_hdr = (struct ubi_vid_hdr *)(buf + VID_HDR_OFFS);
+	int type = test_pebs[i].type;
+
+	memset(buf, 0xFF, PEB_SIZE);
+	if (type == T_EMPTY)
+		return;
+	if (type == T_ALIEN) {
+		memset(buf, 0x5A, PEB_SIZE);
+		return;
+	}
+
+	memset(ec_hdr, 0, UBI_EC_HDR_SIZE);
+	ec_hdr->magic = cpu_to_be32(UBI_EC_HDR_MAGIC);
+	ec_hdr->version = 1;
+	ec_hdr->ec = cpu_to_be64(i);
+	ec_hdr->vid_hdr_offset = cpu_to_be32(VID_HDR_OFFS);
+	ec_hdr->data_offset = cpu_to_be32(DATA_OFFS);
+	ec_hdr->image_seq = cpu_to_be32(0x1234);
+	ec_hdr->hdr_crc = cpu_to_be32(mtd_crc32(UBI_CRC32_INIT, ec_hdr,
+						UBI_EC_HDR_SIZE_CRC));
+	if (type == T_BAD_EC)
+		ec_hdr->hdr_crc ^= cpu_to_be32(1);
+	if (type == T_FREE || type == T_BAD_EC)
+		return;
+
+	memset(vid_hdr, 0, UBI_VID_HDR_SIZE);
+	vid_hdr->magic = cpu_to_be32(UBI_VID_HDR_MAGIC);
+	vid_hdr->version = 1;
+	vid_hdr->vol_type = UBI_VID_DYNAMIC;
+	vid_hdr->vol_id = cpu_to_be32(test_pebs[i].vol_id);
+	vid_hdr->lnum = cpu_to_be32(test_pebs[i].lnum);
+	vid_hdr->sqnum = cpu_to_be64(test_pebs[i].sqnum);
+	vid_hdr->hdr_crc = cpu_to_be32(mtd_crc32(UBI_CRC32_INIT, vid_hdr,
+						 UBI_VID_HDR_SIZE_CRC));
+	if (type == T_BAD_VID)
+		vid_hdr->hdr_crc ^= cpu_to_be32(1);
+}
+
+/* Returns a file descriptor of the test image */
+static int gen_image(struct mtd_dev_info *mtd)
+{
+	char tmpl[] = "/tmp/libscan_XXXXXX";
+	char buf[PEB_SIZE];
+	int fd, i;
+
+	memset(mtd, 0, sizeof(struct mtd_dev_info));
+	mtd->eb_cnt = PEB_COUNT;
+	mtd->eb_size = PEB_SIZE;
+	mtd->size = (long long)PEB_COUNT * PEB_SIZE;
+	mtd->min_io_size = MIN_IO_SIZE;
+	mtd->subpage_size = MIN_IO_SIZE;
+
+	fd = mkstemp(tmpl);
+	assert_true(fd >= 0);
+	unlink(tmpl);
+
+	for (i = 0; i < PEB_COUNT; i++) {
+		init_peb(buf, i);
+		assert_int_equal(write(fd, buf, PEB_SIZE), PEB_SIZE);
+	}
+	return fd;
+}
+
+static void check_scan(struct mtd_dev_info *mtd, int fd, int threads)
+{
+	struct ubi_scan_opts opts = { .threads = threads, .leb_map = 1 };
+	const struct ubi_scan_vol *vol;
+	struct ubi_scan_info *si;
+	int i;
+
+	assert_int_equal(ubi_scan(mtd, fd, &si, &opts), 0);
+
+	assert_int_equal(si->ok_cnt, 9);
+	assert_int_equal(si->empty_cnt, 5);
+	assert_int_equal(si->alien_cnt, 1);
+	assert_int_equal(si->corrupted_cnt, 1);
+	assert_int_equal(si->used_cnt, 7);
+	assert_int_equal(si->vid_corrupted_cnt, 1);
+
+	/* The per-PEB records */
+	assert_non_null(si->lebs);
+	for (i = 0; i < PEB_COUNT; i++) {
+		const struct ubi_scan_leb *leb = &si->lebs[i];
+
+		switch (test_pebs[i].type) {
+		case T_LEB:
+			assert_int_equal(leb->vol_id, test_pebs[i].vol_id);
+			assert_int_equal(leb->lnum, test_pebs[i].lnum);
+			assert_true(leb->sqnum == test_pebs[i].sqnum);
+			break;
+		case T_BAD_VID:
+			assert_int_equal(leb->vol_id, CORRUPT_VID);
+			break;
+		default:
+			assert_int_equal(leb->vol_id, NO_VID);
+			break;
+		}
+	}
+
+	/* The LEB to PEB index, sorted by volume ID */
+	assert_int_equal(si->vol_cnt, 3);
+	assert_int_equal(si->vols[0].vol_id, 0);
+	assert_int_equal(si->vols[1].vol_id, 7);
+	assert_int_equal(si->vols[2].vol_id, UBI_LAYOUT_VOLUME_ID);
+
+	vol = ubi_scan_get_vol(si, 0);
+	assert_non_null(vol);
+	assert_int_equal(vol->leb_cnt, 5);
+	assert_int_equal(vol->pebs[0], 0);
+	/* The copies with the highest sequence number win */
+	assert_int_equal(vol->pebs[1], 2);
+	/* The corrupted VID header does not map LEB 2 */
+	assert_int_equal(vol->pebs[2], -1);
+	assert_int_equal(vol->pebs[3], -1);
+	assert_int_equal(vol->pebs[4], 5);
+
+	vol = ubi_scan_get_vol(si, 7);
+	assert_non_null(vol);
+	assert_int_equal(vol->leb_cnt, 4);
+	for (i = 0; i < 3; i++)
+		assert_int_equal(vol->pebs[i], -1);
+	assert_int_equal(vol->pebs[3], 4);
+
+	vol = ubi_scan_get_vol(si, UBI_LAYOUT_VOLUME_ID);
+	assert_non_null(vol);
+	assert_int_equal(vol->leb_cnt, 1);
+	assert_int_equal(vol->pebs[0], 11);
+
+	assert_null(ubi_scan_get_vol(si, 3));
+	ubi_scan_free(si);
+}
+
+static void test_ubi_scan_leb_map(void **state)
+{
+	struct mtd_dev_info mtd;
+	int fd = gen_image(&mtd);
+
+	check_scan(&mtd, fd, 1);
+	check_scan(&mtd, fd, 4);
+	close(fd);
+	(void) state;
+}
+
+static void test_ubi_scan_no_leb_map(void **state)
+{
+	struct ubi_scan_opts opts = { .threads = 1 };
+	struct mtd_dev_info mtd;
+	struct ubi_scan_info *si;
+	int fd = gen_image(&mtd);
+
+	assert_int_equal(ubi_scan(&mtd, fd, &si, &opts), 0);
+	assert_int_equal(si->ok_cnt, 9);
+	assert_null(si->lebs);
+	assert_null(si->vols);
+	assert_null(ubi_scan_get_vol(si, 0));
+	ubi_scan_free(si);
+	close(fd);
+	(void) state;
+}
+
+int main(void)
+{
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test(test_ubi_scan_leb_map),
+		cmocka_unit_test(test_ubi_scan_no_leb_map),
+	};
+
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}
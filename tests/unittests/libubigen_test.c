@@ -0,0 +1,404 @@
+#include <stdarg.h>
+#include <setjmp.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <cmocka.h>
+
+#include "mtd/ubi-media.h"
+#include "mtd/ubi-user.h"
+#include "mtd_swab.h"
+#include "libubigen.h"
+#include "crc32.h"
+
+#define PEB_SIZE	(16 * 1024)
+#define MIN_IO_SIZE	512
+#define PEB_COUNT	1024
+#define EC		7
+
+/* Volumes of the test image, their PEBs follow the layout volume and fastmap */
+static const struct {
+	int id;
+	int type;
+	int alignment;
+	long long vol_size;
+	long long bytes;
+} test_vols[] = {
+	{ 0, UBI_VID_DYNAMIC, 1,    8 * PEB_SIZE, 5 * PEB_SIZE / 2 },
+	{ 3, UBI_VID_STATIC,  2048, 4 * PEB_SIZE, 3 * PEB_SIZE / 2 },
+	{ 5, UBI_VID_DYNAMIC, 1,    2 * PEB_SIZE, 0 },
+};
+
+#define VOL_CNT (sizeof(test_vols) / sizeof(test_vols[0]))
+
+static int write_data(int fd, long long bytes)
+{
+	char buf[MIN_IO_SIZE];
+	long long i;
+
+	assert_int_equal(ftruncate(fd, 0), 0);
+	for (i = 0; i < bytes; i++) {
+		buf[i % MIN_IO_SIZE] = (char)(i * 7 + 1);
+		if (i % MIN_IO_SIZE == MIN_IO_SIZE - 1 || i == bytes - 1)
+			assert_int_equal(write(fd, buf, i % MIN_IO_SIZE + 1),
+					 i % MIN_IO_SIZE + 1);
+	}
+	return lseek(fd, 0, SEEK_SET);
+}
+
+/*
+ * Generate an image with a fastmap of the first @fm_blocks PEBs after the
+ * layout volume. Returns the image, the PEBs it does not cover are 0xFF bytes.
+ */
+static char *gen_image(struct ubigen_info *ui, int *fm_blocks,
+		       struct ubigen_vol_info *vi)
+{
+	char in_tmpl[] = "/tmp/ubigen_in_XXXXXX";
+	char out_tmpl[] = "/tmp/ubigen_out_XXXXXX";
+	int in, out, pnums[UBI_FM_MAX_BLOCKS], pnum, i;
+	long long ecs[UBI_FM_MAX_BLOCKS];
+	struct ubi_vtbl_record *vtbl;
+	struct ubigen_fastmap *fm;
+	char *img;
+	ssize_t rd;
+
+	ubigen_info_init(ui, PEB_SIZE, MIN_IO_SIZE, MIN_IO_SIZE, 0, 1, 0x1234,
+			 NULL);
+	*fm_blocks = ubigen_fm_blocks(ui, PEB_COUNT);
+	assert_true(*fm_blocks > 1);
+
+	in = mkstemp(in_tmpl);
+	out = mkstemp(out_tmpl);
+	assert_true(in >= 0 && out >= 0);
+	unlink(in_tmpl);
+	unlink(out_tmpl);
+
+	vtbl = ubigen_create_empty_vtbl(ui);
+	assert_non_null(vtbl);
+	fm = ubigen_fm_new(ui, PEB_COUNT, EC);
+	assert_non_null(fm);
+
+	pnum = UBI_LAYOUT_VOLUME_EBS + *fm_blocks;
+	for (i = 0; i < (int)VOL_CNT; i++) {
+		memset(&vi[i], 0, sizeof(struct ubigen_vol_info));
+		vi[i].id = test_vols[i].id;
+		vi[i].type = test_vols[i].type;
+		vi[i].alignment = test_vols[i].alignment;
+		vi[i].data_pad = ui->leb_size % vi[i].alignment;
+		vi[i].usable_leb_size = ui->leb_size - vi[i].data_pad;
+		vi[i].name = "test";
+		vi[i].name_len = 4;
+		vi[i].bytes = test_vols[i].vol_size;
+		vi[i].used_ebs = (test_vols[i].bytes + vi[i].usable_leb_size - 1) /
+				 vi[i].usable_leb_size;
+		assert_int_equal(ubigen_add_volume(ui, &vi[i], vtbl), 0);
+
+		assert_int_equal(write_data(in, test_vols[i].bytes), 0);
+		assert_int_equal(ubigen_write_volume_at(ui, &vi[i], EC,
+						test_vols[i].bytes, in, out,
+						(off_t)pnum * PEB_SIZE), 0);
+		assert_int_equal(ubigen_fm_add_vol(fm, &vi[i],
+						   test_vols[i].bytes, pnum, EC),
+				 0);
+		pnum += ubigen_volume_pebs(ui, &vi[i], test_vols[i].bytes);
+	}
+
+	assert_int_equal(ubigen_write_layout_vol(ui, 0, 1, EC, EC, vtbl, out),
+			 0);
+	assert_int_equal(ubigen_fm_add_vtbl(fm, vtbl, 0, 1, EC, EC), 0);
+	ubigen_fm_set_peb(fm, PEB_COUNT - 1, UBIGEN_FM_BAD, 0);
+	ubigen_fm_set_peb(fm, PEB_COUNT - 2, UBIGEN_FM_FREE, EC + 1);
+
+	for (i = 0; i < *fm_blocks; i++) {
+		pnums[i] = UBI_LAYOUT_VOLUME_EBS + i;
+		ecs[i] = EC + i;
+	}
+	assert_int_equal(ubigen_write_fastmap(ui, fm, pnums, ecs, out), 0);
+	ubigen_fm_free(fm);
+	free(vtbl);
+
+	img = malloc((size_t)PEB_COUNT * PEB_SIZE);
+	assert_non_null(img);
+	memset(img, 0xFF, (size_t)PEB_COUNT * PEB_SIZE);
+	rd = pread(out, img, (size_t)PEB_COUNT * PEB_SIZE, 0);
+	assert_true(rd >= (ssize_t)pnum * PEB_SIZE);
+
+	/* The free PEB holds an EC header only */
+	ubigen_init_ec_hdr(ui, (void *)(img + (size_t)(PEB_COUNT - 2) * PEB_SIZE),
+			   EC + 1);
+
+	close(in);
+	close(out);
+	return img;
+}
+
+static const struct ubi_ec_hdr *ec_hdr(const char *img, int pnum)
+{
+	const struct ubi_ec_hdr *hdr = (void *)(img + (size_t)pnum * PEB_SIZE);
+
+	if (be32_to_cpu(hdr->magic) != UBI_EC_HDR_MAGIC ||
+	    be32_to_cpu(hdr->hdr_crc) != mtd_crc32(UBI_CRC32_INIT, hdr,
+						    UBI_EC_HDR_SIZE_CRC))
+		return NULL;
+	return hdr;
+}
+
+static const struct ubi_vid_hdr *vid_hdr(const char *img, int pnum)
+{
+	const struct ubi_ec_hdr *ech = ec_hdr(img, pnum);
+	const struct ubi_vid_hdr *hdr;
+
+	if (!ech)
+		return NULL;
+	hdr = (void *)(img + (size_t)pnum * PEB_SIZE +
+		       be32_to_cpu(ech->vid_hdr_offset));
+	if (be32_to_cpu(hdr->magic) != UBI_VID_HDR_MAGIC ||
+	    be32_to_cpu(hdr->hdr_crc) != mtd_crc32(UBI_CRC32_INIT, hdr,
+						    UBI_VID_HDR_SIZE_CRC))
+		return NULL;
+	return hdr;
+}
+
+/*
+ * Parse the fastmap of @img the way the kernel attaches it and check it
+ * against the VID headers of the image.
+ */
+static void check_fastmap(const struct ubigen_info *ui, const char *img,
+			  int fm_blocks, const struct ubigen_vol_info *vi)
+{
+	const struct ubi_vid_hdr *vh;
+	const struct ubi_fm_sb *fmsb;
+	const struct ubi_fm_hdr *fmh;
+	const struct ubi_fm_scan_pool *pool;
+	int anchor = -1, used_blocks, i, j, pnum, counts[4], vol_cnt;
+	int mapped = 0, used_cnt;
+	size_t fm_size, pos;
+	char *raw, seen[PEB_COUNT], used[PEB_COUNT];
+
+	for (pnum = 0; pnum < UBI_FM_MAX_START; pnum++) {
+		vh = vid_hdr(img, pnum);
+		if (vh && be32_to_cpu(vh->vol_id) == UBI_FM_SB_VOLUME_ID) {
+			anchor = pnum;
+			break;
+		}
+	}
+	assert_int_equal(anchor, UBI_LAYOUT_VOLUME_EBS);
+
+	fmsb = (void *)(img + (size_t)anchor * PEB_SIZE + ui->data_offs);
+	assert_int_equal(be32_to_cpu(fmsb->magic), UBI_FM_SB_MAGIC);
+	assert_int_equal(fmsb->version, UBI_FM_FMT_VERSION);
+	used_blocks = be32_to_cpu(fmsb->used_blocks);
+	assert_int_equal(used_blocks, fm_blocks);
+	assert_int_equal(be32_to_cpu(fmsb->block_loc[0]), anchor);
+
+	fm_size = (size_t)used_blocks * ui->leb_size;
+	raw = malloc(fm_size);
+	assert_non_null(raw);
+	memset(seen, 0, sizeof(seen));
+	for (i = 0; i < used_blocks; i++) {
+		pnum = be32_to_cpu(fmsb->block_loc[i]);
+		assert_non_null(ec_hdr(img, pnum));
+		assert_int_equal(be64_to_cpu(ec_hdr(img, pnum)->ec),
+				 be32_to_cpu(fmsb->block_ec[i]));
+		vh = vid_hdr(img, pnum);
+		assert_non_null(vh);
+		assert_int_equal(be32_to_cpu(vh->vol_id),
+				 i ? UBI_FM_DATA_VOLUME_ID : UBI_FM_SB_VOLUME_ID);
+		assert_int_equal(be32_to_cpu(vh->lnum), i);
+		assert_true(be64_to_cpu(vh->sqnum) > be64_to_cpu(fmsb->sqnum));
+		memcpy(raw + (size_t)i * ui->leb_size,
+		       img + (size_t)pnum * PEB_SIZE + ui->data_offs,
+		       ui->leb_size);
+		seen[pnum] = 1;
+	}
+	/*
+	 * UBI checks the CRC of the whole fastmap, super block included, with
+	 * @data_crc zero
+	 */
+	((struct ubi_fm_sb *)raw)->data_crc = 0;
+	assert_int_equal(be32_to_cpu(fmsb->data_crc),
+			 mtd_crc32(UBI_CRC32_INIT, raw, fm_size));
+
+	pos = sizeof(*fmsb);
+	fmh = (void *)(raw + pos);
+	pos += sizeof(*fmh);
+	assert_int_equal(be32_to_cpu(fmh->magic), UBI_FM_HDR_MAGIC);
+	for (i = 0; i < 2; i++) {
+		pool = (void *)(raw + pos);
+		pos += sizeof(*pool);
+		assert_int_equal(be32_to_cpu(pool->magic), UBI_FM_POOL_MAGIC);
+		assert_int_equal(be16_to_cpu(pool->size), 0);
+		assert_true(be16_to_cpu(pool->max_size) <= UBI_FM_MAX_POOL_SIZE);
+	}
+
+	/* The free, used and erase lists */
+	counts[0] = be32_to_cpu(fmh->free_peb_count);
+	counts[1] = be32_to_cpu(fmh->used_peb_count);
+	counts[2] = be32_to_cpu(fmh->erase_peb_count);
+	counts[3] = be32_to_cpu(fmh->bad_peb_count);
+	assert_int_equal(counts[3], 1);
+	assert_int_equal(counts[0] + counts[1] + counts[2],
+			 PEB_COUNT - counts[3] - used_blocks);
+	memset(used, 0, sizeof(used));
+	for (i = 0; i < 3; i++) {
+		for (j = 0; j < counts[i]; j++) {
+			const struct ubi_fm_ec *fec = (void *)(raw + pos);
+
+			pos += sizeof(*fec);
+			assert_true(pos <= fm_size);
+			pnum = be32_to_cpu(fec->pnum);
+			assert_true(pnum >= 0 && pnum < PEB_COUNT - 1);
+			assert_false(seen[pnum]);
+			seen[pnum] = 1;
+			if (i == 2)
+				continue;
+
+			assert_non_null(ec_hdr(img, pnum));
+			assert_int_equal(be64_to_cpu(ec_hdr(img, pnum)->ec),
+					 be32_to_cpu(fec->ec));
+			if (i == 0) {
+				assert_null(vid_hdr(img, pnum));
+			} else {
+				assert_non_null(vid_hdr(img, pnum));
+				used[pnum] = 1;
+			}
+		}
+	}
+	assert_int_equal(counts[0], 1);
+
+	/* Every volume and the layout volume, with the LEBs they map */
+	vol_cnt = be32_to_cpu(fmh->vol_count);
+	assert_int_equal(vol_cnt, VOL_CNT + 1);
+	for (i = 0; i < vol_cnt; i++) {
+		const struct ubi_fm_volhdr *fvh = (void *)(raw + pos);
+		const struct ubi_fm_eba *feba;
+		int vol_id = be32_to_cpu(fvh->vol_id);
+		const struct ubigen_vol_info *v = NULL;
+
+		pos += sizeof(*fvh);
+		feba = (void *)(raw + pos);
+		assert_int_equal(be32_to_cpu(fvh->magic), UBI_FM_VHDR_MAGIC);
+		assert_int_equal(be32_to_cpu(feba->magic), UBI_FM_EBA_MAGIC);
+		pos += sizeof(*feba) +
+		       be32_to_cpu(feba->reserved_pebs) * sizeof(__be32);
+		assert_true(pos <= fm_size);
+
+		for (j = 0; j < (int)VOL_CNT; j++)
+			if (vi[j].id == vol_id)
+				v = &vi[j];
+		if (vol_id == UBI_LAYOUT_VOLUME_ID) {
+			assert_int_equal(fvh->vol_type, UBI_DYNAMIC_VOLUME);
+			assert_int_equal(be32_to_cpu(feba->reserved_pebs),
+					 UBI_LAYOUT_VOLUME_EBS);
+		} else {
+			assert_non_null(v);
+			assert_int_equal(be32_to_cpu(fvh->data_pad), v->data_pad);
+		}
+
+		if (v && v->type == UBI_VID_STATIC) {
+			assert_int_equal(fvh->vol_type, UBI_STATIC_VOLUME);
+			assert_int_equal(be32_to_cpu(fvh->used_ebs), 2);
+			assert_int_equal(be32_to_cpu(fvh->last_eb_bytes),
+					 3 * PEB_SIZE / 2 - v->usable_leb_size);
+		} else if (v) {
+			assert_int_equal(fvh->vol_type, UBI_DYNAMIC_VOLUME);
+			assert_int_equal(be32_to_cpu(fvh->last_eb_bytes),
+					 v->usable_leb_size);
+		}
+
+		for (j = 0; j < (int)be32_to_cpu(feba->reserved_pebs); j++) {
+			pnum = be32_to_cpu(feba->pnum[j]);
+			if (pnum == -1)
+				continue;
+
+			assert_true(used[pnum]);
+			used[pnum] = 0;
+			vh = vid_hdr(img, pnum);
+			assert_int_equal(be32_to_cpu(vh->vol_id), vol_id);
+			assert_int_equal(be32_to_cpu(vh->lnum), j);
+			mapped += 1;
+		}
+	}
+
+	/* Every used PEB is mapped once */
+	used_cnt = UBI_LAYOUT_VOLUME_EBS;
+	for (i = 0; i < (int)VOL_CNT; i++)
+		used_cnt += ubigen_volume_pebs(ui, &vi[i], test_vols[i].bytes);
+	assert_int_equal(counts[1], used_cnt);
+	assert_int_equal(mapped, used_cnt);
+
+	free(raw);
+}
+
+static void test_ubigen_fastmap(void **state)
+{
+	struct ubigen_vol_info vi[VOL_CNT];
+	struct ubigen_info ui;
+	int fm_blocks;
+	char *img;
+
+	img = gen_image(&ui, &fm_blocks, vi);
+	check_fastmap(&ui, img, fm_blocks, vi);
+	free(img);
+	(void) state;
+}
+
+/* A fastmap made from the PEBs of an image is the same as ubinize makes */
+static void test_ubigen_fastmap_from_pebs(void **state)
+{
+	int fm_blocks, pnums[UBI_FM_MAX_BLOCKS], pnum, i;
+	long long ecs[UBI_FM_MAX_BLOCKS];
+	struct ubigen_vol_info vi[VOL_CNT];
+	struct ubigen_fastmap *fm;
+	struct ubigen_info ui;
+	char *img, *pebs;
+
+	img = gen_image(&ui, &fm_blocks, vi);
+
+	fm = ubigen_fm_new(&ui, PEB_COUNT, EC);
+	assert_non_null(fm);
+	for (pnum = 0; pnum < PEB_COUNT - 1; pnum++) {
+		const struct ubi_ec_hdr *ech = ec_hdr(img, pnum);
+
+		if (pnum >= UBI_LAYOUT_VOLUME_EBS &&
+		    pnum < UBI_LAYOUT_VOLUME_EBS + fm_blocks)
+			continue;
+		if (!ech)
+			continue;
+		assert_int_equal(ubigen_fm_add_peb(fm, pnum,
+				be64_to_cpu(ech->ec),
+				img + (size_t)pnum * PEB_SIZE), 0);
+	}
+	ubigen_fm_set_peb(fm, PEB_COUNT - 1, UBIGEN_FM_BAD, 0);
+
+	for (i = 0; i < fm_blocks; i++) {
+		pnums[i] = UBI_LAYOUT_VOLUME_EBS + i;
+		ecs[i] = EC + i;
+	}
+	pebs = ubigen_fm_build(fm, pnums, ecs);
+	assert_non_null(pebs);
+	assert_memory_equal(pebs, img + (size_t)pnums[0] * PEB_SIZE,
+			    (size_t)fm_blocks * PEB_SIZE);
+
+	/* The fastmap PEBs cannot hold LEBs */
+	pnums[0] = 0;
+	assert_null(ubigen_fm_build(fm, pnums, ecs));
+
+	free(pebs);
+	ubigen_fm_free(fm);
+	free(img);
+	(void) state;
+}
+
+int main(void)
+{
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test(test_ubigen_fastmap),
+		cmocka_unit_test(test_ubigen_fastmap_from_pebs),
+	};
+
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}
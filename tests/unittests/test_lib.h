@@ -9,6 +9,7 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <sys/ioctl.h>
+#include <sys/uio.h>
 #include <cmocka.h>
 
 int __real_open(const char*, mode_t);
@@ -96,6 +97,36 @@ off_t __wrap_lseek(int fd, off_t seek, int whence)
 	return mock_type(off_t);
 }
 
+ssize_t __wrap_pread(int fd, void *buf, size_t len, off_t offs)
+{
+	assert_true(fd > 0);
+	assert_non_null(buf);
+	check_expected(len);
+	check_expected(offs);
+	return mock_type(ssize_t);
+}
+
+ssize_t __wrap_pwrite(int fd, const void *buf, size_t len, off_t offs)
+{
+	assert_true(fd > 0);
+	assert_non_null(buf);
+	void *expected_buf = mock_type(void*);
+	size_t expected_len = mock_type(size_t);
+	assert_int_equal(expected_len, len);
+	assert_memory_equal(expected_buf, buf, expected_len);
+	check_expected(offs);
+	return mock_type(ssize_t);
+}
+
+ssize_t __wrap_preadv(int fd, const struct iovec *iov, int iovcnt, off_t offs)
+{
+	assert_true(fd > 0);
+	assert_non_null(iov);
+	check_expected(iovcnt);
+	check_expected(offs);
+	return mock_type(ssize_t);
+}
+
 #define expect_open(X,Y,Z) do { \
 		expect_string(__wrap_open, path, X);\
 		will_return(__wrap_open, Y);\
@@ -138,6 +169,25 @@ off_t __wrap_lseek(int fd, off_t seek, int whence)
 		will_return(__wrap_lseek, Z);\
 	} while(0);
 
+#define expect_pread(X,Y,Z) do { \
+		expect_value(__wrap_pread, len, X);\
+		expect_value(__wrap_pread, offs, Y);\
+		will_return(__wrap_pread, Z);\
+	} while(0);
+
+#define expect_pwrite(W,X,Y,Z) do { \
+		will_return(__wrap_pwrite, W);\
+		will_return(__wrap_pwrite, X);\
+		expect_value(__wrap_pwrite, offs, Y);\
+		will_return(__wrap_pwrite, Z);\
+	} while(0);
+
+#define expect_preadv(X,Y,Z) do { \
+		expect_value(__wrap_preadv, iovcnt, X);\
+		expect_value(__wrap_preadv, offs, Y);\
+		will_return(__wrap_preadv, Z);\
+	} while(0);
+
 #define expect_read(X,Y) do { \
 		expect_value(__wrap_read, len, X);\
 		will_return(__wrap_read, Y);\
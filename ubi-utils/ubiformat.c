@@ -37,6 +37,7 @@
 #include <stdlib.h>
 #include <getopt.h>
 #include <fcntl.h>
+#include <pthread.h>
 
 #include <libubi.h>
 #include <libmtd.h>
@@ -53,14 +54,21 @@ struct args {
 	unsigned int verbose:1;
 	unsigned int override_ec:1;
 	unsigned int novtbl:1;
+	unsigned int scan_cache:1;
+	unsigned int diff:1;
+	unsigned int image_seq_set:1;
+	unsigned int fastmap:1;
 	unsigned int manual_subpage;
 	int subpage_size;
 	int vid_hdr_offs;
 	int ubi_ver;
+	int scan_threads;
+	int aio_depth;
 	uint32_t image_seq;
 	off_t image_sz;
 	long long ec;
 	const char *image;
+	const char *ffmap;
 	const char *node;
 	int node_fd;
 };
@@ -86,12 +94,29 @@ static const char optionsstr[] =
 "                             counters, do not write empty volume table\n"
 "-f, --flash-image=<file>     flash image file, or '-' for stdin\n"
 "-S, --image-size=<bytes>     bytes in input, if not reading from file\n"
+"    --ff-map=<file>          the flash image is a sparse image described by\n"
+"                             the ff-map <file>, the regions it does not list\n"
+"                             are 0xFF bytes; a sparse image is refused\n"
+"                             without its ff-map\n"
+"    --fastmap                write a fastmap describing the flashed image,\n"
+"                             so that UBI attaches without scanning\n"
+"-d, --diff                   do not erase and write eraseblocks which already\n"
+"                             contain the same data as the flash image (the\n"
+"                             image sequence number on flash is kept unless\n"
+"                             -Q is used)\n"
 "-e, --erase-counter=<value>  use <value> as the erase counter value for all\n"
 "                             eraseblocks\n"
 "-x, --ubi-ver=<num>          UBI version number to put to EC headers\n"
 "                             (default is 1)\n"
 "-Q, --image-seq=<num>        32-bit UBI image sequence number to use\n"
 "                             (by default a random number is picked)\n"
+"-t, --scan-threads=<num>     read erase counter headers with <num> threads\n"
+"                             in parallel (default is 1)\n"
+"-C, --scan-cache             re-use the scanning results of the previous\n"
+"                             run if the flash has not changed since, and\n"
+"                             save them for the next run\n"
+"-a, --aio=<depth>            write erase counter headers with asynchronous\n"
+"                             I/O, keeping up to <depth> writes in flight\n"
 "-y, --yes                    assume the answer is \"yes\" for all question\n"
 "                             this program would otherwise ask\n"
 "-q, --quiet                  suppress progress percentage information\n"
@@ -101,10 +126,14 @@ static const char optionsstr[] =
 
 static const char usage[] =
 "Usage: " PROGRAM_NAME " <MTD device node file name> [-s <bytes>] [-O <offs>] [-n]\n"
-"\t\t\t[-Q <num>] [-f <file>] [-S <bytes>] [-e <value>] [-x <num>] [-y] [-q] [-v] [-h]\n"
+"\t\t\t[-Q <num>] [-f <file>] [-S <bytes>] [-e <value>] [-x <num>] [-t <num>]\n"
+"\t\t\t[-a <depth>] [-d] [-C] [-y] [-q] [-v] [-h]\n"
 "\t\t\t[--sub-page-size=<bytes>] [--vid-hdr-offset=<offs>] [--no-volume-table]\n"
 "\t\t\t[--flash-image=<file>] [--image-size=<bytes>] [--erase-counter=<value>]\n"
-"\t\t\t[--image-seq=<num>] [--ubi-ver=<num>] [--yes] [--quiet] [--verbose]\n"
+"\t\t\t[--image-seq=<num>] [--ubi-ver=<num>] [--scan-threads=<num>]\n"
+"\t\t\t[--diff] [--scan-cache] [--aio=<depth>] [--ff-map=<file>]\n"
+"\t\t\t[--fastmap]\n"
+"\t\t\t[--yes] [--quiet] [--verbose]\n"
 "\t\t\t[--help] [--version]\n\n"
 "Example 1: " PROGRAM_NAME " /dev/mtd0 -y - format MTD device number 0 and do\n"
 "           not ask questions.\n"
@@ -112,35 +141,82 @@ static const char usage[] =
 "           be quiet and force erase counter value 0.";
 
 static const struct option long_options[] = {
+	/* Order matters for opts w/val=0; see option_index below. */
+	{ .name = "ff-map",          .has_arg = 1, .flag = NULL, .val = 0 },
+	{ .name = "fastmap",         .has_arg = 0, .flag = NULL, .val = 0 },
 	{ .name = "sub-page-size",   .has_arg = 1, .flag = NULL, .val = 's' },
 	{ .name = "vid-hdr-offset",  .has_arg = 1, .flag = NULL, .val = 'O' },
 	{ .name = "no-volume-table", .has_arg = 0, .flag = NULL, .val = 'n' },
 	{ .name = "flash-image",     .has_arg = 1, .flag = NULL, .val = 'f' },
 	{ .name = "image-size",      .has_arg = 1, .flag = NULL, .val = 'S' },
+	{ .name = "diff",            .has_arg = 0, .flag = NULL, .val = 'd' },
 	{ .name = "yes",             .has_arg = 0, .flag = NULL, .val = 'y' },
 	{ .name = "erase-counter",   .has_arg = 1, .flag = NULL, .val = 'e' },
 	{ .name = "quiet",           .has_arg = 0, .flag = NULL, .val = 'q' },
 	{ .name = "verbose",         .has_arg = 0, .flag = NULL, .val = 'v' },
 	{ .name = "ubi-ver",         .has_arg = 1, .flag = NULL, .val = 'x' },
+	{ .name = "scan-threads",    .has_arg = 1, .flag = NULL, .val = 't' },
+	{ .name = "scan-cache",      .has_arg = 0, .flag = NULL, .val = 'C' },
+	{ .name = "aio",             .has_arg = 1, .flag = NULL, .val = 'a' },
 	{ .name = "help",            .has_arg = 0, .flag = NULL, .val = 'h' },
 	{ .name = "version",         .has_arg = 0, .flag = NULL, .val = 'V' },
 	{ NULL, 0, NULL, 0},
 };
 
+/*
+ * Turn an image eraseblock which belongs to a fastmap into a free one. A
+ * fastmap in the image describes the image as it was generated, which is
+ * not what the flash holds once bad eraseblocks were skipped and the erase
+ * counters changed.
+ */
+static void drop_fastmap(const struct mtd_dev_info *mtd, void *buf)
+{
+	const struct ubi_ec_hdr *ec_hdr = buf;
+	const struct ubi_vid_hdr *vid_hdr;
+	int vid_hdr_offs, vol_id;
+
+	if (be32_to_cpu(ec_hdr->magic) != UBI_EC_HDR_MAGIC)
+		return;
+
+	vid_hdr_offs = be32_to_cpu(ec_hdr->vid_hdr_offset);
+	if (vid_hdr_offs < UBI_EC_HDR_SIZE ||
+	    vid_hdr_offs > mtd->eb_size - UBI_VID_HDR_SIZE)
+		return;
+
+	vid_hdr = buf + vid_hdr_offs;
+	vol_id = be32_to_cpu(vid_hdr->vol_id);
+	if (be32_to_cpu(vid_hdr->magic) != UBI_VID_HDR_MAGIC ||
+	    (vol_id != UBI_FM_SB_VOLUME_ID && vol_id != UBI_FM_DATA_VOLUME_ID))
+		return;
+
+	memset(buf + vid_hdr_offs, 0xFF, mtd->eb_size - vid_hdr_offs);
+}
+
 static int parse_opt(int argc, char * const argv[])
 {
 	util_srand();
 	args.image_seq = rand();
 
 	while (1) {
-		int key, error = 0;
+		int option_index, key, error = 0;
 		unsigned long int image_seq;
 
-		key = getopt_long(argc, argv, "nh?Vyqve:x:s:O:f:S:", long_options, NULL);
+		key = getopt_long(argc, argv, "nh?VyqvdCe:x:s:O:f:S:t:a:",
+				  long_options, &option_index);
 		if (key == -1)
 			break;
 
 		switch (key) {
+		case 0:
+			switch (option_index) {
+			case 0: /* --ff-map */
+				args.ffmap = optarg;
+				break;
+			case 1: /* --fastmap */
+				args.fastmap = 1;
+				break;
+			}
+			break;
 		case 's':
 			args.subpage_size = util_get_bytes(optarg);
 			if (args.subpage_size <= 0)
@@ -178,6 +254,10 @@ static int parse_opt(int argc, char * const argv[])
 			args.novtbl = 1;
 			break;
 
+		case 'd':
+			args.diff = 1;
+			break;
+
 		case 'y':
 			args.yes = 1;
 			break;
@@ -192,11 +272,28 @@ static int parse_opt(int argc, char * const argv[])
 				return errmsg("bad UBI version: \"%s\"", optarg);
 			break;
 
+		case 't':
+			args.scan_threads = simple_strtoul(optarg, &error);
+			if (error || args.scan_threads <= 0)
+				return errmsg("bad scan thread count: \"%s\"", optarg);
+			break;
+
+		case 'C':
+			args.scan_cache = 1;
+			break;
+
+		case 'a':
+			args.aio_depth = simple_strtoul(optarg, &error);
+			if (error || args.aio_depth <= 0)
+				return errmsg("bad asynchronous I/O queue depth: \"%s\"", optarg);
+			break;
+
 		case 'Q':
 			image_seq = simple_strtoul(optarg, &error);
 			if (error || image_seq > 0xFFFFFFFF)
 				return errmsg("bad UBI image sequence number: \"%s\"", optarg);
 			args.image_seq = image_seq;
+			args.image_seq_set = 1;
 			break;
 
 
@@ -235,6 +332,15 @@ static int parse_opt(int argc, char * const argv[])
 	if (args.image && args.novtbl)
 		return errmsg("-n cannot be used together with -f");
 
+	if (args.diff && !args.image)
+		return errmsg("-d can only be used together with -f");
+
+	if (args.ffmap && !args.image)
+		return errmsg("--ff-map can only be used together with -f");
+
+	if (args.fastmap && !args.image)
+		return errmsg("--fastmap can only be used together with -f");
+
 
 	args.node = argv[optind];
 	return 0;
@@ -414,11 +520,438 @@ static int mark_bad(const struct mtd_dev_info *mtd, struct ubi_scan_info *si, in
 	return consecutive_bad_check(eb);
 }
 
+/**
+ * struct fastmap - the fastmap written with '--fastmap'.
+ * @fm: the fastmap being generated, %NULL if there is none
+ * @blocks: count of eraseblocks of the fastmap
+ * @pnums: eraseblocks of the fastmap, the first one is the anchor
+ * @ecs: erase counters of the fastmap eraseblocks
+ * @scan_ecs: what the scanning found in the fastmap eraseblocks
+ *
+ * The fastmap eraseblocks are the first good ones, so that the anchor is
+ * where UBI looks for it. They are hidden as bad eraseblocks while the image
+ * is flashed and the rest of the flash is formatted, and written last.
+ */
+static struct {
+	struct ubigen_fastmap *fm;
+	int blocks;
+	int pnums[UBI_FM_MAX_BLOCKS];
+	long long ecs[UBI_FM_MAX_BLOCKS];
+	uint32_t scan_ecs[UBI_FM_MAX_BLOCKS];
+} fastmap;
+
+static int fastmap_reserve(const struct mtd_dev_info *mtd,
+			   const struct ubigen_info *ui,
+			   struct ubi_scan_info *si)
+{
+	long long ec = args.override_ec ? args.ec : si->mean_ec;
+	int eb, i = 0;
+
+	fastmap.blocks = ubigen_fm_blocks(ui, mtd->eb_cnt);
+	if (fastmap.blocks < 0)
+		return -1;
+
+	for (eb = 0; eb < mtd->eb_cnt && i < fastmap.blocks; eb++) {
+		if (si->ec[eb] == EB_BAD)
+			continue;
+		if (i == 0 && eb >= UBI_FM_MAX_START)
+			return errmsg("no good eraseblock among the first %d for the fastmap anchor",
+				      UBI_FM_MAX_START);
+		fastmap.pnums[i] = eb;
+		fastmap.scan_ecs[i] = si->ec[eb];
+		i += 1;
+	}
+
+	if (si->good_cnt - fastmap.blocks < 2)
+		return errmsg("too few non-bad eraseblocks (%d) on mtd%d for a %d eraseblocks fastmap",
+			      si->good_cnt, mtd->mtd_num, fastmap.blocks);
+
+	fastmap.fm = ubigen_fm_new(ui, mtd->eb_cnt, ec);
+	if (!fastmap.fm)
+		return -1;
+
+	for (i = 0; i < fastmap.blocks; i++)
+		si->ec[fastmap.pnums[i]] = EB_BAD;
+	si->good_cnt -= fastmap.blocks;
+
+	verbose(args.verbose, "reserved eraseblocks %d-%d for a fastmap of %d eraseblocks",
+		fastmap.pnums[0], fastmap.pnums[fastmap.blocks - 1],
+		fastmap.blocks);
+	return 0;
+}
+
+/* Give up writing the fastmap, UBI will have to scan the flash */
+static void fastmap_drop(void)
+{
+	if (!fastmap.fm)
+		return;
+
+	warnmsg("no fastmap is written, the flash will be attached by scanning");
+	ubigen_fm_free(fastmap.fm);
+	fastmap.fm = NULL;
+}
+
+/* Eraseblock @eb got an image eraseblock with erase counter @ec */
+static void fastmap_add(int eb, long long ec, const void *buf)
+{
+	if (fastmap.fm && ubigen_fm_add_peb(fastmap.fm, eb, ec, buf))
+		fastmap_drop();
+}
+
+/*
+ * Erase eraseblock @eb and write an EC header with erase counter @ec to it.
+ * Returns %0 on success and %-1 on failure.
+ */
+static int fastmap_write_ec(libmtd_t libmtd, const struct mtd_dev_info *mtd,
+			    const struct ubigen_info *ui, int eb,
+			    long long ec, void *buf)
+{
+	int write_size;
+
+	write_size = UBI_EC_HDR_SIZE + mtd->subpage_size - 1;
+	write_size /= mtd->subpage_size;
+	write_size *= mtd->subpage_size;
+
+	memset(buf, 0xFF, write_size);
+	ubigen_init_ec_hdr(ui, buf, ec);
+	if (mtd_erase(libmtd, mtd, args.node_fd, eb) ||
+	    mtd_write(libmtd, mtd, args.node_fd, eb, 0, buf, write_size,
+		      NULL, 0, 0))
+		return sys_errmsg("cannot write EC header to eraseblock %d", eb);
+	return 0;
+}
+
+/**
+ * fastmap_write - write the fastmap.
+ * @libmtd: MTD library descriptor
+ * @mtd: the MTD device
+ * @ui: libubigen information
+ * @si: scanning information
+ * @start_eb: first eraseblock formatted after the image
+ *
+ * The eraseblocks after @start_eb are free unless they are bad, the ones
+ * before it were given to 'fastmap_add()'. Failing to write the fastmap is
+ * not fatal, its eraseblocks get just EC headers then. The anchor is written
+ * last, so UBI ignores a fastmap which is not complete.
+ */
+static int fastmap_write(libmtd_t libmtd, const struct mtd_dev_info *mtd,
+			 const struct ubigen_info *ui, struct ubi_scan_info *si,
+			 int start_eb)
+{
+	int eb, i, err = 0, written = 0;
+	char *pebs = NULL, *buf;
+
+	buf = malloc(mtd->eb_size);
+	if (!buf)
+		return sys_errmsg("cannot allocate %d bytes of memory",
+				  mtd->eb_size);
+
+	for (i = 0; i < fastmap.blocks; i++) {
+		eb = fastmap.pnums[i];
+		si->ec[eb] = fastmap.scan_ecs[i];
+		if (args.override_ec)
+			fastmap.ecs[i] = args.ec;
+		else if (si->ec[eb] <= EC_MAX)
+			fastmap.ecs[i] = si->ec[eb] + 1;
+		else
+			fastmap.ecs[i] = si->mean_ec;
+	}
+	si->good_cnt += fastmap.blocks;
+
+	if (!fastmap.fm)
+		goto out_ec;
+
+	for (eb = 0; eb < mtd->eb_cnt; eb++) {
+		if (si->ec[eb] == EB_BAD)
+			ubigen_fm_set_peb(fastmap.fm, eb, UBIGEN_FM_BAD, 0);
+		else if (eb < start_eb)
+			continue;
+		else if (si->ec[eb] <= EC_MAX)
+			ubigen_fm_set_peb(fastmap.fm, eb, UBIGEN_FM_FREE,
+					  si->ec[eb]);
+		else
+			ubigen_fm_set_peb(fastmap.fm, eb, UBIGEN_FM_ERASE,
+					  si->mean_ec);
+	}
+
+	pebs = ubigen_fm_build(fastmap.fm, fastmap.pnums, fastmap.ecs);
+	if (!pebs) {
+		fastmap_drop();
+		goto out_ec;
+	}
+
+	/* The data eraseblocks go first and the anchor last */
+	for (written = 0; written < fastmap.blocks; written++) {
+		char *peb;
+		int len;
+
+		i = (written + 1) % fastmap.blocks;
+		eb = fastmap.pnums[i];
+		peb = pebs + (size_t)i * mtd->eb_size;
+		len = drop_ffs(mtd, peb, mtd->eb_size);
+
+		verbose(args.verbose, "write fastmap eraseblock %d to eraseblock %d",
+			i, eb);
+		if (mtd_erase(libmtd, mtd, args.node_fd, eb) ||
+		    mtd_write(libmtd, mtd, args.node_fd, eb, 0, peb, len,
+			      NULL, 0, 0)) {
+			sys_errmsg("cannot write fastmap to eraseblock %d", eb);
+			fastmap_drop();
+			break;
+		}
+		si->ec[eb] = fastmap.ecs[i];
+	}
+
+	if (written == fastmap.blocks) {
+		if (!args.quiet)
+			normsg("wrote a fastmap of %d eraseblocks", fastmap.blocks);
+		goto out;
+	}
+
+out_ec:
+	/*
+	 * The fastmap data eraseblocks which are written already are deleted
+	 * by UBI, since there is no anchor.
+	 */
+	for (; written < fastmap.blocks; written++) {
+		i = (written + 1) % fastmap.blocks;
+		eb = fastmap.pnums[i];
+		if (fastmap_write_ec(libmtd, mtd, ui, eb, fastmap.ecs[i], buf)) {
+			err = -1;
+			continue;
+		}
+		si->ec[eb] = fastmap.ecs[i];
+	}
+
+out:
+	ubigen_fm_free(fastmap.fm);
+	fastmap.fm = NULL;
+	free(pebs);
+	free(buf);
+	return err;
+}
+
+/* How many image eraseblocks may be read ahead of the one being written */
+#define FLASH_RING_SIZE 4
+
+/* How many good eraseblocks may be erased ahead of the one being written */
+#define FLASH_ERASE_AHEAD 4
+
+/* Eraseblock states of 'struct flash_pipe' besides errno values */
+#define FLASH_ERASED   0
+#define FLASH_PENDING -1
+#define FLASH_SAME    -2
+
+/**
+ * struct flash_pipe - state shared by the stages of 'flash_image()'.
+ * @libmtd: MTD library descriptor
+ * @mtd: the MTD device to flash
+ * @si: scanning information, the eraser skips bad eraseblocks in it
+ * @fd: image file descriptor
+ * @ffmap: erased-region map of the image, %NULL if there is none
+ * @img_ebs: count of eraseblocks in the image
+ * @diff: compare eraseblocks with the image before erasing them
+ * @image_seq: image sequence number an unchanged eraseblock must have
+ * @cmp_buf: buffer the eraser reads eraseblocks to in differential mode
+ * @lock: protects all the fields below
+ * @cond: broadcasted whenever a stage makes progress or has to stop
+ * @bufs: ring of image eraseblock buffers
+ * @read_cnt: count of image eraseblocks read so far
+ * @read_err: errno of the failed image read, %0 if reading did not fail
+ * @written: count of image eraseblocks written so far, the reader may re-use
+ *           their buffers
+ * @erase_err: per-eraseblock state: %FLASH_PENDING, %FLASH_ERASED,
+ *             %FLASH_SAME or the errno of the failed erasure
+ * @chunk: per-eraseblock image eraseblock the state was prepared for
+ * @next_chunk: image eraseblock the next good eraseblock will get
+ * @erased_ahead: count of prepared eraseblocks the writer is not done with
+ * @stop: tells the reader and the eraser to stop
+ *
+ * The reader fills @bufs with the image while the eraser erases the good
+ * eraseblocks ahead of the writer, which is the thread calling
+ * 'flash_image()'. Only the writer handles errors, marks eraseblocks as bad or
+ * prints anything, so the output is the same as without the pipeline.
+ *
+ * In differential mode the eraser first compares the eraseblock with the
+ * image eraseblock it is going to get and leaves it alone if they match
+ * (%FLASH_SAME). A failed write makes the following eraseblocks get an earlier
+ * image eraseblock than they were compared with, the writer erases such
+ * eraseblocks itself.
+ */
+struct flash_pipe {
+	libmtd_t libmtd;
+	const struct mtd_dev_info *mtd;
+	const struct ubi_scan_info *si;
+	int fd;
+	struct ffmap *ffmap;
+	int img_ebs;
+	int diff;
+	uint32_t image_seq;
+	void *cmp_buf;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	char *bufs[FLASH_RING_SIZE];
+	int read_cnt;
+	int read_err;
+	int written;
+	int *erase_err;
+	int *chunk;
+	int next_chunk;
+	int erased_ahead;
+	int stop;
+};
+
+static void *flash_reader(void *arg)
+{
+	struct flash_pipe *p = arg;
+	int i, err, stop;
+
+	/* Reading from a pipe may block forever, only allow cancelling there */
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+	for (i = 0; i < p->img_ebs; i++) {
+		pthread_mutex_lock(&p->lock);
+		while (!p->stop && i >= p->written + FLASH_RING_SIZE)
+			pthread_cond_wait(&p->cond, &p->lock);
+		stop = p->stop;
+		pthread_mutex_unlock(&p->lock);
+		if (stop)
+			break;
+
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+		errno = 0;
+		err = read_all(p->fd, p->bufs[i % FLASH_RING_SIZE],
+			       p->mtd->eb_size);
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+		if (!err && p->ffmap)
+			ffmap_fill(p->ffmap, p->bufs[i % FLASH_RING_SIZE],
+				   p->mtd->eb_size, (off_t)i * p->mtd->eb_size);
+		if (!err)
+			drop_fastmap(p->mtd, p->bufs[i % FLASH_RING_SIZE]);
+
+		pthread_mutex_lock(&p->lock);
+		if (err)
+			p->read_err = errno ? errno : EIO;
+		else
+			p->read_cnt += 1;
+		pthread_cond_broadcast(&p->cond);
+		pthread_mutex_unlock(&p->lock);
+		if (err)
+			break;
+	}
+
+	return NULL;
+}
+
+/*
+ * Check whether eraseblock @eb contains image eraseblock @img, apart from the
+ * erase counter. The writer may be changing the erase counter, image sequence
+ * number and CRC of the EC header in @img meanwhile, so those are not looked
+ * at.
+ */
+static int flash_same(struct flash_pipe *p, int eb, const void *img)
+{
+	const struct mtd_dev_info *mtd = p->mtd;
+	const struct ubi_ec_hdr *ih = img, *fh = p->cmp_buf;
+	off_t seek = (off_t)eb * mtd->eb_size;
+	int rd = 0;
+	uint32_t crc;
+
+	while (rd < mtd->eb_size) {
+		ssize_t ret = pread(args.node_fd, p->cmp_buf + rd,
+				    mtd->eb_size - rd, seek + rd);
+
+		if (ret <= 0)
+			return 0;
+		rd += ret;
+	}
+
+	if (be32_to_cpu(fh->magic) != UBI_EC_HDR_MAGIC)
+		return 0;
+	crc = mtd_crc32(UBI_CRC32_INIT, fh, UBI_EC_HDR_SIZE_CRC);
+	if (be32_to_cpu(fh->hdr_crc) != crc)
+		return 0;
+
+	if (be32_to_cpu(fh->image_seq) != p->image_seq ||
+	    ih->magic != fh->magic || ih->version != fh->version ||
+	    ih->vid_hdr_offset != fh->vid_hdr_offset ||
+	    ih->data_offset != fh->data_offset)
+		return 0;
+
+	return !memcmp(img + UBI_EC_HDR_SIZE, p->cmp_buf + UBI_EC_HDR_SIZE,
+		       mtd->eb_size - UBI_EC_HDR_SIZE);
+}
+
+static void *flash_eraser(void *arg)
+{
+	struct flash_pipe *p = arg;
+	const struct mtd_dev_info *mtd = p->mtd;
+	int eb, err, stop, chunk, have;
+
+	for (eb = 0; eb < mtd->eb_cnt; eb++) {
+		if (p->si->ec[eb] == EB_BAD)
+			continue;
+
+		/* Do not erase more than the rest of the image needs */
+		pthread_mutex_lock(&p->lock);
+		while (!p->stop && (p->erased_ahead >= FLASH_ERASE_AHEAD ||
+				    p->erased_ahead >= p->img_ebs - p->written))
+			pthread_cond_wait(&p->cond, &p->lock);
+		chunk = p->next_chunk;
+		while (p->diff && !p->stop && p->read_cnt <= chunk &&
+		       !p->read_err)
+			pthread_cond_wait(&p->cond, &p->lock);
+		have = p->read_cnt > chunk;
+		stop = p->stop;
+		pthread_mutex_unlock(&p->lock);
+		if (stop)
+			break;
+
+		if (p->diff && have &&
+		    flash_same(p, eb, p->bufs[chunk % FLASH_RING_SIZE]))
+			err = FLASH_SAME;
+		else if (mtd_erase(p->libmtd, mtd, args.node_fd, eb))
+			err = errno;
+		else
+			err = FLASH_ERASED;
+
+		pthread_mutex_lock(&p->lock);
+		p->erase_err[eb] = err;
+		p->chunk[eb] = chunk;
+		if (err <= 0) {
+			p->erased_ahead += 1;
+			p->next_chunk += 1;
+		}
+		pthread_cond_broadcast(&p->cond);
+		pthread_mutex_unlock(&p->lock);
+	}
+
+	return NULL;
+}
+
+/*
+ * The writer is done with a prepared eraseblock, @written tells whether it
+ * consumed an image eraseblock.
+ */
+static void flash_done(struct flash_pipe *p, int written)
+{
+	pthread_mutex_lock(&p->lock);
+	p->erased_ahead -= 1;
+	if (written)
+		p->written += 1;
+	else
+		p->next_chunk -= 1;
+	pthread_cond_broadcast(&p->cond);
+	pthread_mutex_unlock(&p->lock);
+}
+
 static int flash_image(libmtd_t libmtd, const struct mtd_dev_info *mtd,
 		       const struct ubigen_info *ui, struct ubi_scan_info *si)
 {
-	int fd, img_ebs, eb, written_ebs = 0, divisor, skip_data_read = 0;
+	int fd, img_ebs, eb, i, written_ebs = 0, divisor, ret = -1, same = 0;
 	off_t st_size;
+	struct flash_pipe p;
+	pthread_t reader, eraser;
 
 	fd = open_file(&st_size);
 	if (fd < 0)
@@ -438,11 +971,76 @@ static int flash_image(libmtd_t libmtd, const struct mtd_dev_info *mtd,
 		goto out_close;
 	}
 
+	memset(&p, 0, sizeof(struct flash_pipe));
+	p.libmtd = libmtd;
+	p.mtd = mtd;
+	p.si = si;
+	p.fd = fd;
+	p.img_ebs = img_ebs;
+	p.diff = args.diff;
+	p.image_seq = ui->image_seq;
+	if (args.ffmap) {
+		p.ffmap = ffmap_load(args.ffmap);
+		if (!p.ffmap)
+			goto out_free;
+		if (p.ffmap->size != st_size) {
+			errmsg("ff-map \"%s\" is for a %lld bytes image, \"%s\" has %lld bytes",
+			       args.ffmap, (long long)p.ffmap->size, args.image,
+			       (long long)st_size);
+			goto out_free;
+		}
+	} else if (ffmap_check_holes(fd, args.image)) {
+		goto out_free;
+	}
+	for (i = 0; i < FLASH_RING_SIZE; i++) {
+		p.bufs[i] = malloc(mtd->eb_size);
+		if (!p.bufs[i]) {
+			sys_errmsg("cannot allocate %d bytes of memory",
+				   mtd->eb_size);
+			goto out_free;
+		}
+	}
+	p.erase_err = malloc(mtd->eb_cnt * sizeof(int));
+	p.chunk = malloc(mtd->eb_cnt * sizeof(int));
+	if (!p.erase_err || !p.chunk) {
+		sys_errmsg("cannot allocate %zd bytes of memory",
+			   mtd->eb_cnt * sizeof(int));
+		goto out_free;
+	}
+	for (i = 0; i < mtd->eb_cnt; i++)
+		p.erase_err[i] = FLASH_PENDING;
+	if (p.diff) {
+		p.cmp_buf = malloc(mtd->eb_size);
+		if (!p.cmp_buf) {
+			sys_errmsg("cannot allocate %d bytes of memory",
+				   mtd->eb_size);
+			goto out_free;
+		}
+	}
+
+	pthread_mutex_init(&p.lock, NULL);
+	pthread_cond_init(&p.cond, NULL);
+	errno = pthread_create(&reader, NULL, flash_reader, &p);
+	if (errno) {
+		sys_errmsg("cannot create image reading thread");
+		goto out_destroy;
+	}
+	errno = pthread_create(&eraser, NULL, flash_eraser, &p);
+	if (errno) {
+		sys_errmsg("cannot create erasing thread");
+		pthread_mutex_lock(&p.lock);
+		p.stop = 1;
+		pthread_cond_broadcast(&p.cond);
+		pthread_mutex_unlock(&p.lock);
+		pthread_cancel(reader);
+		goto out_join_reader;
+	}
+
 	verbose(args.verbose, "will write %d eraseblocks", img_ebs);
 	divisor = img_ebs;
 	for (eb = 0; eb < mtd->eb_cnt; eb++) {
-		int err, new_len;
-		char buf[mtd->eb_size];
+		int err, new_len, chunk;
+		char *buf;
 		long long ec;
 
 		if (!args.quiet && !args.verbose) {
@@ -456,35 +1054,72 @@ static int flash_image(libmtd_t libmtd, const struct mtd_dev_info *mtd,
 			continue;
 		}
 
+		pthread_mutex_lock(&p.lock);
+		while (p.erase_err[eb] == FLASH_PENDING)
+			pthread_cond_wait(&p.cond, &p.lock);
+		err = p.erase_err[eb];
+		chunk = p.chunk[eb];
+		pthread_mutex_unlock(&p.lock);
+
+		if (err == FLASH_SAME && chunk == written_ebs) {
+			if (args.verbose)
+				normsg("eraseblock %d: same data, skip", eb);
+			same += 1;
+			fastmap_add(eb, si->ec[eb],
+				    p.bufs[written_ebs % FLASH_RING_SIZE]);
+			flash_done(&p, 1);
+			if (++written_ebs >= img_ebs)
+				break;
+			continue;
+		}
+
 		if (args.verbose) {
 			normsg_cont("eraseblock %d: erase", eb);
 			fflush(stdout);
 		}
 
-		err = mtd_erase(libmtd, mtd, args.node_fd, eb);
+		if (err == FLASH_SAME) {
+			/* Compared with another image eraseblock, erase now */
+			err = mtd_erase(libmtd, mtd, args.node_fd, eb);
+			if (err) {
+				err = errno;
+				flash_done(&p, 0);
+			}
+		}
+
 		if (err) {
+			errno = err;
 			if (!args.quiet)
 				printf("\n");
 			sys_errmsg("failed to erase eraseblock %d", eb);
 
 			if (errno != EIO)
-				goto out_close;
+				goto out_stop;
 
 			if (mark_bad(mtd, si, eb))
-				goto out_close;
+				goto out_stop;
 
 			continue;
 		}
+		si->ec[eb] = EB_EMPTY;
 
-		if (!skip_data_read) {
-			err = read_all(fd, buf, mtd->eb_size);
-			if (err) {
-				sys_errmsg("failed to read eraseblock %d from \"%s\"",
-					   written_ebs, args.image);
-				goto out_close;
-			}
+		/*
+		 * An image eraseblock is only consumed once it is written, so
+		 * if writing fails, the same data goes to the next eraseblock
+		 * instead of reading more of the image.
+		 */
+		pthread_mutex_lock(&p.lock);
+		while (p.read_cnt <= written_ebs && !p.read_err)
+			pthread_cond_wait(&p.cond, &p.lock);
+		err = p.read_cnt <= written_ebs ? p.read_err : 0;
+		pthread_mutex_unlock(&p.lock);
+		if (err) {
+			errno = err;
+			sys_errmsg("failed to read eraseblock %d from \"%s\"",
+				   written_ebs, args.image);
+			goto out_stop;
 		}
-		skip_data_read = 0;
+		buf = p.bufs[written_ebs % FLASH_RING_SIZE];
 
 		if (args.override_ec)
 			ec = args.ec;
@@ -502,7 +1137,7 @@ static int flash_image(libmtd_t libmtd, const struct mtd_dev_info *mtd,
 		if (err) {
 			errmsg("bad EC header at eraseblock %d of \"%s\"",
 			       written_ebs, args.image);
-			goto out_close;
+			goto out_stop;
 		}
 
 		if (args.verbose) {
@@ -518,53 +1153,159 @@ static int flash_image(libmtd_t libmtd, const struct mtd_dev_info *mtd,
 			sys_errmsg("cannot write eraseblock %d", eb);
 
 			if (errno != EIO)
-				goto out_close;
+				goto out_stop;
 
+			/* A tortured eraseblock is left filled with a pattern */
+			si->ec[eb] = EB_ALIEN;
 			err = mtd_torture(libmtd, mtd, args.node_fd, eb);
 			if (err) {
 				if (mark_bad(mtd, si, eb))
-					goto out_close;
+					goto out_stop;
 			}
 
-			/*
-			 * We have to make sure that we do not read next block
-			 * of data from the input image or stdin - we have to
-			 * write buf first instead.
-			 */
-			skip_data_read = 1;
+			flash_done(&p, 0);
 			continue;
 		}
+		si->ec[eb] = ec;
+		fastmap_add(eb, ec, buf);
+
+		flash_done(&p, 1);
 		if (++written_ebs >= img_ebs)
 			break;
 	}
 
 	if (!args.quiet && !args.verbose)
 		printf("\n");
-	close(fd);
-	return eb + 1;
-
+	if (args.diff && !args.quiet)
+		normsg("%d of %d eraseblocks already contained the image data",
+		       same, written_ebs);
+	ret = eb + 1;
+
+out_stop:
+	pthread_mutex_lock(&p.lock);
+	p.stop = 1;
+	pthread_cond_broadcast(&p.cond);
+	pthread_mutex_unlock(&p.lock);
+	if (ret < 0)
+		pthread_cancel(reader);
+	pthread_join(eraser, NULL);
+out_join_reader:
+	pthread_join(reader, NULL);
+out_destroy:
+	pthread_cond_destroy(&p.cond);
+	pthread_mutex_destroy(&p.lock);
+out_free:
+	ffmap_free(p.ffmap);
+	free(p.cmp_buf);
+	free(p.chunk);
+	free(p.erase_err);
+	for (i = 0; i < FLASH_RING_SIZE; i++)
+		free(p.bufs[i]);
 out_close:
 	close(fd);
-	return -1;
+	return ret;
+}
+
+/*
+ * Handle a failure to write the EC header to eraseblock @eb, @err is the error
+ * code. Returns %0 if formatting may go on and %-1 if not.
+ */
+static int ec_write_failed(libmtd_t libmtd, const struct mtd_dev_info *mtd,
+			   struct ubi_scan_info *si, int eb, int write_size,
+			   int err)
+{
+	if (!args.quiet && !args.verbose)
+		printf("\n");
+	errno = err;
+	sys_errmsg("cannot write EC header (%d bytes buffer) to eraseblock %d",
+		   write_size, eb);
+
+	if (err != EIO) {
+		if (args.subpage_size != mtd->min_io_size)
+			normsg("may be sub-page size is incorrect?");
+		return -1;
+	}
+
+	si->ec[eb] = EB_ALIEN;
+	if (mtd_torture(libmtd, mtd, args.node_fd, eb))
+		if (mark_bad(mtd, si, eb))
+			return -1;
+	return 0;
+}
+
+/* EC header writes which failed since the last 'format_aio_wait()' */
+static struct {
+	int *ebs;
+	int *errs;
+	int cnt;
+} aio_failed;
+
+static void format_aio_failed(__attribute__((unused)) void *priv, int eb,
+			      __attribute__((unused)) int offs, int err)
+{
+	aio_failed.ebs[aio_failed.cnt] = eb;
+	aio_failed.errs[aio_failed.cnt] = err;
+	aio_failed.cnt += 1;
+}
+
+/* Wait for the queued EC header writes and handle the failed ones */
+static int format_aio_wait(libmtd_t libmtd, const struct mtd_dev_info *mtd,
+			   struct ubi_scan_info *si, mtd_aio_t aio,
+			   int write_size)
+{
+	int i, err = 0;
+
+	mtd_aio_wait(aio);
+	for (i = 0; i < aio_failed.cnt && !err; i++)
+		err = ec_write_failed(libmtd, mtd, si, aio_failed.ebs[i],
+				      write_size, aio_failed.errs[i]);
+	aio_failed.cnt = 0;
+	return err;
 }
 
 static int format(libmtd_t libmtd, const struct mtd_dev_info *mtd,
 		  const struct ubigen_info *ui, struct ubi_scan_info *si,
 		  int start_eb, int novtbl)
 {
-	int eb, err, write_size;
+	int eb, err, write_size, hdr_cnt = 1, queued = 0;
 	struct ubi_ec_hdr *hdr;
+	void *hdrs = NULL;
+	mtd_aio_t aio = NULL;
 	struct ubi_vtbl_record *vtbl;
 	int eb1 = -1, eb2 = -1;
 	long long ec1 = -1, ec2 = -1;
+	int erased_to = 0, single_to = 0, erase_reqs = 0, erased = 0;
+	unsigned long long start_ms = util_get_msecs();
 
 	write_size = UBI_EC_HDR_SIZE + mtd->subpage_size - 1;
 	write_size /= mtd->subpage_size;
 	write_size *= mtd->subpage_size;
-	hdr = malloc(write_size);
-	if (!hdr)
-		return sys_errmsg("cannot allocate %d bytes of memory", write_size);
-	memset(hdr, 0xFF, write_size);
+	/*
+	 * With asynchronous I/O, every EC header in flight needs its own
+	 * buffer, and they are waited for once all the buffers are used.
+	 */
+	if (args.aio_depth) {
+		hdr_cnt = args.aio_depth;
+		aio_failed.ebs = xcalloc(hdr_cnt, sizeof(int));
+		aio_failed.errs = xcalloc(hdr_cnt, sizeof(int));
+		aio_failed.cnt = 0;
+		aio = mtd_aio_open(libmtd, mtd, args.node_fd, hdr_cnt,
+				   format_aio_failed);
+		if (!aio)
+			goto out_free;
+		verbose(args.verbose, "writing EC headers with %s I/O, queue depth %d",
+			mtd_aio_is_async(aio) ? "asynchronous" : "synchronous",
+			hdr_cnt);
+	}
+
+	hdrs = malloc((size_t)write_size * hdr_cnt);
+	if (!hdrs) {
+		sys_errmsg("cannot allocate %d bytes of memory",
+			   write_size * hdr_cnt);
+		goto out_free;
+	}
+	memset(hdrs, 0xFF, (size_t)write_size * hdr_cnt);
+	hdr = hdrs;
 
 	for (eb = start_eb; eb < mtd->eb_cnt; eb++) {
 		long long ec;
@@ -584,14 +1325,53 @@ static int format(libmtd_t libmtd, const struct mtd_dev_info *mtd,
 			ec = si->ec[eb] + 1;
 		else
 			ec = si->mean_ec;
+		if (aio) {
+			if (queued == hdr_cnt) {
+				if (format_aio_wait(libmtd, mtd, si, aio, write_size))
+					goto out_free;
+				queued = 0;
+			}
+			hdr = hdrs + (size_t)queued * write_size;
+		}
 		ubigen_init_ec_hdr(ui, hdr, ec);
 
+		/*
+		 * Erase the whole run of good eraseblocks starting here with
+		 * one request. If that fails, erase them one by one, so that
+		 * the bad ones are found.
+		 */
+		if (eb >= erased_to && eb >= single_to) {
+			int cnt = 1;
+
+			while (eb + cnt < mtd->eb_cnt && si->ec[eb + cnt] != EB_BAD)
+				cnt += 1;
+			if (cnt > 1) {
+				erase_reqs += 1;
+				err = mtd_erase_multi(libmtd, mtd, args.node_fd,
+						      eb, cnt);
+				if (!err) {
+					erased_to = eb + cnt;
+				} else {
+					if (!args.quiet)
+						printf("\n");
+					warnmsg("cannot erase eraseblocks %d-%d at once, erase them one by one",
+						eb, eb + cnt - 1);
+					single_to = eb + cnt;
+				}
+			}
+		}
+
 		if (args.verbose) {
 			normsg_cont("eraseblock %d: erase", eb);
 			fflush(stdout);
 		}
 
-		err = mtd_erase(libmtd, mtd, args.node_fd, eb);
+		if (eb < erased_to) {
+			err = 0;
+		} else {
+			erase_reqs += 1;
+			err = mtd_erase(libmtd, mtd, args.node_fd, eb);
+		}
 		if (err) {
 			if (!args.quiet)
 				printf("\n");
@@ -604,6 +1384,8 @@ static int format(libmtd_t libmtd, const struct mtd_dev_info *mtd,
 				goto out_free;
 			continue;
 		}
+		si->ec[eb] = EB_EMPTY;
+		erased += 1;
 
 		if ((eb1 == -1 || eb2 == -1) && !novtbl) {
 			if (eb1 == -1) {
@@ -615,6 +1397,7 @@ static int format(libmtd_t libmtd, const struct mtd_dev_info *mtd,
 			}
 			if (args.verbose)
 				printf(", do not write EC, leave for vtbl\n");
+			si->ec[eb] = ec;
 			continue;
 		}
 
@@ -623,32 +1406,32 @@ static int format(libmtd_t libmtd, const struct mtd_dev_info *mtd,
 			fflush(stdout);
 		}
 
+		if (aio) {
+			si->ec[eb] = ec;
+			if (mtd_aio_write(aio, eb, 0, hdr, write_size, NULL))
+				goto out_free;
+			queued += 1;
+			continue;
+		}
+
 		err = mtd_write(libmtd, mtd, args.node_fd, eb, 0, hdr,
 				write_size, NULL, 0, 0);
 		if (err) {
-			if (!args.quiet && !args.verbose)
-				printf("\n");
-			sys_errmsg("cannot write EC header (%d bytes buffer) to eraseblock %d",
-				   write_size, eb);
-
-			if (errno != EIO) {
-				if (args.subpage_size != mtd->min_io_size)
-					normsg("may be sub-page size is incorrect?");
+			if (ec_write_failed(libmtd, mtd, si, eb, write_size, errno))
 				goto out_free;
-			}
-
-			err = mtd_torture(libmtd, mtd, args.node_fd, eb);
-			if (err) {
-				if (mark_bad(mtd, si, eb))
-					goto out_free;
-			}
 			continue;
-
 		}
+		si->ec[eb] = ec;
 	}
 
+	if (aio && format_aio_wait(libmtd, mtd, si, aio, write_size))
+		goto out_free;
+
 	if (!args.quiet && !args.verbose)
 		printf("\n");
+	if (!args.quiet)
+		normsg("erased %d eraseblocks with %d erase requests in %llu ms",
+		       erased, erase_reqs, util_get_msecs() - start_ms);
 
 	if (!novtbl) {
 		if (eb1 == -1 || eb2 == -1) {
@@ -670,23 +1453,30 @@ static int format(libmtd_t libmtd, const struct mtd_dev_info *mtd,
 		}
 	}
 
-	free(hdr);
-	return 0;
+	err = 0;
+out:
+	mtd_aio_close(aio);
+	free(hdrs);
+	free(aio_failed.ebs);
+	free(aio_failed.errs);
+	aio_failed.ebs = aio_failed.errs = NULL;
+	return err;
 
 out_free:
-	free(hdr);
-	return -1;
+	err = -1;
+	goto out;
 }
 
 int main(int argc, char * const argv[])
 {
-	int err, verbose;
+	int err;
 	libmtd_t libmtd;
 	struct mtd_info mtd_info;
 	struct mtd_dev_info mtd;
 	libubi_t libubi;
 	struct ubigen_info ui;
 	struct ubi_scan_info *si;
+	struct ubi_scan_opts scan_opts;
 
 	libmtd = libmtd_open();
 	if (!libmtd)
@@ -797,17 +1587,39 @@ int main(int argc, char * const argv[])
 	}
 
 	if (args.quiet)
-		verbose = 0;
+		scan_opts.verbose = 0;
 	else if (args.verbose)
-		verbose = 2;
+		scan_opts.verbose = 2;
 	else
-		verbose = 1;
-	err = ubi_scan(&mtd, args.node_fd, &si, verbose);
-	if (err) {
-		errmsg("failed to scan mtd%d (%s)", mtd.mtd_num, args.node);
+		scan_opts.verbose = 1;
+	scan_opts.threads = args.scan_threads;
+	scan_opts.leb_map = 0;
+
+	/* Ask about every eraseblock being bad only once */
+	if (mtd_get_bbt(&mtd)) {
+		errmsg("cannot read the bad eraseblock table of mtd%d",
+		       mtd.mtd_num);
 		goto out_close;
 	}
 
+	si = NULL;
+	if (args.scan_cache) {
+		err = ubi_scan_cache_load(&mtd, args.node_fd, &si, &scan_opts);
+		if (err == -1)
+			warnmsg("cannot use the scanning cache, scan mtd%d",
+				mtd.mtd_num);
+		else if (err == 0 && !args.quiet)
+			normsg("scanning results are cached, skip scanning");
+	}
+
+	if (!si) {
+		err = ubi_scan(&mtd, args.node_fd, &si, &scan_opts);
+		if (err) {
+			errmsg("failed to scan mtd%d (%s)", mtd.mtd_num, args.node);
+			goto out_close;
+		}
+	}
+
 	if (si->good_cnt == 0) {
 		errmsg("all %d eraseblocks are bad", si->bad_cnt);
 		goto out_free;
@@ -882,6 +1694,13 @@ int main(int argc, char * const argv[])
 	if (!args.quiet && args.override_ec)
 		normsg("use erase counter %lld for all eraseblocks", args.ec);
 
+	/* Unchanged eraseblocks keep their EC headers, so keep the sequence */
+	if (args.diff && !args.image_seq_set && si->ok_cnt) {
+		args.image_seq = si->image_seq;
+		verbose(args.verbose, "use image sequence number %u from flash",
+			args.image_seq);
+	}
+
 	ubigen_info_init(&ui, mtd.eb_size, mtd.min_io_size, mtd.subpage_size,
 			 args.vid_hdr_offs, args.ubi_ver, args.image_seq,
 			 mtd.pairing);
@@ -909,29 +1728,56 @@ int main(int argc, char * const argv[])
 		normsg("use offsets %d and %d",  ui.vid_hdr_offs, ui.data_offs);
 	}
 
+	/* The flash is about to change, the cached scanning results go stale */
+	if (ubi_scan_cache_invalidate(&mtd))
+		warnmsg("cannot invalidate the scanning cache of mtd%d",
+			mtd.mtd_num);
+
 	if (args.image) {
-		err = flash_image(libmtd, &mtd, &ui, si);
-		if (err < 0)
+		int start_eb;
+
+		if (args.fastmap && fastmap_reserve(&mtd, &ui, si))
 			goto out_free;
 
-		err = format(libmtd, &mtd, &ui, si, err, 1);
+		start_eb = flash_image(libmtd, &mtd, &ui, si);
+		if (start_eb < 0)
+			goto out_free;
+
+		err = format(libmtd, &mtd, &ui, si, start_eb, 1);
 		if (err)
 			goto out_free;
+
+		if (args.fastmap) {
+			err = fastmap_write(libmtd, &mtd, &ui, si, start_eb);
+			if (err)
+				goto out_free;
+		}
 	} else {
 		err = format(libmtd, &mtd, &ui, si, 0, args.novtbl);
 		if (err)
 			goto out_free;
 	}
 
+	if (args.scan_cache) {
+		si->vid_hdr_offs = ui.vid_hdr_offs;
+		si->data_offs = ui.data_offs;
+		if (ubi_scan_cache_save(&mtd, si, ui.image_seq))
+			warnmsg("cannot save the scanning cache of mtd%d",
+				mtd.mtd_num);
+	}
+
 	ubi_scan_free(si);
 	close(args.node_fd);
+	mtd_bbt_free(&mtd);
 	libmtd_close(libmtd);
 	return 0;
 
 out_free:
+	ubigen_fm_free(fastmap.fm);
 	ubi_scan_free(si);
 out_close:
 	close(args.node_fd);
+	mtd_bbt_free(&mtd);
 out_close_mtd:
 	libmtd_close(libmtd);
 	return -1;
@@ -31,15 +31,19 @@
 #include <getopt.h>
 #include <string.h>
 #include <fcntl.h>
+#include <pthread.h>
 
 #include <mtd/ubi-media.h>
+#include <mtd_swab.h>
 #include <libubigen.h>
+#include <libffmap.h>
 #include <libiniparser.h>
 #include <libubi.h>
+#include <crc32.h>
 #include "common.h"
 
 static const char optionsstr[] =
-"-o, --output=<file name>     output file name\n"
+"-o, --output=<file name>     output file name, or '-' for stdout\n"
 "-p, --peb-size=<bytes>       size of the physical eraseblock of the flash\n"
 "                             this UBI image is created for in bytes,\n"
 "                             kilobytes (KiB), or megabytes (MiB)\n"
@@ -63,6 +67,14 @@ static const char optionsstr[] =
 "                             (default is 1)\n"
 "-Q, --image-seq=<num>        32-bit UBI image sequence number to use\n"
 "                             (by default a random number is picked)\n"
+"    --ff-map=<file>          write the image as a sparse file leaving out\n"
+"                             the regions of 0xFF bytes, and list the\n"
+"                             regions containing data in <file>; the image\n"
+"                             is only valid together with <file>\n"
+"    --fastmap=<bytes>        add a fastmap for a flash of this size to the\n"
+"                             image, so it is attached without scanning\n"
+"-j, --jobs=<num>             write up to <num> volumes at once (default is\n"
+"                             1), the image does not depend on it\n"
 "-v, --verbose                be verbose\n"
 "-h, --help                   print help message\n"
 "-V, --version                print program version\n\n";
@@ -71,9 +83,14 @@ static const char usage[] =
 "Usage: " PROGRAM_NAME " [options] <ini-file>\n\n"
 "Generate UBI images. An UBI image may contain one or more UBI volumes which\n"
 "have to be defined in the input configuration ini-file. The flash\n"
-"characteristics are defined via the command-line options.\n\n";
+"characteristics are defined via the command-line options.\n"
+"The volume images and the output may be pipes, the image of a volume may\n"
+"also be '-' for stdin.\n\n";
 
 static const struct option long_options[] = {
+	/* Order matters for opts w/val=0; see option_index below. */
+	{ .name = "ff-map",         .has_arg = 1, .flag = NULL, .val = 0 },
+	{ .name = "fastmap",        .has_arg = 1, .flag = NULL, .val = 0 },
 	{ .name = "output",         .has_arg = 1, .flag = NULL, .val = 'o' },
 	{ .name = "peb-size",       .has_arg = 1, .flag = NULL, .val = 'p' },
 	{ .name = "min-io-size",    .has_arg = 1, .flag = NULL, .val = 'm' },
@@ -83,6 +100,7 @@ static const struct option long_options[] = {
 	{ .name = "ubi-ver",        .has_arg = 1, .flag = NULL, .val = 'x' },
 	{ .name = "image-seq",      .has_arg = 1, .flag = NULL, .val = 'Q' },
 	{ .name = "mlc",            .has_arg = 1, .flag = NULL, .val = 'M' },
+	{ .name = "jobs",           .has_arg = 1, .flag = NULL, .val = 'j' },
 	{ .name = "verbose",        .has_arg = 0, .flag = NULL, .val = 'v' },
 	{ .name = "help",           .has_arg = 0, .flag = NULL, .val = 'h' },
 	{ .name = "version",        .has_arg = 0, .flag = NULL, .val = 'V' },
@@ -92,7 +110,9 @@ static const struct option long_options[] = {
 struct args {
 	const char *f_in;
 	const char *f_out;
+	const char *f_ffmap;
 	int out_fd;
+	int out_stream;
 	int peb_size;
 	int min_io_size;
 	int subpage_size;
@@ -102,6 +122,8 @@ struct args {
 	uint32_t image_seq;
 	const struct mtd_pairing_scheme *pairing;
 	int verbose;
+	int jobs;
+	long long fm_bytes;
 	dictionary *dict;
 };
 
@@ -110,6 +132,7 @@ static struct args args = {
 	.min_io_size  = -1,
 	.subpage_size = -1,
 	.ubi_ver      = 1,
+	.jobs         = 1,
 };
 
 static int parse_opt(int argc, char * const argv[])
@@ -118,19 +141,41 @@ static int parse_opt(int argc, char * const argv[])
 	args.image_seq = rand();
 
 	while (1) {
-		int key, error = 0;
+		int option_index, key, error = 0;
 		unsigned long int image_seq;
 
-		key = getopt_long(argc, argv, "o:p:m:M:s:O:e:x:Q:vhV", long_options, NULL);
+		key = getopt_long(argc, argv, "o:p:m:M:s:O:e:x:Q:j:vhV", long_options,
+				  &option_index);
 		if (key == -1)
 			break;
 
 		switch (key) {
+		case 0:
+			switch (option_index) {
+			case 0: /* --ff-map */
+				args.f_ffmap = optarg;
+				break;
+			case 1: /* --fastmap */
+				args.fm_bytes = util_get_bytes(optarg);
+				if (args.fm_bytes <= 0)
+					return errmsg("bad flash size: \"%s\"",
+						      optarg);
+				break;
+			}
+			break;
 		case 'o':
-			args.out_fd = open(optarg, O_CREAT | O_TRUNC | O_WRONLY,
-					   S_IWUSR | S_IRUSR | S_IRGRP | S_IWGRP | S_IROTH);
-			if (args.out_fd == -1)
-				return sys_errmsg("cannot open file \"%s\"", optarg);
+			if (!strcmp(optarg, "-")) {
+				/* Keep the messages out of the image */
+				args.out_fd = dup(STDOUT_FILENO);
+				if (args.out_fd == -1 ||
+				    dup2(STDERR_FILENO, STDOUT_FILENO) == -1)
+					return sys_errmsg("cannot use stdout as output");
+			} else {
+				args.out_fd = open(optarg, O_CREAT | O_TRUNC | O_WRONLY,
+						   S_IWUSR | S_IRUSR | S_IRGRP | S_IWGRP | S_IROTH);
+				if (args.out_fd == -1)
+					return sys_errmsg("cannot open file \"%s\"", optarg);
+			}
 			args.f_out = optarg;
 			break;
 
@@ -187,6 +232,12 @@ static int parse_opt(int argc, char * const argv[])
 			args.image_seq = image_seq;
 			break;
 
+		case 'j':
+			args.jobs = simple_strtoul(optarg, &error);
+			if (error || args.jobs <= 0)
+				return errmsg("bad number of jobs: \"%s\"", optarg);
+			break;
+
 		case 'v':
 			args.verbose = 1;
 			break;
@@ -245,15 +296,38 @@ static int parse_opt(int argc, char * const argv[])
 			return errmsg("VID header offset has to be multiple of min. I/O unit size");
 	}
 
+	if (args.fm_bytes && args.fm_bytes % args.peb_size)
+		return errmsg("flash size should be multiple of physical eraseblocks");
+
+	/*
+	 * An output which cannot seek gets the PEBs one after the other, and
+	 * the volume table after the volumes.
+	 */
+	if (lseek(args.out_fd, 0, SEEK_CUR) == -1) {
+		if (errno != ESPIPE)
+			return sys_errmsg("cannot seek \"%s\"", args.f_out);
+		args.out_stream = 1;
+		if (args.f_ffmap)
+			return errmsg("--ff-map needs an output which can seek");
+		if (args.fm_bytes)
+			return errmsg("--fastmap needs an output which can seek");
+	}
+
 	return 0;
 }
 
+/*
+ * Read the volume described by section @sname. The size of the image is put to
+ * @st->st_size, which is %-1 if the image is a stream, e.g., a pipe or '-' for
+ * stdin, whose size is only known once it is read.
+ */
 static int read_section(const struct ubigen_info *ui, const char *sname,
 			struct ubigen_vol_info *vi, const char **img,
 			struct stat *st)
 {
 	char buf[256];
 	const char *p;
+	int fd, err;
 
 	*img = NULL;
 
@@ -325,12 +399,27 @@ static int read_section(const struct ubigen_info *ui, const char *sname,
 	p = iniparser_getstring(args.dict, buf, NULL);
 	if (p) {
 		*img = p;
-		if (stat(p, st))
-			return sys_errmsg("cannot stat \"%s\" referred from section \"%s\"",
-					  p, sname);
-		if (st->st_size == 0)
-			return errmsg("empty file \"%s\" referred from section \"%s\"",
-				       p, sname);
+		if (!strcmp(p, "-")) {
+			st->st_size = -1;
+		} else {
+			if (stat(p, st))
+				return sys_errmsg("cannot stat \"%s\" referred from section \"%s\"",
+						  p, sname);
+			if (!S_ISREG(st->st_mode))
+				st->st_size = -1;
+			else if (st->st_size == 0)
+				return errmsg("empty file \"%s\" referred from section \"%s\"",
+					      p, sname);
+
+			/* Sparse images written with --ff-map are not usable */
+			fd = open(p, O_RDONLY);
+			if (fd == -1)
+				return sys_errmsg("cannot open \"%s\"", p);
+			err = ffmap_check_holes(fd, p);
+			close(fd);
+			if (err)
+				return -1;
+		}
 	} else if (vi->type == UBI_VID_STATIC)
 		return errmsg("image is not specified for static volume in section \"%s\"",
 			      sname);
@@ -364,6 +453,11 @@ static int read_section(const struct ubigen_info *ui, const char *sname,
 				      "\"%s\" is %lld, which is larger than volume size %lld",
 				      sname, *img, (long long)st->st_size, vi->bytes);
 		verbose(args.verbose, "volume size: %lld bytes", vi->bytes);
+	} else if (*img && st->st_size == -1) {
+		/* Known once the image is written */
+		vi->bytes = 0;
+		normsg("volume size was not specified in section \"%s\", assume"
+		       " minimum to fit stream \"%s\"", sname, *img);
 	} else {
 		struct stat st;
 
@@ -429,23 +523,635 @@ static int read_section(const struct ubigen_info *ui, const char *sname,
 	vi->usable_leb_size = ui->leb_size - vi->data_pad;
 	if (vi->type == UBI_VID_DYNAMIC)
 		vi->used_ebs = (vi->bytes + vi->usable_leb_size - 1) / vi->usable_leb_size;
+	else if (st->st_size == -1)
+		vi->used_ebs = 0;
 	else
 		vi->used_ebs = (st->st_size + vi->usable_leb_size - 1) / vi->usable_leb_size;
 	vi->compat = 0;
 	return 0;
 }
 
+/**
+ * struct vol_job - a volume to write.
+ * @vi: volume information
+ * @sname: ini-file section of the volume
+ * @img: image file with the contents of the volume
+ * @bytes: size of the image file
+ * @offs: output file offset to write the volume at
+ */
+struct vol_job {
+	struct ubigen_vol_info *vi;
+	const char *sname;
+	const char *img;
+	long long bytes;
+	off_t offs;
+};
+
+/**
+ * struct vol_writer - a thread writing volumes.
+ * @ui: libubigen information, with an erased-region map of its own
+ * @tid: the thread
+ * @err: the thread failed to write a volume
+ */
+struct vol_writer {
+	struct ubigen_info ui;
+	pthread_t tid;
+	int err;
+};
+
+static struct vol_job *jobs;
+static int job_cnt;
+static int next_job;
+static int job_failed;
+
+static int write_vol_job(const struct ubigen_info *ui,
+			 const struct vol_job *job)
+{
+	int fd, err;
+
+	fd = open(job->img, O_RDONLY);
+	if (fd == -1)
+		return sys_errmsg("cannot open \"%s\"", job->img);
+
+	verbose(args.verbose, "writing volume %d from image file %s",
+		job->vi->id, job->img);
+
+	err = ubigen_write_volume_at(ui, job->vi, args.ec, job->bytes, fd,
+				     args.out_fd, job->offs);
+	close(fd);
+	if (err)
+		errmsg("cannot write volume for section \"%s\"", job->sname);
+	return err;
+}
+
+/*
+ * Take volumes to write until there are none left or one of the writers
+ * failed.
+ */
+static void *vol_writer(void *arg)
+{
+	struct vol_writer *w = arg;
+	int i;
+
+	while (!__atomic_load_n(&job_failed, __ATOMIC_RELAXED)) {
+		i = __atomic_fetch_add(&next_job, 1, __ATOMIC_RELAXED);
+		if (i >= job_cnt)
+			break;
+		if (write_vol_job(&w->ui, &jobs[i])) {
+			__atomic_store_n(&job_failed, 1, __ATOMIC_RELAXED);
+			w->err = -1;
+		}
+	}
+	return NULL;
+}
+
+/**
+ * write_volumes - write the volumes, several at once with '--jobs'.
+ * @ui: libubigen information
+ *
+ * The offset of each volume is known beforehand, so the volumes are written
+ * with 'pwrite()' in any order. Every thread writes to an erased-region map of
+ * its own, the maps are merged afterwards.
+ */
+static int write_volumes(struct ubigen_info *ui)
+{
+	struct vol_writer *w;
+	int i, n = args.jobs < job_cnt ? args.jobs : job_cnt, started = 0;
+	int err = 0;
+
+	if (n <= 1) {
+		for (i = 0; i < job_cnt; i++)
+			if (write_vol_job(ui, &jobs[i]))
+				return -1;
+		return 0;
+	}
+
+	w = calloc(n, sizeof(*w));
+	if (!w)
+		return sys_errmsg("cannot allocate memory");
+
+	for (i = 0; i < n; i++) {
+		memcpy(&w[i].ui, ui, sizeof(*ui));
+		if (ui->ffmap) {
+			w[i].ui.ffmap = ffmap_new(ui->min_io_size);
+			if (!w[i].ui.ffmap) {
+				err = -1;
+				break;
+			}
+		}
+		err = pthread_create(&w[i].tid, NULL, vol_writer, &w[i]);
+		if (err) {
+			errno = err;
+			err = sys_errmsg("cannot create a writer thread");
+			break;
+		}
+		started += 1;
+	}
+	if (err)
+		__atomic_store_n(&job_failed, 1, __ATOMIC_RELAXED);
+
+	for (i = 0; i < started; i++) {
+		pthread_join(w[i].tid, NULL);
+		if (w[i].err)
+			err = -1;
+		if (!err && ui->ffmap)
+			err = ffmap_merge(ui->ffmap, w[i].ui.ffmap);
+	}
+	for (i = 0; i < n; i++)
+		ffmap_free(w[i].ui.ffmap);
+	free(w);
+	return err;
+}
+
+/* How many PEBs the stages of 'write_stream()' may be ahead of the writer */
+#define STREAM_RING_SIZE 8
+
+/**
+ * struct vol_stream - state shared by the stages of 'write_stream()'.
+ * @ui: libubigen information
+ * @vi: volume information
+ * @in: image file descriptor
+ * @len: bytes of the image per PEB
+ * @max_bytes: how many bytes the volume may take, %0 if there is no limit
+ * @lock: protects all the fields below
+ * @cond: broadcasted whenever a stage makes progress or has to stop
+ * @in_bufs: ring of image pieces of @len bytes
+ * @in_lens: how many bytes each piece of @in_bufs holds
+ * @out_bufs: ring of the PEBs laid out from @in_bufs
+ * @bytes: count of image bytes read so far
+ * @read_cnt: count of image pieces read so far
+ * @read_eof: the whole image was read
+ * @read_err: errno of the failed image read, %0 if reading did not fail
+ * @laid_cnt: count of PEBs laid out so far
+ * @laid_done: all PEBs are laid out
+ * @written: count of PEBs written so far, their buffers may be re-used
+ * @stop: tells the reader and the layout stage to stop
+ *
+ * The reader fills @in_bufs with the image, the layout stage computes the CRC
+ * of the data and the headers of each PEB, and the writer, which is the thread
+ * calling 'write_stream()', writes the PEBs in order. The size of the image
+ * does not have to be known, it is read until the end of file.
+ */
+struct vol_stream {
+	const struct ubigen_info *ui;
+	const struct ubigen_vol_info *vi;
+	int in;
+	int len;
+	long long max_bytes;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	char *in_bufs[STREAM_RING_SIZE];
+	int in_lens[STREAM_RING_SIZE];
+	char *out_bufs[STREAM_RING_SIZE];
+	long long bytes;
+	int read_cnt;
+	int read_eof;
+	int read_err;
+	int laid_cnt;
+	int laid_done;
+	int written;
+	int stop;
+};
+
+/*
+ * Read up to @len bytes, less only at the end of file. Returns the count of
+ * bytes read, or %-1 on failure.
+ */
+static int read_full(int fd, char *buf, int len)
+{
+	int rd, done = 0;
+
+	while (done < len) {
+		rd = read(fd, buf + done, len - done);
+		if (rd < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (rd == 0)
+			break;
+		done += rd;
+	}
+	return done;
+}
+
+static void *stream_reader(void *arg)
+{
+	struct vol_stream *s = arg;
+	int i, len, stop;
+
+	/* Reading from a pipe may block forever, only allow cancelling there */
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+	for (i = 0; ; i++) {
+		char *buf = s->in_bufs[i % STREAM_RING_SIZE];
+
+		pthread_mutex_lock(&s->lock);
+		while (!s->stop && i >= s->written + STREAM_RING_SIZE)
+			pthread_cond_wait(&s->cond, &s->lock);
+		stop = s->stop;
+		pthread_mutex_unlock(&s->lock);
+		if (stop)
+			break;
+
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+		errno = 0;
+		len = read_full(s->in, buf, s->len);
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+		pthread_mutex_lock(&s->lock);
+		if (len < 0) {
+			s->read_err = errno ? errno : EIO;
+		} else if (len > 0) {
+			s->bytes += len;
+			if (s->max_bytes && s->bytes > s->max_bytes) {
+				s->read_err = EFBIG;
+			} else {
+				s->in_lens[i % STREAM_RING_SIZE] = len;
+				s->read_cnt += 1;
+			}
+		}
+		if (len < s->len)
+			s->read_eof = 1;
+		stop = s->read_err || s->read_eof;
+		pthread_cond_broadcast(&s->cond);
+		pthread_mutex_unlock(&s->lock);
+		if (stop)
+			break;
+	}
+
+	return NULL;
+}
+
+static void *stream_layout(void *arg)
+{
+	struct vol_stream *s = arg;
+	int i, slot, have;
+
+	for (i = 0; ; i++) {
+		pthread_mutex_lock(&s->lock);
+		while (!s->stop && i >= s->read_cnt && !s->read_eof &&
+		       !s->read_err)
+			pthread_cond_wait(&s->cond, &s->lock);
+		have = !s->stop && i < s->read_cnt;
+		pthread_mutex_unlock(&s->lock);
+		if (!have)
+			break;
+
+		slot = i % STREAM_RING_SIZE;
+		ubigen_layout_vid_and_data(s->ui, s->vi,
+					   i * s->ui->max_lebs_per_peb,
+					   s->in_bufs[slot], s->out_bufs[slot],
+					   s->in_lens[slot]);
+
+		pthread_mutex_lock(&s->lock);
+		s->laid_cnt += 1;
+		pthread_cond_broadcast(&s->cond);
+		pthread_mutex_unlock(&s->lock);
+	}
+
+	pthread_mutex_lock(&s->lock);
+	s->laid_done = 1;
+	pthread_cond_broadcast(&s->cond);
+	pthread_mutex_unlock(&s->lock);
+	return NULL;
+}
+
+/* Write PEB @buf at offset @offs, or after the previous one to a stream */
+static int stream_write_peb(const struct ubigen_info *ui, const char *buf,
+			    off_t offs)
+{
+	int done = 0, ret;
+
+	if (!args.out_stream) {
+		if (ui->ffmap)
+			return ffmap_pwrite(ui->ffmap, args.out_fd, buf,
+					    ui->peb_size, offs);
+		if (pwrite(args.out_fd, buf, ui->peb_size, offs) != ui->peb_size)
+			return sys_errmsg("cannot write %d bytes to the output file at offset %lld",
+					  ui->peb_size, (long long)offs);
+		return 0;
+	}
+
+	while (done < ui->peb_size) {
+		ret = write(args.out_fd, buf + done, ui->peb_size - done);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return sys_errmsg("cannot write %d bytes to the output file",
+					  ui->peb_size);
+		done += ret;
+	}
+	return 0;
+}
+
+/*
+ * The number of LEBs of a static volume is in every VID header, so when the
+ * size of the image was not known, the VID headers are written again with it.
+ */
+static int fix_used_ebs(const struct ubigen_info *ui,
+			struct ubi_vid_hdr *vid_hdrs, int cnt, int used_ebs,
+			off_t offs)
+{
+	int i;
+
+	for (i = 0; i < cnt; i++) {
+		struct ubi_vid_hdr *hdr = &vid_hdrs[i];
+		off_t pos = offs + (off_t)i * ui->peb_size + ui->vid_hdr_offs;
+
+		hdr->used_ebs = cpu_to_be32(used_ebs);
+		hdr->hdr_crc = cpu_to_be32(mtd_crc32(UBI_CRC32_INIT, hdr,
+						     UBI_VID_HDR_SIZE_CRC));
+		if (pwrite(args.out_fd, hdr, UBI_VID_HDR_SIZE, pos) !=
+		    UBI_VID_HDR_SIZE)
+			return sys_errmsg("cannot write VID header at offset %lld",
+					  (long long)pos);
+	}
+	return 0;
+}
+
+/**
+ * write_stream - write a volume from an image of any size.
+ * @ui: libubigen information
+ * @job: the volume, @job->bytes is %-1 if the size of the image is not known
+ * @in: image file descriptor
+ *
+ * Writes the volume at @job->offs, or after what was written so far if the
+ * output is a stream. Once the image is read, its size is put to @job->bytes.
+ * Returns %0 on success and %-1 on failure.
+ */
+static int write_stream(const struct ubigen_info *ui, struct vol_job *job,
+			int in)
+{
+	const struct ubigen_vol_info *vi = job->vi;
+	struct ubi_vid_hdr *vid_hdrs = NULL;
+	int i, err = -1, fix = 0, vid_hdr_cnt = 0;
+	pthread_t reader, layout;
+	struct vol_stream s;
+
+	memset(&s, 0, sizeof(struct vol_stream));
+	s.ui = ui;
+	s.vi = vi;
+	s.in = in;
+	s.len = vi->usable_leb_size;
+	if (vi->mode == UBI_VID_MODE_MLC_SAFE)
+		s.len *= ui->max_lebs_per_peb;
+	if (job->bytes == -1) {
+		s.max_bytes = vi->bytes;
+		fix = vi->type == UBI_VID_STATIC;
+	} else {
+		s.max_bytes = job->bytes;
+	}
+
+	for (i = 0; i < STREAM_RING_SIZE; i++) {
+		s.in_bufs[i] = malloc(s.len);
+		s.out_bufs[i] = malloc(ui->peb_size);
+		if (!s.in_bufs[i] || !s.out_bufs[i]) {
+			sys_errmsg("cannot allocate memory");
+			goto out_free;
+		}
+		memset(s.out_bufs[i], 0xFF, ui->data_offs);
+		ubigen_init_ec_hdr(ui, (struct ubi_ec_hdr *)s.out_bufs[i],
+				   args.ec);
+	}
+
+	pthread_mutex_init(&s.lock, NULL);
+	pthread_cond_init(&s.cond, NULL);
+	errno = pthread_create(&reader, NULL, stream_reader, &s);
+	if (errno) {
+		sys_errmsg("cannot create image reading thread");
+		goto out_destroy;
+	}
+	errno = pthread_create(&layout, NULL, stream_layout, &s);
+	if (errno) {
+		sys_errmsg("cannot create PEB layout thread");
+		pthread_mutex_lock(&s.lock);
+		s.stop = 1;
+		pthread_cond_broadcast(&s.cond);
+		pthread_mutex_unlock(&s.lock);
+		pthread_cancel(reader);
+		goto out_join_reader;
+	}
+
+	for (i = 0; ; i++) {
+		char *buf = s.out_bufs[i % STREAM_RING_SIZE];
+		int have;
+
+		pthread_mutex_lock(&s.lock);
+		while (i >= s.laid_cnt && !s.laid_done)
+			pthread_cond_wait(&s.cond, &s.lock);
+		have = i < s.laid_cnt;
+		pthread_mutex_unlock(&s.lock);
+		if (!have)
+			break;
+
+		if (stream_write_peb(ui, buf, job->offs + (off_t)i * ui->peb_size))
+			goto out_stop;
+
+		if (fix) {
+			if (vid_hdr_cnt % 64 == 0) {
+				void *p = realloc(vid_hdrs, (vid_hdr_cnt + 64) *
+						  sizeof(struct ubi_vid_hdr));
+
+				if (!p) {
+					sys_errmsg("cannot allocate memory");
+					goto out_stop;
+				}
+				vid_hdrs = p;
+			}
+			memcpy(&vid_hdrs[vid_hdr_cnt++], buf + ui->vid_hdr_offs,
+			       sizeof(struct ubi_vid_hdr));
+		}
+
+		pthread_mutex_lock(&s.lock);
+		s.written += 1;
+		pthread_cond_broadcast(&s.cond);
+		pthread_mutex_unlock(&s.lock);
+	}
+
+	if (s.read_err == EFBIG) {
+		errmsg("image \"%s\" is larger than the volume size %lld",
+		       job->img, s.max_bytes);
+		goto out_stop;
+	} else if (s.read_err) {
+		errno = s.read_err;
+		sys_errmsg("cannot read \"%s\"", job->img);
+		goto out_stop;
+	} else if (!s.bytes) {
+		errmsg("empty image \"%s\"", job->img);
+		goto out_stop;
+	}
+
+	if (fix && fix_used_ebs(ui, vid_hdrs, vid_hdr_cnt,
+				(s.bytes + vi->usable_leb_size - 1) /
+				vi->usable_leb_size, job->offs))
+		goto out_stop;
+
+	job->bytes = s.bytes;
+	err = 0;
+
+out_stop:
+	pthread_mutex_lock(&s.lock);
+	s.stop = 1;
+	pthread_cond_broadcast(&s.cond);
+	pthread_mutex_unlock(&s.lock);
+	if (err)
+		pthread_cancel(reader);
+	pthread_join(layout, NULL);
+out_join_reader:
+	pthread_join(reader, NULL);
+out_destroy:
+	pthread_cond_destroy(&s.cond);
+	pthread_mutex_destroy(&s.lock);
+out_free:
+	for (i = 0; i < STREAM_RING_SIZE; i++) {
+		free(s.in_bufs[i]);
+		free(s.out_bufs[i]);
+	}
+	free(vid_hdrs);
+	return err;
+}
+
+/**
+ * write_volumes_seq - write the volumes one after the other.
+ * @ui: libubigen information
+ * @vtbl: the volume table
+ * @offs: output offset of the first volume, the offset after the last one is
+ *        put here
+ *
+ * Used when the output is a stream or the size of an image is only known once
+ * it is read, so the offset of a volume depends on the volumes before it. The
+ * volumes whose size was not known are added to @vtbl again once written.
+ */
+static int write_volumes_seq(const struct ubigen_info *ui,
+			     struct ubi_vtbl_record *vtbl, off_t *offs)
+{
+	int i, fd, err;
+
+	for (i = 0; i < job_cnt; i++) {
+		struct vol_job *job = &jobs[i];
+		struct ubigen_vol_info *vi = job->vi;
+		int unsized = job->bytes == -1;
+
+		if (!strcmp(job->img, "-")) {
+			fd = STDIN_FILENO;
+		} else {
+			fd = open(job->img, O_RDONLY);
+			if (fd == -1)
+				return sys_errmsg("cannot open \"%s\"", job->img);
+		}
+
+		verbose(args.verbose, "writing volume %d from image %s",
+			vi->id, job->img);
+
+		job->offs = *offs;
+		err = write_stream(ui, job, fd);
+		if (fd != STDIN_FILENO)
+			close(fd);
+		if (err)
+			return errmsg("cannot write volume for section \"%s\"",
+				      job->sname);
+
+		*offs += (off_t)ubigen_volume_pebs(ui, vi, job->bytes) *
+			 ui->peb_size;
+		if (!unsized)
+			continue;
+
+		verbose(args.verbose, "volume %d image size: %lld bytes",
+			vi->id, job->bytes);
+		if (!vi->bytes)
+			vi->bytes = job->bytes;
+		if (vi->type == UBI_VID_DYNAMIC)
+			vi->used_ebs = (vi->bytes + vi->usable_leb_size - 1) /
+				       vi->usable_leb_size;
+		else
+			vi->used_ebs = (job->bytes + vi->usable_leb_size - 1) /
+				       vi->usable_leb_size;
+		if (ubigen_add_volume(ui, vi, vtbl))
+			return errmsg("cannot add volume for section \"%s\"",
+				      job->sname);
+	}
+
+	return 0;
+}
+
+/*
+ * Write the layout volume after the volumes to an output which cannot seek.
+ * UBI finds it by scanning, wherever it is.
+ */
+static int write_layout_stream(const struct ubigen_info *ui,
+			       const struct ubi_vtbl_record *vtbl)
+{
+	char *buf;
+	int lnum, err = 0;
+
+	buf = malloc(ui->peb_size);
+	if (!buf)
+		return sys_errmsg("failed to allocate %d bytes", ui->peb_size);
+
+	for (lnum = 0; lnum < UBI_LAYOUT_VOLUME_EBS && !err; lnum++) {
+		ubigen_layout_vtbl_peb(ui, lnum, args.ec, vtbl, buf);
+		err = stream_write_peb(ui, buf, 0);
+	}
+
+	free(buf);
+	return err;
+}
+
+/**
+ * write_fastmap - write the fastmap of the image.
+ * @ui: libubigen information
+ * @vtbl: the volume table
+ * @peb_count: count of PEBs of the flash
+ * @fm_blocks: count of PEBs of the fastmap, which follow the layout volume
+ *
+ * The image is expected to be flashed as is, so the PEBs of the image hold
+ * what the fastmap says, and the PEBs after it are erased by UBI.
+ */
+static int write_fastmap(const struct ubigen_info *ui,
+			 const struct ubi_vtbl_record *vtbl, int peb_count,
+			 int fm_blocks)
+{
+	int pnums[UBI_FM_MAX_BLOCKS], i, err = -1;
+	long long ecs[UBI_FM_MAX_BLOCKS];
+	struct ubigen_fastmap *fm;
+
+	fm = ubigen_fm_new(ui, peb_count, args.ec);
+	if (!fm)
+		return -1;
+
+	if (ubigen_fm_add_vtbl(fm, vtbl, 0, 1, args.ec, args.ec))
+		goto out;
+
+	for (i = 0; i < job_cnt; i++)
+		if (ubigen_fm_add_vol(fm, jobs[i].vi, jobs[i].bytes,
+				      jobs[i].offs / ui->peb_size, args.ec))
+			goto out;
+
+	for (i = 0; i < fm_blocks; i++) {
+		pnums[i] = UBI_LAYOUT_VOLUME_EBS + i;
+		ecs[i] = args.ec;
+	}
+
+	err = ubigen_write_fastmap(ui, fm, pnums, ecs, args.out_fd);
+out:
+	ubigen_fm_free(fm);
+	return err;
+}
+
 int main(int argc, char * const argv[])
 {
 	int err = -1, sects, i, autoresize_was_already = 0;
 	struct ubigen_info ui;
 	struct ubi_vtbl_record *vtbl;
 	struct ubigen_vol_info *vi;
-	off_t seek;
+	int peb_count = 0, fm_blocks = 0, seq, from_stdin = 0;
+	off_t offs;
 
 	err = parse_opt(argc, argv);
 	if (err)
 		return -1;
+	seq = args.out_stream;
 
 	ubigen_info_init(&ui, args.peb_size, args.min_io_size,
 			 args.subpage_size, args.vid_hdr_offs,
@@ -459,6 +1165,20 @@ int main(int argc, char * const argv[])
 	verbose(args.verbose, "data offset:               %d", ui.data_offs);
 	verbose(args.verbose, "UBI image sequence number: %u", ui.image_seq);
 
+	if (args.fm_bytes) {
+		peb_count = args.fm_bytes / ui.peb_size;
+		fm_blocks = ubigen_fm_blocks(&ui, peb_count);
+		if (fm_blocks < 0)
+			goto out;
+		verbose(args.verbose, "fastmap PEBs:              %d", fm_blocks);
+	}
+
+	if (args.f_ffmap) {
+		ui.ffmap = ffmap_new(ui.min_io_size);
+		if (!ui.ffmap)
+			goto out;
+	}
+
 	vtbl = ubigen_create_empty_vtbl(&ui);
 	if (!vtbl)
 		goto out;
@@ -493,27 +1213,23 @@ int main(int argc, char * const argv[])
 	}
 
 	vi = calloc(sizeof(struct ubigen_vol_info), sects);
-	if (!vi) {
+	jobs = calloc(sizeof(struct vol_job), sects);
+	if (!vi || !jobs) {
 		errmsg("cannot allocate memory");
-		goto out_dict;
+		goto out_free;
 	}
 
 	/*
 	 * Skip 2 PEBs at the beginning of the file for the volume table which
-	 * will be written later.
+	 * will be written last, and the PEBs of the fastmap after them.
 	 */
-	seek = ui.peb_size * 2;
-	if (lseek(args.out_fd, seek, SEEK_SET) != seek) {
-		err = -1;
-		sys_errmsg("cannot seek file \"%s\"", args.f_out);
-		goto out_free;
-	}
+	offs = (off_t)ui.peb_size * (UBI_LAYOUT_VOLUME_EBS + fm_blocks);
 
 	for (i = 0; i < sects; i++) {
 		const char *sname = iniparser_getsecname(args.dict, i);
 		const char *img = NULL;
 		struct stat st;
-		int fd, j;
+		int j;
 
 		if (!sname) {
 			err = -1;
@@ -560,45 +1276,114 @@ int main(int argc, char * const argv[])
 			autoresize_was_already = 1;
 		}
 
+		/*
+		 * A volume whose image size is not known yet is added again
+		 * once the image is read, which may change its size.
+		 */
 		err = ubigen_add_volume(&ui, &vi[i], vtbl);
 		if (err) {
 			errmsg("cannot add volume for section \"%s\"", sname);
 			goto out_free;
 		}
 
-		if (img) {
-			fd = open(img, O_RDONLY);
-			if (fd == -1) {
-				err = fd;
-				sys_errmsg("cannot open \"%s\"", img);
+		if (img && st.st_size == -1) {
+			/*
+			 * The number of LEBs of a static volume is only put to
+			 * its VID headers once the image is read, which needs
+			 * seeking back, and cannot be done at all for one VID
+			 * header per LEB.
+			 */
+			if (vi[i].type == UBI_VID_STATIC &&
+			    (args.out_stream ||
+			     vi[i].mode == UBI_VID_MODE_MLC_SAFE)) {
+				err = -1;
+				errmsg("the size of the image of static volume in section \"%s\" has to be known",
+				       sname);
 				goto out_free;
 			}
-
-			verbose(args.verbose, "writing volume %d", vi[i].id);
-			verbose(args.verbose, "image file: %s", img);
-
-			err = ubigen_write_volume(&ui, &vi[i], args.ec, st.st_size, fd, args.out_fd);
-			close(fd);
-			if (err) {
-				errmsg("cannot write volume for section \"%s\"", sname);
+			if (!strcmp(img, "-") && from_stdin++) {
+				err = -1;
+				errmsg("only one volume image may be read from stdin");
 				goto out_free;
 			}
+			seq = 1;
+		}
+
+		if (img) {
+			/* The volumes are written once all are known */
+			jobs[job_cnt].vi = &vi[i];
+			jobs[job_cnt].sname = sname;
+			jobs[job_cnt].img = img;
+			jobs[job_cnt].bytes = st.st_size;
+			jobs[job_cnt].offs = offs;
+			job_cnt += 1;
+			if (st.st_size != -1)
+				offs += (off_t)ubigen_volume_pebs(&ui, &vi[i],
+								  st.st_size) *
+					ui.peb_size;
 		}
 
 		if (args.verbose)
 			printf("\n");
 	}
 
+	if (!seq) {
+		err = write_volumes(&ui);
+	} else {
+		/*
+		 * The offsets of the volumes are only known once the images
+		 * before them are read, and an output which cannot seek gets
+		 * the volume table last.
+		 */
+		offs = (off_t)ui.peb_size * fm_blocks;
+		if (!args.out_stream)
+			offs += (off_t)ui.peb_size * UBI_LAYOUT_VOLUME_EBS;
+		err = write_volumes_seq(&ui, vtbl, &offs);
+	}
+	if (err)
+		goto out_free;
+
+	if (peb_count && offs > (off_t)peb_count * ui.peb_size) {
+		err = -1;
+		errmsg("the image takes %lld PEBs, but the flash has only %d",
+		       (long long)(offs / ui.peb_size), peb_count);
+		goto out_free;
+	}
+
+	if (fm_blocks) {
+		verbose(args.verbose, "writing fastmap");
+
+		err = write_fastmap(&ui, vtbl, peb_count, fm_blocks);
+		if (err) {
+			errmsg("cannot write fastmap");
+			goto out_free;
+		}
+	}
+
 	verbose(args.verbose, "writing layout volume");
 
-	err = ubigen_write_layout_vol(&ui, 0, 1, args.ec, args.ec, vtbl, args.out_fd);
+	if (args.out_stream)
+		err = write_layout_stream(&ui, vtbl);
+	else
+		err = ubigen_write_layout_vol(&ui, 0, 1, args.ec, args.ec,
+					      vtbl, args.out_fd);
 	if (err) {
 		errmsg("cannot write layout volume");
 		goto out_free;
 	}
 
+	if (ui.ffmap) {
+		err = ffmap_save(ui.ffmap, args.out_fd, args.f_ffmap);
+		if (err) {
+			errmsg("cannot write the ff-map");
+			goto out_free;
+		}
+	}
+
 	verbose(args.verbose, "done");
 
+	ffmap_free(ui.ffmap);
+	free(jobs);
 	free(vi);
 	iniparser_freedict(args.dict);
 	free(vtbl);
@@ -606,13 +1391,16 @@ int main(int argc, char * const argv[])
 	return 0;
 
 out_free:
+	free(jobs);
 	free(vi);
 out_dict:
 	iniparser_freedict(args.dict);
 out_vtbl:
 	free(vtbl);
 out:
+	ffmap_free(ui.ffmap);
 	close(args.out_fd);
-	remove(args.f_out);
+	if (!args.out_stream && strcmp(args.f_out, "-"))
+		remove(args.f_out);
 	return err;
 }
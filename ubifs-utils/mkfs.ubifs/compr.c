@@ -24,9 +24,13 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <string.h>
+#include <math.h>
 #ifndef WITHOUT_LZO
 #include <lzo/lzo1x.h>
 #endif
+#ifndef WITHOUT_ZSTD
+#include <zstd.h>
+#endif
 #include <linux/types.h>
 
 #define crc32 __zlib_crc32
@@ -36,11 +40,17 @@
 #include "compr.h"
 #include "mkfs.ubifs.h"
 
-static void *lzo_mem;
+/*
+ * The compressors may be called from several threads at once, so the work
+ * buffers are per-thread and the error counter is updated atomically.
+ */
+static __thread void *lzo_mem;
+static __thread char *zlib_buf;
+#ifndef WITHOUT_ZSTD
+static __thread ZSTD_CCtx *zstd_ctx;
+#endif
 static unsigned long long errcnt = 0;
-#ifndef WITHOUT_LZO
 static struct ubifs_info *c = &info_;
-#endif
 
 #define DEFLATE_DEF_LEVEL     Z_DEFAULT_COMPRESSION
 #define DEFLATE_DEF_WINBITS   11
@@ -58,10 +68,12 @@ static int zlib_deflate(void *in_buf, size_t in_len, void *out_buf,
 	 * Match exactly the zlib parameters used by the Linux kernel crypto
 	 * API.
 	 */
-        if (deflateInit2(&strm, DEFLATE_DEF_LEVEL, Z_DEFLATED,
+        if (deflateInit2(&strm,
+			 c->compr_level ? c->compr_level : DEFLATE_DEF_LEVEL,
+			 Z_DEFLATED,
 			 -DEFLATE_DEF_WINBITS, DEFLATE_DEF_MEMLEVEL,
 			 Z_DEFAULT_STRATEGY)) {
-		errcnt += 1;
+		__sync_fetch_and_add(&errcnt, 1);
 		return -1;
 	}
 
@@ -75,12 +87,12 @@ static int zlib_deflate(void *in_buf, size_t in_len, void *out_buf,
 
 	if (deflate(&strm, Z_FINISH) != Z_STREAM_END) {
 		deflateEnd(&strm);
-		errcnt += 1;
+		__sync_fetch_and_add(&errcnt, 1);
 		return -1;
 	}
 
 	if (deflateEnd(&strm) != Z_OK) {
-		errcnt += 1;
+		__sync_fetch_and_add(&errcnt, 1);
 		return -1;
 	}
 
@@ -101,10 +113,34 @@ static int lzo_compress(void *in_buf, size_t in_len, void *out_buf,
 	*out_len = len;
 
 	if (ret != LZO_E_OK) {
-		errcnt += 1;
+		__sync_fetch_and_add(&errcnt, 1);
+		return -1;
+	}
+
+	return 0;
+}
+#endif
+
+#ifndef WITHOUT_ZSTD
+static int zstd_compress(void *in_buf, size_t in_len, void *out_buf,
+			 size_t *out_len)
+{
+	size_t ret;
+
+	/*
+	 * The context is kept for all the blocks the thread compresses, so
+	 * that its tables are only allocated once.
+	 */
+	ret = ZSTD_compressCCtx(zstd_ctx, out_buf, *out_len, in_buf, in_len,
+				c->compr_level ? c->compr_level :
+						 ZSTD_CLEVEL_DEFAULT);
+	if (ZSTD_isError(ret)) {
+		__sync_fetch_and_add(&errcnt, 1);
 		return -1;
 	}
 
+	*out_len = ret;
+
 	return 0;
 }
 #endif
@@ -117,18 +153,98 @@ static int no_compress(void *in_buf, size_t in_len, void *out_buf,
 	return 0;
 }
 
-static char *zlib_buf;
-
 #ifndef WITHOUT_LZO
+/*
+ * Blocks with a byte entropy above this many bits per byte and no repeated
+ * sequences are taken for already compressed data. Note, the entropy of a
+ * random 4KiB block is estimated at about 7.95 bits per byte.
+ */
+#define ENTROPY_INCOMPRESSIBLE 7.8
+
+/*
+ * zlib mostly gains over LZO by Huffman coding the literals, which cannot
+ * shrink the data much below its byte entropy. zlib is tried only if the
+ * entropy is less than this many bits per byte above the entropy which would
+ * let zlib win by 'favor_percent'.
+ */
+#define ENTROPY_MARGIN 1.0
+
+/**
+ * byte_entropy - estimate the entropy of a block.
+ * @buf: the block
+ * @len: length of the block
+ *
+ * Returns the order-0 entropy of the bytes in @buf in bits per byte.
+ */
+static double byte_entropy(const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+	unsigned int cnt[256] = { 0 };
+	double h = 0;
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		cnt[p[i]] += 1;
+	for (i = 0; i < 256; i++)
+		if (cnt[i]) {
+			double f = (double)cnt[i] / len;
+
+			h -= f * log2(f);
+		}
+	return h;
+}
+
+/**
+ * has_repeats - check whether a block contains repeated sequences.
+ * @buf: the block
+ * @len: length of the block, at most %UBIFS_BLOCK_SIZE
+ *
+ * This is a cheap LZ probe: it looks for 4-byte sequences seen before in the
+ * block, like LZ compressors do, and returns %1 if there are enough of them
+ * to matter and %0 if not.
+ */
+static int has_repeats(const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+	uint16_t last[1 << 12];
+	size_t i, matches = 0;
+
+	memset(last, 0, sizeof(last));
+	for (i = 0; i + 4 <= len; i++) {
+		uint32_t v, h;
+
+		memcpy(&v, p + i, 4);
+		h = (v * 2654435761U) >> 20;
+		if (last[h] && !memcmp(p + last[h] - 1, p + i, 4))
+			matches += 1;
+		last[h] = i + 1;
+	}
+	return matches > len / 64;
+}
+
 static int favor_lzo_compress(void *in_buf, size_t in_len, void *out_buf,
 			       size_t *out_len, int *type)
 {
-	int lzo_ret, zlib_ret;
+	int lzo_ret, zlib_ret = -1, try_zlib = 1;
 	size_t lzo_len, zlib_len;
 
+	if (c->favor_probe) {
+		double h = byte_entropy(in_buf, in_len);
+
+		if (h > ENTROPY_INCOMPRESSIBLE && !has_repeats(in_buf, in_len)) {
+			/* Already compressed data, do not bother */
+			no_compress(in_buf, in_len, out_buf, out_len);
+			*type = MKFS_UBIFS_COMPR_NONE;
+			return 0;
+		}
+		try_zlib = h < 8.0 * (100 - c->favor_percent) / 100 +
+			       ENTROPY_MARGIN;
+	}
+
 	lzo_len = zlib_len = *out_len;
 	lzo_ret = lzo_compress(in_buf, in_len, out_buf, &lzo_len);
-	zlib_ret = zlib_deflate(in_buf, in_len, zlib_buf, &zlib_len);
+	if (try_zlib || lzo_ret)
+		zlib_ret = zlib_deflate(in_buf, in_len, zlib_buf, &zlib_len);
 
 	if (lzo_ret && zlib_ret)
 		/* Both compressors failed */
@@ -192,11 +308,16 @@ int compress_data(void *in_buf, size_t in_len, void *out_buf, size_t *out_len,
 		case MKFS_UBIFS_COMPR_ZLIB:
 			ret = zlib_deflate(in_buf, in_len, out_buf, out_len);
 			break;
+#ifndef WITHOUT_ZSTD
+		case MKFS_UBIFS_COMPR_ZSTD:
+			ret = zstd_compress(in_buf, in_len, out_buf, out_len);
+			break;
+#endif
 		case MKFS_UBIFS_COMPR_NONE:
 			ret = 1;
 			break;
 		default:
-			errcnt += 1;
+			__sync_fetch_and_add(&errcnt, 1);
 			ret = 1;
 			break;
 		}
@@ -208,7 +329,14 @@ int compress_data(void *in_buf, size_t in_len, void *out_buf, size_t *out_len,
 	return type;
 }
 
-int init_compression(void)
+/**
+ * init_compression_thread - allocate the compressor buffers of the calling
+ *                           thread.
+ *
+ * Every thread which calls 'compress_data()' has to call this function first.
+ * Returns zero in case of success and %-1 in case of failure.
+ */
+int init_compression_thread(void)
 {
 #ifdef WITHOUT_LZO
 	lzo_mem = NULL;
@@ -224,13 +352,42 @@ int init_compression(void)
 		return -1;
 	}
 
+#ifndef WITHOUT_ZSTD
+	zstd_ctx = ZSTD_createCCtx();
+	if (!zstd_ctx) {
+		free(zlib_buf);
+		free(lzo_mem);
+		return -1;
+	}
+#endif
+
 	return 0;
 }
 
-void destroy_compression(void)
+/**
+ * destroy_compression_thread - free the compressor buffers of the calling
+ *                              thread.
+ */
+void destroy_compression_thread(void)
 {
 	free(zlib_buf);
 	free(lzo_mem);
+	zlib_buf = NULL;
+	lzo_mem = NULL;
+#ifndef WITHOUT_ZSTD
+	ZSTD_freeCCtx(zstd_ctx);
+	zstd_ctx = NULL;
+#endif
+}
+
+int init_compression(void)
+{
+	return init_compression_thread();
+}
+
+void destroy_compression(void)
+{
+	destroy_compression_thread();
 	if (errcnt)
 		fprintf(stderr, "%llu compression errors occurred\n", errcnt);
 }
@@ -36,11 +36,14 @@ enum compression_type
 	MKFS_UBIFS_COMPR_NONE,
 	MKFS_UBIFS_COMPR_LZO,
 	MKFS_UBIFS_COMPR_ZLIB,
+	MKFS_UBIFS_COMPR_ZSTD,
 };
 
 int compress_data(void *in_buf, size_t in_len, void *out_buf, size_t *out_len,
 		  int type);
 int init_compression(void);
 void destroy_compression(void);
+int init_compression_thread(void);
+void destroy_compression_thread(void);
 
 #endif
@@ -0,0 +1,476 @@
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/*
+ * This file implements a persistent cache of compressed data blocks. Images
+ * which are rebuilt often tend to contain mostly the same file data as the
+ * previous build, so the result of compressing each block is stored in a file
+ * and looked up by the SHA-256 digest of the block and the compression
+ * settings the next time. The cache file has a size limit, the least recently
+ * used blocks are dropped when it is reached.
+ *
+ * The cache file starts with a 'struct cc_hdr' followed by the cached blocks,
+ * least recently used first, each one a 'struct cc_rec' followed by the
+ * compressed data. Blocks which do not compress have no data. The data is put
+ * to the image as it is, so each record is protected by a CRC.
+ */
+
+#include <pthread.h>
+#include <crc32.h>
+
+#include "mkfs.ubifs.h"
+#include "compr_cache.h"
+#include "sha256.h"
+#include "hashtable/hashtable.h"
+
+#define CC_MAGIC "UBIFSCC\n"
+#define CC_VERSION 2
+
+static struct ubifs_info *c = &info_;
+
+/**
+ * struct cc_hdr - compression cache file header.
+ * @magic: %CC_MAGIC
+ * @version: %CC_VERSION
+ * @padding: reserved for future, zeroes
+ */
+struct cc_hdr {
+	char magic[8];
+	__le32 version;
+	__le32 padding;
+} __attribute__ ((packed));
+
+/**
+ * struct cc_rec - cached block in the compression cache file.
+ * @crc: CRC-32 checksum of the rest of the record and the compressed data
+ * @digest: digest of the uncompressed block and the compression settings
+ * @compr_type: compression type the block was compressed with
+ * @padding: reserved for future, zeroes
+ * @len: length of the compressed data which follows
+ */
+struct cc_rec {
+	__le32 crc;
+	uint8_t digest[SHA256_DIGEST_SIZE];
+	__le16 compr_type;
+	__le16 padding;
+	__le32 len;
+} __attribute__ ((packed));
+
+/**
+ * struct cc_entry - cached block.
+ * @digest: digest of the uncompressed block and the compression settings
+ * @prev: previous entry on the LRU list (more recently used)
+ * @next: next entry on the LRU list (less recently used)
+ * @compr_type: compression type the block was compressed with
+ * @len: length of the compressed data, %0 if the block is not compressed
+ * @data: compressed data
+ *
+ * The entry is both the key and the value in the hash table, so @digest has
+ * to be the first member.
+ */
+struct cc_entry {
+	uint8_t digest[SHA256_DIGEST_SIZE];
+	struct cc_entry *prev;
+	struct cc_entry *next;
+	int compr_type;
+	unsigned int len;
+	uint8_t data[];
+};
+
+/**
+ * struct compr_cache - the compression cache.
+ * @path: cache file
+ * @max_size: maximum size of the cache file
+ * @size: the size the cache file would have now
+ * @htbl: cached blocks by digest
+ * @first: most recently used entry
+ * @last: least recently used entry
+ * @hits: how many blocks were found in the cache
+ * @misses: how many blocks were not found in the cache
+ * @lock: protects all of the above, the cache is used by the compression
+ *        threads
+ */
+struct compr_cache {
+	const char *path;
+	long long max_size;
+	long long size;
+	struct hashtable *htbl;
+	struct cc_entry *first;
+	struct cc_entry *last;
+	unsigned long long hits;
+	unsigned long long misses;
+	pthread_mutex_t lock;
+};
+
+static struct compr_cache cache = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static unsigned int cc_hash(void *k)
+{
+	uint32_t hash;
+
+	memcpy(&hash, k, sizeof(hash));
+	return hash;
+}
+
+static int cc_equal(void *k1, void *k2)
+{
+	return !memcmp(k1, k2, SHA256_DIGEST_SIZE);
+}
+
+/**
+ * cc_digest - calculate the cache key of a block.
+ * @in_buf: uncompressed block
+ * @in_len: length of the block
+ * @type: compressor the block is compressed with
+ * @digest: the digest is returned here
+ */
+static void cc_digest(const void *in_buf, size_t in_len, int type,
+		      uint8_t *digest)
+{
+	struct sha256_ctx ctx;
+	__le32 settings[6];
+
+	settings[0] = cpu_to_le32(CC_VERSION);
+	settings[1] = cpu_to_le32(type);
+	settings[2] = cpu_to_le32(c->favor_lzo);
+	settings[3] = cpu_to_le32(c->favor_percent);
+	settings[4] = cpu_to_le32(c->favor_probe);
+	settings[5] = cpu_to_le32(c->compr_level);
+
+	sha256_init(&ctx);
+	sha256_update(&ctx, settings, sizeof(settings));
+	sha256_update(&ctx, in_buf, in_len);
+	sha256_final(&ctx, digest);
+}
+
+static void cc_unlink(struct cc_entry *e)
+{
+	if (e->prev)
+		e->prev->next = e->next;
+	else
+		cache.first = e->next;
+	if (e->next)
+		e->next->prev = e->prev;
+	else
+		cache.last = e->prev;
+}
+
+static void cc_link_first(struct cc_entry *e)
+{
+	e->prev = NULL;
+	e->next = cache.first;
+	if (cache.first)
+		cache.first->prev = e;
+	else
+		cache.last = e;
+	cache.first = e;
+}
+
+/* Drop the least recently used entry */
+static void cc_evict(void)
+{
+	struct cc_entry *e = cache.last;
+
+	cc_unlink(e);
+	cache.size -= sizeof(struct cc_rec) + e->len;
+	/* This frees @e as it is the key */
+	hashtable_remove(cache.htbl, e->digest);
+}
+
+/**
+ * cc_insert - add a block to the cache.
+ * @digest: digest of the block
+ * @compr_type: compression type of the block
+ * @data: compressed data
+ * @len: compressed data length, %0 if the block is not compressed
+ *
+ * The cache is only an optimization, so this function silently gives up if it
+ * runs out of memory. The caller has to hold @cache.lock.
+ */
+static void cc_insert(const uint8_t *digest, int compr_type, const void *data,
+		      unsigned int len)
+{
+	long long sz = sizeof(struct cc_rec) + len;
+	struct cc_entry *e;
+
+	if (sz > cache.max_size - (long long)sizeof(struct cc_hdr))
+		return;
+	/* Another thread may have added the same block meanwhile */
+	if (hashtable_search(cache.htbl, (void *)digest))
+		return;
+
+	while (cache.size + sz > cache.max_size)
+		cc_evict();
+
+	e = malloc(sizeof(struct cc_entry) + len);
+	if (!e)
+		return;
+	memcpy(e->digest, digest, SHA256_DIGEST_SIZE);
+	e->compr_type = compr_type;
+	e->len = len;
+	if (len)
+		memcpy(e->data, data, len);
+	if (!hashtable_insert(cache.htbl, e, e)) {
+		free(e);
+		return;
+	}
+	cc_link_first(e);
+	cache.size += sz;
+}
+
+/**
+ * compr_cache_compress - compress a block using the compression cache.
+ * @in_buf: data to compress
+ * @in_len: length of the data
+ * @out_buf: output buffer
+ * @out_len: output buffer size is passed here, and the compressed data length
+ *           is returned here
+ * @type: compressor to use
+ *
+ * The same as 'compress_data()', but the compressed data is taken from the
+ * cache if the same block was compressed the same way before.
+ */
+int compr_cache_compress(void *in_buf, size_t in_len, void *out_buf,
+			 size_t *out_len, int type)
+{
+	uint8_t digest[SHA256_DIGEST_SIZE];
+	struct cc_entry *e;
+	int compr_type;
+
+	if (!cache.htbl || in_len < UBIFS_MIN_COMPR_LEN ||
+	    type == MKFS_UBIFS_COMPR_NONE)
+		return compress_data(in_buf, in_len, out_buf, out_len, type);
+
+	cc_digest(in_buf, in_len, type, digest);
+
+	pthread_mutex_lock(&cache.lock);
+	e = hashtable_search(cache.htbl, digest);
+	if (e && e->len <= *out_len) {
+		cc_unlink(e);
+		cc_link_first(e);
+		if (e->len) {
+			memcpy(out_buf, e->data, e->len);
+			*out_len = e->len;
+		} else {
+			memcpy(out_buf, in_buf, in_len);
+			*out_len = in_len;
+		}
+		compr_type = e->compr_type;
+		cache.hits += 1;
+		pthread_mutex_unlock(&cache.lock);
+		return compr_type;
+	}
+	cache.misses += 1;
+	pthread_mutex_unlock(&cache.lock);
+
+	compr_type = compress_data(in_buf, in_len, out_buf, out_len, type);
+
+	pthread_mutex_lock(&cache.lock);
+	if (compr_type == MKFS_UBIFS_COMPR_NONE)
+		cc_insert(digest, compr_type, NULL, 0);
+	else
+		cc_insert(digest, compr_type, out_buf, *out_len);
+	pthread_mutex_unlock(&cache.lock);
+
+	return compr_type;
+}
+
+/* CRC of cache file record @rec and its data @data of @len bytes */
+static uint32_t cc_rec_crc(const struct cc_rec *rec, const void *data,
+			   unsigned int len)
+{
+	uint32_t crc;
+
+	crc = mtd_crc32(UBIFS_CRC32_INIT, (const void *)rec + 4,
+			sizeof(struct cc_rec) - 4);
+	return mtd_crc32(crc, data, len);
+}
+
+/*
+ * Check that a record read from the cache file describes a block the way
+ * 'compr_cache_compress()' stores it: only blocks which do not compress have
+ * no data.
+ */
+static int cc_rec_valid(int compr_type, unsigned int len)
+{
+	switch (compr_type) {
+	case MKFS_UBIFS_COMPR_NONE:
+		return len == 0;
+	case MKFS_UBIFS_COMPR_LZO:
+	case MKFS_UBIFS_COMPR_ZLIB:
+	case MKFS_UBIFS_COMPR_ZSTD:
+		return len != 0;
+	default:
+		return 0;
+	}
+}
+
+/**
+ * cc_load - read the cache file.
+ *
+ * A missing cache file is not an error, and neither is a broken one, the
+ * cache then starts empty. Returns %0 in case of success and %-1 in case of
+ * failure.
+ */
+static int cc_load(void)
+{
+	uint8_t *buf;
+	struct cc_hdr hdr;
+	struct cc_rec rec;
+	FILE *f;
+	int err = 0;
+
+	f = fopen(cache.path, "r");
+	if (!f) {
+		if (errno == ENOENT)
+			return 0;
+		return sys_err_msg("cannot open compression cache '%s'",
+				   cache.path);
+	}
+
+	if (fread(&hdr, sizeof(hdr), 1, f) != 1 ||
+	    memcmp(hdr.magic, CC_MAGIC, sizeof(hdr.magic)) ||
+	    le32_to_cpu(hdr.version) != CC_VERSION) {
+		warnmsg("'%s' is not a compression cache, ignoring it",
+			cache.path);
+		goto out;
+	}
+
+	buf = xmalloc(UBIFS_BLOCK_SIZE);
+	while (fread(&rec, sizeof(rec), 1, f) == 1) {
+		unsigned int len = le32_to_cpu(rec.len);
+		int compr_type = le16_to_cpu(rec.compr_type);
+
+		if (len > UBIFS_BLOCK_SIZE ||
+		    (len && fread(buf, len, 1, f) != 1) ||
+		    le32_to_cpu(rec.crc) != cc_rec_crc(&rec, buf, len) ||
+		    !cc_rec_valid(compr_type, len)) {
+			warnmsg("compression cache '%s' is corrupted, ignoring the rest of it",
+				cache.path);
+			break;
+		}
+		cc_insert(rec.digest, compr_type, buf, len);
+	}
+	if (ferror(f))
+		err = sys_err_msg("cannot read compression cache '%s'",
+				  cache.path);
+	free(buf);
+
+out:
+	fclose(f);
+	return err;
+}
+
+/**
+ * cc_save - write the cache file.
+ *
+ * The cache is written to a temporary file first which then replaces the old
+ * cache file. Returns %0 in case of success and %-1 in case of failure.
+ */
+static int cc_save(void)
+{
+	struct cc_entry *e;
+	struct cc_hdr hdr;
+	char *tmp;
+	FILE *f;
+
+	xasprintf(&tmp, "%s.tmp", cache.path);
+	f = fopen(tmp, "w");
+	if (!f) {
+		sys_err_msg("cannot create '%s'", tmp);
+		free(tmp);
+		return -1;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, CC_MAGIC, sizeof(hdr.magic));
+	hdr.version = cpu_to_le32(CC_VERSION);
+	fwrite(&hdr, sizeof(hdr), 1, f);
+
+	for (e = cache.last; e; e = e->prev) {
+		struct cc_rec rec;
+
+		memcpy(rec.digest, e->digest, SHA256_DIGEST_SIZE);
+		rec.compr_type = cpu_to_le16(e->compr_type);
+		rec.padding = 0;
+		rec.len = cpu_to_le32(e->len);
+		rec.crc = cpu_to_le32(cc_rec_crc(&rec, e->data, e->len));
+		fwrite(&rec, sizeof(rec), 1, f);
+		if (e->len)
+			fwrite(e->data, 1, e->len, f);
+	}
+
+	if (ferror(f) || fclose(f)) {
+		sys_err_msg("cannot write '%s'", tmp);
+		unlink(tmp);
+		free(tmp);
+		return -1;
+	}
+	if (rename(tmp, cache.path)) {
+		sys_err_msg("cannot rename '%s' to '%s'", tmp, cache.path);
+		unlink(tmp);
+		free(tmp);
+		return -1;
+	}
+	free(tmp);
+	return 0;
+}
+
+/**
+ * compr_cache_open - start using the compression cache.
+ * @path: cache file
+ * @max_size: maximum size of the cache file
+ *
+ * Returns %0 in case of success and %-1 in case of failure.
+ */
+int compr_cache_open(const char *path, long long max_size)
+{
+	cache.path = path;
+	cache.max_size = max_size;
+	cache.size = sizeof(struct cc_hdr);
+	cache.htbl = create_hashtable(1024, &cc_hash, &cc_equal);
+	if (!cache.htbl)
+		return err_msg("cannot create the compression cache");
+	return cc_load();
+}
+
+/**
+ * compr_cache_close - write the compression cache back and free it.
+ *
+ * Also prints the cache statistics. Failing to write the cache file does not
+ * affect the image, so it is only warned about.
+ */
+void compr_cache_close(void)
+{
+	unsigned long long total = cache.hits + cache.misses;
+
+	if (!cache.htbl)
+		return;
+
+	printf("compression cache: %llu hits, %llu misses (%llu%% hit rate), %u blocks, %lld bytes\n",
+	       cache.hits, cache.misses,
+	       total ? cache.hits * 100 / total : 0,
+	       hashtable_count(cache.htbl), cache.size);
+
+	if (cc_save())
+		warnmsg("the compression cache was not saved");
+
+	/* The entries are the keys, so this frees them */
+	hashtable_destroy(cache.htbl, 0);
+	cache.htbl = NULL;
+	cache.first = cache.last = NULL;
+}
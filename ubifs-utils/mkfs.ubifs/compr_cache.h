@@ -0,0 +1,26 @@
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef __UBIFS_COMPR_CACHE_H__
+#define __UBIFS_COMPR_CACHE_H__
+
+#include <stdlib.h>
+
+int compr_cache_open(const char *path, long long max_size);
+void compr_cache_close(void);
+int compr_cache_compress(void *in_buf, size_t in_len, void *out_buf,
+			 size_t *out_len, int type);
+
+#endif
@@ -25,10 +25,16 @@
 #include "mkfs.ubifs.h"
 #include <crc32.h>
 #include "common.h"
+#include <libffmap.h>
+#include "compr_cache.h"
 #include <sys/types.h>
+#include <pthread.h>
 #ifndef WITHOUT_XATTR
 #include <sys/xattr.h>
 #endif
+#ifndef WITHOUT_ZSTD
+#include <zstd.h>
+#endif
 
 /* Size (prime number) of hash table for link counting */
 #define HASH_TABLE_SIZE 10099
@@ -37,26 +43,25 @@
 #define NODE_BUFFER_SIZE (UBIFS_DATA_NODE_SZ + \
 			  UBIFS_BLOCK_SIZE * WORST_COMPR_FACTOR)
 
+/* How many nodes the compression pipeline may hold per compression thread */
+#define PIPE_SLOTS_PER_JOB 8
+
 /* Default time granularity in nanoseconds */
 #define DEFAULT_TIME_GRAN 1000000000
 
 /**
  * struct idx_entry - index entry.
- * @next: next index entry (NULL at end of list)
- * @prev: previous index entry (NULL at beginning of list)
  * @key: key
  * @name: directory entry name used for sorting colliding keys by name
  * @lnum: LEB number
  * @offs: offset
  * @len: length
  *
- * The index is recorded as a linked list which is sorted and used to create
- * the bottom level of the on-flash index tree. The remaining levels of the
- * index tree are each built from the level below.
+ * The index is recorded in an array which is sorted and used to create the
+ * bottom level of the on-flash index tree. The remaining levels of the index
+ * tree are each built from the level below.
  */
 struct idx_entry {
-	struct idx_entry *next;
-	struct idx_entry *prev;
 	union ubifs_key key;
 	char *name;
 	int lnum;
@@ -64,6 +69,40 @@ struct idx_entry {
 	int len;
 };
 
+/**
+ * struct idx_rec - index entry in a run file.
+ * @key: key
+ * @lnum: LEB number
+ * @offs: offset
+ * @len: length
+ * @nlen: length of the name which follows the record, %-1 if there is none
+ */
+struct idx_rec {
+	uint32_t key[2];
+	int32_t lnum;
+	int32_t offs;
+	int32_t len;
+	int32_t nlen;
+};
+
+/**
+ * struct idx_run - sorted run of index entries spilled to a temporary file.
+ * @f: the run file
+ * @left: how many entries are left to read
+ * @e: the current entry while merging the runs
+ * @name: name of the current entry
+ *
+ * With the '--index-mem' option, the index entries are sorted and written to
+ * a run file whenever they take more memory than allowed. 'write_index()'
+ * reads the index back by merging the runs.
+ */
+struct idx_run {
+	FILE *f;
+	size_t left;
+	struct idx_entry e;
+	char name[UBIFS_MAX_NLEN + 1];
+};
+
 /**
  * struct inum_mapping - inode number mapping for link counting.
  * @next: next inum_mapping (NULL at end of list)
@@ -95,6 +134,27 @@ struct inum_mapping {
 	struct stat st;
 };
 
+/**
+ * struct dent_info - a directory entry and its looked up attributes.
+ * @name: entry name
+ * @path: path name of the entry
+ * @st: attributes of the entry
+ * @xattrs: extended attributes of the entry in the 'read_xattrs()' format
+ * @xattr_len: length of @xattrs, %-1 if they were not looked up
+ * @ok: @st was looked up, otherwise the writer looks it up again and reports
+ *      the error
+ * @done: the entry was looked up
+ */
+struct dent_info {
+	char *name;
+	char *path;
+	struct stat st;
+	char *xattrs;
+	ssize_t xattr_len;
+	int ok;
+	int done;
+};
+
 /*
  * Because we copy functions from the kernel, we use a subset of the UBIFS
  * file-system description object struct ubifs_info.
@@ -116,16 +176,34 @@ static int out_fd;
 static int out_ubi;
 static int squash_owner;
 static int do_create_inum_attr;
+static int jobs = 1;
+static int stat_jobs;
+static const char *ff_map;
 
 /* The 'head' (position) which nodes are written */
 static int head_lnum;
 static int head_offs;
 static int head_flags;
 
-/* The index list */
-static struct idx_entry *idx_list_first;
-static struct idx_entry *idx_list_last;
+/* The index entries, 'idx_max' is how many of them fit in 'idx_arr' */
+static struct idx_entry *idx_arr;
 static size_t idx_cnt;
+static size_t idx_max;
+static size_t idx_pos;
+
+/* Memory limit for the index entries, 0 if there is none */
+static long long index_mem;
+
+/* Compression cache file and its maximum size */
+static const char *compr_cache;
+static long long compr_cache_size = 256 * 1024 * 1024;
+
+/* Index runs spilled to temporary files, and the heap to merge them */
+static struct idx_run *idx_runs;
+static int idx_run_cnt;
+static size_t idx_spilled;
+static struct idx_run **idx_heap;
+static size_t idx_heap_cnt;
 
 /* Global buffers */
 static void *leb_buf;
@@ -138,9 +216,20 @@ static struct inum_mapping **hash_table;
 /* Inode creation sequence number */
 static unsigned long long creat_sqnum;
 
-static const char *optstring = "d:r:m:o:D:yh?vVe:c:g:f:Fp:k:x:X:j:R:l:j:UQqa";
+/* The directory entry being written, if its attributes were looked up */
+static struct dent_info *cur_dent;
+
+static const char *optstring = "d:r:m:o:D:yh?vVe:c:g:f:Fp:k:x:X:j:J:R:l:j:UQqa";
 
 static const struct option longopts[] = {
+	/* Order matters for opts w/val=0; see the 'case 0' below. */
+	{"ff-map",             1, NULL, 0},
+	{"index-mem",          1, NULL, 0},
+	{"compr-cache",        1, NULL, 0},
+	{"compr-cache-size",   1, NULL, 0},
+	{"favor-probe",        0, NULL, 0},
+	{"compr-level",        1, NULL, 0},
+	{"stat-jobs",          1, NULL, 0},
 	{"root",               1, NULL, 'r'},
 	{"min-io-size",        1, NULL, 'm'},
 	{"leb-size",           1, NULL, 'e'},
@@ -163,6 +252,7 @@ static const struct option longopts[] = {
 	{"orph-lebs",          1, NULL, 'p'},
 	{"squash-uids" ,       0, NULL, 'U'},
 	{"set-inode-attr",     0, NULL, 'a'},
+	{"jobs",               1, NULL, 'J'},
 	{NULL, 0, NULL, 0}
 };
 
@@ -184,11 +274,16 @@ static const char *helptext =
 "-o, --output=FILE        output to FILE\n"
 "-j, --jrn-size=SIZE      journal size\n"
 "-R, --reserved=SIZE      how much space should be reserved for the super-user\n"
-"-x, --compr=TYPE         compression type - \"lzo\", \"favor_lzo\", \"zlib\" or\n"
-"                         \"none\" (default: \"lzo\")\n"
+"-x, --compr=TYPE         compression type - \"lzo\", \"favor_lzo\", \"zlib\",\n"
+"                         \"zstd\" or \"none\" (default: \"lzo\")\n"
+"    --compr-level=NUM    zlib (1-9) or zstd (1-22) compression level, the default\n"
+"                         is 6 for zlib and 3 for zstd\n"
 "-X, --favor-percent      may only be used with favor LZO compression and defines\n"
 "                         how many percent better zlib should compress to make\n"
 "                         mkfs.ubifs use zlib instead of LZO (default 20%)\n"
+"    --favor-probe        with favor LZO compression, store blocks which look\n"
+"                         incompressible as they are, and try zlib only if it\n"
+"                         may win (faster, but the image may differ)\n"
 "-f, --fanout=NUM         fanout NUM (default: 8)\n"
 "-F, --space-fixup        file-system free space has to be fixed up on first mount\n"
 "                         (requires kernel version 3.0 or greater)\n"
@@ -206,17 +301,36 @@ static const char *helptext =
 "-a, --set-inum-attr      create user.image-inode-number extended attribute on files\n"
 "                         added to the image. The attribute will contain the inode\n"
 "                         number the file has in the generated image.\n"
+"-J, --jobs=NUM           compress file data with NUM threads (default: 1), the\n"
+"                         image does not depend on the number of threads\n"
+"    --stat-jobs=NUM      look up file attributes and extended attributes with\n"
+"                         NUM threads ahead of writing the files (default: 0)\n"
+"    --ff-map=FILE        write the image as a sparse file leaving out the regions\n"
+"                         of 0xFF bytes, and list the regions containing data in\n"
+"                         FILE; the holes read back as zeroes, so the image is\n"
+"                         only valid together with FILE\n"
+"    --index-mem=SIZE     use at most SIZE bytes of memory for sorting the index\n"
+"                         and spill the rest of it to temporary files in $TMPDIR\n"
+"    --compr-cache=FILE   reuse compressed data blocks from earlier runs, which\n"
+"                         are kept in FILE\n"
+"    --compr-cache-size=SIZE\n"
+"                         maximum size of the compression cache file, the least\n"
+"                         recently used blocks are dropped (default: 256MiB)\n"
 "-h, --help               display this help text\n\n"
 "Note, SIZE is specified in bytes, but it may also be specified in Kilobytes,\n"
 "Megabytes, and Gigabytes if a KiB, MiB, or GiB suffix is used.\n\n"
-"If you specify \"lzo\" or \"zlib\" compressors, mkfs.ubifs will use this compressor\n"
-"for all data. The \"none\" disables any data compression. The \"favor_lzo\" is not\n"
-"really a separate compressor. It is just a method of combining \"lzo\" and \"zlib\"\n"
-"compressors. Namely, mkfs.ubifs tries to compress data with both \"lzo\" and \"zlib\"\n"
+"If you specify \"lzo\", \"zlib\" or \"zstd\" compressors, mkfs.ubifs will use this\n"
+"compressor for all data (\"zstd\" requires kernel version 5.3 or greater). The\n"
+"\"none\" disables any data compression. The \"favor_lzo\" is not really a separate\n"
+"compressor. It is just a method of combining \"lzo\" and \"zlib\" compressors.\n"
+"Namely, mkfs.ubifs tries to compress data with both \"lzo\" and \"zlib\"\n"
 "compressors, then it compares which compressor is better. If \"zlib\" compresses 20\n"
 "or more percent better than \"lzo\", mkfs.ubifs chooses \"lzo\", otherwise it chooses\n"
 "\"zlib\". The \"--favor-percent\" may specify arbitrary threshold instead of the\n"
-"default 20%.\n\n"
+"default 20%. With \"--favor-probe\", blocks which look already compressed are not\n"
+"compressed at all, and \"zlib\" is only tried if the data looks like it may\n"
+"compress that much better. This is faster, but may pick differently than trying\n"
+"both compressors on every block.\n\n"
 "The -F parameter is used to set the \"fix up free space\" flag in the superblock,\n"
 "which forces UBIFS to \"fixup\" all the free space which it is going to use. This\n"
 "option is useful to work-around the problem of double free space programming: if the\n"
@@ -501,6 +615,43 @@ static int get_options(int argc, char**argv)
 		if (opt == -1)
 			break;
 		switch (opt) {
+		case 0:
+			switch (i) {
+			case 0: /* --ff-map */
+				ff_map = optarg;
+				break;
+			case 1: /* --index-mem */
+				index_mem = get_bytes(optarg);
+				if (index_mem < 64 * 1024)
+					return err_msg("bad index memory limit (min. 64KiB)");
+				break;
+			case 2: /* --compr-cache */
+				compr_cache = optarg;
+				break;
+			case 3: /* --compr-cache-size */
+				compr_cache_size = get_bytes(optarg);
+				if (compr_cache_size < 64 * 1024)
+					return err_msg("bad compression cache size (min. 64KiB)");
+				break;
+			case 4: /* --favor-probe */
+				c->favor_probe = 1;
+				break;
+			case 5: /* --compr-level */
+				c->compr_level = strtol(optarg, &endp, 0);
+				if (*endp != '\0' || endp == optarg ||
+				    c->compr_level <= 0)
+					return err_msg("bad compression level '%s'",
+						       optarg);
+				break;
+			case 6: /* --stat-jobs */
+				stat_jobs = strtol(optarg, &endp, 0);
+				if (*endp != '\0' || endp == optarg ||
+				    stat_jobs < 0)
+					return err_msg("bad number of stat jobs '%s'",
+						       optarg);
+				break;
+			}
+			break;
 		case 'r':
 		case 'd':
 			root_len = strlen(optarg);
@@ -600,6 +751,10 @@ static int get_options(int argc, char**argv)
 				c->default_compr = UBIFS_COMPR_NONE;
 			else if (strcmp(optarg, "zlib") == 0)
 				c->default_compr = UBIFS_COMPR_ZLIB;
+#ifndef WITHOUT_ZSTD
+			else if (strcmp(optarg, "zstd") == 0)
+				c->default_compr = UBIFS_COMPR_ZSTD;
+#endif
 #ifndef WITHOUT_LZO
 			else if (strcmp(optarg, "favor_lzo") == 0)
 				c->favor_lzo = 1;
@@ -636,10 +791,32 @@ static int get_options(int argc, char**argv)
 		case 'a':
 			do_create_inum_attr = 1;
 			break;
+		case 'J':
+			jobs = strtol(optarg, &endp, 0);
+			if (*endp != '\0' || endp == optarg || jobs <= 0)
+				return err_msg("bad number of jobs '%s'",
+					       optarg);
+			break;
 
 		}
 	}
 
+	if (c->compr_level) {
+		int max_level = 0;
+
+		if (c->default_compr == UBIFS_COMPR_ZLIB || c->favor_lzo)
+			max_level = 9;
+#ifndef WITHOUT_ZSTD
+		else if (c->default_compr == UBIFS_COMPR_ZSTD)
+			max_level = ZSTD_maxCLevel();
+#endif
+		if (!max_level)
+			return err_msg("--compr-level may only be used with zlib, zstd or favor LZO compression");
+		if (c->compr_level > max_level)
+			return err_msg("bad compression level %d (max. %d)",
+				       c->compr_level, max_level);
+	}
+
 	if (optind != argc && !output)
 		output = xstrdup(argv[optind]);
 
@@ -647,6 +824,8 @@ static int get_options(int argc, char**argv)
 		return err_msg("not output device or file specified");
 
 	out_ubi = !open_ubi(output);
+	if (out_ubi && ff_map)
+		return err_msg("--ff-map cannot be used with an UBI volume");
 
 	if (out_ubi) {
 		c->min_io_size = c->di.min_io_size;
@@ -714,6 +893,9 @@ static int get_options(int argc, char**argv)
 		case UBIFS_COMPR_ZLIB:
 			printf("\tcompr:        zlib\n");
 			break;
+		case UBIFS_COMPR_ZSTD:
+			printf("\tcompr:        zstd\n");
+			break;
 		case UBIFS_COMPR_NONE:
 			printf("\tcompr:        none\n");
 			break;
@@ -735,11 +917,12 @@ static int get_options(int argc, char**argv)
 }
 
 /**
- * prepare_node - fill in the common header.
+ * prepare_node_sqnum - fill in the common header.
  * @node: node
  * @len: node length
+ * @sqnum: sequence number of the node
  */
-static void prepare_node(void *node, int len)
+static void prepare_node_sqnum(void *node, int len, unsigned long long sqnum)
 {
 	uint32_t crc;
 	struct ubifs_ch *ch = node;
@@ -747,35 +930,291 @@ static void prepare_node(void *node, int len)
 	ch->magic = cpu_to_le32(UBIFS_NODE_MAGIC);
 	ch->len = cpu_to_le32(len);
 	ch->group_type = UBIFS_NO_NODE_GROUP;
-	ch->sqnum = cpu_to_le64(++c->max_sqnum);
+	ch->sqnum = cpu_to_le64(sqnum);
 	ch->padding[0] = ch->padding[1] = 0;
 	crc = mtd_crc32(UBIFS_CRC32_INIT, node + 8, len - 8);
 	ch->crc = cpu_to_le32(crc);
 }
 
+/**
+ * prepare_node - fill in the common header, using the next sequence number.
+ * @node: node
+ * @len: node length
+ */
+static void prepare_node(void *node, int len)
+{
+	prepare_node_sqnum(node, len, ++c->max_sqnum);
+}
+
+/*
+ * The output stage.
+ *
+ * 'write_leb()' does not write to the target itself but copies the LEB image
+ * to an output buffer. Runs of consecutive LEBs are collected in the buffer
+ * and written with one positional write by the writer thread, while the main
+ * thread goes on filling the other buffer. For an UBI volume each LEB still
+ * needs its own atomic LEB change, but 'ubi_leb_change_start()' and the write
+ * are done by the writer thread as well. The buffers are kept filled with 0xFF
+ * bytes by the writer thread, so the main thread copies only the data.
+ */
+
+/* How many bytes of consecutive LEBs are collected before they are written */
+#define OUT_BUF_SIZE (4 * 1024 * 1024)
+
+/**
+ * struct out_buf - an output buffer.
+ * @buf: LEB images
+ * @lnum: number of the first LEB in the buffer
+ * @cnt: how many LEBs are in the buffer
+ */
+struct out_buf {
+	void *buf;
+	int lnum;
+	int cnt;
+};
+
+/**
+ * struct out_stage - state shared by 'write_leb()' and the writer thread.
+ * @bufs: the two output buffers
+ * @fill: the buffer 'write_leb()' copies to
+ * @busy: the buffer the writer thread writes, %NULL if it is idle
+ * @max_lebs: how many LEBs fit in a buffer
+ * @lock: protects @busy, @stop and @err
+ * @cond: signalled when @busy changes or @stop is set
+ * @stop: the writer thread has to exit
+ * @err: writing failed
+ * @tid: the writer thread
+ * @threaded: the writer thread is running, otherwise the buffers are written
+ *            by 'write_leb()' itself
+ */
+struct out_stage {
+	struct out_buf bufs[2];
+	struct out_buf *fill;
+	struct out_buf *busy;
+	int max_lebs;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int stop;
+	int err;
+	pthread_t tid;
+	int threaded;
+};
+
+static struct out_stage out;
+
+/* Erased-region map of the output file if '--ff-map' was given */
+static struct ffmap *ffmap;
+
+/**
+ * out_write_buf - write an output buffer to the output target.
+ * @ob: output buffer
+ *
+ * Refills the written part of the buffer with 0xFF bytes.
+ */
+static int out_write_buf(struct out_buf *ob)
+{
+	off_t pos = (off_t)ob->lnum * c->leb_size;
+	size_t len = (size_t)ob->cnt * c->leb_size, done = 0;
+	ssize_t ret;
+	int i;
+
+	if (out_ubi) {
+		for (i = 0; i < ob->cnt; i++) {
+			if (ubi_leb_change_start(ubi, out_fd, ob->lnum + i,
+						 c->leb_size))
+				return sys_err_msg("ubi_leb_change_start failed");
+			ret = pwrite(out_fd, ob->buf + (size_t)i * c->leb_size,
+				     c->leb_size, pos + (off_t)i * c->leb_size);
+			if (ret != c->leb_size)
+				return sys_err_msg("write failed writing %d bytes at pos %"PRIdoff_t,
+						   c->leb_size,
+						   pos + (off_t)i * c->leb_size);
+		}
+	} else if (ffmap) {
+		if (ffmap_pwrite(ffmap, out_fd, ob->buf, len, pos))
+			return -1;
+	} else {
+		while (done < len) {
+			ret = pwrite(out_fd, ob->buf + done, len - done,
+				     pos + done);
+			if (ret <= 0)
+				return sys_err_msg("write failed writing %zu bytes at pos %"PRIdoff_t,
+						   len - done, pos + done);
+			done += ret;
+		}
+	}
+
+	memset(ob->buf, 0xff, len);
+	ob->cnt = 0;
+	return 0;
+}
+
+static void *out_writer(void *arg)
+{
+	struct out_buf *ob;
+	int err;
+
+	(void)arg;
+	pthread_mutex_lock(&out.lock);
+	while (1) {
+		while (!out.busy && !out.stop)
+			pthread_cond_wait(&out.cond, &out.lock);
+		ob = out.busy;
+		if (!ob)
+			break;
+		pthread_mutex_unlock(&out.lock);
+		err = out_write_buf(ob);
+		pthread_mutex_lock(&out.lock);
+		if (err)
+			out.err = 1;
+		out.busy = NULL;
+		pthread_cond_broadcast(&out.cond);
+	}
+	pthread_mutex_unlock(&out.lock);
+	return NULL;
+}
+
+/*
+ * Wait until the writer thread is idle. Has to be called with @out.lock held.
+ */
+static int out_wait(void)
+{
+	while (out.busy)
+		pthread_cond_wait(&out.cond, &out.lock);
+	return out.err ? -1 : 0;
+}
+
+/**
+ * out_submit - hand the buffer being filled over to the writer thread.
+ */
+static int out_submit(void)
+{
+	struct out_buf *ob = out.fill;
+	int err;
+
+	if (!ob->cnt)
+		return 0;
+	if (!out.threaded)
+		return out_write_buf(ob);
+
+	pthread_mutex_lock(&out.lock);
+	err = out_wait();
+	if (!err) {
+		out.busy = ob;
+		out.fill = (ob == &out.bufs[0]) ? &out.bufs[1] : &out.bufs[0];
+		pthread_cond_broadcast(&out.cond);
+	}
+	pthread_mutex_unlock(&out.lock);
+	return err;
+}
+
+/**
+ * out_flush - write everything 'write_leb()' was given to the output target.
+ */
+static int out_flush(void)
+{
+	int err;
+
+	err = out_submit();
+	if (err || !out.threaded)
+		return err;
+
+	pthread_mutex_lock(&out.lock);
+	err = out_wait();
+	pthread_mutex_unlock(&out.lock);
+	return err;
+}
+
+/**
+ * out_init - set up the output stage.
+ */
+static int out_init(void)
+{
+	size_t sz;
+	int err;
+
+	if (ff_map) {
+		ffmap = ffmap_new(c->min_io_size);
+		if (!ffmap)
+			return -1;
+	}
+
+	out.max_lebs = OUT_BUF_SIZE / c->leb_size;
+	if (out.max_lebs < 1)
+		out.max_lebs = 1;
+	sz = (size_t)out.max_lebs * c->leb_size;
+	out.bufs[0].buf = xmalloc(sz);
+	out.bufs[1].buf = xmalloc(sz);
+	memset(out.bufs[0].buf, 0xff, sz);
+	memset(out.bufs[1].buf, 0xff, sz);
+	out.fill = &out.bufs[0];
+
+	pthread_mutex_init(&out.lock, NULL);
+	pthread_cond_init(&out.cond, NULL);
+	err = pthread_create(&out.tid, NULL, out_writer, NULL);
+	if (err) {
+		errno = err;
+		sys_err_msg("cannot create the writer thread, writing synchronously");
+	} else
+		out.threaded = 1;
+	return 0;
+}
+
+/**
+ * out_destroy - stop the writer thread and free the output buffers.
+ *
+ * Data not written by 'out_flush()' is dropped.
+ */
+static void out_destroy(void)
+{
+	if (!out.fill)
+		return;
+
+	if (out.threaded) {
+		pthread_mutex_lock(&out.lock);
+		out.stop = 1;
+		pthread_cond_broadcast(&out.cond);
+		pthread_mutex_unlock(&out.lock);
+		pthread_join(out.tid, NULL);
+		out.threaded = 0;
+	}
+	pthread_cond_destroy(&out.cond);
+	pthread_mutex_destroy(&out.lock);
+	free(out.bufs[0].buf);
+	free(out.bufs[1].buf);
+	out.fill = NULL;
+	ffmap_free(ffmap);
+	ffmap = NULL;
+}
+
 /**
  * write_leb - copy the image of a LEB to the output target.
  * @lnum: LEB number
  * @len: length of data in the buffer
- * @buf: buffer (must be at least c->leb_size bytes)
+ * @buf: buffer
+ *
+ * The LEB is written by the output stage, the buffer may be reused as soon as
+ * this function returns. Errors of earlier writes are reported here and by
+ * 'out_flush()'.
  */
 int write_leb(int lnum, int len, void *buf)
 {
-	off_t pos = (off_t)lnum * c->leb_size;
+	struct out_buf *ob = out.fill;
+	int err;
 
 	dbg_msg(3, "LEB %d len %d", lnum, len);
-	memset(buf + len, 0xff, c->leb_size - len);
-	if (out_ubi)
-		if (ubi_leb_change_start(ubi, out_fd, lnum, c->leb_size))
-			return sys_err_msg("ubi_leb_change_start failed");
-
-	if (lseek(out_fd, pos, SEEK_SET) != pos)
-		return sys_err_msg("lseek failed seeking %"PRIdoff_t, pos);
-
-	if (write(out_fd, buf, c->leb_size) != c->leb_size)
-		return sys_err_msg("write failed writing %d bytes at pos %"PRIdoff_t,
-				   c->leb_size, pos);
+	if (ob->cnt && (lnum != ob->lnum + ob->cnt ||
+			ob->cnt == out.max_lebs)) {
+		err = out_submit();
+		if (err)
+			return err;
+		ob = out.fill;
+	}
 
+	if (!ob->cnt)
+		ob->lnum = lnum;
+	memcpy(ob->buf + (size_t)ob->cnt * c->leb_size, buf, len);
+	ob->cnt += 1;
 	return 0;
 }
 
@@ -911,6 +1350,330 @@ static void set_lprops(int lnum, int offs, int flags)
 	}
 }
 
+static int namecmp(const char *name1, const char *name2)
+{
+	size_t len1 = strlen(name1), len2 = strlen(name2);
+	size_t clen = (len1 < len2) ? len1 : len2;
+	int cmp;
+
+	cmp = memcmp(name1, name2, clen);
+	if (cmp)
+		return cmp;
+	return (len1 < len2) ? -1 : 1;
+}
+
+/* The key as one number which sorts the same way as 'keys_cmp()' does */
+static inline uint64_t idx_key(const struct idx_entry *e)
+{
+	return ((uint64_t)e->key.u32[0] << 32) | e->key.u32[1];
+}
+
+static int cmp_idx(const struct idx_entry *e1, const struct idx_entry *e2)
+{
+	uint64_t k1 = idx_key(e1), k2 = idx_key(e2);
+
+	if (k1 != k2)
+		return k1 < k2 ? -1 : 1;
+	return namecmp(e1->name, e2->name);
+}
+
+static int cmp_idx_name(const void *a, const void *b)
+{
+	const struct idx_entry *e1 = a;
+	const struct idx_entry *e2 = b;
+
+	return namecmp(e1->name, e2->name);
+}
+
+
+/**
+ * sort_index - sort the index entries.
+ *
+ * The entries are sorted by key with an LSD radix sort, one byte per pass.
+ * Passes for bytes which are the same in all keys, e.g. the high bytes of
+ * inode numbers, are skipped. Entries with equal keys, i.e. directory entries
+ * with colliding name hashes, are then sorted by name. The result is the same
+ * as sorting with 'keys_cmp()' and 'namecmp()'.
+ */
+static void sort_index(void)
+{
+	size_t (*cnt)[256], i, j, pos;
+	struct idx_entry *tmp, *src, *dst, *t;
+	int b;
+
+	if (idx_cnt < 2)
+		return;
+
+	cnt = xzalloc(8 * sizeof(*cnt));
+	for (i = 0; i < idx_cnt; i++) {
+		uint64_t k = idx_key(&idx_arr[i]);
+
+		for (b = 0; b < 8; b++)
+			cnt[b][(k >> (b * 8)) & 0xff] += 1;
+	}
+
+	tmp = xmalloc(idx_cnt * sizeof(struct idx_entry));
+	src = idx_arr;
+	dst = tmp;
+	for (b = 0; b < 8; b++) {
+		size_t *bucket = cnt[b];
+
+		/* Skip the pass if all keys have the same byte here */
+		if (bucket[(idx_key(&src[0]) >> (b * 8)) & 0xff] == idx_cnt)
+			continue;
+
+		for (pos = 0, j = 0; j < 256; j++) {
+			size_t n = bucket[j];
+
+			bucket[j] = pos;
+			pos += n;
+		}
+		for (i = 0; i < idx_cnt; i++) {
+			uint64_t k = idx_key(&src[i]);
+
+			dst[bucket[(k >> (b * 8)) & 0xff]++] = src[i];
+		}
+		t = src;
+		src = dst;
+		dst = t;
+	}
+	if (src != idx_arr)
+		memcpy(idx_arr, src, idx_cnt * sizeof(struct idx_entry));
+	free(tmp);
+	free(cnt);
+
+	/* Sort the runs of equal keys by name */
+	for (i = 0; i < idx_cnt; i = j) {
+		uint64_t k = idx_key(&idx_arr[i]);
+
+		for (j = i + 1; j < idx_cnt && idx_key(&idx_arr[j]) == k; j++)
+			;
+		if (j - i > 1)
+			qsort(&idx_arr[i], j - i, sizeof(struct idx_entry),
+			      cmp_idx_name);
+	}
+}
+
+/**
+ * spill_index - write the index entries collected so far to a run file.
+ *
+ * The entries are sorted and appended to a temporary file as a sorted run,
+ * which 'write_index()' merges with the other runs later. The names of the
+ * entries are written to the run file too and freed. Returns %0 in case of
+ * success and %-1 in case of failure.
+ */
+static int spill_index(void)
+{
+	struct idx_run *run;
+	const char *tmpdir;
+	char *path;
+	size_t i;
+	int fd;
+
+	sort_index();
+
+	tmpdir = getenv("TMPDIR");
+	if (!tmpdir)
+		tmpdir = "/tmp";
+	path = xmalloc(strlen(tmpdir) + sizeof("/mkfs.ubifs-idx-XXXXXX"));
+	sprintf(path, "%s/mkfs.ubifs-idx-XXXXXX", tmpdir);
+	fd = mkstemp(path);
+	if (fd == -1) {
+		sys_err_msg("cannot create a temporary file in '%s'", tmpdir);
+		free(path);
+		return -1;
+	}
+	unlink(path);
+	free(path);
+
+	idx_runs = xrealloc(idx_runs, (idx_run_cnt + 1) * sizeof(*idx_runs));
+	run = &idx_runs[idx_run_cnt];
+	memset(run, 0, sizeof(*run));
+	run->f = fdopen(fd, "w+");
+	if (!run->f) {
+		close(fd);
+		return sys_err_msg("fdopen failed");
+	}
+	idx_run_cnt += 1;
+	run->left = idx_cnt;
+
+	for (i = 0; i < idx_cnt; i++) {
+		struct idx_entry *e = &idx_arr[i];
+		struct idx_rec rec;
+
+		rec.key[0] = e->key.u32[0];
+		rec.key[1] = e->key.u32[1];
+		rec.lnum = e->lnum;
+		rec.offs = e->offs;
+		rec.len = e->len;
+		rec.nlen = e->name ? strlen(e->name) : -1;
+		if (rec.nlen > UBIFS_MAX_NLEN)
+			return err_msg("too long name '%s'", e->name);
+		if (fwrite(&rec, sizeof(rec), 1, run->f) != 1 ||
+		    (rec.nlen > 0 &&
+		     fwrite(e->name, rec.nlen, 1, run->f) != 1))
+			return sys_err_msg("cannot write the index run file");
+		free(e->name);
+	}
+	if (fflush(run->f))
+		return sys_err_msg("cannot write the index run file");
+
+	dbg_msg(1, "index run %d: %zu entries", idx_run_cnt - 1, idx_cnt);
+	idx_spilled += idx_cnt;
+	idx_cnt = 0;
+	return 0;
+}
+
+/**
+ * read_run - read the next entry of a run.
+ * @run: the run to read from
+ *
+ * Returns %1 if the entry was read to @run->e, %0 if the run is exhausted and
+ * %-1 in case of failure.
+ */
+static int read_run(struct idx_run *run)
+{
+	struct idx_rec rec;
+
+	if (!run->left)
+		return 0;
+	if (fread(&rec, sizeof(rec), 1, run->f) != 1 ||
+	    rec.nlen > UBIFS_MAX_NLEN ||
+	    (rec.nlen > 0 && fread(run->name, rec.nlen, 1, run->f) != 1))
+		return err_msg("cannot read the index run file");
+	run->e.key.u32[0] = rec.key[0];
+	run->e.key.u32[1] = rec.key[1];
+	run->e.lnum = rec.lnum;
+	run->e.offs = rec.offs;
+	run->e.len = rec.len;
+	if (rec.nlen >= 0) {
+		run->name[rec.nlen] = '\0';
+		run->e.name = run->name;
+	} else
+		run->e.name = NULL;
+	run->left -= 1;
+	return 1;
+}
+
+/* Restore the heap property of 'idx_heap' below position @i */
+static void heap_down(size_t i)
+{
+	for (;;) {
+		size_t l = 2 * i + 1, m = i;
+		struct idx_run *t;
+
+		if (l < idx_heap_cnt &&
+		    cmp_idx(&idx_heap[l]->e, &idx_heap[m]->e) < 0)
+			m = l;
+		if (l + 1 < idx_heap_cnt &&
+		    cmp_idx(&idx_heap[l + 1]->e, &idx_heap[m]->e) < 0)
+			m = l + 1;
+		if (m == i)
+			break;
+		t = idx_heap[i];
+		idx_heap[i] = idx_heap[m];
+		idx_heap[m] = t;
+		i = m;
+	}
+}
+
+/**
+ * start_index - prepare to read the index entries in sorted order.
+ *
+ * If the index was spilled to run files, the rest of it is spilled too and a
+ * heap of the runs is built to merge them, otherwise the index is sorted in
+ * memory. Returns %0 in case of success and %-1 in case of failure.
+ */
+static int start_index(void)
+{
+	int i, err;
+
+	idx_pos = 0;
+	if (!idx_run_cnt) {
+		sort_index();
+		return 0;
+	}
+
+	if (idx_cnt) {
+		err = spill_index();
+		if (err)
+			return err;
+	}
+	free(idx_arr);
+	idx_arr = NULL;
+	idx_max = 0;
+	idx_cnt = idx_spilled;
+
+	idx_heap = xmalloc(idx_run_cnt * sizeof(*idx_heap));
+	idx_heap_cnt = 0;
+	for (i = 0; i < idx_run_cnt; i++) {
+		struct idx_run *run = &idx_runs[i];
+
+		rewind(run->f);
+		err = read_run(run);
+		if (err < 0)
+			return err;
+		if (err)
+			idx_heap[idx_heap_cnt++] = run;
+	}
+	for (i = idx_heap_cnt / 2; i > 0; i--)
+		heap_down(i - 1);
+	return 0;
+}
+
+/**
+ * next_index - get the next index entry in sorted order.
+ * @e: the entry is returned here, without the name
+ *
+ * Returns %0 in case of success and %-1 in case of failure.
+ */
+static int next_index(struct idx_entry *e)
+{
+	struct idx_run *run;
+	int err;
+
+	if (!idx_run_cnt) {
+		*e = idx_arr[idx_pos++];
+		e->name = NULL;
+		return 0;
+	}
+
+	if (!idx_heap_cnt)
+		return err_msg("index runs are shorter than expected");
+	run = idx_heap[0];
+	*e = run->e;
+	e->name = NULL;
+	err = read_run(run);
+	if (err < 0)
+		return err;
+	if (!err)
+		idx_heap[0] = idx_heap[--idx_heap_cnt];
+	heap_down(0);
+	return 0;
+}
+
+/**
+ * free_index - free the index entries and close the run files.
+ */
+static void free_index(void)
+{
+	size_t i;
+
+	for (i = 0; i < idx_cnt && idx_arr; i++)
+		free(idx_arr[i].name);
+	free(idx_arr);
+	idx_arr = NULL;
+	idx_cnt = idx_max = 0;
+	for (i = 0; i < (size_t)idx_run_cnt; i++)
+		fclose(idx_runs[i].f);
+	free(idx_runs);
+	idx_runs = NULL;
+	idx_run_cnt = 0;
+	free(idx_heap);
+	idx_heap = NULL;
+	idx_spilled = 0;
+}
+
 /**
  * add_to_index - add a node key and position to the index.
  * @key: node key
@@ -921,23 +1684,35 @@ static void set_lprops(int lnum, int offs, int flags)
 static int add_to_index(union ubifs_key *key, char *name, int lnum, int offs,
 			int len)
 {
+	/* Half of the memory limit is left for sorting */
+	size_t run_max = index_mem / 2 / sizeof(struct idx_entry);
 	struct idx_entry *e;
 
 	dbg_msg(3, "LEB %d offs %d len %d", lnum, offs, len);
-	e = xmalloc(sizeof(struct idx_entry));
-	e->next = NULL;
-	e->prev = idx_list_last;
+	if (run_max && idx_cnt == run_max) {
+		int err = spill_index();
+
+		if (err)
+			return err;
+	}
+	if (idx_cnt == idx_max) {
+		size_t max = idx_max ? idx_max * 2 : 4096;
+
+		if (run_max && max > run_max)
+			max = run_max;
+		if (max * sizeof(struct idx_entry) / max !=
+		    sizeof(struct idx_entry))
+			return err_msg("index is too big (%zu entries)",
+				       idx_cnt);
+		idx_arr = xrealloc(idx_arr, max * sizeof(struct idx_entry));
+		idx_max = max;
+	}
+	e = &idx_arr[idx_cnt++];
 	e->key = *key;
 	e->name = name;
 	e->lnum = lnum;
 	e->offs = offs;
 	e->len = len;
-	if (!idx_list_first)
-		idx_list_first = e;
-	if (idx_list_last)
-		idx_list_last->next = e;
-	idx_list_last = e;
-	idx_cnt += 1;
 	return 0;
 }
 
@@ -961,24 +1736,358 @@ static int flush_nodes(void)
 }
 
 /**
- * reserve_space - reserve space for a node on the head.
- * @len: node length
- * @lnum: LEB number is returned here
- * @offs: offset is returned here
+ * reserve_space - reserve space for a node on the head.
+ * @len: node length
+ * @lnum: LEB number is returned here
+ * @offs: offset is returned here
+ */
+static int reserve_space(int len, int *lnum, int *offs)
+{
+	int err;
+
+	if (len > c->leb_size - head_offs) {
+		err = flush_nodes();
+		if (err)
+			return err;
+	}
+	*lnum = head_lnum;
+	*offs = head_offs;
+	head_offs += ALIGN(len, 8);
+	return 0;
+}
+
+/**
+ * write_head_node - write a node to the head.
+ * @key: node key
+ * @name: name to pass to the index
+ * @node: node
+ * @len: node length
+ * @sqnum: sequence number of the node
+ */
+static int write_head_node(union ubifs_key *key, char *name, void *node,
+			   int len, unsigned long long sqnum)
+{
+	int err, lnum, offs;
+
+	prepare_node_sqnum(node, len, sqnum);
+
+	err = reserve_space(len, &lnum, &offs);
+	if (err)
+		return err;
+
+	memcpy(leb_buf + offs, node, len);
+	memset(leb_buf + offs + len, 0xff, ALIGN(len, 8) - len);
+
+	return add_to_index(key, name, lnum, offs, len);
+}
+
+/*
+ * The compression pipeline.
+ *
+ * With more than one job, nodes are not written to the head by 'add_node()'
+ * directly but queued in a ring of slots. Data nodes are queued uncompressed
+ * and compressed by the worker threads, other nodes are ready to be written
+ * as soon as they are queued. The main thread is the sequencer: it writes the
+ * oldest slot once it is ready, so nodes end up on the head in the order they
+ * were queued. The sequence number of a node is taken when it is queued, which
+ * keeps the numbering interleaved with 'creat_sqnum' as in the serial case.
+ * Together this makes the image independent of the number of jobs.
+ */
+
+/**
+ * struct pipe_slot - a node in the compression pipeline.
+ * @key: node key
+ * @name: name to pass to the index
+ * @node: the node, only the header for a data node not compressed yet
+ * @block: uncompressed data of a data node
+ * @len: node length, the uncompressed data length for a data node not
+ *       compressed yet
+ * @compr: compressor for a data node, %-1 for other nodes
+ * @sqnum: sequence number of the node
+ * @done: the node is ready to be written
+ */
+struct pipe_slot {
+	union ubifs_key key;
+	char *name;
+	void *node;
+	void *block;
+	int len;
+	int compr;
+	unsigned long long sqnum;
+	int done;
+};
+
+/**
+ * struct compr_pipe - state shared by the sequencer and the workers.
+ * @slots: ring of slots
+ * @cnt: number of slots, zero if the pipeline is not used
+ * @head: the oldest slot not written yet
+ * @work: the first slot not looked at by the compressing threads
+ * @tail: the next free slot
+ * @lock: protects @work, @tail, @stop and the @done flags
+ * @work_cond: signalled when a data node is queued
+ * @done_cond: signalled when a data node is compressed
+ * @stop: the workers have to exit
+ * @tids: worker threads
+ * @nthreads: number of worker threads started
+ *
+ * @head, @work and @tail only grow, the slot of position @n is
+ * @slots[@n % @cnt].
+ */
+struct compr_pipe {
+	struct pipe_slot *slots;
+	unsigned int cnt;
+	unsigned long head;
+	unsigned long work;
+	unsigned long tail;
+	pthread_mutex_t lock;
+	pthread_cond_t work_cond;
+	pthread_cond_t done_cond;
+	int stop;
+	pthread_t *tids;
+	int nthreads;
+};
+
+static struct compr_pipe pipeline;
+
+/**
+ * init_data_node - fill in the header of a data node.
+ * @dn: data node
+ * @key: node key
+ * @len: uncompressed data length
+ */
+static void init_data_node(struct ubifs_data_node *dn, union ubifs_key *key,
+			   int len)
+{
+	memset(dn, 0, UBIFS_DATA_NODE_SZ);
+	dn->ch.node_type = UBIFS_DATA_NODE;
+	key_write(key, &dn->key);
+	dn->size = cpu_to_le32(len);
+}
+
+/**
+ * compress_data_node - compress the data of a data node.
+ * @dn: data node with its header filled in
+ * @buf: uncompressed data
+ * @len: uncompressed data length
+ * @compr: compressor to use
+ *
+ * Returns the length of the data node.
+ */
+static int compress_data_node(struct ubifs_data_node *dn, void *buf, int len,
+			      int compr)
+{
+	size_t out_len = NODE_BUFFER_SIZE - UBIFS_DATA_NODE_SZ;
+	int compr_type;
+
+	compr_type = compr_cache_compress(buf, len, &dn->data, &out_len, compr);
+	dn->compr_type = cpu_to_le16(compr_type);
+	return UBIFS_DATA_NODE_SZ + out_len;
+}
+
+/*
+ * Find the next queued data node nobody compresses yet and take it. Has to be
+ * called with @pipeline.lock held. Returns %NULL if there is none.
+ */
+static struct pipe_slot *pipe_claim(void)
+{
+	struct pipe_slot *s;
+
+	while (pipeline.work != pipeline.tail) {
+		s = &pipeline.slots[pipeline.work++ % pipeline.cnt];
+		if (!s->done)
+			return s;
+	}
+	return NULL;
+}
+
+/*
+ * Compress a claimed data node. Has to be called with @pipeline.lock held, the
+ * lock is dropped while compressing.
+ */
+static void pipe_compress(struct pipe_slot *s)
+{
+	int len;
+
+	pthread_mutex_unlock(&pipeline.lock);
+	len = compress_data_node(s->node, s->block, s->len, s->compr);
+	pthread_mutex_lock(&pipeline.lock);
+	s->len = len;
+	s->done = 1;
+	pthread_cond_signal(&pipeline.done_cond);
+}
+
+static void *pipe_worker(void *arg)
+{
+	struct pipe_slot *s;
+
+	(void)arg;
+	if (init_compression_thread()) {
+		err_msg("cannot allocate compressor buffers");
+		return NULL;
+	}
+
+	pthread_mutex_lock(&pipeline.lock);
+	while (!pipeline.stop) {
+		s = pipe_claim();
+		if (s)
+			pipe_compress(s);
+		else
+			pthread_cond_wait(&pipeline.work_cond, &pipeline.lock);
+	}
+	pthread_mutex_unlock(&pipeline.lock);
+
+	destroy_compression_thread();
+	return NULL;
+}
+
+/**
+ * pipe_write_one - write the oldest node of the pipeline to the head.
+ *
+ * Waits for the node to be compressed. If no worker has taken it yet, the
+ * calling thread compresses it itself, so the pipeline makes progress even if
+ * the workers could not be started.
+ */
+static int pipe_write_one(void)
+{
+	struct pipe_slot *s = &pipeline.slots[pipeline.head % pipeline.cnt];
+	struct pipe_slot *w;
+	int err;
+
+	pthread_mutex_lock(&pipeline.lock);
+	while (!s->done) {
+		w = pipe_claim();
+		if (w)
+			pipe_compress(w);
+		else
+			pthread_cond_wait(&pipeline.done_cond, &pipeline.lock);
+	}
+	pthread_mutex_unlock(&pipeline.lock);
+
+	err = write_head_node(&s->key, s->name, s->node, s->len, s->sqnum);
+	pipeline.head += 1;
+	return err;
+}
+
+/**
+ * pipe_get_slot - get a free slot, writing out the oldest node if needed.
+ * @slot: the slot is returned here
+ *
+ * The slot is not part of the pipeline until 'pipe_queue()' is called.
+ */
+static int pipe_get_slot(struct pipe_slot **slot)
+{
+	int err;
+
+	if (pipeline.tail - pipeline.head == pipeline.cnt) {
+		err = pipe_write_one();
+		if (err)
+			return err;
+	}
+	*slot = &pipeline.slots[pipeline.tail % pipeline.cnt];
+	return 0;
+}
+
+/**
+ * pipe_queue - add a filled in slot to the pipeline.
+ * @s: the slot returned by 'pipe_get_slot()'
+ */
+static void pipe_queue(struct pipe_slot *s)
+{
+	s->sqnum = ++c->max_sqnum;
+	pthread_mutex_lock(&pipeline.lock);
+	/*
+	 * Written nodes are not claimed, so @work may lag behind @head. Move
+	 * it on before a slot is reused, a stale position would let the slot
+	 * be claimed twice otherwise.
+	 */
+	if (pipeline.work < pipeline.head)
+		pipeline.work = pipeline.head;
+	s->done = (s->compr == -1);
+	pipeline.tail += 1;
+	if (!s->done)
+		pthread_cond_signal(&pipeline.work_cond);
+	pthread_mutex_unlock(&pipeline.lock);
+}
+
+/**
+ * pipe_flush - write all the nodes in the pipeline to the head.
+ */
+static int pipe_flush(void)
+{
+	int err;
+
+	while (pipeline.head != pipeline.tail) {
+		err = pipe_write_one();
+		if (err)
+			return err;
+	}
+	return 0;
+}
+
+/**
+ * pipe_init - start the compression pipeline.
+ *
+ * Starts @jobs - 1 worker threads, the main thread compresses as well while
+ * it waits for a node to be ready.
+ */
+static int pipe_init(void)
+{
+	unsigned int i;
+	int err;
+
+	pipeline.cnt = jobs * PIPE_SLOTS_PER_JOB;
+	pipeline.slots = xzalloc(pipeline.cnt * sizeof(struct pipe_slot));
+	for (i = 0; i < pipeline.cnt; i++) {
+		pipeline.slots[i].node = xmalloc(NODE_BUFFER_SIZE);
+		pipeline.slots[i].block = xmalloc(UBIFS_BLOCK_SIZE);
+	}
+	pthread_mutex_init(&pipeline.lock, NULL);
+	pthread_cond_init(&pipeline.work_cond, NULL);
+	pthread_cond_init(&pipeline.done_cond, NULL);
+
+	pipeline.tids = xmalloc((jobs - 1) * sizeof(pthread_t));
+	for (i = 0; i < (unsigned int)jobs - 1; i++) {
+		err = pthread_create(&pipeline.tids[i], NULL, pipe_worker, NULL);
+		if (err) {
+			errno = err;
+			sys_err_msg("cannot create compression thread, use %u",
+				    i + 1);
+			break;
+		}
+		pipeline.nthreads += 1;
+	}
+	return 0;
+}
+
+/**
+ * pipe_destroy - stop the compression pipeline and free its resources.
  */
-static int reserve_space(int len, int *lnum, int *offs)
+static void pipe_destroy(void)
 {
-	int err;
-
-	if (len > c->leb_size - head_offs) {
-		err = flush_nodes();
-		if (err)
-			return err;
+	unsigned int i;
+	int n;
+
+	if (!pipeline.cnt)
+		return;
+
+	pthread_mutex_lock(&pipeline.lock);
+	pipeline.stop = 1;
+	pthread_cond_broadcast(&pipeline.work_cond);
+	pthread_mutex_unlock(&pipeline.lock);
+	for (n = 0; n < pipeline.nthreads; n++)
+		pthread_join(pipeline.tids[n], NULL);
+	free(pipeline.tids);
+
+	pthread_cond_destroy(&pipeline.done_cond);
+	pthread_cond_destroy(&pipeline.work_cond);
+	pthread_mutex_destroy(&pipeline.lock);
+	for (i = 0; i < pipeline.cnt; i++) {
+		free(pipeline.slots[i].node);
+		free(pipeline.slots[i].block);
 	}
-	*lnum = head_lnum;
-	*offs = head_offs;
-	head_offs += ALIGN(len, 8);
-	return 0;
+	free(pipeline.slots);
+	pipeline.cnt = 0;
 }
 
 /**
@@ -986,22 +2095,59 @@ static int reserve_space(int len, int *lnum, int *offs)
  * @key: node key
  * @node: node
  * @len: node length
+ *
+ * When the compression pipeline is used, the node is only queued and written
+ * by a later 'pipe_write_one()'.
  */
 static int add_node(union ubifs_key *key, char *name, void *node, int len)
 {
-	int err, lnum, offs;
+	struct pipe_slot *s;
+	int err;
 
-	prepare_node(node, len);
+	if (!pipeline.cnt)
+		return write_head_node(key, name, node, len, ++c->max_sqnum);
 
-	err = reserve_space(len, &lnum, &offs);
+	err = pipe_get_slot(&s);
 	if (err)
 		return err;
+	s->key = *key;
+	s->name = name;
+	memcpy(s->node, node, len);
+	s->len = len;
+	s->compr = -1;
+	pipe_queue(s);
+	return 0;
+}
 
-	memcpy(leb_buf + offs, node, len);
-	memset(leb_buf + offs + len, 0xff, ALIGN(len, 8) - len);
+/**
+ * add_data_node - compress a block of file data and write it to the head.
+ * @key: node key
+ * @buf: uncompressed data
+ * @len: uncompressed data length
+ * @compr: compressor to use
+ */
+static int add_data_node(union ubifs_key *key, void *buf, int len, int compr)
+{
+	struct ubifs_data_node *dn = node_buf;
+	struct pipe_slot *s;
+	int err;
 
-	add_to_index(key, name, lnum, offs, len);
+	if (!pipeline.cnt) {
+		init_data_node(dn, key, len);
+		len = compress_data_node(dn, buf, len, compr);
+		return add_node(key, NULL, dn, len);
+	}
 
+	err = pipe_get_slot(&s);
+	if (err)
+		return err;
+	s->key = *key;
+	s->name = NULL;
+	init_data_node(s->node, key, len);
+	memcpy(s->block, buf, len);
+	s->len = len;
+	s->compr = compr;
+	pipe_queue(s);
 	return 0;
 }
 
@@ -1074,7 +2220,7 @@ static int add_xattr(struct stat *st, ino_t inum, const void *data,
 
 	xent->inum = cpu_to_le64(inum);
 
-	ret = add_node(&xkey, nm->name, xent, len);
+	ret = add_node(&xkey, xstrdup(nm->name), xent, len);
 	if (ret)
 		goto out;
 
@@ -1106,7 +2252,7 @@ static int add_xattr(struct stat *st, ino_t inum, const void *data,
 	if (data_len)
 		memcpy(&ino->data, data, data_len);
 
-	ret = add_node(&nkey, nm->name, ino, UBIFS_INO_NODE_SZ + data_len) ;
+	ret = add_node(&nkey, NULL, ino, UBIFS_INO_NODE_SZ + data_len) ;
 
 out:
 	free(xent);
@@ -1115,57 +2261,114 @@ out:
 	return ret;
 }
 
-static int inode_add_xattr(struct ubifs_ino_node *host_ino,
-			   const char *path_name, struct stat *st, ino_t inum)
+/**
+ * read_xattrs - read the extended attributes of a file.
+ * @path_name: path name of the file
+ * @xattrs: the attributes are returned here
+ * @report: whether to print an error message in case of failure
+ *
+ * The attributes are returned as a sequence of the zero-terminated name, the
+ * value length as an int and the zero-terminated value of each. Returns the
+ * length of @xattrs, and %-1 in case of failure.
+ */
+static ssize_t read_xattrs(const char *path_name, char **xattrs, int report)
 {
-	int ret;
-	struct qstr nm;
-	void *buf = NULL;
-	ssize_t len;
-	ssize_t pos = 0;
+	char *buf = NULL, *out = NULL;
+	ssize_t len, pos = 0, out_len = 0;
 
+	*xattrs = NULL;
 	len = llistxattr(path_name, NULL, 0);
 	if (len < 0) {
 		if (errno == ENOENT)
 			return 0;
-
-		sys_err_msg("llistxattr failed on %s", path_name);
-
-		return len;
+		goto out_err;
 	}
 
 	if (len == 0)
-		goto noxattr;
+		return 0;
 
 	buf = xmalloc(len);
 
 	len = llistxattr(path_name, buf, len);
-	if (len < 0) {
-		sys_err_msg("llistxattr failed on %s", path_name);
-		goto out_free;
-	}
+	if (len < 0)
+		goto out_err;
 
 	while (pos < len) {
 		char attrbuf[1024] = { };
 		char *name;
-		ssize_t attrsize;
+		int attrsize, nlen;
 
 		name = buf + pos;
-		pos += strlen(name) + 1;
+		nlen = strlen(name) + 1;
+		pos += nlen;
 
 		attrsize = lgetxattr(path_name, name, attrbuf, sizeof(attrbuf) - 1);
 		if (attrsize < 0) {
-			sys_err_msg("lgetxattr failed on %s", path_name);
+			if (report)
+				sys_err_msg("lgetxattr failed on %s", path_name);
 			goto out_free;
 		}
 
+		out = xrealloc(out, out_len + nlen + sizeof(int) + attrsize + 1);
+		memcpy(out + out_len, name, nlen);
+		out_len += nlen;
+		memcpy(out + out_len, &attrsize, sizeof(int));
+		out_len += sizeof(int);
+		memcpy(out + out_len, attrbuf, attrsize + 1);
+		out_len += attrsize + 1;
+	}
+
+	free(buf);
+	*xattrs = out;
+	return out_len;
+
+out_err:
+	if (report)
+		sys_err_msg("llistxattr failed on %s", path_name);
+out_free:
+	free(out);
+	free(buf);
+	return -1;
+}
+
+static int inode_add_xattr(struct ubifs_ino_node *host_ino,
+			   const char *path_name, struct stat *st, ino_t inum)
+{
+	int ret;
+	struct qstr nm;
+	char *buf, *to_free = NULL;
+	ssize_t len;
+	ssize_t pos = 0;
+
+	if (cur_dent && cur_dent->xattr_len >= 0 &&
+	    !strcmp(cur_dent->path, path_name)) {
+		buf = cur_dent->xattrs;
+		len = cur_dent->xattr_len;
+	} else {
+		len = read_xattrs(path_name, &buf, 1);
+		if (len < 0)
+			return -1;
+		to_free = buf;
+	}
+
+	while (pos < len) {
+		char *name, *attrbuf;
+		int attrsize;
+
+		name = buf + pos;
+		pos += strlen(name) + 1;
+		memcpy(&attrsize, buf + pos, sizeof(int));
+		pos += sizeof(int);
+		attrbuf = buf + pos;
+		pos += attrsize + 1;
+
 		if (!strcmp(name, "user.image-inode-number")) {
 			ino_t inum_from_xattr;
 
 			inum_from_xattr = strtoull(attrbuf, NULL, 10);
 			if (inum != inum_from_xattr) {
 				errno = EINVAL;
-				sys_err_msg("calculated inum (%llu) doesn't match inum from xattr (%llu) size (%zd) on %s",
+				sys_err_msg("calculated inum (%llu) doesn't match inum from xattr (%llu) size (%d) on %s",
 					    (unsigned long long)inum,
 					    (unsigned long long)inum_from_xattr,
 					    attrsize,
@@ -1189,12 +2392,11 @@ static int inode_add_xattr(struct ubifs_ino_node *host_ino,
 			goto out_free;
 	}
 
-noxattr:
-	free(buf);
+	free(to_free);
 	return 0;
 
 out_free:
-	free(buf);
+	free(to_free);
 
 	return -1;
 }
@@ -1416,13 +2618,72 @@ static struct inum_mapping *lookup_inum_mapping(dev_t dev, ino_t inum)
 static int all_zero(void *buf, int len)
 {
 	unsigned char *p = buf;
+	const unsigned long *w;
 
-	while (len--)
+	/* Check a word at a time once the buffer is aligned */
+	while (len && ((uintptr_t)p & (sizeof(long) - 1))) {
 		if (*p++ != 0)
 			return 0;
+		len -= 1;
+	}
+	/* Eight words per iteration, so that the compiler may vectorize it */
+	for (w = (void *)p; len >= 8 * (int)sizeof(long); w += 8) {
+		if (w[0] | w[1] | w[2] | w[3] | w[4] | w[5] | w[6] | w[7])
+			return 0;
+		len -= 8 * sizeof(long);
+	}
+	for (; len >= (int)sizeof(long); w++) {
+		if (*w)
+			return 0;
+		len -= sizeof(long);
+	}
+	for (p = (void *)w; len--; p++)
+		if (*p != 0)
+			return 0;
 	return 1;
 }
 
+/**
+ * skip_hole - find the next data in a sparse file.
+ * @fd: file descriptor
+ * @pos: current file position, a multiple of %UBIFS_BLOCK_SIZE
+ * @size: file size
+ * @next_hole: the offset of the hole after the data is returned here
+ *
+ * Moves the file position to the start of the block containing the first data
+ * at or after @pos, or of the last block if there is no more data, and returns
+ * the new position. Returns %-1 if holes cannot be looked up, the file
+ * position is undefined then.
+ */
+static off_t skip_hole(int fd, off_t pos, off_t size, off_t *next_hole)
+{
+#ifdef SEEK_DATA
+	off_t data, hole;
+
+	data = lseek(fd, pos, SEEK_DATA);
+	if (data == -1) {
+		if (errno != ENXIO)
+			return -1;
+		/* The rest of the file is a hole */
+		data = hole = size;
+	} else {
+		hole = lseek(fd, data, SEEK_HOLE);
+		if (hole == -1)
+			return -1;
+	}
+
+	data = data / UBIFS_BLOCK_SIZE * UBIFS_BLOCK_SIZE;
+	if (data < pos)
+		data = pos;
+	if (lseek(fd, data, SEEK_SET) == -1)
+		return -1;
+	*next_hole = hole;
+	return data;
+#else
+	return -1;
+#endif
+}
+
 /**
  * add_file - write the data of a file and its inode to the output file.
  * @path_name: source path name
@@ -1433,19 +2694,38 @@ static int all_zero(void *buf, int len)
 static int add_file(const char *path_name, struct stat *st, ino_t inum,
 		    int flags)
 {
-	struct ubifs_data_node *dn = node_buf;
 	void *buf = block_buf;
 	loff_t file_size = 0;
 	ssize_t ret, bytes_read;
 	union ubifs_key key;
-	int fd, dn_len, err, compr_type, use_compr;
+	int fd, err, use_compr;
 	unsigned int block_no = 0;
-	size_t out_len;
+	off_t pos = 0, next_hole = 0;
+	/* Look for holes only if the file has some */
+	int seek_holes = (off_t)st->st_blocks * 512 < st->st_size;
 
 	fd = open(path_name, O_RDONLY | O_LARGEFILE);
 	if (fd == -1)
 		return sys_err_msg("failed to open file '%s'", path_name);
 	do {
+		/* Skip whole blocks of holes without reading them */
+		if (seek_holes && pos >= next_hole) {
+			off_t data = skip_hole(fd, pos, st->st_size, &next_hole);
+
+			if (data == -1) {
+				seek_holes = 0;
+				if (lseek(fd, pos, SEEK_SET) == -1) {
+					sys_err_msg("failed to seek file '%s'",
+						    path_name);
+					close(fd);
+					return 1;
+				}
+			} else {
+				block_no += (data - pos) / UBIFS_BLOCK_SIZE;
+				file_size += data - pos;
+				pos = data;
+			}
+		}
 		/* Read next block */
 		bytes_read = 0;
 		do {
@@ -1462,18 +2742,14 @@ static int add_file(const char *path_name, struct stat *st, ino_t inum,
 		if (bytes_read == 0)
 			break;
 		file_size += bytes_read;
+		pos += bytes_read;
 		/* Skip holes */
 		if (all_zero(buf, bytes_read)) {
 			block_no += 1;
 			continue;
 		}
 		/* Make data node */
-		memset(dn, 0, UBIFS_DATA_NODE_SZ);
 		data_key_init(&key, inum, block_no++);
-		dn->ch.node_type = UBIFS_DATA_NODE;
-		key_write(&key, &dn->key);
-		dn->size = cpu_to_le32(bytes_read);
-		out_len = NODE_BUFFER_SIZE - UBIFS_DATA_NODE_SZ;
 		if (c->default_compr == UBIFS_COMPR_NONE &&
 		    (flags & FS_COMPR_FL))
 #ifdef WITHOUT_LZO
@@ -1483,12 +2759,8 @@ static int add_file(const char *path_name, struct stat *st, ino_t inum,
 #endif
 		else
 			use_compr = c->default_compr;
-		compr_type = compress_data(buf, bytes_read, &dn->data,
-					   &out_len, use_compr);
-		dn->compr_type = cpu_to_le16(compr_type);
-		dn_len = UBIFS_DATA_NODE_SZ + out_len;
 		/* Add data node to file system */
-		err = add_node(&key, NULL, dn, dn_len);
+		err = add_data_node(&key, buf, bytes_read, use_compr);
 		if (err) {
 			close(fd);
 			return err;
@@ -1504,6 +2776,243 @@ static int add_file(const char *path_name, struct stat *st, ino_t inum,
 	return add_inode(st, inum, NULL, 0, flags, path_name);
 }
 
+/*
+ * Looking up file attributes ahead of the writer.
+ *
+ * On network file systems or with a cold cache, writing a tree is dominated
+ * by the 'lstat()' and extended attribute round-trips. 'add_directory()'
+ * therefore reads all the entries of a directory first and pushes them as a
+ * batch, and the stat threads look the entries up while the writer is busy
+ * with the earlier ones. The workers take entries of the batch on top, that
+ * is of the deepest directory, as the writer needs those next. The writer
+ * still uses the entries in 'readdir()' order and looks up an entry itself if
+ * no worker took it yet, so the image does not depend on the number of stat
+ * threads.
+ */
+
+/**
+ * struct dir_batch - the entries of a directory being written.
+ * @ents: entries in 'readdir()' order
+ * @cnt: number of entries
+ * @next: the first entry nobody looked up yet
+ * @busy: number of entries being looked up by the workers
+ * @dfd: file descriptor of the directory
+ * @up: the batch of the parent directory
+ */
+struct dir_batch {
+	struct dent_info *ents;
+	size_t cnt;
+	size_t next;
+	int busy;
+	int dfd;
+	struct dir_batch *up;
+};
+
+/**
+ * struct stat_pool - state shared by the writer and the stat threads.
+ * @top: the batch of the directory being written
+ * @lock: protects @top, @stop, and the @next, @busy and @done fields
+ * @work_cond: signalled when a batch is pushed
+ * @done_cond: signalled when an entry is looked up
+ * @stop: the workers have to exit
+ * @tids: worker threads
+ * @nthreads: number of worker threads started
+ */
+struct stat_pool {
+	struct dir_batch *top;
+	pthread_mutex_t lock;
+	pthread_cond_t work_cond;
+	pthread_cond_t done_cond;
+	int stop;
+	pthread_t *tids;
+	int nthreads;
+};
+
+static struct stat_pool stat_pool = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.work_cond = PTHREAD_COND_INITIALIZER,
+	.done_cond = PTHREAD_COND_INITIALIZER,
+};
+
+/**
+ * lookup_dent - look up the attributes of a directory entry.
+ * @b: batch of the entry
+ * @d: the entry
+ *
+ * Failures are not reported here, the writer repeats what failed.
+ */
+static void lookup_dent(struct dir_batch *b, struct dent_info *d)
+{
+	d->ok = !fstatat(b->dfd, d->name, &d->st, AT_SYMLINK_NOFOLLOW);
+	d->xattr_len = -1;
+#ifndef WITHOUT_XATTR
+	/* A directory looks its own attributes up when it is written */
+	if (d->ok && !S_ISDIR(d->st.st_mode))
+		d->xattr_len = read_xattrs(d->path, &d->xattrs, 0);
+#endif
+}
+
+static void *stat_worker(void *arg)
+{
+	struct dir_batch *b;
+	struct dent_info *d;
+
+	(void)arg;
+	pthread_mutex_lock(&stat_pool.lock);
+	while (!stat_pool.stop) {
+		for (b = stat_pool.top; b && b->next == b->cnt; b = b->up)
+			;
+		if (!b) {
+			pthread_cond_wait(&stat_pool.work_cond, &stat_pool.lock);
+			continue;
+		}
+
+		d = &b->ents[b->next++];
+		b->busy += 1;
+		pthread_mutex_unlock(&stat_pool.lock);
+		lookup_dent(b, d);
+		pthread_mutex_lock(&stat_pool.lock);
+		d->done = 1;
+		b->busy -= 1;
+		pthread_cond_broadcast(&stat_pool.done_cond);
+	}
+	pthread_mutex_unlock(&stat_pool.lock);
+	return NULL;
+}
+
+/**
+ * read_dir_batch - read all the entries of a directory.
+ * @dir: the directory
+ * @dir_name: directory path name
+ * @b: the batch to fill in
+ *
+ * Pushes the batch for the stat threads to look its entries up. Errors reading
+ * the directory are reported, but the entries read so far are still written.
+ */
+static void read_dir_batch(DIR *dir, const char *dir_name, struct dir_batch *b)
+{
+	struct dirent *entry;
+	size_t max = 0;
+
+	memset(b, 0, sizeof(*b));
+	b->dfd = dirfd(dir);
+	while (1) {
+		errno = 0;
+		entry = readdir(dir);
+		if (!entry) {
+			if (errno)
+				sys_err_msg("error reading directory '%s'",
+					    dir_name);
+			break;
+		}
+
+		if (strcmp(".", entry->d_name) == 0)
+			continue;
+		if (strcmp("..", entry->d_name) == 0)
+			continue;
+
+		if (b->cnt == max) {
+			max = max ? max * 2 : 16;
+			b->ents = xrealloc(b->ents, max * sizeof(*b->ents));
+		}
+		memset(&b->ents[b->cnt], 0, sizeof(*b->ents));
+		b->ents[b->cnt].name = xstrdup(entry->d_name);
+		b->ents[b->cnt].path = make_path(dir_name, entry->d_name);
+		b->cnt += 1;
+	}
+
+	pthread_mutex_lock(&stat_pool.lock);
+	b->up = stat_pool.top;
+	stat_pool.top = b;
+	if (stat_pool.nthreads)
+		pthread_cond_broadcast(&stat_pool.work_cond);
+	pthread_mutex_unlock(&stat_pool.lock);
+}
+
+/**
+ * get_dent - get a looked up entry of a batch.
+ * @b: the batch
+ * @i: index of the entry, the entries have to be got in order
+ */
+static struct dent_info *get_dent(struct dir_batch *b, size_t i)
+{
+	struct dent_info *d = &b->ents[i];
+
+	pthread_mutex_lock(&stat_pool.lock);
+	if (b->next == i) {
+		/* No worker took it, look it up ourselves */
+		b->next += 1;
+		pthread_mutex_unlock(&stat_pool.lock);
+		lookup_dent(b, d);
+		return d;
+	}
+	while (!d->done)
+		pthread_cond_wait(&stat_pool.done_cond, &stat_pool.lock);
+	pthread_mutex_unlock(&stat_pool.lock);
+	return d;
+}
+
+/**
+ * pop_dir_batch - remove a batch once its directory is written.
+ * @b: the batch, which has to be on top
+ */
+static void pop_dir_batch(struct dir_batch *b)
+{
+	size_t i;
+
+	pthread_mutex_lock(&stat_pool.lock);
+	b->next = b->cnt;
+	while (b->busy)
+		pthread_cond_wait(&stat_pool.done_cond, &stat_pool.lock);
+	stat_pool.top = b->up;
+	pthread_mutex_unlock(&stat_pool.lock);
+
+	for (i = 0; i < b->cnt; i++) {
+		free(b->ents[i].name);
+		free(b->ents[i].path);
+		free(b->ents[i].xattrs);
+	}
+	free(b->ents);
+}
+
+/**
+ * stat_pool_init - start the stat threads.
+ */
+static void stat_pool_init(void)
+{
+	int i, err;
+
+	stat_pool.tids = xmalloc(stat_jobs * sizeof(pthread_t));
+	for (i = 0; i < stat_jobs; i++) {
+		err = pthread_create(&stat_pool.tids[i], NULL, stat_worker,
+				     NULL);
+		if (err) {
+			errno = err;
+			sys_err_msg("cannot create stat thread, use %d", i);
+			break;
+		}
+		stat_pool.nthreads += 1;
+	}
+}
+
+/**
+ * stat_pool_destroy - stop the stat threads.
+ */
+static void stat_pool_destroy(void)
+{
+	int n;
+
+	pthread_mutex_lock(&stat_pool.lock);
+	stat_pool.stop = 1;
+	pthread_cond_broadcast(&stat_pool.work_cond);
+	pthread_mutex_unlock(&stat_pool.lock);
+	for (n = 0; n < stat_pool.nthreads; n++)
+		pthread_join(stat_pool.tids[n], NULL);
+	free(stat_pool.tids);
+	stat_pool.tids = NULL;
+	stat_pool.nthreads = 0;
+}
+
 /**
  * add_non_dir - write a non-directory to the output file.
  * @path_name: source path name
@@ -1606,7 +3115,9 @@ static int add_non_dir(const char *path_name, ino_t *inum, unsigned int nlink,
 static int add_directory(const char *dir_name, ino_t dir_inum, struct stat *st,
 			 int existing)
 {
-	struct dirent *entry;
+	struct dir_batch batch;
+	struct dent_info *d;
+	size_t i;
 	DIR *dir = NULL;
 	int err = 0;
 	loff_t size = UBIFS_INO_NODE_SZ;
@@ -1625,6 +3136,7 @@ static int add_directory(const char *dir_name, ino_t dir_inum, struct stat *st,
 		if (dir == NULL)
 			return sys_err_msg("cannot open directory '%s'",
 					   dir_name);
+		read_dir_batch(dir, dir_name, &batch);
 	}
 
 	/*
@@ -1638,23 +3150,10 @@ static int add_directory(const char *dir_name, ino_t dir_inum, struct stat *st,
 	 * Before adding the directory itself, we have to iterate over all the
 	 * entries the device table adds to this directory and create them.
 	 */
-	for (; existing;) {
+	for (i = 0; existing && i < batch.cnt; i++) {
 		struct stat dent_st;
 
-		errno = 0;
-		entry = readdir(dir);
-		if (!entry) {
-			if (errno == 0)
-				break;
-			sys_err_msg("error reading directory '%s'", dir_name);
-			err = -1;
-			break;
-		}
-
-		if (strcmp(".", entry->d_name) == 0)
-			continue;
-		if (strcmp("..", entry->d_name) == 0)
-			continue;
+		d = get_dent(&batch, i);
 
 		if (ph_elt)
 			/*
@@ -1662,19 +3161,19 @@ static int add_directory(const char *dir_name, ino_t dir_inum, struct stat *st,
 			 * file. Check if this directory entry is referred at
 			 * too.
 			 */
-			nh_elt = devtbl_find_name(ph_elt, entry->d_name);
+			nh_elt = devtbl_find_name(ph_elt, d->name);
 
 		/*
 		 * We are going to create the file corresponding to this
-		 * directory entry (@entry->d_name). We use 'struct stat'
-		 * object to pass information about file attributes (actually
-		 * only about UID, GID, mode, major, and minor). Get attributes
-		 * for this file from the UBIFS rootfs on the host.
+		 * directory entry (@d->name). We use 'struct stat' object to
+		 * pass information about file attributes (actually only about
+		 * UID, GID, mode, major, and minor). The attributes of this
+		 * file on the host were looked up by 'get_dent()'.
 		 */
-		free(name);
-		name = make_path(dir_name, entry->d_name);
-		if (lstat(name, &dent_st) == -1) {
-			sys_err_msg("lstat failed for file '%s'", name);
+		if (d->ok)
+			dent_st = d->st;
+		else if (lstat(d->path, &dent_st) == -1) {
+			sys_err_msg("lstat failed for file '%s'", d->path);
 			goto out_free;
 		}
 
@@ -1696,26 +3195,27 @@ static int add_directory(const char *dir_name, ino_t dir_inum, struct stat *st,
 		inum = ++c->highest_inum;
 
 		if (S_ISDIR(dent_st.st_mode)) {
-			err = add_directory(name, inum, &dent_st, 1);
+			err = add_directory(d->path, inum, &dent_st, 1);
 			if (err)
 				goto out_free;
 			nlink += 1;
 			type = UBIFS_ITYPE_DIR;
 		} else {
-			err = add_non_dir(name, &inum, 0, &type, &dent_st);
+			cur_dent = d;
+			err = add_non_dir(d->path, &inum, 0, &type, &dent_st);
+			cur_dent = NULL;
 			if (err)
 				goto out_free;
 		}
 
-		err = create_inum_attr(inum, name);
+		err = create_inum_attr(inum, d->path);
 		if (err)
 			goto out_free;
 
-		err = add_dent_node(dir_inum, entry->d_name, inum, type);
+		err = add_dent_node(dir_inum, d->name, inum, type);
 		if (err)
 			goto out_free;
-		size += ALIGN(UBIFS_DENT_NODE_SZ + strlen(entry->d_name) + 1,
-			      8);
+		size += ALIGN(UBIFS_DENT_NODE_SZ + strlen(d->name) + 1, 8);
 	}
 
 	/*
@@ -1782,15 +3282,21 @@ static int add_directory(const char *dir_name, ino_t dir_inum, struct stat *st,
 		goto out_free;
 
 	free(name);
-	if (existing && closedir(dir) == -1)
-		return sys_err_msg("error closing directory '%s'", dir_name);
+	if (existing) {
+		pop_dir_batch(&batch);
+		if (closedir(dir) == -1)
+			return sys_err_msg("error closing directory '%s'",
+					   dir_name);
+	}
 
 	return 0;
 
 out_free:
 	free(name);
-	if (existing)
+	if (existing) {
+		pop_dir_batch(&batch);
 		closedir(dir);
+	}
 	return -1;
 }
 
@@ -1847,33 +3353,14 @@ static int write_data(void)
 	err = add_multi_linked_files();
 	if (err)
 		return err;
+	if (pipeline.cnt) {
+		err = pipe_flush();
+		if (err)
+			return err;
+	}
 	return flush_nodes();
 }
 
-static int namecmp(const char *name1, const char *name2)
-{
-	size_t len1 = strlen(name1), len2 = strlen(name2);
-	size_t clen = (len1 < len2) ? len1 : len2;
-	int cmp;
-
-	cmp = memcmp(name1, name2, clen);
-	if (cmp)
-		return cmp;
-	return (len1 < len2) ? -1 : 1;
-}
-
-static int cmp_idx(const void *a, const void *b)
-{
-	const struct idx_entry *e1 = *(const struct idx_entry **)a;
-	const struct idx_entry *e2 = *(const struct idx_entry **)b;
-	int cmp;
-
-	cmp = keys_cmp(&e1->key, &e2->key);
-	if (cmp)
-		return cmp;
-	return namecmp(e1->name, e2->name);
-}
-
 /**
  * add_idx_node - write an index node to the head.
  * @node: index node
@@ -1912,12 +3399,17 @@ static int add_idx_node(void *node, int child_cnt)
  */
 static int write_index(void)
 {
-	size_t sz, i, cnt, idx_sz, pstep, bcnt;
-	struct idx_entry **idx_ptr, **p;
+	size_t i, k, cnt, idx_sz, kstep, bcnt;
+	union ubifs_key *keys;
+	struct idx_entry e;
 	struct ubifs_idx_node *idx;
 	struct ubifs_branch *br;
 	int child_cnt = 0, j, level, blnum, boffs, blen, blast_len, err;
 
+	err = start_index();
+	if (err)
+		return err;
+
 	dbg_msg(1, "leaf node count: %zd", idx_cnt);
 
 	/* Reset the head for the index */
@@ -1925,22 +3417,15 @@ static int write_index(void)
 	/* Allocate index node */
 	idx_sz = ubifs_idx_node_sz(c, c->fanout);
 	idx = xmalloc(idx_sz);
-	/* Make an array of pointers to sort the index list */
-	sz = idx_cnt * sizeof(struct idx_entry *);
-	if (sz / sizeof(struct idx_entry *) != idx_cnt) {
-		free(idx);
-		return err_msg("index is too big (%zu entries)", idx_cnt);
-	}
-	idx_ptr = xmalloc(sz);
-	idx_ptr[0] = idx_list_first;
-	for (i = 1; i < idx_cnt; i++)
-		idx_ptr[i] = idx_ptr[i - 1]->next;
-	qsort(idx_ptr, idx_cnt, sizeof(struct idx_entry *), cmp_idx);
 	/* Write level 0 index nodes */
 	cnt = idx_cnt / c->fanout;
 	if (idx_cnt % c->fanout)
 		cnt += 1;
-	p = idx_ptr;
+	/*
+	 * The key of an index node is the same as the key of its first child,
+	 * so the keys of the level 0 index nodes are all the upper levels need.
+	 */
+	keys = xmalloc(cnt * sizeof(union ubifs_key));
 	blnum = head_lnum;
 	boffs = head_offs;
 	for (i = 0; i < cnt; i++) {
@@ -1958,18 +3443,24 @@ static int write_index(void)
 		idx->ch.node_type = UBIFS_IDX_NODE;
 		idx->child_cnt = cpu_to_le16(child_cnt);
 		idx->level = cpu_to_le16(0);
-		for (j = 0; j < child_cnt; j++, p++) {
+		for (j = 0; j < child_cnt; j++) {
+			err = next_index(&e);
+			if (err)
+				goto out_free;
+			if (j == 0)
+				keys[i] = e.key;
 			br = ubifs_idx_branch(c, idx, j);
-			key_write_idx(&(*p)->key, &br->key);
-			br->lnum = cpu_to_le32((*p)->lnum);
-			br->offs = cpu_to_le32((*p)->offs);
-			br->len = cpu_to_le32((*p)->len);
+			key_write_idx(&e.key, &br->key);
+			br->lnum = cpu_to_le32(e.lnum);
+			br->offs = cpu_to_le32(e.offs);
+			br->len = cpu_to_le32(e.len);
 		}
 		add_idx_node(idx, child_cnt);
 	}
+	free_index();
 	/* Write level 1 index nodes and above */
 	level = 0;
-	pstep = 1;
+	kstep = 1;
 	while (cnt > 1) {
 		/*
 		 * 'blast_len' is the length of the last index node in the level
@@ -1985,11 +3476,10 @@ static int write_index(void)
 		level += 1;
 		/*
 		 * The key of an index node is the same as the key of its first
-		 * child. Thus we can get the key by stepping along the bottom
-		 * level 'p' with an increasing large step 'pstep'.
+		 * child. Thus we can get the key by stepping along the level 0
+		 * keys 'k' with an increasing large step 'kstep'.
 		 */
-		p = idx_ptr;
-		pstep *= c->fanout;
+		k = 0;
 		for (i = 0; i < cnt; i++) {
 			/*
 			 * Calculate the child count. All index nodes are
@@ -2032,7 +3522,7 @@ static int write_index(void)
 				 * of the index node from the level below.
 				 */
 				br = ubifs_idx_branch(c, idx, j);
-				key_write_idx(&(*p)->key, &br->key);
+				key_write_idx(&keys[k], &br->key);
 				br->lnum = cpu_to_le32(blnum);
 				br->offs = cpu_to_le32(boffs);
 				br->len = cpu_to_le32(blen);
@@ -2041,16 +3531,15 @@ static int write_index(void)
 				 * below.
 				 */
 				boffs += ALIGN(blen, 8);
-				p += pstep;
+				k += kstep;
 			}
 			add_idx_node(idx, child_cnt);
 		}
+		kstep *= c->fanout;
 	}
 
 	/* Free stuff */
-	for (i = 0; i < idx_cnt; i++)
-		free(idx_ptr[i]);
-	free(idx_ptr);
+	free(keys);
 	free(idx);
 
 	dbg_msg(1, "zroot is at %d:%d len %d", c->zroot.lnum, c->zroot.offs,
@@ -2067,6 +3556,12 @@ static int write_index(void)
 		return err;
 
 	return 0;
+
+out_free:
+	free_index();
+	free(keys);
+	free(idx);
+	return err;
 }
 
 /**
@@ -2398,6 +3893,26 @@ static int init(void)
 	if (err)
 		return err;
 
+	if (compr_cache) {
+		err = compr_cache_open(compr_cache, compr_cache_size);
+		if (err)
+			return err;
+	}
+
+	err = out_init();
+	if (err)
+		return err;
+
+	/*
+	 * With '--set-inum-attr' the extended attributes of the files are
+	 * changed while writing, so they must not be looked up ahead.
+	 */
+	if (stat_jobs && !do_create_inum_attr)
+		stat_pool_init();
+
+	if (jobs > 1)
+		return pipe_init();
+
 	return 0;
 }
 
@@ -2429,6 +3944,9 @@ static void deinit(void)
 	free(block_buf);
 	destroy_hash_table();
 	free(hash_table);
+	stat_pool_destroy();
+	pipe_destroy();
+	out_destroy();
 	destroy_compression();
 	free_devtable_info();
 }
@@ -2483,6 +4001,17 @@ static int mkfs(void)
 		goto out;
 
 	err = write_orphan_area();
+	if (err)
+		goto out;
+
+	err = out_flush();
+	if (err)
+		goto out;
+
+	if (ffmap)
+		err = ffmap_save(ffmap, out_fd, ff_map);
+
+	compr_cache_close();
 
 out:
 	deinit();
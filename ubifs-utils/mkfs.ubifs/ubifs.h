@@ -286,6 +286,9 @@ struct ubifs_znode
  * @default_compr: default compression type
  * @favor_lzo: favor LZO compression method
  * @favor_percent: lzo vs. zlib threshold used in case favor LZO
+ * @favor_probe: in case favor LZO, store blocks which look incompressible
+ *               right away and try zlib only if it may win
+ * @compr_level: zlib and zstd compression level, %0 for their default
  *
  * @key_hash_type: type of the key hash
  * @key_hash: direntry key hash function
@@ -364,6 +367,8 @@ struct ubifs_info
 	int default_compr;
 	int favor_lzo;
 	int favor_percent;
+	int favor_probe;
+	int compr_level;
 
 	uint8_t key_hash_type;
 	uint32_t (*key_hash)(const char *str, int len);